@@ -0,0 +1,56 @@
+#!/bin/sh
+# Times compiling generated sources of growing size, one literal per line,
+# to check that compile time scales linearly with the number of constants.
+#
+# Usage: tools/compilebench.sh [npz] [compiler.nux] [max lines]
+#
+# When compiler.nux is given, the self-hosted compiler is timed as well.
+
+NPZ=${1:-build/npz}
+SELF=$2
+MAX=${3:-100000}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+ms() {
+    echo $(($(date +%s%N) / 1000000))
+}
+
+# Identifiers are used up front, since their constants must fit in a byte.
+generate() {
+    awk -v n="$1" 'BEGIN {
+        print "import std;"
+        print "std.println(\"start\");"
+        print "let total = 0;"
+        print "let name = \"\";"
+        for (i = 0; i < n; i++) {
+            if (i % 2 == 0)
+                printf "total = total + %d;\n", i
+            else
+                printf "name = \"s%d\";\n", i
+        }
+        print "std.println(total);"
+        print "std.println(name);"
+    }' > "$2"
+}
+
+printf "%10s %12s %12s\n" lines "npz (ms)" "self (ms)"
+lines=$((MAX / 8))
+while [ "$lines" -le "$MAX" ]; do
+    src="$DIR/bench$lines.npz"
+    generate "$lines" "$src"
+
+    start=$(ms)
+    "$NPZ" -c "$src" -o "$DIR/out.nux" > /dev/null || exit 1
+    native=$(($(ms) - start))
+
+    self="-"
+    if [ -n "$SELF" ]; then
+        start=$(ms)
+        "$NPZ" -R "$SELF" -c "$src" -o "$DIR/out.nux" > /dev/null || exit 1
+        self=$(($(ms) - start))
+    fi
+
+    printf "%10d %12s %12s\n" "$lines" "$native" "$self"
+    lines=$((lines * 2))
+done
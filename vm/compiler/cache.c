@@ -0,0 +1,734 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WIN32
+#include <direct.h>
+#include <io.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "cache.h"
+#include "chunk.h"
+#include "compiler.h"
+#include "dumper.h"
+#include "../util/memory.h"
+#include "../vm/loader.h"
+
+// FNV-1a
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+typedef struct {
+    uint8_t* bytes;
+    size_t length;
+    // Set when bytes were read for the entry, and are freed with it.
+    bool owned;
+    uint64_t key;
+    char** imports;
+    int importCount;
+    // Offsets of the fixed names and of the binary.
+    size_t names;
+    int nameCount;
+    size_t program;
+} CacheEntry;
+
+typedef struct {
+    uint8_t* bytes;
+    size_t length;
+    size_t idx;
+    bool failed;
+} EntryReader;
+
+typedef struct {
+    ObjFunction* func;
+    // Constants pushed for OP_IMPORT_FILE: the path, then the function. A file that
+    // was already compiled is imported by path, so both are the same constant.
+    int path;
+    int slot;
+} ImportSite;
+
+typedef struct {
+    ImportSite* sites;
+    int count;
+    int capacity;
+} SiteList;
+
+typedef enum {
+    LINK_OK,
+    LINK_ERROR,
+    // A file imported by path has not been compiled yet, so the entry is compiled instead.
+    LINK_ORDER,
+} LinkResult;
+
+static uint64_t hashBytes(uint64_t hash, const uint8_t* bytes, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+static uint64_t hashWord(uint64_t hash, uint64_t word) {
+    uint8_t bytes[8];
+    for (int i = 0; i < 8; i++)
+        bytes[i] = (word >> (i * 8)) & 0xFF;
+    return hashBytes(hash, bytes, 8);
+}
+
+// Key of a file before the keys of its imports are added.
+static uint64_t sourceKey(VM* vm, const uint8_t* src, size_t length) {
+    uint64_t key = hashWord(FNV_OFFSET, MODULE_CACHE_VERSION);
+    key = hashWord(key, BYTECODE_VERSION);
+    key = hashWord(key, vm->optimize);
+    return hashWord(key, hashBytes(FNV_OFFSET, src, length));
+}
+
+// Keeps 0 free to mean no key.
+static uint64_t finishKey(uint64_t key) {
+    return key == 0 ? 1 : key;
+}
+
+ModuleCache* newModuleCache(const char* dir) {
+#ifdef WIN32
+    _mkdir(dir);
+#else
+    mkdir(dir, 0755);
+#endif
+
+    // Imports are compiled from their own directory, so the cache is kept by full path.
+    char* full = getFullPath((char*) dir);
+    if (full == NULL || !dirExists(full)) {
+        free(full);
+        return NULL;
+    }
+
+    ModuleCache* cache = newMemoryModuleCache();
+    cache->dir = full;
+    return cache;
+}
+
+ModuleCache* newMemoryModuleCache() {
+    ModuleCache* cache = malloc(sizeof(ModuleCache));
+    cache->dir = NULL;
+    cache->keys = NULL;
+    cache->count = 0;
+    cache->capacity = 0;
+    cache->entries = NULL;
+    cache->entryCount = 0;
+    cache->entryCapacity = 0;
+    return cache;
+}
+
+void resetModuleCache(ModuleCache* cache) {
+    for (int i = 0; i < cache->count; i++)
+        free(cache->keys[i].path);
+    cache->count = 0;
+}
+
+void freeModuleCache(ModuleCache* cache) {
+    resetModuleCache(cache);
+    for (int i = 0; i < cache->entryCount; i++) {
+        free(cache->entries[i].path);
+        free(cache->entries[i].bytes);
+    }
+    free(cache->entries);
+    free(cache->keys);
+    free(cache->dir);
+    free(cache);
+}
+
+static int findKey(ModuleCache* cache, const char* path) {
+    for (int i = 0; i < cache->count; i++) {
+        if (strcmp(cache->keys[i].path, path) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static void setKey(ModuleCache* cache, const char* path, uint64_t key) {
+    int idx = findKey(cache, path);
+    if (idx < 0) {
+        if (cache->count + 1 > cache->capacity) {
+            cache->capacity = GROW_CAPACITY(cache->capacity);
+            cache->keys = realloc(cache->keys, sizeof(ModuleKey) * cache->capacity);
+        }
+        idx = cache->count++;
+        cache->keys[idx].path = strdup(path);
+    }
+    cache->keys[idx].key = key;
+}
+
+static MemoryEntry* findMemoryEntry(ModuleCache* cache, const char* path, int optimize) {
+    for (int i = 0; i < cache->entryCount; i++) {
+        MemoryEntry* entry = &cache->entries[i];
+        if (entry->optimize == optimize && strcmp(entry->path, path) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+static char* entryPath(ModuleCache* cache, const char* path, int optimize) {
+    uint64_t hash = hashBytes(FNV_OFFSET, (const uint8_t*) path, strlen(path));
+    size_t length = strlen(cache->dir) + 40;
+    char* entry = malloc(length);
+    snprintf(entry, length, "%s/%016llx-O%d.npzm", cache->dir, (unsigned long long) hash, optimize);
+    return entry;
+}
+
+// Reads the whole file, returning NULL when it cannot be read.
+static uint8_t* readBytes(const char* path, size_t* length) {
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL)
+        return NULL;
+
+    fseek(fp, 0, SEEK_END);
+    long len = ftell(fp);
+    rewind(fp);
+
+    uint8_t* bytes = len < 0 ? NULL : malloc(len > 0 ? len : 1);
+    if (bytes != NULL && fread(bytes, 1, len, fp) != (size_t) len) {
+        free(bytes);
+        bytes = NULL;
+    }
+    fclose(fp);
+
+    *length = len;
+    return bytes;
+}
+
+static bool canRead(EntryReader* reader, size_t length) {
+    if (reader->failed || length > reader->length - reader->idx)
+        reader->failed = true;
+    return !reader->failed;
+}
+
+static uint64_t readNumber(EntryReader* reader, int size) {
+    if (!canRead(reader, size))
+        return 0;
+
+    uint64_t num = 0;
+    for (int i = 0; i < size; i++)
+        num |= (uint64_t) reader->bytes[reader->idx++] << (i * 8);
+    return num;
+}
+
+static const char* readChars(EntryReader* reader, uint32_t* length) {
+    *length = readNumber(reader, 4);
+    if (!canRead(reader, *length))
+        return NULL;
+
+    const char* chars = (const char*) reader->bytes + reader->idx;
+    reader->idx += *length;
+    return chars;
+}
+
+static void freeEntry(CacheEntry* entry) {
+    for (int i = 0; i < entry->importCount; i++)
+        free(entry->imports[i]);
+    free(entry->imports);
+    if (entry->owned)
+        free(entry->bytes);
+}
+
+// Reads the header of the entry in bytes, returning false when it was written for
+// another file, optimization level or format.
+static bool parseEntry(VM* vm, const char* path, CacheEntry* entry) {
+    entry->imports = NULL;
+    entry->importCount = 0;
+
+    EntryReader reader = { entry->bytes, entry->length, 0, false };
+    uint32_t length;
+
+    bool valid = canRead(&reader, MODULE_CACHE_MAGIC_LENGTH) &&
+        memcmp(entry->bytes, MODULE_CACHE_MAGIC, MODULE_CACHE_MAGIC_LENGTH) == 0;
+    reader.idx = MODULE_CACHE_MAGIC_LENGTH;
+    valid = valid && readNumber(&reader, 4) == MODULE_CACHE_VERSION &&
+        readNumber(&reader, 4) == (uint32_t) vm->optimize;
+    entry->key = readNumber(&reader, 8);
+
+    const char* name = readChars(&reader, &length);
+    valid = valid && name != NULL && length == strlen(path) && memcmp(name, path, length) == 0;
+
+    int count = valid ? readNumber(&reader, 4) : 0;
+    if (valid && canRead(&reader, count)) {
+        entry->imports = malloc(sizeof(char*) * (count > 0 ? count : 1));
+        for (int i = 0; i < count; i++) {
+            const char* chars = readChars(&reader, &length);
+            if (chars == NULL)
+                break;
+            entry->imports[i] = malloc(length + 1);
+            memcpy(entry->imports[i], chars, length);
+            entry->imports[i][length] = '\0';
+            entry->importCount++;
+        }
+    }
+
+    entry->nameCount = readNumber(&reader, 4);
+    entry->names = reader.idx;
+    for (int i = 0; !reader.failed && i < entry->nameCount; i++) {
+        readChars(&reader, &length);
+        switch (readNumber(&reader, 1)) {
+            case DUMP_NULL:   break;
+            case DUMP_BOOL:   readNumber(&reader, 1); break;
+            case DUMP_NUMBER: readNumber(&reader, 8); break;
+            case DUMP_STRING: readChars(&reader, &length); break;
+            default:          reader.failed = true; break;
+        }
+    }
+    entry->program = reader.idx;
+
+    valid = valid && !reader.failed && entry->importCount == count &&
+        entry->length - entry->program >= BYTECODE_MAGIC_LENGTH &&
+        memcmp(entry->bytes + entry->program, BYTECODE_MAGIC, BYTECODE_MAGIC_LENGTH) == 0;
+    if (!valid)
+        freeEntry(entry);
+    return valid;
+}
+
+// Reads the entry of the file at path from the cache, returning false when there is none.
+static bool readEntry(VM* vm, const char* path, CacheEntry* entry) {
+    ModuleCache* cache = vm->moduleCache;
+    entry->bytes = NULL;
+    entry->owned = true;
+
+    if (cache->dir == NULL) {
+        // Copied, as a later store replaces the bytes while the entry may still be read.
+        MemoryEntry* stored = findMemoryEntry(cache, path, vm->optimize);
+        if (stored != NULL) {
+            entry->length = stored->length;
+            entry->bytes = malloc(stored->length);
+            memcpy(entry->bytes, stored->bytes, stored->length);
+        }
+    } else {
+        char* file = entryPath(cache, path, vm->optimize);
+        entry->bytes = readBytes(file, &entry->length);
+        free(file);
+    }
+    return entry->bytes != NULL && parseEntry(vm, path, entry);
+}
+
+// Key of the file at path worked out from its entry and the current sources, 0 when
+// the entry is missing or out of date. src is the file's source, read when NULL.
+static uint64_t moduleKey(VM* vm, const char* path, const char* src) {
+    ModuleCache* cache = vm->moduleCache;
+    int idx = findKey(cache, path);
+    if (idx >= 0)
+        return cache->keys[idx].key;
+    // Marks the file as in progress, so an import cycle has no key.
+    setKey(cache, path, 0);
+
+    CacheEntry entry;
+    if (!readEntry(vm, path, &entry))
+        return 0;
+
+    uint64_t key = 0;
+    if (src != NULL) {
+        key = sourceKey(vm, (const uint8_t*) src, strlen(src));
+    } else {
+        size_t length;
+        uint8_t* bytes = readBytes(path, &length);
+        if (bytes != NULL)
+            key = sourceKey(vm, bytes, length);
+        free(bytes);
+    }
+
+    for (int i = 0; key != 0 && i < entry.importCount; i++) {
+        uint64_t imported = moduleKey(vm, entry.imports[i], NULL);
+        key = imported == 0 ? 0 : hashWord(key, imported);
+    }
+
+    key = key != 0 && finishKey(key) == entry.key ? entry.key : 0;
+    freeEntry(&entry);
+    setKey(cache, path, key);
+    return key;
+}
+
+static int constantOperand(Chunk* chunk, int offset) {
+    uint8_t* code = chunk->code + offset;
+    if (code[0] == OP_CONSTANT)
+        return code[1];
+    if (code[0] == OP_CONSTANT_LONG)
+        return code[1] | (code[2] << 8) | (code[3] << 16);
+    return -1;
+}
+
+// Finds the imports in func and the functions declared in it, in the order they were
+// compiled. A function is compiled before the closure made from it, so it is searched
+// when its OP_CLOSURE is reached. Returns false on code that cannot be followed.
+static bool findImports(ObjFunction* func, SiteList* list) {
+    Chunk* chunk = &func->chunk;
+    int before = -1;
+    int last = -1;
+
+    for (int offset = 0; offset < chunk->count;) {
+        int length = instructionLength(chunk, offset);
+        if (length < 0)
+            return false;
+
+        uint8_t* code = chunk->code + offset;
+        if (code[0] == OP_CLOSURE) {
+            int constant = code[1] == OP_CONSTANT_LONG ? code[2] | (code[3] << 8) | (code[4] << 16) : code[2];
+            if (!findImports(AS_FUNCTION(chunk->constants.values[constant]), list))
+                return false;
+        } else if (code[0] == OP_IMPORT_FILE) {
+            if (before < 0 || last < 0 || !IS_STRING(chunk->constants.values[before]))
+                return false;
+
+            if (list->count + 1 > list->capacity) {
+                list->capacity = GROW_CAPACITY(list->capacity);
+                list->sites = realloc(list->sites, sizeof(ImportSite) * list->capacity);
+            }
+            list->sites[list->count++] = (ImportSite) { func, before, last };
+        }
+
+        before = last;
+        last = constantOperand(chunk, offset);
+        offset += length;
+    }
+    return true;
+}
+
+static Value sitePath(ImportSite* site) {
+    return site->func->chunk.constants.values[site->path];
+}
+
+static Value* siteSlot(ImportSite* site) {
+    return &site->func->chunk.constants.values[site->slot];
+}
+
+// Compiles or reads the files the entry imports, in the order compiling it would have.
+static LinkResult linkImports(VM* vm, ObjFunction* script) {
+    SiteList list = { NULL, 0, 0 };
+    LinkResult res = findImports(script, &list) ? LINK_OK : LINK_ORDER;
+
+    for (int i = 0; res == LINK_OK && i < list.count; i++) {
+        ImportSite* site = &list.sites[i];
+        ObjString* path = AS_STRING(sitePath(site));
+
+        Value importVal;
+        if (tableGet(&vm->importedFiles, path, &importVal) && IS_FUNCTION(importVal))
+            continue;
+        if (site->path == site->slot) {
+            res = LINK_ORDER;
+            break;
+        }
+
+        ObjFunction* func = compileModule(vm, path);
+        if (func == NULL)
+            res = LINK_ERROR;
+        else
+            *siteSlot(site) = OBJ_VAL(func);
+    }
+
+    free(list.sites);
+    return res;
+}
+
+static void readNames(VM* vm, ObjString* path, CacheEntry* entry) {
+    EntryReader reader = { entry->bytes, entry->length, entry->names, false };
+
+    for (int i = 0; i < entry->nameCount; i++) {
+        uint32_t length;
+        const char* name = readChars(&reader, &length);
+        ObjString* key = formatString(vm, "%s\n%.*s", path->chars, (int) length, name);
+        push(vm, OBJ_VAL(key));
+
+        Value val = NULL_VAL;
+        switch (readNumber(&reader, 1)) {
+            case DUMP_BOOL:
+                val = BOOL_VAL(readNumber(&reader, 1) == 1);
+                break;
+            case DUMP_NUMBER: {
+                uint64_t bits = readNumber(&reader, 8);
+                double num;
+                memcpy(&num, &bits, sizeof(double));
+                val = NUMBER_VAL(num);
+                break;
+            }
+            case DUMP_STRING: {
+                const char* chars = readChars(&reader, &length);
+                val = OBJ_VAL(copyString(vm, chars, length));
+                break;
+            }
+        }
+
+        push(vm, val);
+        tableSet(vm, &vm->fixedNames, key, val);
+        popn(vm, 2);
+    }
+}
+
+// Reads the file from its entry, which is freed, and links its imports.
+static LinkResult loadEntry(VM* vm, ObjString* path, CacheEntry* entry, ObjFunction** func) {
+    VM* temp = malloc(sizeof(VM));
+    initVM(temp, vm, path->chars);
+    // The code goes into the binary being compiled, so typed opcodes are kept.
+    temp->trustTyped = true;
+    tableAddAll(temp, &vm->importedFiles, &temp->importedFiles);
+    tableAddAll(temp, &vm->fixedNames, &temp->fixedNames);
+
+    temp->pauseGC++;
+    size_t length = entry->length - entry->program;
+    uint8_t* program = ALLOCATE(temp, uint8_t, length);
+    memcpy(program, entry->bytes + entry->program, length);
+    BytecodeLoader* loader = newLoader(temp, program, length);
+    ObjFunction* script = readBytecode(loader);
+    freeLoader(temp, loader);
+
+    tableSet(temp, &temp->importedFiles, path, OBJ_VAL(script));
+    readNames(temp, path, entry);
+    temp->pauseGC--;
+    freeEntry(entry);
+
+    LinkResult res = linkImports(temp, script);
+    if (res == LINK_OK) {
+        push(vm, OBJ_VAL(script));
+        tableAddAll(vm, &temp->importedFiles, &vm->importedFiles);
+        tableAddAll(vm, &temp->fixedNames, &vm->fixedNames);
+        pop(vm);
+    }
+
+    decoupleVM(temp);
+    takeOwnership(vm, temp->objects);
+
+    *func = res == LINK_OK ? script : NULL;
+    return res;
+}
+
+bool loadModule(VM* vm, ObjString* path, const char* src, ObjFunction** func) {
+    // Inlining decisions are only reported for files that are compiled.
+    if (vm->inlineReport != NULL)
+        return false;
+
+    CacheEntry entry;
+    if (moduleKey(vm, path->chars, src) == 0 || !readEntry(vm, path->chars, &entry))
+        return false;
+    return loadEntry(vm, path, &entry, func) != LINK_ORDER;
+}
+
+uint8_t* readCachedModule(VM* vm, const char* path, const char* src, size_t* length) {
+    CacheEntry entry;
+    if (moduleKey(vm, path, src) == 0 || !readEntry(vm, path, &entry))
+        return NULL;
+
+    entry.owned = false;
+    freeEntry(&entry);
+    *length = entry.length;
+    return entry.bytes;
+}
+
+bool linkModule(VM* vm, ObjString* path, uint8_t* bytes, size_t length, ObjFunction** func) {
+    CacheEntry entry = { bytes, length, false };
+    if (!parseEntry(vm, path->chars, &entry))
+        return false;
+    return loadEntry(vm, path, &entry, func) != LINK_ORDER;
+}
+
+bool readModuleNames(VM* vm, ObjString* path, uint8_t* bytes, size_t length) {
+    CacheEntry entry = { bytes, length, false };
+    if (!parseEntry(vm, path->chars, &entry))
+        return false;
+
+    vm->pauseGC++;
+    readNames(vm, path, &entry);
+    vm->pauseGC--;
+    freeEntry(&entry);
+    return true;
+}
+
+static void writeNumber(BytecodeWriter* writer, uint64_t num, int size) {
+    uint8_t bytes[8];
+    for (int i = 0; i < size; i++)
+        bytes[i] = (num >> (i * 8)) & 0xFF;
+    writeRaw(writer, bytes, size);
+}
+
+static void writeChars(BytecodeWriter* writer, const char* chars, uint32_t length) {
+    writeNumber(writer, length, 4);
+    writeRaw(writer, chars, length);
+}
+
+static bool isCachedName(Table* names, int i, ObjString* path) {
+    ObjString* key = names->entries[i].key;
+    return key != NULL && key->length > path->length &&
+        memcmp(key->chars, path->chars, path->length) == 0 && key->chars[path->length] == '\n';
+}
+
+// Writes the names the file fixed, without the path they are keyed under. Returns
+// false on a value the entry cannot hold.
+static bool writeNames(BytecodeWriter* writer, Table* names, ObjString* path) {
+    int count = 0;
+    for (int i = 0; i < names->capacity; i++) {
+        if (isCachedName(names, i, path))
+            count++;
+    }
+    writeNumber(writer, count, 4);
+
+    for (int i = 0; i < names->capacity; i++) {
+        if (!isCachedName(names, i, path))
+            continue;
+
+        ObjString* key = names->entries[i].key;
+        Value val = names->entries[i].value;
+        writeChars(writer, key->chars + path->length + 1, key->length - path->length - 1);
+
+        if (IS_NULL(val)) {
+            writeNumber(writer, DUMP_NULL, 1);
+        } else if (IS_BOOL(val)) {
+            writeNumber(writer, DUMP_BOOL, 1);
+            writeNumber(writer, AS_BOOL(val) ? 1 : 0, 1);
+        } else if (IS_NUMBER(val)) {
+            double num = AS_NUMBER(val);
+            uint64_t bits;
+            memcpy(&bits, &num, sizeof(double));
+            writeNumber(writer, DUMP_NUMBER, 1);
+            writeNumber(writer, bits, 8);
+        } else if (IS_STRING(val)) {
+            writeNumber(writer, DUMP_STRING, 1);
+            writeChars(writer, AS_CSTRING(val), AS_STRING(val)->length);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool writeEntry(VM* vm, BytecodeWriter* writer, ObjString* path, ObjFunction* func,
+        SiteList* list, uint64_t key) {
+    writeRaw(writer, MODULE_CACHE_MAGIC, MODULE_CACHE_MAGIC_LENGTH);
+    writeNumber(writer, MODULE_CACHE_VERSION, 4);
+    writeNumber(writer, vm->optimize, 4);
+    writeNumber(writer, key, 8);
+    writeChars(writer, path->chars, path->length);
+
+    writeNumber(writer, list->count, 4);
+    for (int i = 0; i < list->count; i++) {
+        ObjString* imported = AS_STRING(sitePath(&list->sites[i]));
+        writeChars(writer, imported->chars, imported->length);
+    }
+    bool written = writeNames(writer, &vm->fixedNames, path);
+
+    // Imported functions are compiled into the file importing them first, but are
+    // cached on their own, so they are swapped for their path while the file is written.
+    Value* swapped = malloc(sizeof(Value) * (list->count > 0 ? list->count : 1));
+    for (int i = 0; i < list->count; i++) {
+        swapped[i] = *siteSlot(&list->sites[i]);
+        *siteSlot(&list->sites[i]) = sitePath(&list->sites[i]);
+    }
+
+    vm->pauseGC++;
+    written = dumpProgram(vm, writer, func, false) && written;
+    vm->pauseGC--;
+
+    for (int i = list->count - 1; i >= 0; i--)
+        *siteSlot(&list->sites[i]) = swapped[i];
+    free(swapped);
+    return written;
+}
+
+static void keepEntry(VM* vm, ObjString* path, ObjFunction* func, SiteList* list, uint64_t key) {
+    ModuleCache* cache = vm->moduleCache;
+    BytecodeWriter writer;
+    initMemoryWriter(&writer);
+    if (!writeEntry(vm, &writer, path, func, list, key)) {
+        freeWriter(&writer);
+        return;
+    }
+
+    MemoryEntry* entry = findMemoryEntry(cache, path->chars, vm->optimize);
+    if (entry == NULL) {
+        if (cache->entryCount + 1 > cache->entryCapacity) {
+            cache->entryCapacity = GROW_CAPACITY(cache->entryCapacity);
+            cache->entries = realloc(cache->entries, sizeof(MemoryEntry) * cache->entryCapacity);
+        }
+        entry = &cache->entries[cache->entryCount++];
+        entry->path = strdup(path->chars);
+        entry->optimize = vm->optimize;
+    } else {
+        free(entry->bytes);
+    }
+    entry->bytes = writer.bytes;
+    entry->length = writer.count;
+    setKey(cache, path->chars, key);
+}
+
+// Creates a file named by the template, whose trailing Xs are replaced to make a name
+// no other writer has, such as a compile server writing the same entry.
+static FILE* openTemp(char* temp) {
+#ifdef WIN32
+    if (_mktemp_s(temp, strlen(temp) + 1) != 0)
+        return NULL;
+    return fopen(temp, "wb");
+#else
+    int fd = mkstemp(temp);
+    if (fd < 0)
+        return NULL;
+    fchmod(fd, 0644);
+
+    FILE* fp = fdopen(fd, "wb");
+    if (fp == NULL) {
+        close(fd);
+        remove(temp);
+    }
+    return fp;
+#endif
+}
+
+// Writes the entry to a temporary file of its own first, so a run that stops midway or
+// one writing the same entry beside it never leaves half an entry to be read.
+static void saveEntry(VM* vm, ObjString* path, ObjFunction* func, SiteList* list, uint64_t key) {
+    ModuleCache* cache = vm->moduleCache;
+    if (cache->dir == NULL) {
+        keepEntry(vm, path, func, list, key);
+        return;
+    }
+
+    char* file = entryPath(cache, path->chars, vm->optimize);
+    char* temp = malloc(strlen(file) + 8);
+    sprintf(temp, "%s.XXXXXX", file);
+
+    FILE* fp = openTemp(temp);
+    if (fp != NULL) {
+        BytecodeWriter writer;
+        initFileWriter(&writer, fp);
+        bool written = writeEntry(vm, &writer, path, func, list, key);
+        freeWriter(&writer);
+
+        written = fclose(fp) == 0 && written;
+        if (!written || rename(temp, file) != 0)
+            remove(temp);
+        else
+            setKey(cache, path->chars, key);
+    }
+
+    free(temp);
+    free(file);
+}
+
+void storeModule(VM* vm, ObjString* path, const char* src, ObjFunction* func) {
+    ModuleCache* cache = vm->moduleCache;
+    SiteList list = { NULL, 0, 0 };
+
+    uint64_t key = 0;
+    if (findImports(func, &list))
+        key = sourceKey(vm, (const uint8_t*) src, strlen(src));
+
+    for (int i = 0; key != 0 && i < list.count; i++) {
+        int idx = findKey(cache, AS_CSTRING(sitePath(&list.sites[i])));
+        key = idx < 0 || cache->keys[idx].key == 0 ? 0 : hashWord(key, cache->keys[idx].key);
+    }
+
+    if (key != 0)
+        saveEntry(vm, path, func, &list, finishKey(key));
+    free(list.sites);
+}
+
+bool encodeModule(VM* vm, BytecodeWriter* writer, ObjString* path, ObjFunction* func) {
+    SiteList list = { NULL, 0, 0 };
+    bool written = findImports(func, &list) && writeEntry(vm, writer, path, func, &list, 0);
+    free(list.sites);
+    return written;
+}
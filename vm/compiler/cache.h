@@ -0,0 +1,71 @@
+
+#ifndef jp_cache_h
+#define jp_cache_h
+
+#include "../vm/object.h"
+#include "../vm/value.h"
+#include "../vm/vm.h"
+
+// Imported files compiled by earlier runs, one entry per file and optimization level.
+// An entry holds the file's key, the files it imports, the names it fixed for constant
+// folding, then the file as a sectioned binary with its imports left as paths. The key
+// hashes the source with the keys of its imports, so an edit invalidates the file and
+// everything importing it. Entries are little endian, starting with the magic.
+#define MODULE_CACHE_MAGIC "NPZM"
+#define MODULE_CACHE_MAGIC_LENGTH 4
+#define MODULE_CACHE_VERSION 1
+
+typedef struct {
+    char* path;
+    // 0 while the key is being worked out, or when the file has no usable entry.
+    uint64_t key;
+} ModuleKey;
+
+// Entry of a cache kept in memory, by path and optimization level.
+typedef struct {
+    char* path;
+    int optimize;
+    uint8_t* bytes;
+    size_t length;
+} MemoryEntry;
+
+struct ModuleCache {
+    // NULL when entries are only kept in memory.
+    char* dir;
+    // Keys worked out so far this run, by path.
+    ModuleKey* keys;
+    int count;
+    int capacity;
+
+    MemoryEntry* entries;
+    int entryCount;
+    int entryCapacity;
+};
+
+// Opens the cache in dir, creating it if needed. Returns NULL when it cannot be created.
+ModuleCache* newModuleCache(const char* dir);
+// A cache whose entries last as long as it does, for the compile server.
+ModuleCache* newMemoryModuleCache();
+void freeModuleCache(ModuleCache* cache);
+// Forgets the keys worked out so far, as sources may have changed since.
+void resetModuleCache(ModuleCache* cache);
+// Reads the file at path from the cache when its entry is still valid, compiling the
+// files it imports that are not compiled yet, and adds it to the VM's imported files.
+// Returns false when it has to be compiled from source instead, otherwise func is set,
+// to NULL when a file it imports failed to compile.
+bool loadModule(VM* vm, ObjString* path, const char* src, ObjFunction** func);
+// Writes the file compiled from src to the cache. Files whose imports have no key,
+// such as those in an import cycle, are left out.
+void storeModule(VM* vm, ObjString* path, const char* src, ObjFunction* func);
+// Entry of the file at path when the one in the cache is still valid, otherwise NULL.
+uint8_t* readCachedModule(VM* vm, const char* path, const char* src, size_t* length);
+
+// Entries are also how files compiled on worker threads reach the main one, held in
+// memory and without a key.
+bool encodeModule(VM* vm, BytecodeWriter* writer, ObjString* path, ObjFunction* func);
+// Reads the file from an entry in memory as loadModule does from the cache.
+bool linkModule(VM* vm, ObjString* path, uint8_t* bytes, size_t length, ObjFunction** func);
+// Adds the names the file fixed to the VM, returning false on a malformed entry.
+bool readModuleNames(VM* vm, ObjString* path, uint8_t* bytes, size_t length);
+
+#endif
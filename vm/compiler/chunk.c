@@ -1,12 +1,15 @@
 #include <stdio.h>
+#include <string.h>
 
 #include "chunk.h"
 #include "../util/memory.h"
+#include "../vm/object.h"
 
 void initChunk(Chunk* chunk) {
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = NULL;
+    chunk->mapped = false;
 
     chunk->lines = NULL;
     chunk->lines_run = NULL;
@@ -14,6 +17,8 @@ void initChunk(Chunk* chunk) {
     chunk->lines_capacity = 0;
 
     initValueArray(&chunk->constants);
+    chunk->constantIndex = NULL;
+    chunk->constantIndexCapacity = 0;
 }
 
 void writeConstant(VM* vm, Chunk* chunk, Value value, int line) {
@@ -38,14 +43,14 @@ void writeChunk(VM* vm, Chunk* chunk, uint8_t byte, int line) {
         chunk->code = GROW_ARRAY(vm, uint8_t, chunk->code, oldCapacity, chunk->capacity);
     }
 
-    if (chunk->lines != NULL && chunk->lines[chunk->lines_count - 1] == line) {
+    if (chunk->lines_count > 0 && chunk->lines[chunk->lines_count - 1] == line) {
         chunk->lines_run[chunk->lines_count - 1]++;
     } else {
         if (chunk->lines_capacity < chunk->lines_count + 1) {
             int oldCapacity = chunk->lines_capacity;
             chunk->lines_capacity = GROW_CAPACITY(oldCapacity);
-            chunk->lines = GROW_ARRAY(vm, int, chunk->lines, oldCapacity, chunk->capacity);
-            chunk->lines_run = GROW_ARRAY(vm, int, chunk->lines_run, oldCapacity, chunk->capacity);
+            chunk->lines = GROW_ARRAY(vm, int, chunk->lines, oldCapacity, chunk->lines_capacity);
+            chunk->lines_run = GROW_ARRAY(vm, int, chunk->lines_run, oldCapacity, chunk->lines_capacity);
         }
 
         chunk->lines[chunk->lines_count] = line;
@@ -58,26 +63,102 @@ void writeChunk(VM* vm, Chunk* chunk, uint8_t byte, int line) {
 }
 
 void freeChunk(VM* vm, Chunk* chunk) {
-    FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(vm, int, chunk->lines, chunk->capacity);
-    FREE_ARRAY(vm, int, chunk->lines_run, chunk->capacity);
+    if (!chunk->mapped)
+        FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(vm, int, chunk->lines, chunk->lines_capacity);
+    FREE_ARRAY(vm, int, chunk->lines_run, chunk->lines_capacity);
+    freeConstantIndex(vm, chunk);
     initChunk(chunk);
     freeValueArray(vm, &chunk->constants);
 }
 
-int addConstant(VM* vm, Chunk* chunk, Value value) {
-    for (int i = 0; i < chunk->constants.count; i++) {
-        if (valuesEqual(vm, chunk->constants.values[i], value))
-            return i;
+// Consistent with valuesEqual for every value a constant can hold.
+static uint32_t hashConstant(Value value) {
+    switch (value.type) {
+        case VAL_BOOL:
+            return AS_BOOL(value) ? 1 : 2;
+        case VAL_NULL:
+            return 3;
+        case VAL_NUMBER: {
+            double num = AS_NUMBER(value);
+            if (num == 0)
+                num = 0;
+            uint64_t bits;
+            memcpy(&bits, &num, sizeof(bits));
+            bits *= 11400714819323198485ull;
+            return (uint32_t) (bits >> 32);
+        }
+        case VAL_OBJ:
+            if (IS_STRING(value))
+                return AS_STRING(value)->hash;
+            return (uint32_t) (((uintptr_t) AS_OBJ(value) >> 3) * 2654435761u);
+    }
+    return 0;
+}
+
+static int* findConstantSlot(VM* vm, Chunk* chunk, Value value) {
+    int mask = chunk->constantIndexCapacity - 1;
+    for (uint32_t idx = hashConstant(value) & mask;; idx = (idx + 1) & mask) {
+        int* slot = &chunk->constantIndex[idx];
+        if (*slot == 0 || valuesEqual(vm, chunk->constants.values[*slot - 1], value))
+            return slot;
     }
+}
+
+static void buildConstantIndex(VM* vm, Chunk* chunk, int capacity) {
+    FREE_ARRAY(vm, int, chunk->constantIndex, chunk->constantIndexCapacity);
+    chunk->constantIndexCapacity = capacity;
+    while (chunk->constantIndexCapacity < chunk->constants.count * 2)
+        chunk->constantIndexCapacity *= 2;
+
+    chunk->constantIndex = ALLOCATE(vm, int, chunk->constantIndexCapacity);
+    memset(chunk->constantIndex, 0, sizeof(int) * chunk->constantIndexCapacity);
+    for (int i = 0; i < chunk->constants.count; i++)
+        *findConstantSlot(vm, chunk, chunk->constants.values[i]) = i + 1;
+}
+
+int addConstant(VM* vm, Chunk* chunk, Value value) {
+    if ((chunk->constants.count + 1) * 2 > chunk->constantIndexCapacity)
+        buildConstantIndex(vm, chunk, GROW_CAPACITY(chunk->constantIndexCapacity));
+
+    int* slot = findConstantSlot(vm, chunk, value);
+    if (*slot != 0)
+        return *slot - 1;
 
     push(vm, value);
     writeValueArray(vm, &chunk->constants, value);
     pop(vm);
-    
+
+    *slot = chunk->constants.count;
     return chunk->constants.count - 1;
 }
 
+void freeConstantIndex(VM* vm, Chunk* chunk) {
+    FREE_ARRAY(vm, int, chunk->constantIndex, chunk->constantIndexCapacity);
+    chunk->constantIndex = NULL;
+    chunk->constantIndexCapacity = 0;
+}
+
+void truncateChunk(VM* vm, Chunk* chunk, int count, int constants) {
+    int drop = chunk->count - count;
+    while (drop > 0) {
+        int* run = &chunk->lines_run[chunk->lines_count - 1];
+        if (*run > drop) {
+            *run -= drop;
+            break;
+        }
+        drop -= *run;
+        chunk->lines_count--;
+    }
+    chunk->count = count;
+
+    if (constants < chunk->constants.count) {
+        chunk->constants.count = constants;
+        if (chunk->constantIndex != NULL)
+            buildConstantIndex(vm, chunk, chunk->constantIndexCapacity);
+    }
+}
+
 int getLine(Chunk* chunk, int offset) {
     int idx = 0;
     while (idx < chunk->lines_count && offset >= chunk->lines_run[idx]) {
@@ -90,3 +171,132 @@ int getLine(Chunk* chunk, int offset) {
     }
     return chunk->lines[idx];
 }
+
+int instructionLength(Chunk* chunk, int offset) {
+    uint8_t* code = chunk->code + offset;
+    int left = chunk->count - offset;
+    int length;
+
+    switch (code[0]) {
+        case OP_NULL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_NOT:
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL:
+        case OP_NEGATE:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_RETURN:
+        case OP_POP:
+        case OP_CLOSE_UPVALUE:
+        case OP_INHERIT:
+        case OP_GET_INDEX:
+        case OP_SET_INDEX:
+        case OP_IMPORT_FILE:
+        case OP_UNPACK:
+        case OP_THROW:
+        case OP_ADD_NUM:
+        case OP_SUBTRACT_NUM:
+        case OP_MULTIPLY_NUM:
+        case OP_DIVIDE_NUM:
+        case OP_GREATER_NUM:
+        case OP_GREATER_EQUAL_NUM:
+        case OP_LESS_NUM:
+        case OP_LESS_EQUAL_NUM:
+        case OP_ADD_STRING:
+        case OP_ADD_LIST:
+        case OP_GET_INDEX_LIST:
+            length = 1;
+            break;
+
+        case OP_CONSTANT:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_LOCAL:
+        case OP_GET_LOCAL:
+        case OP_SET_UPVALUE:
+        case OP_GET_UPVALUE:
+        case OP_POP_N:
+        case OP_CALL:
+        case OP_CLASS:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_MAKE_LIST:
+        case OP_IMPORT:
+        case OP_GET_STACK:
+        case OP_SET_STACK:
+        case OP_END_INLINE:
+            length = 2;
+            break;
+
+        case OP_LOOP:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+            length = 3;
+            break;
+
+        case OP_CONSTANT_LONG:
+            length = 4;
+            break;
+
+        case OP_ATTRIBUTE:
+        case OP_INLINE:
+            length = 5;
+            break;
+
+        case OP_METHOD:
+            if (left < 2)
+                return -1;
+            length = code[1] == 1 ? 2 : code[1] == 2 ? 3 : 5;
+            break;
+
+        case OP_CLOSURE: {
+            if (left < 3)
+                return -1;
+            bool isLong = code[1] == OP_CONSTANT_LONG;
+            if (isLong && left < 5)
+                return -1;
+
+            int constant = isLong ? code[2] | (code[3] << 8) | (code[4] << 16) : code[2];
+            if (constant >= chunk->constants.count || !IS_FUNCTION(chunk->constants.values[constant]))
+                return -1;
+            length = (isLong ? 5 : 3) + 2 * AS_FUNCTION(chunk->constants.values[constant])->upvalueCount;
+            break;
+        }
+
+        default:
+            return -1;
+    }
+
+    return length <= left ? length : -1;
+}
+
+uint8_t checkedOpcode(uint8_t op) {
+    switch (op) {
+        case OP_ADD_NUM:
+        case OP_ADD_STRING:
+        case OP_ADD_LIST:
+            return OP_ADD;
+        case OP_SUBTRACT_NUM: return OP_SUBTRACT;
+        case OP_MULTIPLY_NUM: return OP_MULTIPLY;
+        case OP_DIVIDE_NUM: return OP_DIVIDE;
+        case OP_GREATER_NUM: return OP_GREATER;
+        case OP_GREATER_EQUAL_NUM: return OP_GREATER_EQUAL;
+        case OP_LESS_NUM: return OP_LESS;
+        case OP_LESS_EQUAL_NUM: return OP_LESS_EQUAL;
+        case OP_GET_INDEX_LIST: return OP_GET_INDEX;
+        default: return op;
+    }
+}
@@ -56,6 +56,27 @@ typedef enum {
     OP_ATTRIBUTE,
     OP_IMPORT_FILE,
     OP_THROW,
+
+    // Typed forms emitted by the self-hosted compiler when the type checker
+    // has proven the operand types. They skip the tag checks of the generic ops.
+    OP_ADD_NUM,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+    OP_GREATER_NUM,
+    OP_GREATER_EQUAL_NUM,
+    OP_LESS_NUM,
+    OP_LESS_EQUAL_NUM,
+    OP_ADD_STRING,
+    OP_ADD_LIST,
+    OP_GET_INDEX_LIST,
+
+    // Inlined calls. OP_INLINE checks the callee and makes the call as usual
+    // when it is not the function the body was copied from.
+    OP_INLINE,
+    OP_GET_STACK,
+    OP_SET_STACK,
+    OP_END_INLINE,
 } OpCode;
 
 struct Chunk {
@@ -67,6 +88,13 @@ struct Chunk {
     int lines_count;
     int lines_capacity;
     ValueArray constants;
+    // Set when code points into a binary held by the loader, so it is neither freed nor written.
+    bool mapped;
+
+    // Open addressed slots holding constant indices plus one, only kept
+    // while the chunk is being compiled.
+    int* constantIndex;
+    int constantIndexCapacity;
 };
 
 void initChunk(Chunk* chunk);
@@ -74,6 +102,13 @@ void writeChunk(VM* vm, Chunk* chunk, uint8_t byte, int line);
 void writeConstant(VM* vm, Chunk* chunk, Value value, int line);
 void freeChunk(VM* vm, Chunk* chunk);
 int addConstant(VM* vm, Chunk* chunk, Value value);
+void freeConstantIndex(VM* vm, Chunk* chunk);
+// Drops code past count and constants past the given number, keeping the line runs in step.
+void truncateChunk(VM* vm, Chunk* chunk, int count, int constants);
 int getLine(Chunk* chunk, int offset);
+// Length of the instruction at offset, or -1 when it cannot be decoded.
+int instructionLength(Chunk* chunk, int offset);
+// The generic opcode a typed opcode specializes, or op itself.
+uint8_t checkedOpcode(uint8_t op);
 
 #endif
@@ -3,9 +3,12 @@
 #include <string.h>
 
 #include "../util/common.h"
+#include "cache.h"
 #include "compiler.h"
 #include "../util/memory.h"
+#include "optimizer.h"
 #include "scanner.h"
+#include "scheduler.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "../util/debug.h"
@@ -17,6 +20,9 @@ typedef struct {
     int loopDepth;
     bool fixed;
     bool isCaptured;
+    // Set for constants with a literal initializer, whose reads load the value directly.
+    bool known;
+    Value value;
 } Local;
 
 typedef struct {
@@ -37,6 +43,21 @@ typedef struct CodePoint {
     int loopDepth;
 } CodePoint;
 
+#define PENDING_MAX 8
+
+// Position in the held back literals, used to tell whether an expression
+// compiled down to a single literal.
+typedef struct {
+    int count;
+    int flushed;
+} LiteralMark;
+
+// Start of code that is compiled for its errors and then dropped.
+typedef struct {
+    int code;
+    int constants;
+} DeadCode;
+
 struct Compiler {
     struct Compiler* enclosing;
 
@@ -51,6 +72,13 @@ struct Compiler {
 
     Upvalue upvalues[UINT8_COUNT];
 
+    // Literal loads held back from the chunk while optimizing, so that an
+    // operator applied to them can replace them with its result.
+    Value pending[PENDING_MAX];
+    int pendingLines[PENDING_MAX];
+    int pendingCount;
+    int pendingFlushed;
+
     ObjFunction* function;
     FunctionType type;
 };
@@ -58,6 +86,16 @@ struct Compiler {
 struct ClassCompiler {
     struct ClassCompiler* enclosing;
     bool hasSuperclass;
+    // Instance methods declared so far, by name, for inlining bare calls to them.
+    Table methods;
+    // The prv ones among them. A bare call to one from a method of this class is
+    // bound when compiled, so a subclass method of the same name does not replace it.
+    Table privateMethods;
+    // Set while compiling a static method, which has no receiver to call them on.
+    bool inStatic;
+    Token name;
+    // Set for classes declared at script level, whose constant fields can be read directly.
+    bool isGlobal;
 };
 
 typedef struct {
@@ -69,8 +107,29 @@ typedef struct {
     VM* vm;
     Compiler* compiler;
     ClassCompiler* classCompiler;
+    // Script level constants with a literal initializer, by name.
+    Table constGlobals;
+    // Script level functions declared so far, by name, for inlining calls to them.
+    // They cannot be reassigned, so calls from outside a class need no guard.
+    Table inlineFunctions;
+    // Script level names assigned so far, which a later function of the name leaves out.
+    Table assignedGlobals;
+    // Function reached by a call of the last global read, and where that read ends.
+    // Fixed when the read can reach nothing else, so the call needs no guard.
+    ObjFunction* callee;
+    int calleeEnd;
+    bool calleeFixed;
+    // File loaded by the last import expression, and where that expression ends.
+    ObjString* imported;
+    int importedEnd;
+    const char* path;
 } Parser;
 
+#define OPTIMIZING(parser) ((parser)->vm->optimize > 0)
+#define INLINING(parser) ((parser)->vm->optimize >= 2)
+// Largest function body, in bytes before its return, that is copied into callers.
+#define INLINE_BUDGET 32
+
 typedef enum {
     PREC_NONE,
     PREC_ASSIGNMENT,  // =
@@ -100,6 +159,12 @@ static Chunk* currentChunk(Parser* parser) {
 static void errorAt(Parser* parser, Token* tok, const char* msg) {
     if (parser->panicMode) return;
     parser->panicMode = true;
+    parser->hadError = true;
+
+    // A file compiled ahead on a thread is compiled again on the main one when it
+    // fails, which reports its errors in order.
+    if (parser->vm->importPlan != NULL)
+        return;
 
     fprintf(stderr, "[line %d] Error", tok->line);
 
@@ -110,7 +175,6 @@ static void errorAt(Parser* parser, Token* tok, const char* msg) {
     }
 
     fprintf(stderr, ": %s\n", msg);
-    parser->hadError = true;
 }
 
 static void errorAtCurrent(Parser* parser, const char* msg) {
@@ -153,10 +217,36 @@ static bool match(Parser* parser, TokenType type) {
 
 // Bytecode emitting
 
+static void writeLiteral(Parser* parser, Value val, int line) {
+    if (IS_NULL(val)) {
+        writeChunk(parser->vm, currentChunk(parser), OP_NULL, line);
+    } else if (IS_BOOL(val)) {
+        writeChunk(parser->vm, currentChunk(parser), AS_BOOL(val) ? OP_TRUE : OP_FALSE, line);
+    } else {
+        writeConstant(parser->vm, currentChunk(parser), val, line);
+    }
+}
+
+// Values stay in the pending array until all are written, so they remain marked.
+static void flushLiterals(Parser* parser) {
+    Compiler* compiler = parser->compiler;
+    for (int i = 0; i < compiler->pendingCount; i++)
+        writeLiteral(parser, compiler->pending[i], compiler->pendingLines[i]);
+
+    compiler->pendingFlushed += compiler->pendingCount;
+    compiler->pendingCount = 0;
+}
+
 static void emitByte(Parser* parser, uint8_t byte) {
+    flushLiterals(parser);
     writeChunk(parser->vm, currentChunk(parser), byte, parser->previous.line);
 }
 
+static int currentOffset(Parser* parser) {
+    flushLiterals(parser);
+    return currentChunk(parser)->count;
+}
+
 static void emitBytes(Parser* parser, uint8_t byte1, uint8_t byte2) {
     emitByte(parser, byte1);
     emitByte(parser, byte2);
@@ -178,7 +268,7 @@ static int emitJump(Parser* parser, uint8_t op) {
 }
 
 static void patchJump(Parser* parser, int idx) {
-    int jump = currentChunk(parser)->count - idx - 2;
+    int jump = currentOffset(parser) - idx - 2;
     
     if (jump > UINT16_MAX) {
         error(parser, "Compiler does not support jumps of this distance.");
@@ -199,9 +289,66 @@ static void emitReturn(Parser* parser) {
 }
 
 static void emitConstant(Parser* parser, Value val) {
+    flushLiterals(parser);
     writeConstant(parser->vm, currentChunk(parser), val, parser->previous.line);
 }
 
+static void emitLiteral(Parser* parser, Value val) {
+    Compiler* compiler = parser->compiler;
+    if (!OPTIMIZING(parser)) {
+        writeLiteral(parser, val, parser->previous.line);
+        return;
+    }
+
+    if (compiler->pendingCount == PENDING_MAX) {
+        writeLiteral(parser, compiler->pending[0], compiler->pendingLines[0]);
+        memmove(compiler->pending, compiler->pending + 1, sizeof(Value) * (PENDING_MAX - 1));
+        memmove(compiler->pendingLines, compiler->pendingLines + 1, sizeof(int) * (PENDING_MAX - 1));
+        compiler->pendingCount--;
+        compiler->pendingFlushed++;
+    }
+
+    compiler->pending[compiler->pendingCount] = val;
+    compiler->pendingLines[compiler->pendingCount] = parser->previous.line;
+    compiler->pendingCount++;
+}
+
+static LiteralMark markLiterals(Parser* parser) {
+    return (LiteralMark) { parser->compiler->pendingCount, parser->compiler->pendingFlushed };
+}
+
+// True when everything compiled since the mark is one held back literal.
+static bool literalSince(Parser* parser, LiteralMark mark) {
+    return parser->compiler->pendingFlushed == mark.flushed &&
+        parser->compiler->pendingCount == mark.count + 1;
+}
+
+static Value peekLiteral(Parser* parser, int distance) {
+    return parser->compiler->pending[parser->compiler->pendingCount - 1 - distance];
+}
+
+static Value popLiteral(Parser* parser) {
+    return parser->compiler->pending[--parser->compiler->pendingCount];
+}
+
+static bool literalFalsey(Value val) {
+    return IS_NULL(val) || (IS_BOOL(val) && !AS_BOOL(val));
+}
+
+static DeadCode beginDeadCode(Parser* parser) {
+    int code = currentOffset(parser);
+    return (DeadCode) { code, currentChunk(parser)->constants.count };
+}
+
+static void endDeadCode(Parser* parser, DeadCode dead) {
+    Compiler* compiler = parser->compiler;
+    compiler->pendingCount = 0;
+    while (compiler->breakCount > 0 && compiler->breakPoints[compiler->breakCount - 1].code >= dead.code)
+        compiler->breakCount--;
+
+    truncateChunk(parser->vm, currentChunk(parser), dead.code, dead.constants);
+}
+
 static void initCompiler(Compiler* compiler, Parser* parser, FunctionType type) {
     compiler->enclosing = parser->compiler;
     parser->compiler = compiler;
@@ -210,6 +357,8 @@ static void initCompiler(Compiler* compiler, Parser* parser, FunctionType type)
     compiler->scopeDepth = 0;
     compiler->loopDepth = 0;
     compiler->breakCount = 0;
+    compiler->pendingCount = 0;
+    compiler->pendingFlushed = 0;
 
     compiler->function = newFunction(parser->vm);
     compiler->function->name = parser->vm->nspace->name;
@@ -219,6 +368,8 @@ static void initCompiler(Compiler* compiler, Parser* parser, FunctionType type)
 
     Local* local = &compiler->locals[compiler->localCount++];
     local->depth = 0;
+    local->loopDepth = 0;
+    local->fixed = false;
     if (type != FUNC_FUNCTION) {
         local->name.start = "this";
         local->name.length = 4;
@@ -227,6 +378,7 @@ static void initCompiler(Compiler* compiler, Parser* parser, FunctionType type)
         local->name.length = 0;
     }
     local->isCaptured = false;
+    local->known = false;
 
     if (type != FUNC_SCRIPT) {
         compiler->function->name = copyString(parser->vm, parser->previous.start, 
@@ -237,6 +389,10 @@ static void initCompiler(Compiler* compiler, Parser* parser, FunctionType type)
 static ObjFunction* endCompiler(Parser* parser) {
     emitReturn(parser);
     ObjFunction* func = parser->compiler->function;
+    freeConstantIndex(parser->vm, &func->chunk);
+
+    if (parser->vm->optimize >= 2 && !parser->hadError)
+        optimizeChunk(parser->vm, &func->chunk);
 
     #ifdef DEBUG_PRINT_CODE
         if (!parser->hadError) {
@@ -252,7 +408,7 @@ static ObjFunction* endCompiler(Parser* parser) {
 
 static void beginLoop(Parser* parser) {
     CodePoint* loopPoint = &parser->compiler->loopPoints[parser->compiler->loopDepth];
-    loopPoint->code = currentChunk(parser)->count;
+    loopPoint->code = currentOffset(parser);
     loopPoint->scopeDepth = parser->compiler->scopeDepth;
     // Not really necessary but whatever. vvv
     loopPoint->loopDepth = parser->compiler->loopDepth;
@@ -291,21 +447,67 @@ static void markInitialized(Parser* parser) {
         parser->compiler->scopeDepth;
 }
 
+static bool fixedName(Parser* parser, const char* path, Token* name, Token* field, Value* val) {
+    if (parser->vm->fixedNames.count == 0)
+        return false;
+
+    ObjString* key = field == NULL ?
+        formatString(parser->vm, "%s\n%.*s", path, name->length, name->start) :
+        formatString(parser->vm, "%s\n%.*s.%.*s", path, name->length, name->start,
+            field->length, field->start);
+    return tableGet(&parser->vm->fixedNames, key, val);
+}
+
+static void setFixedName(Parser* parser, Token* name, Token* field, Value val) {
+    ObjString* key = field == NULL ?
+        formatString(parser->vm, "%s\n%.*s", parser->path, name->length, name->start) :
+        formatString(parser->vm, "%s\n%.*s.%.*s", parser->path, name->length, name->start,
+            field->length, field->start);
+    push(parser->vm, OBJ_VAL(key));
+    tableSet(parser->vm, &parser->vm->fixedNames, key, val);
+    pop(parser->vm);
+}
+
+// Reads of a propagated constant are already replaced, so it cannot change afterwards.
+static bool isConstGlobal(Parser* parser, uint8_t idx) {
+    Value name = currentChunk(parser)->constants.values[idx];
+    if (!IS_STRING(name))
+        return false;
+    if (parser->constGlobals.count > 0 && tableGet(&parser->constGlobals, AS_STRING(name), NULL))
+        return true;
+    // Calls of a script level function may have been inlined without a guard.
+    if (parser->inlineFunctions.count > 0 && tableGet(&parser->inlineFunctions, AS_STRING(name), NULL))
+        return true;
+
+    Token tok = { TOKEN_IDENTIFIER, AS_CSTRING(name), AS_STRING(name)->length, 0 };
+    return fixedName(parser, parser->path, &tok, NULL, NULL);
+}
+
 static void defineVariable(Parser* parser, uint8_t idx) {
     if (parser->compiler->scopeDepth > 0) {
         markInitialized(parser);
         return;
     }
+
+    if (isConstGlobal(parser, idx)) {
+        error(parser, "A constant of the given name already exists.");
+    }
     
     emitBytes(parser, OP_DEFINE_GLOBAL, idx);
 }
 
 static uint8_t identifierConstant(Parser* parser, Token* tok) {
-    return addConstant(
+    int constant = addConstant(
         parser->vm,
         currentChunk(parser), 
         OBJ_VAL(copyString(parser->vm, tok->start, tok->length))
     );
+
+    if (constant > UINT8_MAX) {
+        error(parser, "Too many constants before this identifier in one chunk.");
+        return 0;
+    }
+    return (uint8_t) constant;
 }
 
 static bool identifiersEqual(Token* a, Token* b) {
@@ -383,6 +585,7 @@ static void addLocal(Parser* parser, Token tok, bool constant) {
     local->loopDepth = parser->compiler->loopDepth;
     local->fixed = constant;
     local->isCaptured = false;
+    local->known = false;
 }
 
 static void declareVariable(Parser* parser, bool constant) {
@@ -416,16 +619,36 @@ static uint8_t parseVariable(Parser* parser, const char* errMsg, bool constant)
 
 static void varDeclaration(Parser* parser, bool constant) {
     uint8_t global = parseVariable(parser, "Expected variable identifier.", constant);
+    Token name = parser->previous;
 
+    LiteralMark mark = markLiterals(parser);
     if (match(parser, TOKEN_EQUAL)) {
         expression(parser);
     } else {
-        emitByte(parser, OP_NULL);
+        emitLiteral(parser, NULL_VAL);
     }
 
     consume(parser, TOKEN_SEMICOLON, "expected ';' after declaration.");
 
+    bool known = constant && literalSince(parser, mark);
+    Value value = known ? peekLiteral(parser, 0) : NULL_VAL;
+    bool isImport = OPTIMIZING(parser) && constant && parser->compiler->scopeDepth == 0 &&
+        parser->imported != NULL && parser->importedEnd == currentOffset(parser);
+
     defineVariable(parser, global);
+    if (isImport)
+        setFixedName(parser, &name, NULL, OBJ_VAL(parser->imported));
+
+    if (!known) {
+        return;
+    } else if (parser->compiler->scopeDepth > 0) {
+        Local* local = &parser->compiler->locals[parser->compiler->localCount - 1];
+        local->known = true;
+        local->value = value;
+    } else {
+        tableSet(parser->vm, &parser->constGlobals,
+            copyString(parser->vm, name.start, name.length), value);
+    }
 }
 
 static uint8_t valueList(Parser* parser, TokenType closing, const char* msg) {
@@ -453,13 +676,24 @@ static void beginScope(Parser* parser) {
 
 static void block(Parser* parser) {
     while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+        bool exits = check(parser, TOKEN_RETURN) || check(parser, TOKEN_BREAK) ||
+            check(parser, TOKEN_CONTINUE);
         declaration(parser);
+
+        // Nothing after a return, break or continue in the same block can run.
+        if (exits && OPTIMIZING(parser)) {
+            DeadCode dead = beginDeadCode(parser);
+            while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+                declaration(parser);
+            }
+            endDeadCode(parser, dead);
+        }
     }
 
     consume(parser, TOKEN_RIGHT_BRACE, "Expected '}' after block.");
 }
 
-static void function(Parser* parser, FunctionType type) {
+static ObjFunction* function(Parser* parser, FunctionType type) {
     Compiler compiler;
     initCompiler(&compiler, parser, type);
 
@@ -493,13 +727,21 @@ static void function(Parser* parser, FunctionType type) {
         emitByte(parser, compiler.upvalues[i].isLocal ? 1 : 0);
         emitByte(parser, compiler.upvalues[i].index);
     }
+    return func;
 }
 
 static void funDeclaration(Parser* parser) {
     uint8_t global = parseVariable(parser, "Expect function name.", false);
+    Token name = parser->previous;
     markInitialized(parser);
-    function(parser, FUNC_FUNCTION);
+    ObjFunction* func = function(parser, FUNC_FUNCTION);
     defineVariable(parser, global);
+
+    if (INLINING(parser) && parser->compiler->type == FUNC_SCRIPT && parser->compiler->scopeDepth == 0) {
+        ObjString* key = copyString(parser->vm, name.start, name.length);
+        if (!tableGet(&parser->assignedGlobals, key, NULL))
+            tableSet(parser->vm, &parser->inlineFunctions, key, OBJ_VAL(func));
+    }
 }
 
 static void endScope(Parser* parser) {
@@ -597,9 +839,19 @@ static void method(Parser* parser) {
     } else {
         constant = identifierConstant(parser, &parser->previous);
     }
+    Token name = parser->previous;
 
     FunctionType type = FUNC_METHOD;
-    function(parser, type);
+    parser->classCompiler->inStatic = isStatic;
+    ObjFunction* func = function(parser, type);
+    parser->classCompiler->inStatic = false;
+    if (INLINING(parser) && !isDefaultMethod && !isStatic) {
+        ObjString* key = copyString(parser->vm, name.start, name.length);
+        tableSet(parser->vm, &parser->classCompiler->methods, key, OBJ_VAL(func));
+        if (!isPublic)
+            tableSet(parser->vm, &parser->classCompiler->privateMethods, key, OBJ_VAL(func));
+    }
+
     emitBytes(parser, OP_METHOD, isDefaultMethod ? 2 : 0);
     emitByte(parser, constant);
     if (!isDefaultMethod)
@@ -620,8 +872,10 @@ static void declareAttribute(Parser* parser) {
         isStatic = true;
     
     consume(parser, TOKEN_IDENTIFIER, "Expected attribute name.");
+    Token name = parser->previous;
     uint8_t constant = identifierConstant(parser, &parser->previous);
 
+    LiteralMark mark = markLiterals(parser);
     if (match(parser, TOKEN_EQUAL))
         expression(parser);
     else
@@ -629,6 +883,13 @@ static void declareAttribute(Parser* parser) {
 
     consume(parser, TOKEN_SEMICOLON, "Expected ';' after attribute declaration.");
 
+    // The class name is fixed as well, so that reads through it keep reaching this class.
+    ClassCompiler* classCompiler = parser->classCompiler;
+    if (isConstant && isPublic && isStatic && classCompiler->isGlobal && literalSince(parser, mark)) {
+        setFixedName(parser, &classCompiler->name, &name, peekLiteral(parser, 0));
+        setFixedName(parser, &classCompiler->name, NULL, BOOL_VAL(true));
+    }
+
     emitBytes(parser, OP_ATTRIBUTE, constant);
     emitBytes(parser, isConstant ? 1 : 0, isPublic ? 1 : 0);
     emitByte(parser, isStatic ? 1 : 0);
@@ -685,7 +946,115 @@ static void expressionOp(Parser* parser, TokenType tok) {
     }
 }
 
+static bool isAssignment(TokenType type) {
+    return type == TOKEN_EQUAL || type == TOKEN_PLUS_EQUAL || type == TOKEN_MINUS_EQUAL ||
+        type == TOKEN_STAR_EQUAL || type == TOKEN_SLASH_EQUAL;
+}
+
+// Finds the literal value of a constant visible under the given name, stopping at
+// the innermost declaration so that shadowing variables are respected.
+static bool knownConstant(Parser* parser, Token* tok, Value* val) {
+    for (Compiler* compiler = parser->compiler; compiler != NULL; compiler = compiler->enclosing) {
+        for (int i = compiler->localCount - 1; i >= 0; i--) {
+            Local* local = &compiler->locals[i];
+            if (!identifiersEqual(tok, &local->name))
+                continue;
+            if (!local->known || local->depth == -1)
+                return false;
+
+            *val = local->value;
+            return true;
+        }
+    }
+
+    if (parser->constGlobals.count == 0)
+        return false;
+    return tableGet(&parser->constGlobals, copyString(parser->vm, tok->start, tok->length), val);
+}
+
+static bool isLocalName(Parser* parser, Token* tok) {
+    for (Compiler* compiler = parser->compiler; compiler != NULL; compiler = compiler->enclosing) {
+        for (int i = compiler->localCount - 1; i >= 0; i--) {
+            if (identifiersEqual(tok, &compiler->locals[i].name))
+                return true;
+        }
+    }
+    return false;
+}
+
+// Finds the literal of a const pub static field read as name.field, or as
+// name.class.field when name is a constant holding an imported file. Returns
+// the number of tokens after the name that the read spans, 0 when not found.
+// Calls and assignments are left to the VM, which reports them.
+static int staticConstant(Parser* parser, Token* tok, Value* val) {
+    if (!check(parser, TOKEN_DOT) || parser->vm->fixedNames.count == 0 || isLocalName(parser, tok))
+        return 0;
+
+    Scanner ahead = *parser->scanner;
+    Token clazz = *tok;
+    Token field = scanToken(&ahead);
+    Token next = scanToken(&ahead);
+    const char* path = parser->path;
+    int length = 2;
+
+    Value imported;
+    if (next.type == TOKEN_DOT && fixedName(parser, path, tok, NULL, &imported) && IS_STRING(imported)) {
+        clazz = field;
+        field = scanToken(&ahead);
+        next = scanToken(&ahead);
+        path = AS_CSTRING(imported);
+        length = 4;
+    }
+
+    if (clazz.type != TOKEN_IDENTIFIER || field.type != TOKEN_IDENTIFIER ||
+            next.type == TOKEN_LEFT_PAREN || isAssignment(next.type))
+        return 0;
+    return fixedName(parser, path, &clazz, &field, val) ? length : 0;
+}
+
+// Function a bare call of the name reaches unless something else is bound to
+// it at run time: a method of the class being compiled, then a script level one.
+// Nothing else can be for a prv method called from a method of its class, on
+// the receiver in slot 0, or for a script level function called outside a class.
+static ObjFunction* inlineCandidate(Parser* parser, Token* tok, bool* fixed) {
+    ObjString* name = copyString(parser->vm, tok->start, tok->length);
+    ClassCompiler* classCompiler = parser->classCompiler;
+    FunctionType type = parser->compiler->type;
+    Value func;
+
+    *fixed = false;
+    if (classCompiler != NULL) {
+        if ((type == FUNC_METHOD || type == FUNC_BUILDER) && !classCompiler->inStatic &&
+                tableGet(&classCompiler->privateMethods, name, &func)) {
+            *fixed = true;
+            return AS_FUNCTION(func);
+        }
+        if (tableGet(&classCompiler->methods, name, &func))
+            return AS_FUNCTION(func);
+    }
+    if (tableGet(&parser->inlineFunctions, name, &func)) {
+        *fixed = classCompiler == NULL;
+        return AS_FUNCTION(func);
+    }
+    return NULL;
+}
+
 static void namedVariable(Parser* parser, Token tok, bool canAssign) {
+    Value known;
+    if (OPTIMIZING(parser) && !isAssignment(parser->current.type) &&
+            knownConstant(parser, &tok, &known)) {
+        emitLiteral(parser, known);
+        return;
+    }
+
+    int length;
+    if (OPTIMIZING(parser) && (length = staticConstant(parser, &tok, &known)) > 0) {
+        for (int i = 0; i < length; i++)
+            advance(parser);
+        emitLiteral(parser, known);
+        return;
+    }
+
     uint8_t getOp, setOp;
     int arg = resolveLocal(parser, parser->compiler, &tok);
     if (arg != -1) {
@@ -704,6 +1073,10 @@ static void namedVariable(Parser* parser, Token tok, bool canAssign) {
 
     if (assignmentToken == TOKEN_NULL) {
         emitBytes(parser, getOp, (uint8_t) arg);
+        if (getOp == OP_GET_GLOBAL && INLINING(parser)) {
+            parser->callee = inlineCandidate(parser, &tok, &parser->calleeFixed);
+            parser->calleeEnd = currentOffset(parser);
+        }
         return;
     }
 
@@ -712,6 +1085,15 @@ static void namedVariable(Parser* parser, Token tok, bool canAssign) {
         return;
     }
 
+    if (setOp == OP_SET_GLOBAL && isConstGlobal(parser, (uint8_t) arg)) {
+        error(parser, "Variable is constant and cannot be modified.");
+        return;
+    }
+    if (setOp == OP_SET_GLOBAL && INLINING(parser)) {
+        tableSet(parser->vm, &parser->assignedGlobals,
+            AS_STRING(currentChunk(parser)->constants.values[arg]), BOOL_VAL(true));
+    }
+
     if (assignmentToken != TOKEN_EQUAL)
         emitBytes(parser, getOp, (uint8_t) arg);
 
@@ -744,7 +1126,12 @@ static void classDeclaration(Parser* parser) {
 
     ClassCompiler classCompiler;
     classCompiler.hasSuperclass = false;
+    classCompiler.name = className;
+    classCompiler.isGlobal = parser->compiler->scopeDepth == 0;
     classCompiler.enclosing = parser->classCompiler;
+    initTable(&classCompiler.methods);
+    initTable(&classCompiler.privateMethods);
+    classCompiler.inStatic = false;
     parser->classCompiler = &classCompiler;
 
     if (match(parser, TOKEN_LEFT_ARROW)) {
@@ -777,7 +1164,7 @@ static void classDeclaration(Parser* parser) {
         } else {
             advance(parser);
             error(parser, "Expected field, method, or constructor.");
-            return;
+            break;
         }
     }
     consume(parser, TOKEN_RIGHT_BRACE, "Expected '}' after class body.");
@@ -788,6 +1175,8 @@ static void classDeclaration(Parser* parser) {
         endScope(parser);
     }
 
+    freeTable(parser->vm, &classCompiler.methods);
+    freeTable(parser->vm, &classCompiler.privateMethods);
     parser->classCompiler = classCompiler.enclosing;
 }
 
@@ -807,11 +1196,31 @@ static void declaration(Parser* parser) {
         synchronize(parser);
 }
 
+static void branch(Parser* parser, bool reachable) {
+    if (reachable) {
+        statement(parser);
+        return;
+    }
+
+    DeadCode dead = beginDeadCode(parser);
+    statement(parser);
+    endDeadCode(parser, dead);
+}
+
 static void ifStatement(Parser* parser) {
     consume(parser, TOKEN_LEFT_PAREN, "Expected '(' before condition.");
+    LiteralMark mark = markLiterals(parser);
     expression(parser);
     consume(parser, TOKEN_RIGHT_PAREN, "Expected ')' after condition.");
 
+    if (literalSince(parser, mark)) {
+        bool taken = !literalFalsey(popLiteral(parser));
+        branch(parser, taken);
+        if (match(parser, TOKEN_ELSE))
+            branch(parser, !taken);
+        return;
+    }
+
     int thenJump = emitJump(parser, OP_JUMP_IF_FALSE);
     emitByte(parser, OP_POP);
     statement(parser);
@@ -830,11 +1239,24 @@ static void ifStatement(Parser* parser) {
 static void whileStatement(Parser* parser) {
     beginLoop(parser);
 
-    int loopStart = currentChunk(parser)->count;
+    int loopStart = currentOffset(parser);
     consume(parser, TOKEN_LEFT_PAREN, "Expected '(' before condition.");
+    LiteralMark mark = markLiterals(parser);
     expression(parser);
     consume(parser, TOKEN_RIGHT_PAREN, "Expected ')' after condition.");
 
+    if (literalSince(parser, mark)) {
+        if (literalFalsey(popLiteral(parser))) {
+            branch(parser, false);
+        } else {
+            statement(parser);
+            emitLoop(parser, loopStart);
+        }
+
+        endLoop(parser);
+        return;
+    }
+
     int exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
     emitByte(parser, OP_POP);
     statement(parser);
@@ -857,7 +1279,7 @@ static void forStatement(Parser* parser) {
         expressionStatement(parser);
     }
 
-    int loopStart = currentChunk(parser)->count;
+    int loopStart = currentOffset(parser);
     int exitJump = -1;
     if (!match(parser, TOKEN_SEMICOLON)) {
         expression(parser);
@@ -871,7 +1293,7 @@ static void forStatement(Parser* parser) {
         int bodyJump = emitJump(parser, OP_JUMP);
 
         beginLoop(parser);
-        int incrementStart = currentChunk(parser)->count;
+        int incrementStart = currentOffset(parser);
 
         expression(parser);
         emitByte(parser, OP_POP);
@@ -992,7 +1414,88 @@ static void grouping(Parser* parser, bool canAssign) {
     consume(parser, TOKEN_RIGHT_PAREN, "Expected ')' after expression.");
 }
 
+ObjFunction* compileModule(VM* vm, ObjString* filename) {
+    char* src = readFile(filename->chars);
+
+    char* cwd = getCurrentWorkingDirectory();
+    changeDirectoryToFile(filename->chars);
+
+    ObjFunction* func = NULL;
+    bool loaded = vm->moduleCache != NULL && loadModule(vm, filename, src, &func);
+    if (!loaded && vm->scheduler != NULL && loadScheduled(vm, filename, &func)) {
+        loaded = true;
+        if (func != NULL && vm->moduleCache != NULL)
+            storeModule(vm, filename, src, func);
+    }
+
+    if (loaded) {
+        changeDirectory(cwd);
+        free(cwd);
+        free(src);
+        return func;
+    }
+
+    VM* temp = malloc(sizeof(VM));
+
+    initVM(temp, vm, filename->chars);
+    tableAddAll(temp, &vm->importedFiles, &temp->importedFiles);
+    tableAddAll(temp, &vm->fixedNames, &temp->fixedNames);
+    func = compile(temp, filename->chars, src);
+    if (func != NULL && vm->moduleCache != NULL)
+        storeModule(temp, filename, src, func);
+
+    if (func != NULL)
+        push(vm, OBJ_VAL(func));
+    tableAddAll(vm, &temp->importedFiles, &vm->importedFiles);
+    tableAddAll(vm, &temp->fixedNames, &vm->fixedNames);
+    if (func != NULL)
+        pop(vm);
+    
+    decoupleVM(temp);
+    takeOwnership(vm, temp->objects);
+
+    changeDirectory(cwd);
+    free(cwd);
+    free(src);
+    return func;
+}
+
+// Imports of a file compiled on a thread are taken from its plan. A file compiled
+// before the import is reached is imported by path. Otherwise a placeholder
+// function takes the place of the file's, and is swapped for it when linked.
+static void plannedImport(Parser* parser) {
+    ImportPlan* plan = parser->vm->importPlan;
+    PlannedImport* import = plan->next < plan->count ? &plan->imports[plan->next++] : NULL;
+    if (import == NULL || strlen(import->written) != parser->previous.length - 2 ||
+            memcmp(import->written, parser->previous.start + 1, parser->previous.length - 2) != 0) {
+        error(parser, "Failed to import file.");
+        return;
+    }
+
+    ObjString* filename = copyString(parser->vm, import->path, strlen(import->path));
+    push(parser->vm, OBJ_VAL(filename));
+    emitConstant(parser, OBJ_VAL(filename));
+    if (import->compiled) {
+        emitConstant(parser, OBJ_VAL(filename));
+    } else {
+        ObjFunction* placeholder = newFunction(parser->vm);
+        push(parser->vm, OBJ_VAL(placeholder));
+        emitConstant(parser, OBJ_VAL(placeholder));
+        pop(parser->vm);
+    }
+    pop(parser->vm);
+
+    emitByte(parser, OP_IMPORT_FILE);
+    parser->imported = filename;
+    parser->importedEnd = currentOffset(parser);
+}
+
 static void importFile(Parser* parser) {
+    if (parser->vm->importPlan != NULL) {
+        plannedImport(parser);
+        return;
+    }
+
     ObjString* relPath = copyString(parser->vm, parser->previous.start + 1, parser->previous.length - 2);
     push(parser->vm, OBJ_VAL(relPath));
     
@@ -1006,43 +1509,28 @@ static void importFile(Parser* parser) {
 
     pop(parser->vm);
 
-    char* src = readFile(filename->chars);
-
-    char* cwd = getCurrentWorkingDirectory();
-    changeDirectoryToFile(filename->chars);
-
     Value importVal;
     if (tableGet(&parser->vm->importedFiles, filename, &importVal) 
             && IS_FUNCTION(importVal)) {
         emitConstant(parser, OBJ_VAL(filename));
         emitByte(parser, OP_IMPORT_FILE);
-        changeDirectory(cwd);
-        free(cwd);
+        parser->imported = filename;
+        parser->importedEnd = currentOffset(parser);
         return;
     }
 
-    VM* temp = malloc(sizeof(VM));
-
-    initVM(temp, filename->chars);
-    tableAddAll(temp, &parser->vm->importedFiles, &temp->importedFiles);
-    ObjFunction* func = compile(temp, filename->chars, src);
-    push(parser->vm, OBJ_VAL(func));
-    tableAddAll(parser->vm, &temp->importedFiles, &parser->vm->importedFiles);
-    
-    decoupleVM(temp);
-    takeOwnership(parser->vm, temp->objects);
-
-    changeDirectory(cwd);
-    free(cwd);
-
+    ObjFunction* func = compileModule(parser->vm, filename);
     if (func == NULL) {
         error(parser, "Failed to import file.");
         return;
     }
     
+    push(parser->vm, OBJ_VAL(func));
     emitConstant(parser, OBJ_VAL(func));
     pop(parser->vm);
     emitByte(parser, OP_IMPORT_FILE);
+    parser->imported = filename;
+    parser->importedEnd = currentOffset(parser);
 }
 
 static void import(Parser* parser, bool canAssign) {
@@ -1056,11 +1544,108 @@ static void import(Parser* parser, bool canAssign) {
     emitBytes(parser, OP_IMPORT, constant);
 }
 
+// Folding only covers operands the VM would accept, leaving type errors to runtime.
+static bool foldUnary(TokenType op, Value a, Value* res) {
+    switch (op) {
+        case TOKEN_MINUS:
+            if (!IS_NUMBER(a))
+                return false;
+            *res = NUMBER_VAL(-AS_NUMBER(a));
+            return true;
+        case TOKEN_BANG:
+            *res = BOOL_VAL(literalFalsey(a));
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool foldBinary(Parser* parser, TokenType op, Value a, Value b, Value* res) {
+    switch (op) {
+        case TOKEN_EQUAL_EQUAL:
+            *res = BOOL_VAL(valuesEqual(parser->vm, a, b));
+            return true;
+        case TOKEN_BANG_EQUAL:
+            *res = BOOL_VAL(!valuesEqual(parser->vm, a, b));
+            return true;
+        default:
+            break;
+    }
+
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        double x = AS_NUMBER(a);
+        double y = AS_NUMBER(b);
+        switch (op) {
+            case TOKEN_PLUS:          *res = NUMBER_VAL(x + y); return true;
+            case TOKEN_MINUS:         *res = NUMBER_VAL(x - y); return true;
+            case TOKEN_STAR:          *res = NUMBER_VAL(x * y); return true;
+            case TOKEN_SLASH:         *res = NUMBER_VAL(x / y); return true;
+            case TOKEN_GREATER:       *res = BOOL_VAL(x > y); return true;
+            case TOKEN_GREATER_EQUAL: *res = BOOL_VAL(x >= y); return true;
+            case TOKEN_LESS:          *res = BOOL_VAL(x < y); return true;
+            case TOKEN_LESS_EQUAL:    *res = BOOL_VAL(x <= y); return true;
+            default:                  return false;
+        }
+    }
+
+    if (!IS_STRING(a) || !IS_STRING(b))
+        return false;
+
+    ObjString* x = AS_STRING(a);
+    ObjString* y = AS_STRING(b);
+    switch (op) {
+        case TOKEN_PLUS: {
+            int len = x->length + y->length;
+            char* chars = ALLOCATE(parser->vm, char, len + 1);
+            memcpy(chars, x->chars, x->length);
+            memcpy(chars + x->length, y->chars, y->length);
+            chars[len] = '\0';
+            *res = OBJ_VAL(takeString(parser->vm, chars, len));
+            return true;
+        }
+        case TOKEN_GREATER:       *res = BOOL_VAL(strcmp(x->chars, y->chars) > 0); return true;
+        case TOKEN_GREATER_EQUAL: *res = BOOL_VAL(strcmp(x->chars, y->chars) >= 0); return true;
+        case TOKEN_LESS:          *res = BOOL_VAL(strcmp(x->chars, y->chars) < 0); return true;
+        case TOKEN_LESS_EQUAL:    *res = BOOL_VAL(strcmp(x->chars, y->chars) <= 0); return true;
+        default:                  return false;
+    }
+}
+
+// Unpacking copies the file's globals into this one, along with what the compiler knows of them.
+static void unpackFixedNames(Parser* parser, ObjString* path) {
+    VM* vm = parser->vm;
+    vm->pauseGC++;
+
+    Table names;
+    initTable(&names);
+    for (int i = 0; i < vm->fixedNames.capacity; i++) {
+        ObjString* key = vm->fixedNames.entries[i].key;
+        if (key == NULL || key->length <= path->length ||
+                memcmp(key->chars, path->chars, path->length) != 0 || key->chars[path->length] != '\n')
+            continue;
+
+        const char* name = key->chars + path->length + 1;
+        tableSet(vm, &names, formatString(vm, "%s\n%s", parser->path, name),
+            vm->fixedNames.entries[i].value);
+    }
+    tableAddAll(vm, &names, &vm->fixedNames);
+    freeTable(vm, &names);
+
+    vm->pauseGC--;
+}
+
 static void unary(Parser* parser, bool canAssign) {
     TokenType op = parser->previous.type;
 
+    LiteralMark mark = markLiterals(parser);
     parsePrecedence(parser, PREC_UNARY);
 
+    Value res;
+    if (literalSince(parser, mark) && foldUnary(op, peekLiteral(parser, 0), &res)) {
+        parser->compiler->pending[parser->compiler->pendingCount - 1] = res;
+        return;
+    }
+
     switch (op) {
         case TOKEN_MINUS: 
             emitByte(parser, OP_NEGATE);
@@ -1069,6 +1654,9 @@ static void unary(Parser* parser, bool canAssign) {
             emitByte(parser, OP_NOT);
             break;
         case TOKEN_UNPACK:
+            if (OPTIMIZING(parser) && parser->imported != NULL &&
+                    parser->importedEnd == currentOffset(parser))
+                unpackFixedNames(parser, parser->imported);
             emitByte(parser, OP_UNPACK);
             break;
         default:
@@ -1079,8 +1667,21 @@ static void unary(Parser* parser, bool canAssign) {
 static void binary(Parser* parser, bool canAssign) {
     TokenType op = parser->previous.type;
     ParseRule* rule = getRule(op);
+
+    // Any other instruction flushes held back literals, so one still held
+    // here is the whole left operand.
+    bool leftLiteral = parser->compiler->pendingCount > 0;
+    LiteralMark mark = markLiterals(parser);
     parsePrecedence(parser, (Precedence)(rule->prec + 1));
 
+    Value res;
+    if (leftLiteral && literalSince(parser, mark) &&
+            foldBinary(parser, op, peekLiteral(parser, 1), peekLiteral(parser, 0), &res)) {
+        parser->compiler->pending[parser->compiler->pendingCount - 2] = res;
+        parser->compiler->pendingCount--;
+        return;
+    }
+
     switch (op) {
         case TOKEN_PLUS:
             emitByte(parser, OP_ADD);
@@ -1117,8 +1718,215 @@ static void binary(Parser* parser, bool canAssign) {
     }
 }
 
+static void reportInline(Parser* parser, ObjFunction* func, const char* decision) {
+    FILE* report = parser->vm->inlineReport;
+    if (report != NULL)
+        fprintf(report, "%s:%d %s %s\n", parser->path, parser->previous.line, func->name->chars, decision);
+}
+
+// Stack effect of an instruction that can run in its caller's frame. Jumps,
+// closures, upvalues and declarations cannot.
+static bool inlineEffect(uint8_t* code, int* effect) {
+    switch (code[0]) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_NULL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_GLOBAL:
+            *effect = 1;
+            return true;
+
+        case OP_SET_LOCAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_PROPERTY:
+        case OP_NOT:
+        case OP_NEGATE:
+            *effect = 0;
+            return true;
+
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_ADD_NUM:
+        case OP_SUBTRACT_NUM:
+        case OP_MULTIPLY_NUM:
+        case OP_DIVIDE_NUM:
+        case OP_GREATER_NUM:
+        case OP_GREATER_EQUAL_NUM:
+        case OP_LESS_NUM:
+        case OP_LESS_EQUAL_NUM:
+        case OP_ADD_STRING:
+        case OP_ADD_LIST:
+        case OP_GET_INDEX:
+        case OP_GET_INDEX_LIST:
+        case OP_SET_PROPERTY:
+        case OP_POP:
+            *effect = -1;
+            return true;
+
+        case OP_SET_INDEX:
+            *effect = -2;
+            return true;
+
+        case OP_POP_N:
+        case OP_CALL:
+            *effect = -code[1];
+            return true;
+        case OP_INVOKE:
+            *effect = -code[2];
+            return true;
+        case OP_MAKE_LIST:
+            *effect = 1 - code[1];
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+// Reason the function's body cannot replace a call with argc arguments, or NULL.
+// Its frame would start at the callee, so the stack depth counts from there.
+static const char* inlineBlocker(ObjFunction* func, int argc) {
+    if (func->arity != argc)
+        return "arity mismatch";
+
+    Chunk* body = &func->chunk;
+    int depth = argc + 1;
+    int offset = 0;
+    while (offset < body->count && body->code[offset] != OP_RETURN) {
+        int length = instructionLength(body, offset);
+        int effect;
+        if (length < 0 || !inlineEffect(body->code + offset, &effect))
+            return "branches, closures or upvalues";
+        if (offset + length > INLINE_BUDGET)
+            return "over budget";
+
+        uint8_t op = body->code[offset];
+        if ((op == OP_GET_LOCAL || op == OP_SET_LOCAL) && depth - 1 - body->code[offset + 1] > UINT8_MAX)
+            return "stack too deep";
+
+        depth += effect;
+        offset += length;
+    }
+
+    if (offset >= body->count || depth < 2)
+        return "no return";
+    return NULL;
+}
+
+// Copies a small function's body in place of a call to it. The arguments are
+// already where its frame would start, so its locals are read relative to the
+// stack top, and OP_END_INLINE drops them with the callee under the result.
+// A fixed callee is not looked up or guarded: its read, ending at readEnd, becomes
+// a read of slot 0, the receiver of a prv method and never read by a function's body.
+static bool inlineCall(Parser* parser, ObjFunction* func, uint8_t argc, bool fixed, int readEnd) {
+    const char* blocker = inlineBlocker(func, argc);
+    if (blocker != NULL) {
+        reportInline(parser, func, blocker);
+        return false;
+    }
+
+    Chunk* chunk = currentChunk(parser);
+    Chunk* body = &func->chunk;
+    int start = currentOffset(parser);
+    int constants = chunk->constants.count;
+
+    bool fits = true;
+    int jump = -1;
+    if (!fixed) {
+        int guard = addConstant(parser->vm, chunk, OBJ_VAL(func));
+        emitBytes(parser, OP_INLINE, argc);
+        emitBytes(parser, (uint8_t) guard, 0xff);
+        emitByte(parser, 0xff);
+        jump = chunk->count - 2;
+        fits = guard <= UINT8_MAX;
+    }
+
+    int depth = argc + 1;
+    for (int offset = 0; fits && body->code[offset] != OP_RETURN;) {
+        uint8_t* code = body->code + offset;
+        int length = instructionLength(body, offset);
+
+        switch (code[0]) {
+            case OP_GET_LOCAL:
+                emitBytes(parser, OP_GET_STACK, depth - 1 - code[1]);
+                break;
+            case OP_SET_LOCAL:
+                emitBytes(parser, OP_SET_STACK, depth - 1 - code[1]);
+                break;
+            case OP_CONSTANT:
+                emitConstant(parser, body->constants.values[code[1]]);
+                break;
+            case OP_CONSTANT_LONG:
+                emitConstant(parser, body->constants.values[code[1] | (code[2] << 8) | (code[3] << 16)]);
+                break;
+
+            case OP_GET_GLOBAL:
+            case OP_SET_GLOBAL:
+            case OP_GET_PROPERTY:
+            case OP_SET_PROPERTY:
+            case OP_INVOKE: {
+                int name = addConstant(parser->vm, chunk, body->constants.values[code[1]]);
+                fits = name <= UINT8_MAX;
+                emitBytes(parser, code[0], (uint8_t) name);
+                if (code[0] == OP_INVOKE)
+                    emitByte(parser, code[2]);
+                break;
+            }
+
+            default:
+                for (int i = 0; i < length; i++)
+                    emitByte(parser, code[i]);
+                break;
+        }
+
+        int effect;
+        inlineEffect(code, &effect);
+        depth += effect;
+        offset += length;
+    }
+
+    if (!fits) {
+        truncateChunk(parser->vm, chunk, start, constants);
+        reportInline(parser, func, "constant pool full");
+        return false;
+    }
+
+    emitBytes(parser, OP_END_INLINE, depth - 1);
+    if (fixed) {
+        chunk->code[readEnd - 2] = OP_GET_LOCAL;
+        chunk->code[readEnd - 1] = 0;
+    } else {
+        patchJump(parser, jump);
+    }
+
+    char decision[48];
+    snprintf(decision, sizeof(decision), "inlined%s, %d bytes", fixed ? " unguarded" : "",
+        currentOffset(parser) - start);
+    reportInline(parser, func, decision);
+    return true;
+}
+
 static void call(Parser* parser, bool canAssign) {
+    // Only a call right after the read of a known function can be inlined.
+    ObjFunction* callee = parser->callee != NULL && parser->calleeEnd == currentOffset(parser) ?
+        parser->callee : NULL;
+    int calleeEnd = parser->calleeEnd;
+    bool fixed = parser->calleeFixed;
+    parser->callee = NULL;
+
     uint8_t argCount = argumentList(parser);
+    if (callee != NULL && inlineCall(parser, callee, argCount, fixed, calleeEnd))
+        return;
     emitBytes(parser, OP_CALL, argCount);
 }
 
@@ -1153,7 +1961,7 @@ static void indx(Parser* parser, bool canAssign) {
 
 static void number(Parser* parser, bool canAssign) {
     double val = strtod(parser->previous.start, NULL);
-    emitConstant(parser, NUMBER_VAL(val));
+    emitLiteral(parser, NUMBER_VAL(val));
 }
 
 static void string(Parser* parser, bool canAssign) {
@@ -1189,7 +1997,7 @@ static void string(Parser* parser, bool canAssign) {
     }
     newString[j] = '\0';
 
-    emitConstant(parser, OBJ_VAL(copyString(parser->vm, newString, j)));
+    emitLiteral(parser, OBJ_VAL(copyString(parser->vm, newString, j)));
     
     free(newString);
     newString = NULL;
@@ -1230,13 +2038,13 @@ static void this_(Parser* parser, bool canAssign) {
 static void literal(Parser* parser, bool canAssign) {
     switch (parser->previous.type) {
         case TOKEN_FALSE:
-            emitByte(parser, OP_FALSE);
+            emitLiteral(parser, BOOL_VAL(false));
             break;
         case TOKEN_NULL:
-            emitByte(parser, OP_NULL);
+            emitLiteral(parser, NULL_VAL);
             break;
         case TOKEN_TRUE:
-            emitByte(parser, OP_TRUE);
+            emitLiteral(parser, BOOL_VAL(true));
             break;
         default:
             errorAtCurrent(parser, "UNREACHABLE LITERAL ERROR");
@@ -1336,6 +2144,15 @@ ObjFunction* compile(VM* vm, const char* filepath, const char* src) {
     parser.vm = vm;
     parser.classCompiler = NULL;
     parser.compiler = NULL;
+    initTable(&parser.constGlobals);
+    initTable(&parser.inlineFunctions);
+    initTable(&parser.assignedGlobals);
+    parser.callee = NULL;
+    parser.calleeEnd = -1;
+    parser.calleeFixed = false;
+    parser.imported = NULL;
+    parser.importedEnd = -1;
+    parser.path = filepath;
 
     Compiler compiler;
     initCompiler(&compiler, &parser, FUNC_SCRIPT);
@@ -1361,6 +2178,9 @@ ObjFunction* compile(VM* vm, const char* filepath, const char* src) {
 
     ObjFunction* func = endCompiler(&parser);
     func->name = str;
+    freeTable(vm, &parser.constGlobals);
+    freeTable(vm, &parser.inlineFunctions);
+    freeTable(vm, &parser.assignedGlobals);
 
     return parser.hadError ? NULL : func;
 }
@@ -1368,6 +2188,12 @@ ObjFunction* compile(VM* vm, const char* filepath, const char* src) {
 void markCompilerRoots(VM* vm, Compiler* compiler) {
     while (compiler != NULL) {
         markObject(vm, (Obj*) compiler->function);
+        for (int i = 0; i < compiler->pendingCount; i++)
+            markValue(vm, compiler->pending[i]);
+        for (int i = 0; i < compiler->localCount; i++) {
+            if (compiler->locals[i].known)
+                markValue(vm, compiler->locals[i].value);
+        }
         compiler = compiler->enclosing;
     }
 }
@@ -7,6 +7,9 @@
 #include "../vm/vm.h"
 
 ObjFunction* compile(VM* vm, const char* filepath, const char* src);
+// Compiles the file at the full path, or reads it from the VM's module cache, in a VM
+// of its own from the file's directory. Returns NULL when it fails to compile.
+ObjFunction* compileModule(VM* vm, ObjString* filename);
 void markCompilerRoots(VM* vm, Compiler* compiler);
 
 #endif
@@ -3,224 +3,896 @@
 #include <stdio.h>
 #include "dumper.h"
 #include "../util/memory.h"
+#include "../vm/loader.h"
+#include "../util/lz.h"
+#include "../libraries/core/extension.h"
+
+void initFileWriter(BytecodeWriter* writer, FILE* fp) {
+    writer->fp = fp;
+    writer->bytes = malloc(WRITER_BUFFER_SIZE);
+    writer->count = 0;
+    writer->capacity = WRITER_BUFFER_SIZE;
+    writer->failed = writer->bytes == NULL;
+}
 
-DumpedBytes* newDumpedBytes(VM* vm) {
-    DumpedBytes* bytes = ALLOCATE(vm, DumpedBytes, 1);
+void initMemoryWriter(BytecodeWriter* writer) {
+    writer->fp = NULL;
+    writer->bytes = NULL;
+    writer->count = 0;
+    writer->capacity = 0;
+    writer->failed = false;
+}
 
-    bytes->bytes = NULL;
-    bytes->count = 0;
-    bytes->capacity = 0;
+bool flushWriter(BytecodeWriter* writer) {
+    if (writer->fp == NULL || writer->failed)
+        return !writer->failed;
 
-    return bytes;
+    if (writer->count > 0 && fwrite(writer->bytes, 1, writer->count, writer->fp) != writer->count)
+        writer->failed = true;
+    writer->count = 0;
+    return !writer->failed;
 }
 
-void freeDumpedBytes(VM* vm, DumpedBytes* bytes) {
-    FREE_ARRAY(vm, uint8_t, bytes->bytes, bytes->capacity);
-    FREE(vm, DumpedBytes, bytes);
+void freeWriter(BytecodeWriter* writer) {
+    free(writer->bytes);
+    writer->bytes = NULL;
+    writer->count = 0;
+    writer->capacity = 0;
 }
 
-void writeByte(VM* vm, DumpedBytes* bytes, uint8_t byte) {
-    if (bytes->capacity < bytes->count + 1) {
-        int oldCapacity = bytes->capacity;
-        bytes->capacity = GROW_CAPACITY(oldCapacity);
-        bytes->bytes = GROW_ARRAY(vm, uint8_t, bytes->bytes, oldCapacity, bytes->capacity);
+void writeRaw(BytecodeWriter* writer, const void* bytes, size_t length) {
+    if (writer->failed || length == 0)
+        return;
+
+    if (writer->count + length > writer->capacity) {
+        if (writer->fp != NULL) {
+            // Runs that would not fit the buffer skip it.
+            if (!flushWriter(writer))
+                return;
+            if (length >= writer->capacity) {
+                if (fwrite(bytes, 1, length, writer->fp) != length)
+                    writer->failed = true;
+                return;
+            }
+        } else {
+            size_t capacity = writer->capacity < 8 ? 8 : writer->capacity;
+            while (capacity < writer->count + length)
+                capacity *= 2;
+
+            uint8_t* grown = realloc(writer->bytes, capacity);
+            if (grown == NULL) {
+                writer->failed = true;
+                return;
+            }
+            writer->bytes = grown;
+            writer->capacity = capacity;
+        }
     }
 
-    bytes->bytes[bytes->count++] = byte;
+    memcpy(writer->bytes + writer->count, bytes, length);
+    writer->count += length;
 }
 
-static void writeInt(VM* vm, DumpedBytes* bytes, int i) {
-    writeByte(vm, bytes, i & 0xFF);
-    writeByte(vm, bytes, (i >> 8) & 0xFF);
-    writeByte(vm, bytes, (i >> 16) & 0xFF);
-    writeByte(vm, bytes, (i >> 24) & 0xFF);
+void writeByte(BytecodeWriter* writer, uint8_t byte) {
+    if (writer->count < writer->capacity)
+        writer->bytes[writer->count++] = byte;
+    else
+        writeRaw(writer, &byte, 1);
 }
 
-static void writeObject(VM* vm, DumpedBytes* bytes, Obj* obj) {
-    switch (obj->type) {
-        case OBJ_STRING: {
-            ObjString* str = (ObjString*) obj;
-            #ifdef DEBUG_PRINT_DUMPER
-                printf("-- writing string '%s'\n", str->chars);
-            #endif
-            writeByte(vm, bytes, DUMP_STRING);
-            writeInt(vm, bytes, str->length);
-            for (int i = 0; i < str->length; i++)
-                writeByte(vm, bytes, str->chars[i]);
+void writeInt(BytecodeWriter* writer, uint32_t i) {
+    uint8_t bytes[4] = { i & 0xFF, (i >> 8) & 0xFF, (i >> 16) & 0xFF, (i >> 24) & 0xFF };
+    writeRaw(writer, bytes, 4);
+}
+
+// Seven bits per byte, low first, with the top bit set on all but the last.
+static void writeVarint(BytecodeWriter* writer, uint32_t i) {
+    while (i >= 0x80) {
+        writeByte(writer, (i & 0x7F) | 0x80);
+        i >>= 7;
+    }
+    writeByte(writer, i);
+}
+
+static int varintSize(uint32_t i) {
+    int size = 1;
+    while (i >= 0x80) {
+        i >>= 7;
+        size++;
+    }
+    return size;
+}
+
+void writeDouble(BytecodeWriter* writer, double num) {
+    writeRaw(writer, &num, sizeof(double));
+}
+
+// Objects numbered in the order they are added.
+typedef struct {
+    Obj** objects;
+    int count;
+    int capacity;
+    // Open addressed on the object pointer, holding its index + 1.
+    int* slots;
+    int slotCapacity;
+} ObjectIndex;
+
+static void initObjectIndex(ObjectIndex* index) {
+    index->objects = NULL;
+    index->count = 0;
+    index->capacity = 0;
+    index->slots = NULL;
+    index->slotCapacity = 0;
+}
+
+static void freeObjectIndex(VM* vm, ObjectIndex* index) {
+    FREE_ARRAY(vm, Obj*, index->objects, index->capacity);
+    FREE_ARRAY(vm, int, index->slots, index->slotCapacity);
+    initObjectIndex(index);
+}
+
+static int findSlot(ObjectIndex* index, Obj* obj) {
+    int idx = (int) (((uintptr_t) obj >> 4) & (index->slotCapacity - 1));
+    for (;;) {
+        int slot = index->slots[idx];
+        if (slot == 0 || index->objects[slot - 1] == obj)
+            return idx;
+        idx = (idx + 1) & (index->slotCapacity - 1);
+    }
+}
+
+static void growSlots(VM* vm, ObjectIndex* index) {
+    FREE_ARRAY(vm, int, index->slots, index->slotCapacity);
+
+    index->slotCapacity = GROW_CAPACITY(index->slotCapacity);
+    index->slots = ALLOCATE(vm, int, index->slotCapacity);
+    memset(index->slots, 0, sizeof(int) * index->slotCapacity);
+
+    for (int i = 0; i < index->count; i++)
+        index->slots[findSlot(index, index->objects[i])] = i + 1;
+}
+
+// Returns false when the object already has an index.
+static bool addObject(VM* vm, ObjectIndex* index, Obj* obj) {
+    if ((index->count + 1) * 2 > index->slotCapacity)
+        growSlots(vm, index);
+
+    int slot = findSlot(index, obj);
+    if (index->slots[slot] != 0)
+        return false;
+
+    if (index->capacity < index->count + 1) {
+        int oldCapacity = index->capacity;
+        index->capacity = GROW_CAPACITY(oldCapacity);
+        index->objects = GROW_ARRAY(vm, Obj*, index->objects, oldCapacity, index->capacity);
+    }
+
+    index->objects[index->count++] = obj;
+    index->slots[slot] = index->count;
+    return true;
+}
+
+static int objectIndex(ObjectIndex* index, Obj* obj) {
+    return index->slots[findSlot(index, obj)] - 1;
+}
+
+typedef struct {
+    VM* vm;
+
+    // Strings are written once, and referenced by their index in the list.
+    Table stringIndex;
+    ValueArray strings;
+    size_t stringBytes;
+
+    // Functions can be held by several chunks, such as the guard of an inlined call,
+    // and are written once.
+    ObjectIndex functions;
+
+    // Set when writing an image, with the objects of its heap and the natives of
+    // every library, which are written by name.
+    bool image;
+    ObjectIndex objects;
+    NativeName* natives;
+    int nativeCount;
+} ProgramLayout;
+
+#define LAYOUT_FUNCTION(layout, i) ((ObjFunction*) (layout)->functions.objects[i])
+
+static int stringIndex(ProgramLayout* layout, ObjString* str) {
+    Value idx;
+    if (tableGet(&layout->stringIndex, str, &idx))
+        return (int) AS_NUMBER(idx);
+
+    int count = layout->strings.count;
+    writeValueArray(layout->vm, &layout->strings, OBJ_VAL(str));
+    tableSet(layout->vm, &layout->stringIndex, str, NUMBER_VAL(count));
+    layout->stringBytes += str->length;
+    return count;
+}
+
+static void collectValue(ProgramLayout* layout, Value val);
+
+static void collectFunction(ProgramLayout* layout, ObjFunction* func) {
+    if (!addObject(layout->vm, &layout->functions, (Obj*) func))
+        return;
+    if (func->loader != NULL)
+        loadFunction(func);
+
+    #ifdef DEBUG_PRINT_DUMPER
+        printf("-- collecting function '%s'\n", func->name == NULL ? "<script>" : func->name->chars);
+    #endif
+
+    if (func->name != NULL)
+        stringIndex(layout, func->name);
+    for (int i = 0; i < func->chunk.constants.count; i++)
+        collectValue(layout, func->chunk.constants.values[i]);
+}
+
+// Gives every string and function reachable from the value an index.
+static void collectValue(ProgramLayout* layout, Value val) {
+    if (!IS_OBJ(val))
+        return;
+
+    switch (OBJ_TYPE(val)) {
+        case OBJ_STRING:
+            stringIndex(layout, AS_STRING(val));
             break;
-        }
 
         case OBJ_FUNCTION:
-            takeBytes(vm, bytes, dumpFunction(vm, (ObjFunction*) obj));
+            collectFunction(layout, AS_FUNCTION(val));
             break;
-        
+
         case OBJ_UPVALUE:
-            takeBytes(vm, bytes, dumpValue(vm, ((ObjUpvalue*) obj)->closed));
+            collectValue(layout, ((ObjUpvalue*) AS_OBJ(val))->closed);
             break;
-        
+
         case OBJ_NAMESPACE: {
-            ObjNamespace* nspace = (ObjNamespace*) obj;
-            writeByte(vm, bytes, DUMP_NAMESPACE);
-            writeObject(vm, bytes, (Obj*) nspace->name);
-            writeInt(vm, bytes, nspace->values->count);
+            ObjNamespace* nspace = (ObjNamespace*) AS_OBJ(val);
+            stringIndex(layout, nspace->name);
             for (int i = 0; i < nspace->values->capacity; i++) {
                 Entry* entry = &nspace->values->entries[i];
                 if (entry->key == NULL)
                     continue;
-                
-                writeObject(vm, bytes, (Obj*) entry->key);
-                takeBytes(vm, bytes, dumpValue(vm, entry->value));
-                writeByte(vm, bytes, 
-                    tableGet(nspace->publics, entry->key, NULL) ? 1 : 0);
+                stringIndex(layout, entry->key);
+                collectValue(layout, entry->value);
             }
             break;
         }
-        
+
         default:
-            fprintf(stderr, "Unhandled type '%d'.\n", obj->type);
+            fprintf(stderr, "Unhandled type '%d'.\n", OBJ_TYPE(val));
             exit(2);
             break;
     }
 }
 
-void writeBytes(VM* vm, DumpedBytes* dest, DumpedBytes* src) {
-    while (dest->capacity < dest->count + src->count) {
-        int oldCapacity = dest->capacity;
-        dest->capacity = GROW_CAPACITY(oldCapacity);
-        dest->bytes = GROW_ARRAY(vm, uint8_t, dest->bytes, oldCapacity, dest->capacity);
-    }
+// Strings and functions of the heap go in their own tables, every other object is
+// numbered and traced once the roots are collected.
+static void collectHeapValue(ProgramLayout* layout, Value val) {
+    if (!IS_OBJ(val))
+        return;
+
+    switch (OBJ_TYPE(val)) {
+        case OBJ_STRING:
+            stringIndex(layout, AS_STRING(val));
+            break;
 
-    memcpy(dest->bytes + dest->count, src->bytes, src->count);
-    dest->count += src->count;
+        case OBJ_FUNCTION:
+            collectFunction(layout, AS_FUNCTION(val));
+            break;
+
+        case OBJ_PTR:
+            fprintf(stderr, "Cannot write a '%s' pointer to an image.\n", AS_PTR(val)->origin);
+            exit(70);
+
+        case OBJ_LIBRARY:
+            fprintf(stderr, "Cannot write library '%s' to an image.\n", AS_LIBRARY(val)->name->chars);
+            exit(70);
+
+        default:
+            addObject(layout->vm, &layout->objects, AS_OBJ(val));
+            break;
+    }
 }
 
-void takeBytes(VM* vm, DumpedBytes* dest, DumpedBytes* src) {
-    writeBytes(vm, dest, src);
-    freeDumpedBytes(vm, src);
+static void collectHeapObject(ProgramLayout* layout, Obj* obj) {
+    if (obj != NULL)
+        collectHeapValue(layout, OBJ_VAL(obj));
 }
 
-void printBytes(DumpedBytes* bytes) {
-    for (int i = 0; i < bytes->count; i++) {
-        printf("%04u", bytes->bytes[i]);
-        if (i < bytes->count - 1) printf(" ");
+static void collectTable(ProgramLayout* layout, Table* table) {
+    for (int i = 0; i < table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        if (entry->key == NULL)
+            continue;
+        stringIndex(layout, entry->key);
+        collectHeapValue(layout, entry->value);
     }
 }
 
-bool dumpBytes(FILE* fp, DumpedBytes* bytes) {
-    return bytes->count == fwrite(bytes->bytes, sizeof(uint8_t), bytes->count, fp);
+static NativeName* nativeName(ProgramLayout* layout, ObjNative* native) {
+    for (int i = 0; i < layout->nativeCount; i++) {
+        if (layout->natives[i].function == native->function)
+            return &layout->natives[i];
+    }
+
+    fprintf(stderr, "Cannot write a native function outside of a library to an image.\n");
+    exit(70);
 }
 
-DumpedBytes* dumpFunction(VM* vm, ObjFunction* func) {
-    DumpedBytes* bytes = newDumpedBytes(vm);
+static void traceObject(ProgramLayout* layout, Obj* obj) {
+    switch (obj->type) {
+        case OBJ_CLOSURE: {
+            ObjClosure* clos = (ObjClosure*) obj;
+            collectFunction(layout, clos->function);
+            for (int i = 0; i < clos->upvalueCount; i++)
+                collectHeapObject(layout, (Obj*) clos->upvalues[i]);
+            break;
+        }
 
-    #ifdef DEBUG_PRINT_DUMPER
-        printf("    -- writing function '%s'\n", func->name->chars);
-    #endif
+        case OBJ_UPVALUE:
+            collectHeapValue(layout, *((ObjUpvalue*) obj)->location);
+            break;
 
-    writeByte(vm, bytes, DUMP_FUNC);
-    writeByte(vm, bytes, func->arity);
-    if (func->name == NULL)
-        writeByte(vm, bytes, DUMP_NULL);
-    else
-        writeObject(vm, bytes, (Obj*) func->name);
-    
-    writeByte(vm, bytes, func->upvalueCount);
-    
-    takeBytes(vm, bytes, dumpChunk(vm, &func->chunk));
+        case OBJ_CLASS: {
+            ObjClass* clazz = (ObjClass*) obj;
+            stringIndex(layout, clazz->name);
+            collectHeapObject(layout, (Obj*) clazz->constructor);
+            for (int i = 0; i < DEFAULT_METHOD_COUNT; i++)
+                collectHeapObject(layout, (Obj*) clazz->defaultMethods[i]);
+            collectHeapValue(layout, clazz->bound);
+            collectTable(layout, &clazz->methods);
+            collectTable(layout, &clazz->fields);
+            collectTable(layout, &clazz->staticFields);
+            break;
+        }
 
-    #ifdef DEBUG_PRINT_DUMPER
-        printf("    -- wrote function '%s'\n", func->name->chars);
-    #endif
+        case OBJ_INSTANCE: {
+            ObjInstance* inst = (ObjInstance*) obj;
+            collectHeapObject(layout, (Obj*) inst->clazz);
+            collectHeapValue(layout, inst->bound);
+            collectTable(layout, &inst->fields);
+            break;
+        }
+
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* bound = (ObjBoundMethod*) obj;
+            collectHeapValue(layout, bound->reciever);
+            collectHeapObject(layout, (Obj*) bound->method);
+            break;
+        }
+
+        case OBJ_LIST: {
+            ValueArray* list = &((ObjList*) obj)->list;
+            for (int i = 0; i < list->count; i++)
+                collectHeapValue(layout, list->values[i]);
+            break;
+        }
+
+        case OBJ_NAMESPACE: {
+            ObjNamespace* nspace = (ObjNamespace*) obj;
+            stringIndex(layout, nspace->name);
+            collectTable(layout, nspace->values);
+            collectTable(layout, nspace->publics);
+            break;
+        }
+
+        case OBJ_ATTRIBUTE:
+            collectHeapValue(layout, ((ObjAttribute*) obj)->val);
+            break;
+
+        case OBJ_NATIVE: {
+            NativeName* name = nativeName(layout, (ObjNative*) obj);
+            stringIndex(layout, name->library);
+            stringIndex(layout, name->name);
+            break;
+        }
 
-    return bytes;
+        default:
+            break;
+    }
 }
 
-DumpedBytes* dumpChunk(VM* vm, Chunk* chunk) {
-    DumpedBytes* bytes = newDumpedBytes(vm);
+// Numbers every object reachable from the roots of the VM. The object list doubles
+// as the queue of objects still to trace, so deep structures do not recurse.
+static void collectHeap(ProgramLayout* layout) {
+    VM* vm = layout->vm;
+    layout->natives = listNatives(vm, &layout->nativeCount);
 
-    #ifdef DEBUG_PRINT_DUMPER
-        printf("-- writing chunk\n");
-    #endif
+    collectTable(layout, &vm->globals);
+    collectTable(layout, &vm->importedFiles);
+    collectHeapObject(layout, (Obj*) vm->nspace);
+    collectHeapObject(layout, (Obj*) vm->mainFunc);
 
-    writeByte(vm, bytes, DUMP_CHUNK);
+    for (int i = 0; i < layout->objects.count; i++)
+        traceObject(layout, layout->objects.objects[i]);
+}
 
-    writeInt(vm, bytes, chunk->lines_count);
-    for (int i = 0; i < chunk->lines_count; i++) {
-        writeInt(vm, bytes, chunk->lines[i]);
-        writeInt(vm, bytes, chunk->lines_run[i]);
+static size_t valueSize(Value val) {
+    switch (val.type) {
+        case VAL_BOOL: return 2;
+        case VAL_NUMBER: return 1 + sizeof(double);
+        case VAL_NULL: return 1;
+        case VAL_OBJ: break;
     }
 
-    takeBytes(vm, bytes, dumpValueArray(vm, &chunk->constants));
+    switch (OBJ_TYPE(val)) {
+        case OBJ_UPVALUE:
+            return valueSize(((ObjUpvalue*) AS_OBJ(val))->closed);
+
+        case OBJ_NAMESPACE: {
+            Table* values = ((ObjNamespace*) AS_OBJ(val))->values;
+            size_t size = 9;
+            for (int i = 0; i < values->capacity; i++) {
+                if (values->entries[i].key != NULL)
+                    size += 5 + valueSize(values->entries[i].value);
+            }
+            return size;
+        }
 
-    writeInt(vm, bytes, chunk->count);
-    for (int i = 0; i < chunk->count; i++) {
-        writeByte(vm, bytes, chunk->code[i]);
+        default:
+            return 5;
     }
-    
-    return bytes;
 }
 
-DumpedBytes* dumpValueArray(VM* vm, ValueArray* array) {
-    DumpedBytes* bytes = newDumpedBytes(vm);
+static size_t constantsSize(ObjFunction* func) {
+    size_t size = 0;
+    for (int i = 0; i < func->chunk.constants.count; i++)
+        size += valueSize(func->chunk.constants.values[i]);
+    return size;
+}
 
-    writeInt(vm, bytes, array->count);
-    for (int i = 0; i < array->count; i++)
-        takeBytes(vm, bytes, dumpValue(vm, array->values[i]));
-    
-    return bytes;
+// Lines are written as the zigzag encoded change from the previous run.
+static uint32_t lineDelta(Chunk* chunk, int i) {
+    int delta = chunk->lines[i] - (i == 0 ? 0 : chunk->lines[i - 1]);
+    return ((uint32_t) delta << 1) ^ (uint32_t) (delta >> 31);
 }
 
-DumpedBytes* dumpValue(VM* vm, Value val) {
-    DumpedBytes* bytes = newDumpedBytes(vm);
+static size_t linesSize(ObjFunction* func) {
+    Chunk* chunk = &func->chunk;
+    size_t size = 0;
+    for (int i = 0; i < chunk->lines_count; i++)
+        size += varintSize(lineDelta(chunk, i)) + varintSize(chunk->lines_run[i]);
+    return size;
+}
 
+static void writeValue(ProgramLayout* layout, BytecodeWriter* writer, Value val) {
     switch (val.type) {
         case VAL_BOOL:
-            #ifdef DEBUG_PRINT_DUMPER
-                printf("-- writing bool '%s'\n", AS_BOOL(val) ? "true" : "false");
-            #endif
-            writeByte(vm, bytes, DUMP_BOOL);
-            writeByte(vm, bytes, AS_BOOL(val) ? 1 : 0);
+            writeByte(writer, DUMP_BOOL);
+            writeByte(writer, AS_BOOL(val) ? 1 : 0);
+            return;
+
+        case VAL_NUMBER:
+            writeByte(writer, DUMP_NUMBER);
+            writeDouble(writer, AS_NUMBER(val));
+            return;
+
+        case VAL_NULL:
+            writeByte(writer, DUMP_NULL);
+            return;
+
+        case VAL_OBJ:
             break;
-        
-        case VAL_NUMBER: {
-            #ifdef DEBUG_PRINT_DUMPER
-                printf("-- writing number '%f'\n", AS_NUMBER(val));
-            #endif
-            writeByte(vm, bytes, DUMP_NUMBER);
+    }
 
-            uint8_t byte_array[sizeof(double)];
-            double num = AS_NUMBER(val);
-            memcpy(byte_array, &num, sizeof(double));
-            for (int i = 0; i < sizeof(double); i++)
-                writeByte(vm, bytes, byte_array[i]);
-            
+    switch (OBJ_TYPE(val)) {
+        case OBJ_STRING:
+            writeByte(writer, DUMP_STRING);
+            writeInt(writer, stringIndex(layout, AS_STRING(val)));
+            break;
+
+        case OBJ_FUNCTION:
+            writeByte(writer, DUMP_FUNC);
+            writeInt(writer, objectIndex(&layout->functions, AS_OBJ(val)));
+            break;
+
+        case OBJ_UPVALUE:
+            writeValue(layout, writer, ((ObjUpvalue*) AS_OBJ(val))->closed);
+            break;
+
+        case OBJ_NAMESPACE: {
+            ObjNamespace* nspace = (ObjNamespace*) AS_OBJ(val);
+            writeByte(writer, DUMP_NAMESPACE);
+            writeInt(writer, stringIndex(layout, nspace->name));
+            writeInt(writer, nspace->values->count);
+            for (int i = 0; i < nspace->values->capacity; i++) {
+                Entry* entry = &nspace->values->entries[i];
+                if (entry->key == NULL)
+                    continue;
+
+                writeInt(writer, stringIndex(layout, entry->key));
+                writeValue(layout, writer, entry->value);
+                writeByte(writer, tableGet(nspace->publics, entry->key, NULL) ? 1 : 0);
+            }
             break;
         }
 
-        case VAL_NULL:
-            #ifdef DEBUG_PRINT_DUMPER
-                printf("-- writing null\n");
-            #endif
-            writeByte(vm, bytes, DUMP_NULL);
+        default:
             break;
-        
-        case VAL_OBJ:
-            writeObject(vm, bytes, AS_OBJ(val));
+    }
+}
+
+static void writeStrings(ProgramLayout* layout, BytecodeWriter* writer) {
+    writeInt(writer, layout->strings.count);
+    uint32_t offset = 0;
+    for (int i = 0; i < layout->strings.count; i++) {
+        writeInt(writer, offset);
+        offset += AS_STRING(layout->strings.values[i])->length;
+    }
+    writeInt(writer, offset);
+
+    for (int i = 0; i < layout->strings.count; i++) {
+        ObjString* str = AS_STRING(layout->strings.values[i]);
+        writeRaw(writer, str->chars, str->length);
+    }
+}
+
+static void writeFunctions(ProgramLayout* layout, BytecodeWriter* writer) {
+    writeInt(writer, layout->functions.count);
+
+    uint32_t constants = 0, code = 0, lines = 0;
+    for (int i = 0; i < layout->functions.count; i++) {
+        ObjFunction* func = LAYOUT_FUNCTION(layout, i);
+        Chunk* chunk = &func->chunk;
+
+        writeByte(writer, func->arity);
+        writeByte(writer, func->upvalueCount);
+        writeInt(writer, func->name == NULL ? DUMP_NO_NAME : (uint32_t) stringIndex(layout, func->name));
+        writeInt(writer, constants);
+        writeInt(writer, chunk->constants.count);
+        writeInt(writer, code);
+        writeInt(writer, chunk->count);
+        writeInt(writer, lines);
+        writeInt(writer, chunk->lines_count);
+
+        constants += constantsSize(func);
+        code += chunk->count;
+        lines += linesSize(func);
+    }
+}
+
+static void writeHeapValue(ProgramLayout* layout, BytecodeWriter* writer, Value val) {
+    if (!IS_OBJ(val) || IS_STRING(val) || IS_FUNCTION(val)) {
+        writeValue(layout, writer, val);
+        return;
+    }
+
+    writeByte(writer, DUMP_OBJECT);
+    writeInt(writer, objectIndex(&layout->objects, AS_OBJ(val)));
+}
+
+static void writeObjectRef(ProgramLayout* layout, BytecodeWriter* writer, Obj* obj) {
+    writeInt(writer, obj == NULL ? IMAGE_NO_OBJECT : (uint32_t) objectIndex(&layout->objects, obj));
+}
+
+static void writeTable(ProgramLayout* layout, BytecodeWriter* writer, Table* table) {
+    writeInt(writer, table->count);
+    for (int i = 0; i < table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        if (entry->key == NULL)
+            continue;
+        writeInt(writer, stringIndex(layout, entry->key));
+        writeHeapValue(layout, writer, entry->value);
+    }
+}
+
+static void writeObjectHeader(ProgramLayout* layout, BytecodeWriter* writer, Obj* obj) {
+    switch (obj->type) {
+        case OBJ_CLOSURE:
+            writeByte(writer, IMAGE_CLOSURE);
+            writeInt(writer, objectIndex(&layout->functions, (Obj*) ((ObjClosure*) obj)->function));
+            break;
+        case OBJ_UPVALUE:
+            writeByte(writer, IMAGE_UPVALUE);
+            writeInt(writer, 0);
+            break;
+        case OBJ_CLASS:
+            writeByte(writer, IMAGE_CLASS);
+            writeInt(writer, stringIndex(layout, ((ObjClass*) obj)->name));
+            break;
+        case OBJ_INSTANCE:
+            writeByte(writer, IMAGE_INSTANCE);
+            writeObjectRef(layout, writer, (Obj*) ((ObjInstance*) obj)->clazz);
+            break;
+        case OBJ_BOUND_METHOD:
+            writeByte(writer, IMAGE_BOUND_METHOD);
+            writeInt(writer, 0);
+            break;
+        case OBJ_LIST:
+            writeByte(writer, IMAGE_LIST);
+            writeInt(writer, 0);
+            break;
+        case OBJ_NAMESPACE:
+            writeByte(writer, IMAGE_NAMESPACE);
+            writeInt(writer, stringIndex(layout, ((ObjNamespace*) obj)->name));
+            break;
+        case OBJ_ATTRIBUTE:
+            writeByte(writer, IMAGE_ATTRIBUTE);
+            writeInt(writer, 0);
+            break;
+        case OBJ_NATIVE:
+            writeByte(writer, IMAGE_NATIVE);
+            writeInt(writer, stringIndex(layout, nativeName(layout, (ObjNative*) obj)->library));
+            break;
+        default:
             break;
     }
+}
+
+static void writeObjectBody(ProgramLayout* layout, BytecodeWriter* writer, Obj* obj) {
+    switch (obj->type) {
+        case OBJ_CLOSURE: {
+            ObjClosure* clos = (ObjClosure*) obj;
+            writeInt(writer, clos->upvalueCount);
+            for (int i = 0; i < clos->upvalueCount; i++)
+                writeObjectRef(layout, writer, (Obj*) clos->upvalues[i]);
+            break;
+        }
 
-    return bytes;
+        case OBJ_UPVALUE:
+            writeHeapValue(layout, writer, *((ObjUpvalue*) obj)->location);
+            break;
+
+        case OBJ_CLASS: {
+            ObjClass* clazz = (ObjClass*) obj;
+            writeObjectRef(layout, writer, (Obj*) clazz->constructor);
+            for (int i = 0; i < DEFAULT_METHOD_COUNT; i++)
+                writeObjectRef(layout, writer, (Obj*) clazz->defaultMethods[i]);
+            writeHeapValue(layout, writer, clazz->bound);
+            writeTable(layout, writer, &clazz->methods);
+            writeTable(layout, writer, &clazz->fields);
+            writeTable(layout, writer, &clazz->staticFields);
+            break;
+        }
+
+        case OBJ_INSTANCE: {
+            ObjInstance* inst = (ObjInstance*) obj;
+            writeHeapValue(layout, writer, inst->bound);
+            writeTable(layout, writer, &inst->fields);
+            break;
+        }
+
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* bound = (ObjBoundMethod*) obj;
+            writeHeapValue(layout, writer, bound->reciever);
+            writeObjectRef(layout, writer, (Obj*) bound->method);
+            break;
+        }
+
+        case OBJ_LIST: {
+            ValueArray* list = &((ObjList*) obj)->list;
+            writeInt(writer, list->count);
+            for (int i = 0; i < list->count; i++)
+                writeHeapValue(layout, writer, list->values[i]);
+            break;
+        }
+
+        case OBJ_NAMESPACE: {
+            ObjNamespace* nspace = (ObjNamespace*) obj;
+            writeTable(layout, writer, nspace->values);
+            writeTable(layout, writer, nspace->publics);
+            break;
+        }
+
+        case OBJ_ATTRIBUTE: {
+            ObjAttribute* attr = (ObjAttribute*) obj;
+            writeByte(writer, attr->isPublic | attr->isStatic << 1 | attr->isConstant << 2);
+            writeHeapValue(layout, writer, attr->val);
+            break;
+        }
+
+        case OBJ_NATIVE:
+            writeInt(writer, stringIndex(layout, nativeName(layout, (ObjNative*) obj)->name));
+            break;
+
+        default:
+            break;
+    }
 }
 
-DumpedBytes* dumpTable(VM* vm, Table* tb) {
-    DumpedBytes* bytes = newDumpedBytes(vm);
+static void writeHeap(ProgramLayout* layout, BytecodeWriter* writer) {
+    VM* vm = layout->vm;
 
-    writeInt(vm, bytes, tb->count);
-    for (int i = 0; i < tb->capacity; i++) {
-        if (tb->entries[i].key == NULL) continue;
-        writeObject(vm, bytes, (Obj*) tb->entries[i].key);
-        takeBytes(vm, bytes, dumpValue(vm, tb->entries[i].value));
+    writeInt(writer, layout->objects.count);
+    for (int i = 0; i < layout->objects.count; i++)
+        writeObjectHeader(layout, writer, layout->objects.objects[i]);
+    for (int i = 0; i < layout->objects.count; i++)
+        writeObjectBody(layout, writer, layout->objects.objects[i]);
+
+    writeTable(layout, writer, &vm->globals);
+    writeTable(layout, writer, &vm->importedFiles);
+    writeObjectRef(layout, writer, (Obj*) vm->nspace);
+    writeInt(writer, vm->mainFunc == NULL ? IMAGE_NO_OBJECT :
+        (uint32_t) objectIndex(&layout->functions, (Obj*) vm->mainFunc));
+}
+
+static void writeSection(ProgramLayout* layout, BytecodeWriter* writer, SectionId id) {
+    switch (id) {
+        case SECTION_STRINGS:
+            writeStrings(layout, writer);
+            break;
+
+        case SECTION_CONSTANTS:
+            for (int i = 0; i < layout->functions.count; i++) {
+                ValueArray* constants = &LAYOUT_FUNCTION(layout, i)->chunk.constants;
+                for (int j = 0; j < constants->count; j++)
+                    writeValue(layout, writer, constants->values[j]);
+            }
+            break;
+
+        case SECTION_FUNCTIONS:
+            writeFunctions(layout, writer);
+            break;
+
+        case SECTION_CODE:
+            for (int i = 0; i < layout->functions.count; i++) {
+                Chunk* chunk = &LAYOUT_FUNCTION(layout, i)->chunk;
+                writeRaw(writer, chunk->code, chunk->count);
+            }
+            break;
+
+        case SECTION_LINES:
+            for (int i = 0; i < layout->functions.count; i++) {
+                Chunk* chunk = &LAYOUT_FUNCTION(layout, i)->chunk;
+                for (int j = 0; j < chunk->lines_count; j++) {
+                    writeVarint(writer, lineDelta(chunk, j));
+                    writeVarint(writer, chunk->lines_run[j]);
+                }
+            }
+            break;
+
+        case SECTION_HEAP:
+            writeHeap(layout, writer);
+            break;
     }
+}
+
+static void sectionSizes(ProgramLayout* layout, size_t sizes[]) {
+    sizes[SECTION_STRINGS - 1] = 4 + 4 * ((size_t) layout->strings.count + 1) + layout->stringBytes;
+    sizes[SECTION_CONSTANTS - 1] = 0;
+    sizes[SECTION_FUNCTIONS - 1] = 4 + (size_t) layout->functions.count * FUNCTION_RECORD_SIZE;
+    sizes[SECTION_CODE - 1] = 0;
+    sizes[SECTION_LINES - 1] = 0;
+    for (int i = 0; i < layout->functions.count; i++) {
+        sizes[SECTION_CONSTANTS - 1] += constantsSize(LAYOUT_FUNCTION(layout, i));
+        sizes[SECTION_CODE - 1] += LAYOUT_FUNCTION(layout, i)->chunk.count;
+        sizes[SECTION_LINES - 1] += linesSize(LAYOUT_FUNCTION(layout, i));
+    }
+}
+
+// Writes a section to memory. With compress, it is kept compressed when that makes it smaller.
+static void renderSection(ProgramLayout* layout, BytecodeWriter* writer, SectionId id, bool compress,
+        uint8_t** blob, size_t* size, size_t* rawSize, uint8_t* encoding) {
+    BytecodeWriter section;
+    initMemoryWriter(&section);
+    writeSection(layout, &section, id);
+    if (section.failed)
+        writer->failed = true;
+
+    *rawSize = section.count;
+    *size = section.count;
+    *encoding = SECTION_STORED;
+    *blob = section.bytes;
+    if (!compress)
+        return;
+
+    size_t bound = lzBound(section.count);
+    uint8_t* compressed = malloc(bound);
+    size_t length = compressed == NULL ? 0 : lzCompress(section.bytes, section.count, compressed, bound);
+    if (length > 0 && length < section.count) {
+        freeWriter(&section);
+        *blob = compressed;
+        *size = length;
+        *encoding = SECTION_LZ;
+    } else {
+        free(compressed);
+    }
+}
+
+static bool dumpLayout(ProgramLayout* layout, BytecodeWriter* writer, bool compress) {
+    int sectionCount = layout->image ? SECTION_COUNT : PROGRAM_SECTION_COUNT;
+    size_t sizes[SECTION_COUNT];
+    size_t rawSizes[SECTION_COUNT];
+    uint8_t encodings[SECTION_COUNT];
+    uint8_t* blobs[SECTION_COUNT] = { NULL };
+    if (compress) {
+        for (int i = 0; i < sectionCount; i++)
+            renderSection(layout, writer, i + 1, true, &blobs[i], &sizes[i], &rawSizes[i], &encodings[i]);
+    } else {
+        sectionSizes(layout, sizes);
+        for (int i = 0; i < PROGRAM_SECTION_COUNT; i++) {
+            rawSizes[i] = sizes[i];
+            encodings[i] = SECTION_STORED;
+        }
+
+        // The heap is only sized by writing it.
+        if (layout->image) {
+            int heap = SECTION_HEAP - 1;
+            renderSection(layout, writer, SECTION_HEAP, false, &blobs[heap], &sizes[heap],
+                &rawSizes[heap], &encodings[heap]);
+        }
+    }
+
+    writeRaw(writer, BYTECODE_MAGIC, BYTECODE_MAGIC_LENGTH);
+    writeInt(writer, BYTECODE_VERSION);
+    writeInt(writer, sectionCount);
+
+    size_t offset = BYTECODE_MAGIC_LENGTH + 8 + sectionCount * 5 * 4;
+    for (int i = 0; i < sectionCount; i++) {
+        writeInt(writer, i + 1);
+        writeInt(writer, encodings[i]);
+        writeInt(writer, offset);
+        writeInt(writer, sizes[i]);
+        writeInt(writer, rawSizes[i]);
+        offset += sizes[i];
+        if (rawSizes[i] > INT32_MAX)
+            writer->failed = true;
+    }
+
+    if (offset > INT32_MAX)
+        writer->failed = true;
+
+    for (int i = 0; i < sectionCount; i++) {
+        if (blobs[i] != NULL) {
+            writeRaw(writer, blobs[i], sizes[i]);
+            free(blobs[i]);
+        } else {
+            writeSection(layout, writer, i + 1);
+        }
+    }
+
+    return flushWriter(writer);
+}
+
+static void initLayout(ProgramLayout* layout, VM* vm) {
+    layout->vm = vm;
+    initTable(&layout->stringIndex);
+    initValueArray(&layout->strings);
+    layout->stringBytes = 0;
+    initObjectIndex(&layout->functions);
+    layout->image = false;
+    initObjectIndex(&layout->objects);
+    layout->natives = NULL;
+    layout->nativeCount = 0;
+}
+
+static void freeLayout(ProgramLayout* layout) {
+    VM* vm = layout->vm;
+    freeTable(vm, &layout->stringIndex);
+    freeValueArray(vm, &layout->strings);
+    freeObjectIndex(vm, &layout->functions);
+    freeObjectIndex(vm, &layout->objects);
+    FREE_ARRAY(vm, NativeName, layout->natives, layout->nativeCount);
+}
+
+bool dumpProgram(VM* vm, BytecodeWriter* writer, ObjFunction* script, bool compress) {
+    vm->pauseGC++;
+
+    ProgramLayout layout;
+    initLayout(&layout, vm);
+    collectFunction(&layout, script);
+
+    bool written = dumpLayout(&layout, writer, compress);
+    freeLayout(&layout);
+
+    vm->pauseGC--;
+    return written;
+}
+
+bool dumpImage(VM* vm, BytecodeWriter* writer, ObjFunction* script, bool compress) {
+    vm->pauseGC++;
+
+    // The script stays function 0, so a VM that does not know images runs it from the start.
+    ProgramLayout layout;
+    initLayout(&layout, vm);
+    layout.image = true;
+    collectFunction(&layout, script);
+    collectHeap(&layout);
+
+    bool written = dumpLayout(&layout, writer, compress);
+    freeLayout(&layout);
 
-    return bytes;
+    vm->pauseGC--;
+    return written;
 }
@@ -16,28 +16,112 @@ typedef enum {
     DUMP_FUNC,
     DUMP_CHUNK,
     DUMP_NAMESPACE,
+    // An object in the heap section of an image, by index.
+    DUMP_OBJECT,
 } DumpCode;
 
-struct DumpedBytes {
+// Sectioned binaries start with the magic, which a legacy binary, starting with
+// DUMP_FUNC, never does. The header holds the version and a directory of
+// (id, encoding, offset, length, raw length) entries, all little endian words.
+// Version 1 entries have no encoding or raw length. Readers skip sections they
+// do not know.
+#define BYTECODE_MAGIC "NPZB"
+#define BYTECODE_MAGIC_LENGTH 4
+#define BYTECODE_VERSION 2
+
+typedef enum {
+    SECTION_STORED,
+    // Compressed with the codec in util/lz.h.
+    SECTION_LZ,
+} SectionEncoding;
+
+typedef enum {
+    // Count, count + 1 offsets into the blob that follows, then the blob.
+    SECTION_STRINGS = 1,
+    // Values tagged with a DumpCode. Strings and functions are stored as indices.
+    SECTION_CONSTANTS,
+    // Count, then a FUNCTION_RECORD_SIZE record per function. The script is first.
+    SECTION_FUNCTIONS,
+    // Bytecode of every function, back to back.
+    SECTION_CODE,
+    // Varint (line change, run) pairs of every function, only used for error reporting.
+    SECTION_LINES,
+    // Objects and roots of a heap image, only present in images.
+    SECTION_HEAP,
+} SectionId;
+
+#define SECTION_COUNT 6
+// Sections every binary has.
+#define PROGRAM_SECTION_COUNT 5
+
+// Arity and upvalue count bytes, then words for the name string, the offset and
+// count of the constants, code and lines. Offsets are in bytes from the section start.
+#define FUNCTION_RECORD_SIZE 30
+#define DUMP_NO_NAME 0xFFFFFFFF
+
+// Objects in the heap section of an image. The section holds the object count, a
+// kind byte and word per object, the body of each object, then the globals, imported
+// files, namespace and main function of the VM. The word holds what the object is
+// created from: the function of a closure, the name of a class or namespace, the
+// class of an instance, or the library of a native. Tables are a count followed by
+// (key string, value) pairs.
+typedef enum {
+    // Upvalue objects, one per captured variable.
+    IMAGE_CLOSURE,
+    // Closed value.
+    IMAGE_UPVALUE,
+    // Constructor and default method closures, bound value, then the method,
+    // field and static field tables.
+    IMAGE_CLASS,
+    // Bound value and field table.
+    IMAGE_INSTANCE,
+    // Receiver value and method closure.
+    IMAGE_BOUND_METHOD,
+    // Count and values.
+    IMAGE_LIST,
+    // Value and public tables.
+    IMAGE_NAMESPACE,
+    // Flag byte of public, static and constant, then the value.
+    IMAGE_ATTRIBUTE,
+    // Name string, looked up in the library when the image is read.
+    IMAGE_NATIVE,
+} ImageObject;
+
+#define IMAGE_NO_OBJECT 0xFFFFFFFF
+#define IMAGE_OBJECT_HEADER_SIZE 5
+
+// Output of the dumper. With a file, bytes go out through a fixed buffer and large
+// runs are written directly. Without one, the whole binary is kept in bytes. Its
+// memory is not allocated through the VM, so writing never triggers a collection.
+struct BytecodeWriter {
+    FILE* fp;
     uint8_t* bytes;
-    int count;
-    int capacity;
+    size_t count;
+    size_t capacity;
+    bool failed;
 };
 
-DumpedBytes* newDumpedBytes(VM* vm);
-void freeDumpedBytes(VM* vm, DumpedBytes* bytes);
-
-void writeByte(VM* vm, DumpedBytes* bytes, uint8_t byte);
-void writeBytes(VM* vm, DumpedBytes* dest, DumpedBytes* src);
-void takeBytes(VM* vm, DumpedBytes* dest, DumpedBytes* src);
-void printBytes(DumpedBytes* bytes);
+#define WRITER_BUFFER_SIZE (64 * 1024)
 
-bool dumpBytes(FILE* fp, DumpedBytes* bytes);
+void initFileWriter(BytecodeWriter* writer, FILE* fp);
+void initMemoryWriter(BytecodeWriter* writer);
+// Writes out any buffered bytes, returning false when a write to the file failed.
+bool flushWriter(BytecodeWriter* writer);
+void writeRaw(BytecodeWriter* writer, const void* bytes, size_t length);
+void writeByte(BytecodeWriter* writer, uint8_t byte);
+// Little endian.
+void writeInt(BytecodeWriter* writer, uint32_t i);
+void writeDouble(BytecodeWriter* writer, double num);
+void freeWriter(BytecodeWriter* writer);
 
-DumpedBytes* dumpFunction(VM* vm, ObjFunction* func);
-DumpedBytes* dumpChunk(VM* vm, Chunk* chunk);
-DumpedBytes* dumpValueArray(VM* vm, ValueArray* array);
-DumpedBytes* dumpValue(VM* vm, Value val);
-DumpedBytes* dumpTable(VM* vm, Table* tb);
+// Writes the script and every function reachable from it as a sectioned binary.
+// Section sizes are worked out first, so every byte is written once and in order.
+// Compressed sections are written to memory first.
+// Sections are compressed when compress is set and it makes them smaller.
+bool dumpProgram(VM* vm, BytecodeWriter* writer, ObjFunction* script, bool compress);
+// Writes the script as dumpProgram does, followed by the heap left by running it:
+// every object reachable from the globals, imported files and main function. Exits
+// when the heap holds an object that cannot be written, such as a library pointer.
+bool dumpImage(VM* vm, BytecodeWriter* writer, ObjFunction* script, bool compress);
 
 #endif
@@ -0,0 +1,349 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "optimizer.h"
+#include "../util/memory.h"
+
+typedef struct {
+    int offset;
+    int length;
+    int line;
+    uint8_t op;
+    // Values dropped by OP_POP and OP_POP_N.
+    int count;
+    // Instruction index a jump lands on, the instruction count for the end of the chunk.
+    int target;
+    bool removed;
+    bool isTarget;
+} Instruction;
+
+typedef struct {
+    Instruction* code;
+    int count;
+    int capacity;
+} InstructionList;
+
+// OP_INLINE jumps over the inlined body when its guard fails.
+static bool isJump(uint8_t op) {
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_TRUE || op == OP_LOOP ||
+        op == OP_INLINE;
+}
+
+static bool decode(VM* vm, Chunk* chunk, InstructionList* list) {
+    int* starts = ALLOCATE(vm, int, chunk->count + 1);
+    for (int i = 0; i <= chunk->count; i++)
+        starts[i] = -1;
+
+    int run = 0;
+    int runLeft = chunk->lines_count > 0 ? chunk->lines_run[0] : 0;
+    bool valid = true;
+
+    for (int offset = 0; offset < chunk->count;) {
+        int length = instructionLength(chunk, offset);
+        if (length < 0) {
+            valid = false;
+            break;
+        }
+
+        while (runLeft == 0 && run + 1 < chunk->lines_count)
+            runLeft = chunk->lines_run[++run];
+
+        if (list->capacity < list->count + 1) {
+            int oldCapacity = list->capacity;
+            list->capacity = GROW_CAPACITY(oldCapacity);
+            list->code = GROW_ARRAY(vm, Instruction, list->code, oldCapacity, list->capacity);
+        }
+
+        Instruction* ins = &list->code[list->count];
+        ins->offset = offset;
+        ins->length = length;
+        ins->line = chunk->lines_count > 0 ? chunk->lines[run] : 0;
+        ins->op = chunk->code[offset];
+        ins->count = ins->op == OP_POP ? 1 : ins->op == OP_POP_N ? chunk->code[offset + 1] : 0;
+        ins->target = -1;
+        ins->removed = false;
+        ins->isTarget = false;
+        starts[offset] = list->count++;
+
+        // Line runs are per byte, so an instruction can straddle two of them.
+        for (int i = 0; i < length; i++) {
+            while (runLeft == 0 && run + 1 < chunk->lines_count)
+                runLeft = chunk->lines_run[++run];
+            runLeft--;
+        }
+        offset += length;
+    }
+    starts[chunk->count] = list->count;
+
+    for (int i = 0; valid && i < list->count; i++) {
+        Instruction* ins = &list->code[i];
+        if (!isJump(ins->op))
+            continue;
+
+        // The offset is the last two bytes, counted from the end of the instruction.
+        int end = ins->offset + ins->length;
+        int jump = (chunk->code[end - 2] << 8) | chunk->code[end - 1];
+        int target = end + (ins->op == OP_LOOP ? -jump : jump);
+        if (target < 0 || target > chunk->count || starts[target] == -1) {
+            valid = false;
+            break;
+        }
+        ins->target = starts[target];
+    }
+
+    FREE_ARRAY(vm, int, starts, chunk->count + 1);
+    return valid;
+}
+
+// Index of the first instruction at or after idx that is still in the chunk.
+static int live(InstructionList* list, int idx) {
+    while (idx < list->count && list->code[idx].removed)
+        idx++;
+    return idx;
+}
+
+static bool isOp(InstructionList* list, int idx, uint8_t op) {
+    return idx < list->count && list->code[idx].op == op;
+}
+
+static void markTargets(InstructionList* list) {
+    for (int i = 0; i < list->count; i++)
+        list->code[i].isTarget = false;
+
+    for (int i = 0; i < list->count; i++) {
+        Instruction* ins = &list->code[i];
+        if (ins->removed || !isJump(ins->op))
+            continue;
+
+        int target = live(list, ins->target);
+        if (target < list->count)
+            list->code[target].isTarget = true;
+    }
+}
+
+static uint8_t operand(Chunk* chunk, Instruction* ins) {
+    return chunk->code[ins->offset + 1];
+}
+
+// Jumps landing on a removed instruction land on the next one left instead.
+static void removeInstruction(InstructionList* list, int idx) {
+    Instruction* ins = &list->code[idx];
+    ins->removed = true;
+
+    int next = live(list, idx + 1);
+    if (ins->isTarget && next < list->count)
+        list->code[next].isTarget = true;
+}
+
+// Points a forward jump past jumps it lands on. Conditional jumps keep the
+// condition on the stack, so one landing on a jump on the same condition
+// is taken as well, and one on the opposite condition falls through.
+static bool threadJump(Chunk* chunk, InstructionList* list, int idx) {
+    Instruction* ins = &list->code[idx];
+    int target = live(list, ins->target);
+
+    for (int hops = 0; hops < 16 && target < list->count; hops++) {
+        Instruction* next = &list->code[target];
+        int dest;
+        if (next->op == OP_JUMP || (next->op == ins->op && ins->op != OP_LOOP)) {
+            dest = live(list, next->target);
+        } else if ((ins->op == OP_JUMP_IF_FALSE && next->op == OP_JUMP_IF_TRUE) ||
+                (ins->op == OP_JUMP_IF_TRUE && next->op == OP_JUMP_IF_FALSE)) {
+            dest = live(list, target + 1);
+        } else {
+            break;
+        }
+
+        // Only forward jumps are threaded, and the distance must still fit.
+        int end = dest < list->count ? list->code[dest].offset : chunk->count;
+        if (ins->op == OP_LOOP || dest <= idx || end - (ins->offset + 3) > UINT16_MAX)
+            break;
+        target = dest;
+    }
+
+    if (target == live(list, ins->target))
+        return false;
+    ins->target = target;
+    if (target < list->count)
+        list->code[target].isTarget = true;
+    return true;
+}
+
+static bool peephole(Chunk* chunk, InstructionList* list) {
+    bool changed = false;
+    markTargets(list);
+
+    for (int i = 0; i < list->count; i++) {
+        Instruction* ins = &list->code[i];
+        if (ins->removed)
+            continue;
+
+        int next = live(list, i + 1);
+
+        switch (ins->op) {
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_TRUE:
+                if (threadJump(chunk, list, i))
+                    changed = true;
+
+                // A jump to the next instruction does nothing, the conditional ones only peek.
+                if (live(list, ins->target) == next) {
+                    removeInstruction(list, i);
+                    changed = true;
+                }
+                break;
+
+            // The value is dropped on both sides of the jump, so the negation can move into it.
+            case OP_NOT:
+                if (isOp(list, next, OP_JUMP_IF_FALSE) || isOp(list, next, OP_JUMP_IF_TRUE)) {
+                    Instruction* jump = &list->code[next];
+                    int fallthrough = live(list, next + 1);
+                    int target = live(list, jump->target);
+                    if (!jump->isTarget && isOp(list, fallthrough, OP_POP) && isOp(list, target, OP_POP)) {
+                        jump->op = jump->op == OP_JUMP_IF_FALSE ? OP_JUMP_IF_TRUE : OP_JUMP_IF_FALSE;
+                        removeInstruction(list, i);
+                        changed = true;
+                    }
+                }
+                break;
+
+            // The value set is still on the stack, so popping and reading it again is redundant.
+            case OP_SET_LOCAL:
+            case OP_SET_UPVALUE: {
+                uint8_t getOp = ins->op == OP_SET_LOCAL ? OP_GET_LOCAL : OP_GET_UPVALUE;
+                int get = live(list, next + 1);
+                if (isOp(list, next, OP_POP) && isOp(list, get, getOp) &&
+                        !list->code[next].isTarget && !list->code[get].isTarget &&
+                        operand(chunk, &list->code[get]) == operand(chunk, ins)) {
+                    removeInstruction(list, next);
+                    removeInstruction(list, get);
+                    changed = true;
+                }
+                break;
+            }
+
+            case OP_POP:
+            case OP_POP_N: {
+                if (ins->count == 0) {
+                    removeInstruction(list, i);
+                    changed = true;
+                    break;
+                }
+
+                while ((isOp(list, next, OP_POP) || isOp(list, next, OP_POP_N)) &&
+                        !list->code[next].isTarget && ins->count + list->code[next].count <= UINT8_MAX) {
+                    ins->count += list->code[next].count;
+                    removeInstruction(list, next);
+                    next = live(list, next + 1);
+                    changed = true;
+                }
+
+                ins->op = ins->count > 1 ? OP_POP_N : OP_POP;
+                break;
+            }
+
+            default:
+                break;
+        }
+    }
+
+    return changed;
+}
+
+static int encodedLength(Instruction* ins) {
+    if (ins->removed)
+        return 0;
+    if (ins->op == OP_POP)
+        return 1;
+    if (ins->op == OP_POP_N)
+        return 2;
+    return ins->length;
+}
+
+static bool encode(VM* vm, Chunk* chunk, InstructionList* list) {
+    int* offsets = ALLOCATE(vm, int, list->count + 1);
+    offsets[0] = 0;
+    for (int i = 0; i < list->count; i++)
+        offsets[i + 1] = offsets[i] + encodedLength(&list->code[i]);
+
+    Chunk out;
+    initChunk(&out);
+    bool valid = true;
+
+    for (int i = 0; valid && i < list->count; i++) {
+        Instruction* ins = &list->code[i];
+        if (ins->removed)
+            continue;
+
+        writeChunk(vm, &out, ins->op, ins->line);
+        if (isJump(ins->op)) {
+            for (int j = 1; j < ins->length - 2; j++)
+                writeChunk(vm, &out, chunk->code[ins->offset + j], ins->line);
+
+            int end = offsets[i] + ins->length;
+            int jump = ins->op == OP_LOOP ? end - offsets[ins->target] : offsets[ins->target] - end;
+            if (jump < 0 || jump > UINT16_MAX)
+                valid = false;
+            writeChunk(vm, &out, (jump >> 8) & 0xff, ins->line);
+            writeChunk(vm, &out, jump & 0xff, ins->line);
+        } else if (ins->op == OP_POP_N) {
+            writeChunk(vm, &out, ins->count, ins->line);
+        } else if (ins->op != OP_POP) {
+            for (int j = 1; j < ins->length; j++)
+                writeChunk(vm, &out, chunk->code[ins->offset + j], ins->line);
+        }
+    }
+
+    FREE_ARRAY(vm, int, offsets, list->count + 1);
+
+    if (!valid) {
+        freeChunk(vm, &out);
+        return false;
+    }
+
+    if (!chunk->mapped)
+        FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(vm, int, chunk->lines, chunk->lines_capacity);
+    FREE_ARRAY(vm, int, chunk->lines_run, chunk->lines_capacity);
+
+    chunk->code = out.code;
+    chunk->mapped = false;
+    chunk->count = out.count;
+    chunk->capacity = out.capacity;
+    chunk->lines = out.lines;
+    chunk->lines_run = out.lines_run;
+    chunk->lines_count = out.lines_count;
+    chunk->lines_capacity = out.lines_capacity;
+    return true;
+}
+
+bool optimizeChunk(VM* vm, Chunk* chunk) {
+    if (chunk->count == 0)
+        return false;
+
+    vm->pauseGC++;
+
+    InstructionList list = { NULL, 0, 0 };
+    bool changed = false;
+    if (decode(vm, chunk, &list)) {
+        while (peephole(chunk, &list))
+            changed = true;
+        if (changed)
+            changed = encode(vm, chunk, &list);
+    }
+
+    FREE_ARRAY(vm, Instruction, list.code, list.capacity);
+    vm->pauseGC--;
+    return changed;
+}
+
+void optimizeFunction(VM* vm, ObjFunction* func) {
+    optimizeChunk(vm, &func->chunk);
+
+    for (int i = 0; i < func->chunk.constants.count; i++) {
+        Value val = func->chunk.constants.values[i];
+        if (IS_FUNCTION(val))
+            optimizeFunction(vm, AS_FUNCTION(val));
+    }
+}
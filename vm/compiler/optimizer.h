@@ -0,0 +1,13 @@
+#ifndef jp_optimizer_h
+#define jp_optimizer_h
+
+#include "chunk.h"
+#include "../vm/object.h"
+
+// Rewrites redundant instruction sequences in a finished chunk, keeping jumps and
+// line runs in step. Chunks that fail to decode are left untouched.
+bool optimizeChunk(VM* vm, Chunk* chunk);
+// Optimizes the function's chunk and every function in its constants.
+void optimizeFunction(VM* vm, ObjFunction* func);
+
+#endif
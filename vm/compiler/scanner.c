@@ -89,7 +89,7 @@ static bool isAlpha(char c) {
 static Token stringToken(Scanner* scanner) {
     while (peek(scanner) != '"' && !isAtEnd(scanner)) {
         if (peek(scanner) == '\n') scanner->line++;
-        if (peek(scanner) == '\\') advance(scanner);
+        if (peek(scanner) == '\\' && peekNext(scanner) != '\0') advance(scanner);
         advance(scanner);
     }
 
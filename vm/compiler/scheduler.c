@@ -0,0 +1,429 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <limits.h>
+#include <pthread.h>
+#endif
+
+#include "cache.h"
+#include "compiler.h"
+#include "dumper.h"
+#include "scanner.h"
+#include "scheduler.h"
+#include "../util/memory.h"
+
+#ifndef WIN32
+
+typedef enum {
+    // Waiting on the files it imports.
+    MODULE_WAITING,
+    MODULE_QUEUED,
+    MODULE_COMPILING,
+    MODULE_DONE,
+    MODULE_FAILED,
+    // Compiled on the main thread, such as the script and files in an import cycle.
+    MODULE_SERIAL,
+} ModuleState;
+
+typedef struct {
+    char* path;
+    char* src;
+    ImportPlan plan;
+    // Files this one imports, once each, and the files importing it, by index.
+    int* imports;
+    int importCount;
+    int* dependants;
+    int dependantCount;
+    int dependantCapacity;
+    // Imported files not done yet.
+    int waiting;
+    ModuleState state;
+    bool visiting;
+    // Entry of the compiled file, from a worker or the module cache.
+    uint8_t* entry;
+    size_t entryLength;
+} ScheduledModule;
+
+struct ImportScheduler {
+    ScheduledModule* modules;
+    int count;
+    int capacity;
+    int optimize;
+
+    int* queue;
+    int queueStart;
+    int queueEnd;
+    bool stopping;
+
+    pthread_t* threads;
+    int threadCount;
+    pthread_mutex_t lock;
+    // Signalled when a file is queued, and when one is done or failed.
+    pthread_cond_t queued;
+    pthread_cond_t finished;
+};
+
+static int findModule(ImportScheduler* scheduler, const char* path) {
+    for (int i = 0; i < scheduler->count; i++) {
+        if (strcmp(scheduler->modules[i].path, path) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static int addModule(ImportScheduler* scheduler, char* path, char* src) {
+    if (scheduler->count + 1 > scheduler->capacity) {
+        scheduler->capacity = GROW_CAPACITY(scheduler->capacity);
+        scheduler->modules = realloc(scheduler->modules, sizeof(ScheduledModule) * scheduler->capacity);
+    }
+
+    ScheduledModule* module = &scheduler->modules[scheduler->count];
+    memset(module, 0, sizeof(ScheduledModule));
+    module->path = path;
+    module->src = src;
+    module->state = src == NULL ? MODULE_SERIAL : MODULE_WAITING;
+    return scheduler->count++;
+}
+
+static void addDependant(ScheduledModule* module, int dependant) {
+    if (module->dependantCount + 1 > module->dependantCapacity) {
+        module->dependantCapacity = GROW_CAPACITY(module->dependantCapacity);
+        module->dependants = realloc(module->dependants, sizeof(int) * module->dependantCapacity);
+    }
+    module->dependants[module->dependantCount++] = dependant;
+}
+
+// Resolves an import the way the compiler does, from the directory of the importing
+// file, or the working directory for the script.
+static char* resolveImport(const char* dir, const char* written, int length) {
+    size_t dirLength = dir == NULL || written[0] == '/' ? 0 : strlen(dir) + 1;
+    char* joined = malloc(dirLength + length + 1);
+    if (dirLength > 0)
+        sprintf(joined, "%s/", dir);
+    memcpy(joined + dirLength, written, length);
+    joined[dirLength + length] = '\0';
+
+    char* full = malloc(PATH_MAX);
+    if (realpath(joined, full) == NULL) {
+        free(full);
+        full = NULL;
+    }
+    free(joined);
+    return full;
+}
+
+static void addImport(ImportPlan* plan, const char* written, int length, char* path, bool compiled) {
+    plan->imports = realloc(plan->imports, sizeof(PlannedImport) * (plan->count + 1));
+    PlannedImport* import = &plan->imports[plan->count++];
+    import->written = malloc(length + 1);
+    memcpy(import->written, written, length);
+    import->written[length] = '\0';
+    import->path = path;
+    import->compiled = compiled;
+}
+
+// Follows the imports of the file depth first, as the compiler does, so a file already
+// visited is one compiling it would have reached already.
+static void visitModule(ImportScheduler* scheduler, int idx, bool isScript) {
+    scheduler->modules[idx].visiting = true;
+    char* dir = isScript ? NULL : getDirectory(scheduler->modules[idx].path);
+
+    Scanner scanner;
+    initScanner(&scanner, scheduler->modules[idx].src);
+    Token prev = scanToken(&scanner);
+    while (prev.type != TOKEN_EOF) {
+        Token tok = scanToken(&scanner);
+        bool isImport = prev.type == TOKEN_IMPORT && tok.type == TOKEN_STRING;
+        prev = tok;
+        if (!isImport)
+            continue;
+
+        const char* written = tok.start + 1;
+        int length = tok.length - 2;
+        char* path = resolveImport(dir, written, length);
+        if (path == NULL) {
+            scheduler->modules[idx].state = MODULE_SERIAL;
+            continue;
+        }
+
+        int imported = findModule(scheduler, path);
+        addImport(&scheduler->modules[idx].plan, written, length, path, imported >= 0);
+
+        if (imported < 0) {
+            imported = addModule(scheduler, strdup(path), tryReadFile(path));
+            if (scheduler->modules[imported].src != NULL)
+                visitModule(scheduler, imported, false);
+        } else if (scheduler->modules[imported].visiting) {
+            // A cycle, whose files need each other's constants part way through.
+            scheduler->modules[imported].state = MODULE_SERIAL;
+            scheduler->modules[idx].state = MODULE_SERIAL;
+        }
+
+        ScheduledModule* module = &scheduler->modules[idx];
+        bool seen = false;
+        for (int i = 0; i < module->importCount; i++)
+            seen = seen || module->imports[i] == imported;
+        if (!seen) {
+            module->imports = realloc(module->imports, sizeof(int) * (module->importCount + 1));
+            module->imports[module->importCount++] = imported;
+        }
+    }
+
+    free(dir);
+    scheduler->modules[idx].visiting = false;
+}
+
+// Files importing one left to the main thread are left to it as well.
+static void markSerial(ImportScheduler* scheduler) {
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = 0; i < scheduler->count; i++) {
+            ScheduledModule* module = &scheduler->modules[i];
+            if (module->state == MODULE_SERIAL)
+                continue;
+            for (int j = 0; j < module->importCount; j++) {
+                if (scheduler->modules[module->imports[j]].state == MODULE_SERIAL) {
+                    module->state = MODULE_SERIAL;
+                    changed = true;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+static void enqueue(ImportScheduler* scheduler, int idx) {
+    scheduler->modules[idx].state = MODULE_QUEUED;
+    scheduler->queue[scheduler->queueEnd++] = idx;
+    pthread_cond_signal(&scheduler->queued);
+}
+
+// Called with the lock held.
+static void finishModule(ImportScheduler* scheduler, int idx, bool compiled) {
+    ScheduledModule* module = &scheduler->modules[idx];
+    module->state = compiled ? MODULE_DONE : MODULE_FAILED;
+
+    for (int i = 0; i < module->dependantCount; i++) {
+        int dependant = module->dependants[i];
+        if (scheduler->modules[dependant].state != MODULE_WAITING)
+            continue;
+
+        // Without the constants of the failed file, the files importing it are left to
+        // the main thread, which reports the errors.
+        if (!compiled)
+            finishModule(scheduler, dependant, false);
+        else if (--scheduler->modules[dependant].waiting == 0)
+            enqueue(scheduler, dependant);
+    }
+    pthread_cond_broadcast(&scheduler->finished);
+}
+
+// Compiles the file into an entry, in a VM of its own holding the names fixed by the
+// files it imports.
+static bool compileScheduled(ImportScheduler* scheduler, int idx) {
+    ScheduledModule* module = &scheduler->modules[idx];
+
+    VM* vm = malloc(sizeof(VM));
+    initVM(vm, NULL, module->path);
+    vm->optimize = scheduler->optimize;
+    vm->importPlan = &module->plan;
+
+    bool compiled = true;
+    for (int i = 0; compiled && i < module->importCount; i++) {
+        ScheduledModule* imported = &scheduler->modules[module->imports[i]];
+        ObjString* path = copyString(vm, imported->path, strlen(imported->path));
+        push(vm, OBJ_VAL(path));
+        compiled = readModuleNames(vm, path, imported->entry, imported->entryLength);
+        pop(vm);
+    }
+
+    ObjFunction* func = compiled ? compile(vm, module->path, module->src) : NULL;
+    compiled = func != NULL && module->plan.next == module->plan.count;
+
+    BytecodeWriter writer;
+    initMemoryWriter(&writer);
+    if (compiled)
+        compiled = encodeModule(vm, &writer, func->name, func);
+
+    if (compiled) {
+        module->entry = writer.bytes;
+        module->entryLength = writer.count;
+    } else {
+        freeWriter(&writer);
+    }
+
+    freeVM(vm);
+    free(vm);
+    return compiled;
+}
+
+static void* runWorker(void* arg) {
+    ImportScheduler* scheduler = arg;
+
+    pthread_mutex_lock(&scheduler->lock);
+    for (;;) {
+        while (!scheduler->stopping && scheduler->queueStart == scheduler->queueEnd)
+            pthread_cond_wait(&scheduler->queued, &scheduler->lock);
+        if (scheduler->stopping)
+            break;
+
+        int idx = scheduler->queue[scheduler->queueStart++];
+        scheduler->modules[idx].state = MODULE_COMPILING;
+        pthread_mutex_unlock(&scheduler->lock);
+
+        bool compiled = compileScheduled(scheduler, idx);
+
+        pthread_mutex_lock(&scheduler->lock);
+        finishModule(scheduler, idx, compiled);
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+    return NULL;
+}
+
+static void freeScheduler(ImportScheduler* scheduler) {
+    for (int i = 0; i < scheduler->count; i++) {
+        ScheduledModule* module = &scheduler->modules[i];
+        for (int j = 0; j < module->plan.count; j++) {
+            free(module->plan.imports[j].written);
+            free(module->plan.imports[j].path);
+        }
+        free(module->plan.imports);
+        free(module->imports);
+        free(module->dependants);
+        free(module->path);
+        free(module->src);
+        free(module->entry);
+    }
+    free(scheduler->modules);
+    free(scheduler->queue);
+    free(scheduler->threads);
+    free(scheduler);
+}
+
+ImportScheduler* startImports(VM* vm, const char* path, const char* src, int threads) {
+    // Inlining decisions are reported in the order files are compiled.
+    if (threads < 2 || vm->inlineReport != NULL)
+        return NULL;
+
+    ImportScheduler* scheduler = malloc(sizeof(ImportScheduler));
+    scheduler->modules = NULL;
+    scheduler->count = 0;
+    scheduler->capacity = 0;
+    scheduler->optimize = vm->optimize;
+    scheduler->stopping = false;
+    scheduler->threads = NULL;
+    scheduler->threadCount = 0;
+
+    addModule(scheduler, strdup(path), strdup(src));
+    visitModule(scheduler, 0, true);
+    scheduler->modules[0].state = MODULE_SERIAL;
+    markSerial(scheduler);
+
+    scheduler->queue = malloc(sizeof(int) * scheduler->count);
+    scheduler->queueStart = 0;
+    scheduler->queueEnd = 0;
+
+    int pending = 0;
+    for (int i = 0; i < scheduler->count; i++) {
+        ScheduledModule* module = &scheduler->modules[i];
+        if (module->state != MODULE_WAITING)
+            continue;
+
+        if (vm->moduleCache != NULL)
+            module->entry = readCachedModule(vm, module->path, module->src, &module->entryLength);
+        if (module->entry != NULL)
+            module->state = MODULE_DONE;
+        else
+            pending++;
+    }
+
+    if (pending == 0) {
+        freeScheduler(scheduler);
+        return NULL;
+    }
+
+    pthread_mutex_init(&scheduler->lock, NULL);
+    pthread_cond_init(&scheduler->queued, NULL);
+    pthread_cond_init(&scheduler->finished, NULL);
+
+    for (int i = 0; i < scheduler->count; i++) {
+        ScheduledModule* module = &scheduler->modules[i];
+        if (module->state != MODULE_WAITING)
+            continue;
+
+        for (int j = 0; j < module->importCount; j++) {
+            ScheduledModule* imported = &scheduler->modules[module->imports[j]];
+            if (imported->state != MODULE_DONE) {
+                module->waiting++;
+                addDependant(imported, i);
+            }
+        }
+        if (module->waiting == 0)
+            enqueue(scheduler, i);
+    }
+
+    scheduler->threadCount = threads < pending ? threads : pending;
+    scheduler->threads = malloc(sizeof(pthread_t) * scheduler->threadCount);
+    for (int i = 0; i < scheduler->threadCount; i++) {
+        if (pthread_create(&scheduler->threads[i], NULL, runWorker, scheduler) != 0) {
+            scheduler->threadCount = i;
+            break;
+        }
+    }
+
+    if (scheduler->threadCount == 0) {
+        finishImports(scheduler);
+        return NULL;
+    }
+    return scheduler;
+}
+
+bool loadScheduled(VM* vm, ObjString* path, ObjFunction** func) {
+    ImportScheduler* scheduler = vm->scheduler;
+    int idx = findModule(scheduler, path->chars);
+    if (idx < 0)
+        return false;
+
+    ScheduledModule* module = &scheduler->modules[idx];
+    pthread_mutex_lock(&scheduler->lock);
+    while (module->state != MODULE_DONE && module->state != MODULE_FAILED && module->state != MODULE_SERIAL)
+        pthread_cond_wait(&scheduler->finished, &scheduler->lock);
+    ModuleState state = module->state;
+    pthread_mutex_unlock(&scheduler->lock);
+
+    return state == MODULE_DONE && linkModule(vm, path, module->entry, module->entryLength, func);
+}
+
+void finishImports(ImportScheduler* scheduler) {
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->stopping = true;
+    pthread_cond_broadcast(&scheduler->queued);
+    pthread_mutex_unlock(&scheduler->lock);
+
+    for (int i = 0; i < scheduler->threadCount; i++)
+        pthread_join(scheduler->threads[i], NULL);
+
+    pthread_mutex_destroy(&scheduler->lock);
+    pthread_cond_destroy(&scheduler->queued);
+    pthread_cond_destroy(&scheduler->finished);
+    freeScheduler(scheduler);
+}
+
+#else
+
+// Imports are compiled on the main thread as they are reached.
+ImportScheduler* startImports(VM* vm, const char* path, const char* src, int threads) {
+    return NULL;
+}
+
+bool loadScheduled(VM* vm, ObjString* path, ObjFunction** func) {
+    return false;
+}
+
+void finishImports(ImportScheduler* scheduler) {
+}
+
+#endif
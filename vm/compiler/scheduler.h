@@ -0,0 +1,38 @@
+
+#ifndef jp_scheduler_h
+#define jp_scheduler_h
+
+#include "../vm/object.h"
+#include "../vm/value.h"
+#include "../vm/vm.h"
+
+// An import found before the file is compiled.
+typedef struct {
+    // Path as written in the source, and the full path it resolves to.
+    char* written;
+    char* path;
+    // Set when the file is compiled before the import is reached, so it is imported by path.
+    bool compiled;
+} PlannedImport;
+
+// Imports of a file compiled on a worker thread, in the order the compiler reaches them.
+struct ImportPlan {
+    PlannedImport* imports;
+    int count;
+    int next;
+};
+
+// Finds the files the script at path imports, directly or not, in the order compiling it
+// reaches them, and starts compiling them on threads. Each thread has a VM of its own,
+// and compiles a file once the files it imports are done, as their constants are folded
+// into it. Files in an import cycle, and files importing them, are left to the main
+// thread. Returns NULL when there is nothing to compile ahead.
+ImportScheduler* startImports(VM* vm, const char* path, const char* src, int threads);
+// Waits for the file at path to be compiled ahead, then links it into the VM as a module
+// cache entry is. Returns false when it has to be compiled on the main thread instead,
+// otherwise func is set, to NULL when a file it imports failed to compile.
+bool loadScheduled(VM* vm, ObjString* path, ObjFunction** func);
+// Stops the threads, dropping files that were not needed, and frees the scheduler.
+void finishImports(ImportScheduler* scheduler);
+
+#endif
@@ -0,0 +1,406 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "cache.h"
+#include "compiler.h"
+#include "dumper.h"
+#include "scheduler.h"
+#include "server.h"
+#include "../util/memory.h"
+
+#ifndef WIN32
+
+// Magic, version, optimization level and compress byte.
+#define REQUEST_HEADER_SIZE (SERVER_MAGIC_LENGTH + 9)
+
+typedef struct {
+    int optimize;
+    bool compress;
+    char* cwd;
+    char* src;
+    char* dest;
+    // Client's stdout and stderr.
+    int out;
+    int err;
+} CompileRequest;
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stopServer(int sig) {
+    stopping = 1;
+}
+
+static void putWord(uint8_t* bytes, uint32_t word) {
+    for (int i = 0; i < 4; i++)
+        bytes[i] = (word >> (i * 8)) & 0xFF;
+}
+
+static uint32_t getWord(const uint8_t* bytes) {
+    uint32_t word = 0;
+    for (int i = 0; i < 4; i++)
+        word |= (uint32_t) bytes[i] << (i * 8);
+    return word;
+}
+
+static bool writeAll(int fd, const void* bytes, size_t length) {
+    const uint8_t* at = bytes;
+    while (length > 0) {
+        ssize_t written = send(fd, at, length, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+        at += written;
+        length -= written;
+    }
+    return true;
+}
+
+static bool readAll(int fd, void* bytes, size_t length) {
+    uint8_t* at = bytes;
+    while (length > 0) {
+        ssize_t got = recv(fd, at, length, 0);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return false;
+        at += got;
+        length -= got;
+    }
+    return true;
+}
+
+static bool writeString(int fd, const char* chars) {
+    uint8_t length[4];
+    putWord(length, strlen(chars));
+    return writeAll(fd, length, 4) && writeAll(fd, chars, strlen(chars));
+}
+
+// Reads a path, returning NULL when it is cut short or too long to be one.
+static char* readString(int fd) {
+    uint8_t length[4];
+    if (!readAll(fd, length, 4) || getWord(length) >= PATH_MAX)
+        return NULL;
+
+    uint32_t len = getWord(length);
+    char* chars = malloc(len + 1);
+    if (!readAll(fd, chars, len)) {
+        free(chars);
+        return NULL;
+    }
+    chars[len] = '\0';
+    return chars;
+}
+
+static bool socketAddress(const char* path, struct sockaddr_un* addr) {
+    if (strlen(path) >= sizeof(addr->sun_path))
+        return false;
+
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+static int connectTo(const char* path) {
+    struct sockaddr_un addr;
+    if (!socketAddress(path, &addr))
+        return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void freeRequest(CompileRequest* req) {
+    if (req->out >= 0)
+        close(req->out);
+    if (req->err >= 0)
+        close(req->err);
+    free(req->cwd);
+    free(req->src);
+    free(req->dest);
+}
+
+// Reads the request and the descriptors sent with its header, returning false on one
+// from another version or a client that went away.
+static bool readRequest(int fd, CompileRequest* req) {
+    req->out = -1;
+    req->err = -1;
+    req->cwd = NULL;
+    req->src = NULL;
+    req->dest = NULL;
+
+    uint8_t header[REQUEST_HEADER_SIZE];
+    int fds[2];
+    char control[CMSG_SPACE(sizeof(fds))];
+
+    struct iovec iov = { header, REQUEST_HEADER_SIZE };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t got;
+    do {
+        got = recvmsg(fd, &msg, 0);
+    } while (got < 0 && errno == EINTR);
+    if (got <= 0)
+        return false;
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(sizeof(fds))) {
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+        req->out = fds[0];
+        req->err = fds[1];
+    }
+
+    if (got < REQUEST_HEADER_SIZE && !readAll(fd, header + got, REQUEST_HEADER_SIZE - got))
+        return false;
+    if (req->out < 0 || memcmp(header, SERVER_MAGIC, SERVER_MAGIC_LENGTH) != 0 ||
+            getWord(header + SERVER_MAGIC_LENGTH) != SERVER_VERSION)
+        return false;
+
+    req->optimize = getWord(header + SERVER_MAGIC_LENGTH + 4);
+    req->compress = header[SERVER_MAGIC_LENGTH + 8] != 0;
+    req->cwd = readString(fd);
+    req->src = req->cwd == NULL ? NULL : readString(fd);
+    req->dest = req->src == NULL ? NULL : readString(fd);
+    return req->dest != NULL;
+}
+
+static void redirectOutput(CompileRequest* req, int saved[2]) {
+    fflush(stdout);
+    fflush(stderr);
+    saved[0] = dup(STDOUT_FILENO);
+    saved[1] = dup(STDERR_FILENO);
+    dup2(req->out, STDOUT_FILENO);
+    dup2(req->err, STDERR_FILENO);
+}
+
+static void restoreOutput(int saved[2]) {
+    fflush(stdout);
+    fflush(stderr);
+    dup2(saved[0], STDOUT_FILENO);
+    dup2(saved[1], STDERR_FILENO);
+    close(saved[0]);
+    close(saved[1]);
+}
+
+static int writeProgram(VM* vm, ObjFunction* func, char* path, bool compress) {
+    FILE* fp = fopen(path, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        return 74;
+    }
+
+    BytecodeWriter writer;
+    initFileWriter(&writer, fp);
+    vm->pauseGC++;
+    bool written = dumpProgram(vm, &writer, func, compress);
+    vm->pauseGC--;
+    written = fclose(fp) == 0 && written;
+    freeWriter(&writer);
+
+    if (!written) {
+        fprintf(stderr, "Failed to write to file \"%s\".\n", path);
+        return 74;
+    }
+    return 0;
+}
+
+// Compiles the file as -c does, from the client's working directory, returning the
+// status it exits with. Everything the compile allocated is handed to the server.
+static int compileRequest(VM* server, CompileRequest* req, int threads) {
+    changeDirectory(req->cwd);
+    changeDirectoryToFile(req->src);
+
+    char* src = tryReadFile(req->src);
+    char* path = src == NULL ? NULL : getFullPath(req->src);
+    if (path == NULL) {
+        fprintf(stderr, "Could not open file \"%s\".\n", req->src);
+        free(src);
+        return 74;
+    }
+
+    VM* vm = malloc(sizeof(VM));
+    initVM(vm, server, "main");
+    vm->optimize = req->optimize;
+    resetModuleCache(vm->moduleCache);
+
+    vm->scheduler = startImports(vm, path, src, threads);
+    ObjFunction* func = compile(vm, path, src);
+    if (vm->scheduler != NULL) {
+        finishImports(vm->scheduler);
+        vm->scheduler = NULL;
+    }
+
+    int status = func == NULL ? 65 : writeProgram(vm, func, req->dest, req->compress);
+
+    decoupleVM(vm);
+    if (vm->objects != NULL)
+        takeOwnership(server, vm->objects);
+    free(vm);
+    free(path);
+    free(src);
+
+    // Strings stay interned for later compiles until the heap grows past its limit.
+    if (server->bytesAllocated > server->nextGC)
+        collectGarbage(server);
+    return status;
+}
+
+// Replaces a socket left by a server that stopped without removing it, but not one a
+// server is still listening on, or a file that is not a socket.
+static bool claimSocket(const char* path) {
+    int running = connectTo(path);
+    if (running >= 0) {
+        close(running);
+        fprintf(stderr, "A compile server is already listening on \"%s\".\n", path);
+        return false;
+    }
+
+    struct stat st;
+    if (stat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "\"%s\" is not a socket.\n", path);
+            return false;
+        }
+        unlink(path);
+    }
+    return true;
+}
+
+bool serveCompiles(VM* vm, const char* path, int threads) {
+    struct sockaddr_un addr;
+    if (!socketAddress(path, &addr)) {
+        fprintf(stderr, "Socket path \"%s\" is too long.\n", path);
+        return false;
+    }
+    if (!claimSocket(path))
+        return false;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 || listen(fd, 16) != 0) {
+        fprintf(stderr, "Could not listen on \"%s\".\n", path);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    // Interrupts stop the server once the compile running finishes, and a client that
+    // goes away mid compile does not take the server with it.
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stopServer;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (vm->moduleCache == NULL)
+        vm->moduleCache = newMemoryModuleCache();
+    char* cwd = getCurrentWorkingDirectory();
+
+    while (!stopping) {
+        int client = accept(fd, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+
+        CompileRequest req;
+        if (readRequest(client, &req)) {
+            int saved[2];
+            redirectOutput(&req, saved);
+            uint8_t status = compileRequest(vm, &req, threads);
+            restoreOutput(saved);
+
+            changeDirectory(cwd);
+            writeAll(client, &status, 1);
+        }
+        freeRequest(&req);
+        close(client);
+    }
+
+    close(fd);
+    unlink(path);
+    free(cwd);
+    return true;
+}
+
+int requestCompile(VM* vm, const char* socketPath, const char* srcPath, const char* destPath, bool compress) {
+    int fd = connectTo(socketPath);
+    if (fd < 0)
+        return -1;
+
+    uint8_t header[REQUEST_HEADER_SIZE];
+    memcpy(header, SERVER_MAGIC, SERVER_MAGIC_LENGTH);
+    putWord(header + SERVER_MAGIC_LENGTH, SERVER_VERSION);
+    putWord(header + SERVER_MAGIC_LENGTH + 4, vm->optimize);
+    header[SERVER_MAGIC_LENGTH + 8] = compress ? 1 : 0;
+
+    int fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+
+    struct iovec iov = { header, REQUEST_HEADER_SIZE };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    fflush(stdout);
+    fflush(stderr);
+    char* cwd = getCurrentWorkingDirectory();
+    bool sent = sendmsg(fd, &msg, MSG_NOSIGNAL) == REQUEST_HEADER_SIZE &&
+        writeString(fd, cwd) && writeString(fd, srcPath) && writeString(fd, destPath);
+    free(cwd);
+
+    uint8_t status;
+    int res = sent && readAll(fd, &status, 1) ? status : -1;
+    close(fd);
+    return res;
+}
+
+#else
+
+bool serveCompiles(VM* vm, const char* path, int threads) {
+    fprintf(stderr, "The compile server needs Unix domain sockets.\n");
+    return false;
+}
+
+// Without a server, files are compiled where the client runs.
+int requestCompile(VM* vm, const char* socketPath, const char* srcPath, const char* destPath, bool compress) {
+    return -1;
+}
+
+#endif
@@ -0,0 +1,26 @@
+
+#ifndef jp_server_h
+#define jp_server_h
+
+#include "../vm/object.h"
+#include "../vm/value.h"
+#include "../vm/vm.h"
+
+// Requests are little endian: the magic, version, optimization level and compress
+// byte, then the working directory, source and output paths as length prefixed
+// strings. The client's stdout and stderr travel with the request, so errors are
+// printed where it runs. The reply is the status byte it exits with.
+#define SERVER_MAGIC "NPZS"
+#define SERVER_MAGIC_LENGTH 4
+#define SERVER_VERSION 1
+
+// Compiles the files clients send to the Unix socket at path until interrupted,
+// one at a time. Each is compiled in a VM made from this one, which keeps the intern
+// table and module cache between compiles, so only files that changed are compiled
+// again. Returns false, after printing why, when the socket cannot be opened.
+bool serveCompiles(VM* vm, const char* path, int threads);
+// Has the server at socketPath compile the file as -c would from the working directory.
+// Returns the status to exit with, or -1 when no server is listening.
+int requestCompile(VM* vm, const char* socketPath, const char* srcPath, const char* destPath, bool compress);
+
+#endif
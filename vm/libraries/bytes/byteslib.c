@@ -0,0 +1,421 @@
+#include <string.h>
+
+#include "byteslib.h"
+#include "npbytes.h"
+
+static NPBytes* expectBytes(VM* vm, int argc, Value* args, int expected, bool writing) {
+    if (!expectArgs(vm, argc, expected))
+        return NULL;
+    if (!IS_NPBYTES(args[0])) {
+        runtimeError(vm, "Expected bytes as first argument.");
+        return NULL;
+    }
+    if (!checkNPBytes(vm, AS_NPBYTES(args[0]), writing))
+        return NULL;
+    for (int i = 1; i < argc; i++) {
+        if (!IS_NUMBER(args[i])) {
+            runtimeError(vm, "Expected number as argument %d.", i + 1);
+            return NULL;
+        }
+    }
+    return AS_NPBYTES(args[0]);
+}
+
+// Where a value of size bytes at the offset in the second argument is read or written.
+static uint8_t* expectField(VM* vm, int argc, Value* args, int expected, int size, bool writing) {
+    NPBytes* bytes = expectBytes(vm, argc, args, expected, writing);
+    if (bytes == NULL)
+        return NULL;
+
+    double offset = AS_NUMBER(args[1]);
+    if (offset < 0 || offset + size > bytes->length) {
+        runtimeError(vm, "Index out of bounds.");
+        return NULL;
+    }
+    return npbytesData(bytes) + (size_t) offset;
+}
+
+static bool hostBigEndian() {
+    uint16_t one = 1;
+    return *(uint8_t*) &one == 0;
+}
+
+static NativeResult allocNative(VM* vm, int argc, Value* args) {
+    if (!expectArgs(vm, argc, 1))
+        return NATIVE_FAIL;
+    if (!IS_NUMBER(args[0]) || AS_NUMBER(args[0]) < 0) {
+        runtimeError(vm, "Expected length as argument.");
+        return NATIVE_FAIL;
+    }
+
+    return NATIVE_VAL(OBJ_VAL(newNPBytes(vm, (size_t) AS_NUMBER(args[0]))));
+}
+
+static NativeResult fromStringNative(VM* vm, int argc, Value* args) {
+    if (!expectArgs(vm, argc, 1))
+        return NATIVE_FAIL;
+    if (!IS_STRING(args[0])) {
+        runtimeError(vm, "Expected string as argument.");
+        return NATIVE_FAIL;
+    }
+
+    ObjString* str = AS_STRING(args[0]);
+    ObjPtr* ptr = newNPBytes(vm, str->length);
+    if (str->length > 0)
+        memcpy(((NPBytes*) ptr->ptr)->bytes, str->chars, str->length);
+    return NATIVE_VAL(OBJ_VAL(ptr));
+}
+
+static NativeResult toStringNative(VM* vm, int argc, Value* args) {
+    NPBytes* bytes = expectBytes(vm, argc, args, 1, false);
+    if (bytes == NULL)
+        return NATIVE_FAIL;
+
+    return NATIVE_VAL(OBJ_VAL(copyString(vm, (char*) npbytesData(bytes), bytes->length)));
+}
+
+static NativeResult sizeNative(VM* vm, int argc, Value* args) {
+    NPBytes* bytes = expectBytes(vm, argc, args, 1, false);
+    if (bytes == NULL)
+        return NATIVE_FAIL;
+
+    return NATIVE_VAL(NUMBER_VAL(bytes->length));
+}
+
+// Bounds are handled as std.slice handles them.
+static NativeResult sliceNative(VM* vm, int argc, Value* args) {
+    NPBytes* bytes = expectBytes(vm, argc, args, 3, false);
+    if (bytes == NULL)
+        return NATIVE_FAIL;
+
+    double start = AS_NUMBER(args[1]);
+    if (start < 0)
+        start += bytes->length + 1;
+
+    double end = AS_NUMBER(args[2]);
+    if (end < 0)
+        end += bytes->length + 1;
+
+    if (end > bytes->length)
+        end = bytes->length;
+    if (start > end)
+        start = end;
+
+    if (start < 0 || end < 0) {
+        runtimeError(vm, "Indices out of bounds.");
+        return NATIVE_FAIL;
+    }
+
+    ObjPtr* view = newNPBytesView(vm, AS_PTR(args[0]), (size_t) start, (size_t) end - (size_t) start);
+    return NATIVE_VAL(OBJ_VAL(view));
+}
+
+static NativeResult copyNative(VM* vm, int argc, Value* args) {
+    if (!expectArgs(vm, argc, 3))
+        return NATIVE_FAIL;
+    if (!IS_NPBYTES(args[0]) || !IS_NUMBER(args[1]) || !IS_NPBYTES(args[2])) {
+        runtimeError(vm, "Expected (bytes, int, bytes) as arguments.");
+        return NATIVE_FAIL;
+    }
+
+    NPBytes* dest = AS_NPBYTES(args[0]);
+    NPBytes* src = AS_NPBYTES(args[2]);
+    if (!checkNPBytes(vm, dest, true) || !checkNPBytes(vm, src, false))
+        return NATIVE_FAIL;
+    double offset = AS_NUMBER(args[1]);
+    if (offset < 0 || offset + src->length > dest->length) {
+        runtimeError(vm, "Index out of bounds.");
+        return NATIVE_FAIL;
+    }
+
+    if (src->length > 0)
+        memmove(npbytesData(dest) + (size_t) offset, npbytesData(src), src->length);
+    return NATIVE_OK;
+}
+
+static NativeResult fillNative(VM* vm, int argc, Value* args) {
+    NPBytes* bytes = expectBytes(vm, argc, args, 2, true);
+    if (bytes == NULL)
+        return NATIVE_FAIL;
+
+    if (bytes->length > 0)
+        memset(npbytesData(bytes), (uint8_t) AS_NUMBER(args[1]), bytes->length);
+    return NATIVE_OK;
+}
+
+// Strings and bytes are both searched for as bytes.
+static bool expectNeedle(VM* vm, Value val, const uint8_t** needle, size_t* length) {
+    if (IS_STRING(val)) {
+        *needle = (const uint8_t*) AS_STRING(val)->chars;
+        *length = AS_STRING(val)->length;
+        return true;
+    }
+    if (IS_NPBYTES(val)) {
+        if (!checkNPBytes(vm, AS_NPBYTES(val), false))
+            return false;
+        *needle = npbytesData(AS_NPBYTES(val));
+        *length = AS_NPBYTES(val)->length;
+        return true;
+    }
+
+    runtimeError(vm, "Expected string or bytes as second argument.");
+    return false;
+}
+
+// Offset of the first match of the needle from start, or -1.
+static int64_t findBytes(const uint8_t* haystack, size_t length, size_t start,
+        const uint8_t* needle, size_t needleLength) {
+    if (start > length || length - start < needleLength)
+        return -1;
+    if (needleLength == 0)
+        return start;
+
+    const uint8_t* i = haystack + start;
+    const uint8_t* last = haystack + length - needleLength;
+    while (i <= last) {
+        i = memchr(i, needle[0], last - i + 1);
+        if (i == NULL)
+            return -1;
+        if (memcmp(i, needle, needleLength) == 0)
+            return i - haystack;
+        i++;
+    }
+    return -1;
+}
+
+static NativeResult findNative(VM* vm, int argc, Value* args) {
+    if (!expectArgs(vm, argc, 3))
+        return NATIVE_FAIL;
+    if (!IS_NPBYTES(args[0]) || !IS_NUMBER(args[2])) {
+        runtimeError(vm, "Expected (bytes, string, int) as arguments.");
+        return NATIVE_FAIL;
+    }
+
+    NPBytes* bytes = AS_NPBYTES(args[0]);
+    const uint8_t* needle;
+    size_t needleLength;
+    if (!checkNPBytes(vm, bytes, false) || !expectNeedle(vm, args[1], &needle, &needleLength))
+        return NATIVE_FAIL;
+
+    double start = AS_NUMBER(args[2]);
+    if (start < 0 || start > bytes->length) {
+        runtimeError(vm, "Index out of bounds.");
+        return NATIVE_FAIL;
+    }
+
+    int64_t found = findBytes(npbytesData(bytes), bytes->length, (size_t) start, needle, needleLength);
+    return NATIVE_VAL(NUMBER_VAL(found));
+}
+
+// Pieces are views, so splitting copies no bytes.
+static NativeResult splitNative(VM* vm, int argc, Value* args) {
+    if (!expectArgs(vm, argc, 2))
+        return NATIVE_FAIL;
+    if (!IS_NPBYTES(args[0])) {
+        runtimeError(vm, "Expected bytes as first argument.");
+        return NATIVE_FAIL;
+    }
+
+    NPBytes* bytes = AS_NPBYTES(args[0]);
+    const uint8_t* sep;
+    size_t sepLength;
+    if (!checkNPBytes(vm, bytes, false) || !expectNeedle(vm, args[1], &sep, &sepLength))
+        return NATIVE_FAIL;
+    if (sepLength == 0) {
+        runtimeError(vm, "Expected separator that is not empty.");
+        return NATIVE_FAIL;
+    }
+
+    ObjList* list = newList(vm);
+    push(vm, OBJ_VAL(list));
+
+    const uint8_t* data = npbytesData(bytes);
+    size_t start = 0;
+    while (true) {
+        int64_t found = findBytes(data, bytes->length, start, sep, sepLength);
+        size_t end = found < 0 ? bytes->length : (size_t) found;
+
+        Value piece = OBJ_VAL(newNPBytesView(vm, AS_PTR(args[0]), start, end - start));
+        push(vm, piece);
+        writeValueArray(vm, &list->list, piece);
+        pop(vm);
+
+        if (found < 0)
+            break;
+        start = end + sepLength;
+    }
+
+    pop(vm);
+    return NATIVE_VAL(OBJ_VAL(list));
+}
+
+static bool expectIntSize(VM* vm, Value size) {
+    double n = AS_NUMBER(size);
+    if (n != 1 && n != 2 && n != 4) {
+        runtimeError(vm, "Integer size must be 1, 2 or 4.");
+        return false;
+    }
+    return true;
+}
+
+static NativeResult getInt(VM* vm, int argc, Value* args, bool isSigned, bool bigEndian) {
+    if (expectBytes(vm, argc, args, 3, false) == NULL || !expectIntSize(vm, args[2]))
+        return NATIVE_FAIL;
+    int size = (int) AS_NUMBER(args[2]);
+    uint8_t* field = expectField(vm, argc, args, 3, size, false);
+    if (field == NULL)
+        return NATIVE_FAIL;
+
+    uint32_t num = 0;
+    for (int i = 0; i < size; i++) {
+        if (bigEndian)
+            num = (num << 8) | field[i];
+        else
+            num |= (uint32_t) field[i] << (8 * i);
+    }
+
+    if (!isSigned)
+        return NATIVE_VAL(NUMBER_VAL(num));
+    if (size == 4)
+        return NATIVE_VAL(NUMBER_VAL((int32_t) num));
+
+    int64_t sign = (int64_t) 1 << (8 * size - 1);
+    return NATIVE_VAL(NUMBER_VAL((num & sign) ? (int64_t) num - 2 * sign : (int64_t) num));
+}
+
+// Numbers are truncated and wrapped to the size, so signed and unsigned values are set alike.
+static NativeResult setInt(VM* vm, int argc, Value* args, bool bigEndian) {
+    if (expectBytes(vm, argc, args, 4, true) == NULL || !expectIntSize(vm, args[2]))
+        return NATIVE_FAIL;
+    int size = (int) AS_NUMBER(args[2]);
+    uint8_t* field = expectField(vm, argc, args, 4, size, true);
+    if (field == NULL)
+        return NATIVE_FAIL;
+
+    uint32_t num = (uint32_t) (int64_t) AS_NUMBER(args[3]);
+    for (int i = 0; i < size; i++) {
+        int shift = bigEndian ? 8 * (size - 1 - i) : 8 * i;
+        field[i] = (num >> shift) & 0xFF;
+    }
+    return NATIVE_OK;
+}
+
+static bool expectFloatSize(VM* vm, Value size) {
+    double n = AS_NUMBER(size);
+    if (n != 4 && n != 8) {
+        runtimeError(vm, "Float size must be 4 or 8.");
+        return false;
+    }
+    return true;
+}
+
+static void copyOrdered(uint8_t* dest, const uint8_t* src, int size, bool bigEndian) {
+    if (bigEndian == hostBigEndian()) {
+        memcpy(dest, src, size);
+    } else {
+        for (int i = 0; i < size; i++)
+            dest[i] = src[size - 1 - i];
+    }
+}
+
+static NativeResult getFloat(VM* vm, int argc, Value* args, bool bigEndian) {
+    if (expectBytes(vm, argc, args, 3, false) == NULL || !expectFloatSize(vm, args[2]))
+        return NATIVE_FAIL;
+    int size = (int) AS_NUMBER(args[2]);
+    uint8_t* field = expectField(vm, argc, args, 3, size, false);
+    if (field == NULL)
+        return NATIVE_FAIL;
+
+    if (size == 4) {
+        float num;
+        copyOrdered((uint8_t*) &num, field, size, bigEndian);
+        return NATIVE_VAL(NUMBER_VAL(num));
+    }
+    double num;
+    copyOrdered((uint8_t*) &num, field, size, bigEndian);
+    return NATIVE_VAL(NUMBER_VAL(num));
+}
+
+static NativeResult setFloat(VM* vm, int argc, Value* args, bool bigEndian) {
+    if (expectBytes(vm, argc, args, 4, true) == NULL || !expectFloatSize(vm, args[2]))
+        return NATIVE_FAIL;
+    int size = (int) AS_NUMBER(args[2]);
+    uint8_t* field = expectField(vm, argc, args, 4, size, true);
+    if (field == NULL)
+        return NATIVE_FAIL;
+
+    if (size == 4) {
+        float num = (float) AS_NUMBER(args[3]);
+        copyOrdered(field, (uint8_t*) &num, size, bigEndian);
+    } else {
+        double num = AS_NUMBER(args[3]);
+        copyOrdered(field, (uint8_t*) &num, size, bigEndian);
+    }
+    return NATIVE_OK;
+}
+
+static NativeResult getIntNative(VM* vm, int argc, Value* args) {
+    return getInt(vm, argc, args, true, false);
+}
+
+static NativeResult getUintNative(VM* vm, int argc, Value* args) {
+    return getInt(vm, argc, args, false, false);
+}
+
+static NativeResult setIntNative(VM* vm, int argc, Value* args) {
+    return setInt(vm, argc, args, false);
+}
+
+static NativeResult getFloatNative(VM* vm, int argc, Value* args) {
+    return getFloat(vm, argc, args, false);
+}
+
+static NativeResult setFloatNative(VM* vm, int argc, Value* args) {
+    return setFloat(vm, argc, args, false);
+}
+
+static NativeResult getIntBENative(VM* vm, int argc, Value* args) {
+    return getInt(vm, argc, args, true, true);
+}
+
+static NativeResult getUintBENative(VM* vm, int argc, Value* args) {
+    return getInt(vm, argc, args, false, true);
+}
+
+static NativeResult setIntBENative(VM* vm, int argc, Value* args) {
+    return setInt(vm, argc, args, true);
+}
+
+static NativeResult getFloatBENative(VM* vm, int argc, Value* args) {
+    return getFloat(vm, argc, args, true);
+}
+
+static NativeResult setFloatBENative(VM* vm, int argc, Value* args) {
+    return setFloat(vm, argc, args, true);
+}
+
+bool importBytesLib(VM* vm, ObjString* lib) {
+    LIBFUNC("alloc", allocNative);
+    LIBFUNC("fromString", fromStringNative);
+    LIBFUNC("toString", toStringNative);
+    LIBFUNC("size", sizeNative);
+    LIBFUNC("slice", sliceNative);
+    LIBFUNC("copy", copyNative);
+    LIBFUNC("fill", fillNative);
+    LIBFUNC("find", findNative);
+    LIBFUNC("split", splitNative);
+
+    LIBFUNC("getInt", getIntNative);
+    LIBFUNC("getUint", getUintNative);
+    LIBFUNC("setInt", setIntNative);
+    LIBFUNC("getFloat", getFloatNative);
+    LIBFUNC("setFloat", setFloatNative);
+
+    LIBFUNC("getIntBE", getIntBENative);
+    LIBFUNC("getUintBE", getUintBENative);
+    LIBFUNC("setIntBE", setIntBENative);
+    LIBFUNC("getFloatBE", getFloatBENative);
+    LIBFUNC("setFloatBE", setFloatBENative);
+
+    return true;
+}
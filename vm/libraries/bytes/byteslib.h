@@ -0,0 +1,8 @@
+#ifndef jp_byteslib_h
+#define jp_byteslib_h
+
+#include "../core/extension.h"
+
+bool importBytesLib(VM* vm, ObjString* lib);
+
+#endif
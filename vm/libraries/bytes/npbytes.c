@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "npbytes.h"
+#include "../../vm/object.h"
+
+const char* npbytesPtrOrigin = "nupiz.bytes";
+
+static void freeNPBytes(VM* vm, ObjPtr* ptr) {
+    NPBytes* bytes = (NPBytes*) ptr->ptr;
+    if (bytes->release != NULL)
+        releaseNPBytes(bytes);
+    else if (bytes->source == NULL)
+        FREE_ARRAY(vm, uint8_t, bytes->bytes, bytes->length);
+
+    FREE(vm, NPBytes, bytes);
+    ptr->ptr = NULL;
+}
+
+static void blackenNPBytes(VM* vm, ObjPtr* ptr) {
+    NPBytes* bytes = (NPBytes*) ptr->ptr;
+    if (bytes->source != NULL)
+        markObject(vm, (Obj*) bytes->source);
+}
+
+static void relocateNPBytes(VM* vm, ObjPtr* ptr) {
+    NPBytes* bytes = (NPBytes*) ptr->ptr;
+    if (bytes->source != NULL)
+        bytes->source = (ObjPtr*) forwardObject(vm, (Obj*) bytes->source);
+}
+
+static ObjString* stringNPBytes(VM* vm, ObjPtr* ptr) {
+    return formatString(vm, "<bytes %zu>", ((NPBytes*) ptr->ptr)->length);
+}
+
+static void printNPBytes(ObjPtr* ptr) {
+    printf("<bytes %zu>", ((NPBytes*) ptr->ptr)->length);
+}
+
+static bool byteIndex(VM* vm, NPBytes* bytes, Value idx, size_t* res) {
+    if (!checkNPBytes(vm, bytes, false))
+        return false;
+    if (!IS_NUMBER(idx)) {
+        runtimeError(vm, "Expected number as index.");
+        return false;
+    }
+
+    double i = AS_NUMBER(idx);
+    if (i < 0)
+        i += bytes->length;
+    if (i < 0 || i >= bytes->length) {
+        runtimeError(vm, "Index out of bounds.");
+        return false;
+    }
+
+    *res = (size_t) i;
+    return true;
+}
+
+static bool getIndexNPBytes(VM* vm, ObjPtr* ptr, Value idx, Value* res) {
+    NPBytes* bytes = (NPBytes*) ptr->ptr;
+    size_t i;
+    if (!byteIndex(vm, bytes, idx, &i))
+        return false;
+
+    *res = NUMBER_VAL(npbytesData(bytes)[i]);
+    return true;
+}
+
+static bool setIndexNPBytes(VM* vm, ObjPtr* ptr, Value idx, Value val) {
+    NPBytes* bytes = (NPBytes*) ptr->ptr;
+    size_t i;
+    if (!byteIndex(vm, bytes, idx, &i) || !checkNPBytes(vm, bytes, true))
+        return false;
+    if (!IS_NUMBER(val) || AS_NUMBER(val) < 0 || AS_NUMBER(val) > UINT8_MAX) {
+        runtimeError(vm, "Expected byte value.");
+        return false;
+    }
+
+    npbytesData(bytes)[i] = (uint8_t) AS_NUMBER(val);
+    return true;
+}
+
+static ObjPtr* wrapNPBytes(VM* vm, NPBytes* bytes) {
+    ObjPtr* ptr = newPtr(vm, npbytesPtrOrigin, 0);
+    ptr->ptr = (void*) bytes;
+    ptr->freeFn = freeNPBytes;
+    ptr->blackenFn = blackenNPBytes;
+    ptr->relocateFn = relocateNPBytes;
+    ptr->stringFn = stringNPBytes;
+    ptr->printFn = printNPBytes;
+    ptr->getIndexFn = getIndexNPBytes;
+    ptr->setIndexFn = setIndexNPBytes;
+
+    return ptr;
+}
+
+ObjPtr* newNPBytes(VM* vm, size_t length) {
+    // No memory is allocated for no bytes, leaving data NULL.
+    uint8_t* data = ALLOCATE(vm, uint8_t, length);
+    if (length > 0)
+        memset(data, 0, length);
+
+    NPBytes* bytes = ALLOCATE(vm, NPBytes, 1);
+    bytes->bytes = data;
+    bytes->length = length;
+    bytes->source = NULL;
+    bytes->offset = 0;
+    bytes->readOnly = false;
+    bytes->release = NULL;
+    bytes->released = false;
+
+    return wrapNPBytes(vm, bytes);
+}
+
+ObjPtr* newNPBytesView(VM* vm, ObjPtr* source, size_t offset, size_t length) {
+    NPBytes* sourceBytes = (NPBytes*) source->ptr;
+    if (sourceBytes->source != NULL) {
+        offset += sourceBytes->offset;
+        source = sourceBytes->source;
+    }
+
+    push(vm, OBJ_VAL(source));
+    NPBytes* bytes = ALLOCATE(vm, NPBytes, 1);
+    bytes->bytes = NULL;
+    bytes->length = length;
+    bytes->source = source;
+    bytes->offset = offset;
+    bytes->readOnly = ((NPBytes*) source->ptr)->readOnly;
+    bytes->release = NULL;
+    bytes->released = false;
+
+    ObjPtr* ptr = wrapNPBytes(vm, bytes);
+    pop(vm);
+    return ptr;
+}
+
+ObjPtr* newNPBytesExternal(VM* vm, uint8_t* data, size_t length, bool readOnly,
+        NPBytesRelease release) {
+    NPBytes* bytes = ALLOCATE(vm, NPBytes, 1);
+    bytes->bytes = data;
+    bytes->length = length;
+    bytes->source = NULL;
+    bytes->offset = 0;
+    bytes->readOnly = readOnly;
+    bytes->release = release;
+    bytes->released = false;
+
+    return wrapNPBytes(vm, bytes);
+}
+
+bool releaseNPBytes(NPBytes* bytes) {
+    if (bytes->released)
+        return false;
+
+    bytes->release(bytes->bytes, bytes->length);
+    bytes->bytes = NULL;
+    bytes->released = true;
+    return true;
+}
+
+uint8_t* npbytesData(NPBytes* bytes) {
+    if (bytes->source != NULL)
+        return ((NPBytes*) bytes->source->ptr)->bytes + bytes->offset;
+    return bytes->bytes;
+}
+
+bool npbytesReleased(NPBytes* bytes) {
+    if (bytes->source != NULL)
+        return ((NPBytes*) bytes->source->ptr)->released;
+    return bytes->released;
+}
+
+bool checkNPBytes(VM* vm, NPBytes* bytes, bool writing) {
+    if (npbytesReleased(bytes)) {
+        runtimeError(vm, "Bytes were released.");
+        return false;
+    }
+    if (writing && bytes->readOnly) {
+        runtimeError(vm, "Bytes are read only.");
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,45 @@
+#ifndef jp_npbytes_h
+#define jp_npbytes_h
+
+#include "../core/extension.h"
+
+extern const char* npbytesPtrOrigin;
+
+#define IS_NPBYTES(val) (IS_PTR(val) && AS_PTR(val)->origin == npbytesPtrOrigin && \
+    AS_PTR(val)->typeEncoding == 0)
+#define AS_NPBYTES(val) ((NPBytes*) AS_PTR(val)->ptr)
+
+// Frees bytes a buffer does not own, such as unmapping a mapped file.
+typedef void (*NPBytesRelease)(uint8_t* bytes, size_t length);
+
+// Buffers never change size, so views of them stay valid. A view holds the buffer
+// it was sliced from and an offset into it instead of bytes of its own.
+typedef struct {
+    uint8_t* bytes;
+    size_t length;
+    ObjPtr* source;
+    size_t offset;
+    // Views of a read only buffer are read only too.
+    bool readOnly;
+    // Set for bytes the buffer does not own.
+    NPBytesRelease release;
+    // Released buffers, and their views, can no longer be read.
+    bool released;
+} NPBytes;
+
+// A buffer of length zeroed bytes.
+ObjPtr* newNPBytes(VM* vm, size_t length);
+// A view of length bytes of the buffer or view source, from offset.
+ObjPtr* newNPBytesView(VM* vm, ObjPtr* source, size_t offset, size_t length);
+// A buffer of bytes owned elsewhere, handed to release when the buffer is freed.
+ObjPtr* newNPBytesExternal(VM* vm, uint8_t* bytes, size_t length, bool readOnly,
+    NPBytesRelease release);
+// Releases the bytes of an external buffer before it is freed. Returns false when
+// they were already released.
+bool releaseNPBytes(NPBytes* bytes);
+uint8_t* npbytesData(NPBytes* bytes);
+bool npbytesReleased(NPBytes* bytes);
+// Reports released bytes, or read only bytes when writing, as a runtime error.
+bool checkNPBytes(VM* vm, NPBytes* bytes, bool writing);
+
+#endif
@@ -0,0 +1,335 @@
+
+#include <stdio.h>
+#include <string.h>
+
+#include "chunklib.h"
+#include "../../compiler/chunk.h"
+#include "../../compiler/dumper.h"
+
+// Chunks are the VM's own, so code, line runs and constants are kept as its compiler
+// keeps them. Buffers are the dumper's memory writers, outside of the collector.
+const char* npchunkPtrOrigin = "nupiz.chunk";
+
+#define PTR_CHUNK 0
+#define PTR_BUFFER 1
+
+#define IS_NPCHUNK(val) (IS_PTR(val) && AS_PTR(val)->origin == npchunkPtrOrigin && \
+    AS_PTR(val)->typeEncoding == PTR_CHUNK)
+#define AS_NPCHUNK(val) ((Chunk*) AS_PTR(val)->ptr)
+
+#define IS_NPBUFFER(val) (IS_PTR(val) && AS_PTR(val)->origin == npchunkPtrOrigin && \
+    AS_PTR(val)->typeEncoding == PTR_BUFFER)
+#define AS_NPBUFFER(val) ((BytecodeWriter*) AS_PTR(val)->ptr)
+
+static void freeNPChunk(VM* vm, ObjPtr* ptr) {
+    Chunk* chunk = (Chunk*) ptr->ptr;
+    freeChunk(vm, chunk);
+
+    FREE(vm, Chunk, chunk);
+    ptr->ptr = NULL;
+}
+
+static void blackenNPChunk(VM* vm, ObjPtr* ptr) {
+    Chunk* chunk = (Chunk*) ptr->ptr;
+    for (int i = 0; i < chunk->constants.count; i++)
+        markValue(vm, chunk->constants.values[i]);
+}
+
+static void relocateNPChunk(VM* vm, ObjPtr* ptr) {
+    Chunk* chunk = (Chunk*) ptr->ptr;
+    for (int i = 0; i < chunk->constants.count; i++)
+        chunk->constants.values[i] = forwardValue(vm, chunk->constants.values[i]);
+    // Objects are indexed by address, so the index is built again on the next constant.
+    freeConstantIndex(vm, chunk);
+}
+
+static void freeNPBuffer(VM* vm, ObjPtr* ptr) {
+    BytecodeWriter* writer = (BytecodeWriter*) ptr->ptr;
+    freeWriter(writer);
+
+    FREE(vm, BytecodeWriter, writer);
+    ptr->ptr = NULL;
+}
+
+static Chunk* expectChunk(VM* vm, int argc, Value* args, int expected) {
+    if (!expectArgs(vm, argc, expected))
+        return NULL;
+    if (!IS_NPCHUNK(args[0])) {
+        runtimeError(vm, "Expected chunk as first argument.");
+        return NULL;
+    }
+    return AS_NPCHUNK(args[0]);
+}
+
+static BytecodeWriter* expectBuffer(VM* vm, int argc, Value* args, int expected) {
+    if (!expectArgs(vm, argc, expected))
+        return NULL;
+    if (!IS_NPBUFFER(args[0])) {
+        runtimeError(vm, "Expected buffer as first argument.");
+        return NULL;
+    }
+    return AS_NPBUFFER(args[0]);
+}
+
+static bool expectNumbers(VM* vm, int argc, Value* args, int from) {
+    for (int i = from; i < argc; i++) {
+        if (!IS_NUMBER(args[i])) {
+            runtimeError(vm, "Expected number as argument %d.", i + 1);
+            return false;
+        }
+    }
+    return true;
+}
+
+static NativeResult chunkNative(VM* vm, int argc, Value* args) {
+    if (!expectArgs(vm, argc, 0))
+        return NATIVE_FAIL;
+
+    Chunk* chunk = ALLOCATE(vm, Chunk, 1);
+    initChunk(chunk);
+
+    ObjPtr* ptr = newPtr(vm, npchunkPtrOrigin, PTR_CHUNK);
+    ptr->ptr = (void*) chunk;
+    ptr->freeFn = freeNPChunk;
+    ptr->blackenFn = blackenNPChunk;
+    ptr->relocateFn = relocateNPChunk;
+
+    return NATIVE_VAL(OBJ_VAL(ptr));
+}
+
+static NativeResult writeNative(VM* vm, int argc, Value* args) {
+    Chunk* chunk = expectChunk(vm, argc, args, 3);
+    if (chunk == NULL || !expectNumbers(vm, argc, args, 1))
+        return NATIVE_FAIL;
+
+    writeChunk(vm, chunk, (uint8_t) AS_NUMBER(args[1]), (int) AS_NUMBER(args[2]));
+    return NATIVE_VAL(NUMBER_VAL(chunk->count));
+}
+
+static NativeResult writeConstantNative(VM* vm, int argc, Value* args) {
+    Chunk* chunk = expectChunk(vm, argc, args, 3);
+    if (chunk == NULL || !expectNumbers(vm, argc, args, 2))
+        return NATIVE_FAIL;
+
+    writeConstant(vm, chunk, args[1], (int) AS_NUMBER(args[2]));
+    return NATIVE_VAL(NUMBER_VAL(chunk->count));
+}
+
+static NativeResult addConstantNative(VM* vm, int argc, Value* args) {
+    Chunk* chunk = expectChunk(vm, argc, args, 2);
+    if (chunk == NULL)
+        return NATIVE_FAIL;
+
+    return NATIVE_VAL(NUMBER_VAL(addConstant(vm, chunk, args[1])));
+}
+
+static NativeResult patchNative(VM* vm, int argc, Value* args) {
+    Chunk* chunk = expectChunk(vm, argc, args, 3);
+    if (chunk == NULL || !expectNumbers(vm, argc, args, 1))
+        return NATIVE_FAIL;
+
+    int idx = (int) AS_NUMBER(args[1]);
+    if (idx < 0 || idx >= chunk->count) {
+        runtimeError(vm, "Index out of range.");
+        return NATIVE_FAIL;
+    }
+    chunk->code[idx] = (uint8_t) AS_NUMBER(args[2]);
+    return NATIVE_OK;
+}
+
+static NativeResult countNative(VM* vm, int argc, Value* args) {
+    Chunk* chunk = expectChunk(vm, argc, args, 1);
+    if (chunk == NULL)
+        return NATIVE_FAIL;
+
+    return NATIVE_VAL(NUMBER_VAL(chunk->count));
+}
+
+static NativeResult constantCountNative(VM* vm, int argc, Value* args) {
+    Chunk* chunk = expectChunk(vm, argc, args, 1);
+    if (chunk == NULL)
+        return NATIVE_FAIL;
+
+    return NATIVE_VAL(NUMBER_VAL(chunk->constants.count));
+}
+
+static NativeResult constantAtNative(VM* vm, int argc, Value* args) {
+    Chunk* chunk = expectChunk(vm, argc, args, 2);
+    if (chunk == NULL || !expectNumbers(vm, argc, args, 1))
+        return NATIVE_FAIL;
+
+    int idx = (int) AS_NUMBER(args[1]);
+    if (idx < 0 || idx >= chunk->constants.count) {
+        runtimeError(vm, "Index out of range.");
+        return NATIVE_FAIL;
+    }
+    return NATIVE_VAL(chunk->constants.values[idx]);
+}
+
+static NativeResult bufferNative(VM* vm, int argc, Value* args) {
+    if (!expectArgs(vm, argc, 0))
+        return NATIVE_FAIL;
+
+    BytecodeWriter* writer = ALLOCATE(vm, BytecodeWriter, 1);
+    initMemoryWriter(writer);
+
+    ObjPtr* ptr = newPtr(vm, npchunkPtrOrigin, PTR_BUFFER);
+    ptr->ptr = (void*) writer;
+    ptr->freeFn = freeNPBuffer;
+
+    return NATIVE_VAL(OBJ_VAL(ptr));
+}
+
+static NativeResult writeByteNative(VM* vm, int argc, Value* args) {
+    BytecodeWriter* writer = expectBuffer(vm, argc, args, 2);
+    if (writer == NULL || !expectNumbers(vm, argc, args, 1))
+        return NATIVE_FAIL;
+
+    writeByte(writer, (uint8_t) AS_NUMBER(args[1]));
+    return NATIVE_OK;
+}
+
+static NativeResult writeIntNative(VM* vm, int argc, Value* args) {
+    BytecodeWriter* writer = expectBuffer(vm, argc, args, 2);
+    if (writer == NULL || !expectNumbers(vm, argc, args, 1))
+        return NATIVE_FAIL;
+
+    writeInt(writer, (uint32_t) (int64_t) AS_NUMBER(args[1]));
+    return NATIVE_OK;
+}
+
+static NativeResult writeDoubleNative(VM* vm, int argc, Value* args) {
+    BytecodeWriter* writer = expectBuffer(vm, argc, args, 2);
+    if (writer == NULL || !expectNumbers(vm, argc, args, 1))
+        return NATIVE_FAIL;
+
+    writeDouble(writer, AS_NUMBER(args[1]));
+    return NATIVE_OK;
+}
+
+static NativeResult writeStringNative(VM* vm, int argc, Value* args) {
+    BytecodeWriter* writer = expectBuffer(vm, argc, args, 2);
+    if (writer == NULL)
+        return NATIVE_FAIL;
+    if (!IS_STRING(args[1])) {
+        runtimeError(vm, "Expected string as second argument.");
+        return NATIVE_FAIL;
+    }
+
+    ObjString* str = AS_STRING(args[1]);
+    writeRaw(writer, str->chars, str->length);
+    return NATIVE_OK;
+}
+
+// Values are written as the legacy format holds constants. Functions are left to the caller.
+static NativeResult writeValueNative(VM* vm, int argc, Value* args) {
+    BytecodeWriter* writer = expectBuffer(vm, argc, args, 2);
+    if (writer == NULL)
+        return NATIVE_FAIL;
+
+    Value val = args[1];
+    if (IS_NULL(val)) {
+        writeByte(writer, DUMP_NULL);
+    } else if (IS_BOOL(val)) {
+        writeByte(writer, DUMP_BOOL);
+        writeByte(writer, AS_BOOL(val) ? 1 : 0);
+    } else if (IS_NUMBER(val)) {
+        writeByte(writer, DUMP_NUMBER);
+        writeDouble(writer, AS_NUMBER(val));
+    } else if (IS_STRING(val)) {
+        ObjString* str = AS_STRING(val);
+        writeByte(writer, DUMP_STRING);
+        writeInt(writer, str->length);
+        writeRaw(writer, str->chars, str->length);
+    } else {
+        return NATIVE_VAL(BOOL_VAL(false));
+    }
+    return NATIVE_VAL(BOOL_VAL(true));
+}
+
+static NativeResult writeLinesNative(VM* vm, int argc, Value* args) {
+    BytecodeWriter* writer = expectBuffer(vm, argc, args, 2);
+    if (writer == NULL)
+        return NATIVE_FAIL;
+    if (!IS_NPCHUNK(args[1])) {
+        runtimeError(vm, "Expected chunk as second argument.");
+        return NATIVE_FAIL;
+    }
+
+    Chunk* chunk = AS_NPCHUNK(args[1]);
+    writeInt(writer, chunk->lines_count);
+    for (int i = 0; i < chunk->lines_count; i++) {
+        writeInt(writer, chunk->lines[i]);
+        writeInt(writer, chunk->lines_run[i]);
+    }
+    return NATIVE_OK;
+}
+
+static NativeResult writeCodeNative(VM* vm, int argc, Value* args) {
+    BytecodeWriter* writer = expectBuffer(vm, argc, args, 2);
+    if (writer == NULL)
+        return NATIVE_FAIL;
+    if (!IS_NPCHUNK(args[1])) {
+        runtimeError(vm, "Expected chunk as second argument.");
+        return NATIVE_FAIL;
+    }
+
+    Chunk* chunk = AS_NPCHUNK(args[1]);
+    writeInt(writer, chunk->count);
+    writeRaw(writer, chunk->code, chunk->count);
+    return NATIVE_OK;
+}
+
+static NativeResult sizeNative(VM* vm, int argc, Value* args) {
+    BytecodeWriter* writer = expectBuffer(vm, argc, args, 1);
+    if (writer == NULL)
+        return NATIVE_FAIL;
+
+    return NATIVE_VAL(NUMBER_VAL(writer->count));
+}
+
+static NativeResult writeFileNative(VM* vm, int argc, Value* args) {
+    BytecodeWriter* writer = expectBuffer(vm, argc, args, 2);
+    if (writer == NULL)
+        return NATIVE_FAIL;
+    if (!IS_STRING(args[1])) {
+        runtimeError(vm, "Expected string as second argument.");
+        return NATIVE_FAIL;
+    }
+    if (writer->failed) {
+        runtimeError(vm, "Buffer ran out of memory.");
+        return NATIVE_FAIL;
+    }
+
+    FILE* fp = fopen(AS_CSTRING(args[1]), "wb");
+    if (fp == NULL)
+        return NATIVE_VAL(BOOL_VAL(false));
+
+    bool written = fwrite(writer->bytes, 1, writer->count, fp) == writer->count;
+    written = fclose(fp) == 0 && written;
+    return NATIVE_VAL(BOOL_VAL(written));
+}
+
+bool importChunkLib(VM* vm, ObjString* lib) {
+    LIBFUNC("chunk", chunkNative);
+    LIBFUNC("write", writeNative);
+    LIBFUNC("writeConstant", writeConstantNative);
+    LIBFUNC("addConstant", addConstantNative);
+    LIBFUNC("patch", patchNative);
+    LIBFUNC("count", countNative);
+    LIBFUNC("constantCount", constantCountNative);
+    LIBFUNC("constantAt", constantAtNative);
+
+    LIBFUNC("buffer", bufferNative);
+    LIBFUNC("writeByte", writeByteNative);
+    LIBFUNC("writeInt", writeIntNative);
+    LIBFUNC("writeDouble", writeDoubleNative);
+    LIBFUNC("writeString", writeStringNative);
+    LIBFUNC("writeValue", writeValueNative);
+    LIBFUNC("writeLines", writeLinesNative);
+    LIBFUNC("writeCode", writeCodeNative);
+    LIBFUNC("size", sizeNative);
+    LIBFUNC("writeFile", writeFileNative);
+
+    return true;
+}
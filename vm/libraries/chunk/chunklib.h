@@ -0,0 +1,8 @@
+#ifndef jp_chunklib_h
+#define jp_chunklib_h
+
+#include "../core/extension.h"
+
+bool importChunkLib(VM* vm, ObjString* lib);
+
+#endif
@@ -86,3 +86,48 @@ bool importLibrary(VM* vm, ObjString* lib) {
     
     return true;
 }
+
+NativeName* listNatives(VM* vm, int* count) {
+    vm->pauseGC++;
+
+    VM* temp = malloc(sizeof(VM));
+    initVM(temp, vm, "natives");
+    temp->pauseGC++;
+
+    NativeName* natives = NULL;
+    int capacity = 0;
+    *count = 0;
+
+    for (int i = 0; i < temp->libraries.capacity; i++) {
+        Entry* entry = &temp->libraries.entries[i];
+        if (entry->key == NULL || !importLibrary(temp, entry->key))
+            continue;
+
+        Table* values = AS_LIBRARY(entry->value)->nspace->values;
+        for (int j = 0; j < values->capacity; j++) {
+            Entry* member = &values->entries[j];
+            if (member->key == NULL || !IS_NATIVE(member->value))
+                continue;
+
+            if (capacity < *count + 1) {
+                int oldCapacity = capacity;
+                capacity = GROW_CAPACITY(oldCapacity);
+                natives = GROW_ARRAY(vm, NativeName, natives, oldCapacity, capacity);
+            }
+            natives[*count].function = AS_NATIVE(member->value);
+            natives[*count].library = entry->key;
+            natives[*count].name = member->key;
+            (*count)++;
+        }
+    }
+
+    natives = GROW_ARRAY(vm, NativeName, natives, capacity, *count);
+
+    freeTable(temp, &temp->libraries);
+    decoupleVM(temp);
+    takeOwnership(vm, temp->objects);
+    free(temp);
+
+    vm->pauseGC--;
+    return natives;
+}
@@ -18,4 +18,15 @@ bool expectArgs(VM* vm, int argc, int expected);
 
 bool importLibrary(VM* vm, ObjString* lib);
 
+typedef struct {
+    NativeFn function;
+    ObjString* library;
+    ObjString* name;
+} NativeName;
+
+// Lists the native functions of every library with their names, importing the
+// libraries into a scratch VM so that vm is left as it is. The names are owned by
+// vm, so are only held while its collector is paused. Freed with FREE_ARRAY.
+NativeName* listNatives(VM* vm, int* count);
+
 #endif
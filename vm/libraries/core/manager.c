@@ -8,6 +8,9 @@
 #include "../vec/veclib.h"
 #include "../maps/maplib.h"
 #include "../math/npmath.h"
+#include "../token/tokenlib.h"
+#include "../chunk/chunklib.h"
+#include "../bytes/byteslib.h"
 
 void defineAllLibraries(VM* vm) {
     defineLibrary(vm, "std", importNPLib);
@@ -15,4 +18,7 @@ void defineAllLibraries(VM* vm) {
     defineLibrary(vm, "npvec", importVecLib);
     defineLibrary(vm, "npmap", importMapLib);
     defineLibrary(vm, "math", importMathLib);
+    defineLibrary(vm, "nptoken", importTokenLib);
+    defineLibrary(vm, "npchunk", importChunkLib);
+    defineLibrary(vm, "npbytes", importBytesLib);
 }
@@ -1,18 +1,58 @@
 #include <string.h>
 
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include "filelib.h"
+#include "../bytes/npbytes.h"
 
 
 typedef struct {
     FILE* fp;
 } NPFile;
 
+// Reads through its own buffer, so lines can be handed out as views of it.
+typedef struct {
+    FILE* fp;
+    // Bytes read ahead, from start up to end of the buffer.
+    ObjPtr* buffer;
+    size_t start;
+    size_t end;
+    bool eof;
+    // View nextLine hands out, pointed at each line in turn.
+    ObjPtr* line;
+} NPReader;
+
+typedef enum {
+    IOFILE_FILE,
+    IOFILE_READER,
+    // A file with a large stdio buffer, flushed when full or asked to.
+    IOFILE_WRITER,
+} IOFileEncoding;
+
+#define READER_BUFFER_SIZE (64 * 1024)
+#define WRITER_BUFFER_SIZE (64 * 1024)
+
 const char* npfilePtrOrigin = "nupiz.iofile";
 
 #define IS_NPFILE(val) (IS_PTR(val) && AS_PTR(val)->origin == npfilePtrOrigin && \
-    AS_PTR(val)->typeEncoding == 0)
+    AS_PTR(val)->typeEncoding == IOFILE_FILE)
 #define AS_NPFILE(val) ((NPFile*) AS_PTR(val)->ptr)
 
+#define IS_NPREADER(val) (IS_PTR(val) && AS_PTR(val)->origin == npfilePtrOrigin && \
+    AS_PTR(val)->typeEncoding == IOFILE_READER)
+#define AS_NPREADER(val) ((NPReader*) AS_PTR(val)->ptr)
+
+#define IS_NPWRITER(val) (IS_PTR(val) && AS_PTR(val)->origin == npfilePtrOrigin && \
+    AS_PTR(val)->typeEncoding == IOFILE_WRITER)
+
+// Readers and writers start with their file, so closeFile takes all three.
+#define IS_ANY_NPFILE(val) (IS_PTR(val) && AS_PTR(val)->origin == npfilePtrOrigin)
+
 static void freeNPFile(VM* vm, ObjPtr* ptr) {
     NPFile* npfile = (NPFile*) ptr->ptr;
     if (npfile->fp != NULL) {
@@ -24,11 +64,11 @@ static void freeNPFile(VM* vm, ObjPtr* ptr) {
     ptr->ptr = NULL;
 }
 
-static ObjPtr* newNPFile(VM* vm, FILE* fp) {
+static ObjPtr* newNPFile(VM* vm, FILE* fp, IOFileEncoding encoding) {
     NPFile* npfile = ALLOCATE(vm, NPFile, 1);
     npfile->fp = fp;
 
-    ObjPtr* ptr = newPtr(vm, npfilePtrOrigin, 0);
+    ObjPtr* ptr = newPtr(vm, npfilePtrOrigin, encoding);
     ptr->ptr = (void*) npfile;
     ptr->freeFn = freeNPFile;
 
@@ -52,7 +92,7 @@ static NativeResult openFileNative(VM* vm, int argc, Value* args) {
         return NATIVE_FAIL;
     }
 
-    return NATIVE_VAL(OBJ_VAL(newNPFile(vm, fp)));
+    return NATIVE_VAL(OBJ_VAL(newNPFile(vm, fp, IOFILE_FILE)));
 }
 
 static NPFile* expectOpenFile(VM* vm, int argc, Value* args, int expected) {
@@ -74,7 +114,7 @@ static NPFile* expectOpenFile(VM* vm, int argc, Value* args, int expected) {
 static NativeResult closeFileNative(VM* vm, int argc, Value* args) {
     if (!expectArgs(vm, argc, 1))
         return NATIVE_FAIL;
-    if (!IS_NPFILE(args[0])) {
+    if (!IS_ANY_NPFILE(args[0])) {
         runtimeError(vm, "Expected file pointer.");
         return NATIVE_FAIL;
     }
@@ -97,14 +137,23 @@ static NativeResult readFileNative(VM* vm, int argc, Value* args) {
     FILE* fp = npfile->fp;
 
     fseek(fp, 0, SEEK_END);
-    size_t len = ftell(fp);
+    long len = ftell(fp);
     rewind(fp);
+    if (len < 0) {
+        runtimeError(vm, "Failed to read file.");
+        return NATIVE_FAIL;
+    }
 
-    char buf[len];
-    fread(buf, sizeof(char), len, fp);
+    // Read straight into the string's own memory, which is kept unless an equal string is interned.
+    char* buf = ALLOCATE(vm, char, len + 1);
+    size_t read = fread(buf, sizeof(char), len, fp);
     rewind(fp);
 
-    ObjString* str = copyString(vm, buf, len);
+    if (read < (size_t) len)
+        buf = GROW_ARRAY(vm, char, buf, len + 1, read + 1);
+    buf[read] = '\0';
+
+    ObjString* str = takeString(vm, buf, read);
     return NATIVE_VAL(OBJ_VAL(str));
 }
 
@@ -202,6 +251,429 @@ static NativeResult writeFileByteNative(VM* vm, int argc, Value* args) {
     return NATIVE_VAL(NUMBER_VAL(written));
 }
 
+static NPBytes* expectBytesArg(VM* vm, Value val, bool writing) {
+    if (!IS_NPBYTES(val)) {
+        runtimeError(vm, "Expected bytes as second argument.");
+        return NULL;
+    }
+    if (!checkNPBytes(vm, AS_NPBYTES(val), writing))
+        return NULL;
+    return AS_NPBYTES(val);
+}
+
+// Reads from where the last read stopped, unlike readFile, so a file can be read
+// through one buffer at a time. Other calls on the file return it to the start.
+static NativeResult readIntoNative(VM* vm, int argc, Value* args) {
+    NPFile* npfile = expectOpenFile(vm, argc, args, 2);
+    if (npfile == NULL)
+        return NATIVE_FAIL;
+    NPBytes* bytes = expectBytesArg(vm, args[1], true);
+    if (bytes == NULL)
+        return NATIVE_FAIL;
+
+    size_t read = fread(npbytesData(bytes), sizeof(uint8_t), bytes->length, npfile->fp);
+    return NATIVE_VAL(NUMBER_VAL(read));
+}
+
+static NativeResult writeFromNative(VM* vm, int argc, Value* args) {
+    NPFile* npfile = expectOpenFile(vm, argc, args, 2);
+    if (npfile == NULL)
+        return NATIVE_FAIL;
+    NPBytes* bytes = expectBytesArg(vm, args[1], false);
+    if (bytes == NULL)
+        return NATIVE_FAIL;
+
+    FILE* fp = npfile->fp;
+
+    fseek(fp, 0, SEEK_END);
+    size_t written = fwrite(npbytesData(bytes), sizeof(uint8_t), bytes->length, fp);
+    rewind(fp);
+
+    return NATIVE_VAL(NUMBER_VAL(written));
+}
+
+#ifndef WIN32
+static void unmapBytes(uint8_t* bytes, size_t length) {
+    munmap(bytes, length);
+}
+#endif
+
+// Pages are read in by the OS as they are touched, and never copied into the heap.
+static NativeResult mapFileNative(VM* vm, int argc, Value* args) {
+    if (!expectArgs(vm, argc, 1))
+        return NATIVE_FAIL;
+    if (!IS_STRING(args[0])) {
+        runtimeError(vm, "Expected string as argument.");
+        return NATIVE_FAIL;
+    }
+    const char* path = AS_STRING(args[0])->chars;
+
+#ifndef WIN32
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        runtimeError(vm, "Failed to open file '%s'.", path);
+        return NATIVE_FAIL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        runtimeError(vm, "Failed to read file '%s'.", path);
+        return NATIVE_FAIL;
+    }
+
+    // Empty files cannot be mapped.
+    if (st.st_size == 0) {
+        close(fd);
+        ObjPtr* ptr = newNPBytes(vm, 0);
+        ((NPBytes*) ptr->ptr)->readOnly = true;
+        return NATIVE_VAL(OBJ_VAL(ptr));
+    }
+
+    size_t length = (size_t) st.st_size;
+    void* bytes = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (bytes == MAP_FAILED) {
+        runtimeError(vm, "Failed to map file '%s'.", path);
+        return NATIVE_FAIL;
+    }
+
+    return NATIVE_VAL(OBJ_VAL(newNPBytesExternal(vm, (uint8_t*) bytes, length, true, unmapBytes)));
+#else
+    // Read the file in whole where it is not mapped.
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) {
+        runtimeError(vm, "Failed to open file '%s'.", path);
+        return NATIVE_FAIL;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    long len = ftell(fp);
+    rewind(fp);
+    if (len < 0) {
+        fclose(fp);
+        runtimeError(vm, "Failed to read file '%s'.", path);
+        return NATIVE_FAIL;
+    }
+
+    ObjPtr* ptr = newNPBytes(vm, len);
+    NPBytes* bytes = (NPBytes*) ptr->ptr;
+    fread(bytes->bytes, sizeof(uint8_t), len, fp);
+    bytes->readOnly = true;
+    fclose(fp);
+
+    return NATIVE_VAL(OBJ_VAL(ptr));
+#endif
+}
+
+static NativeResult unmapNative(VM* vm, int argc, Value* args) {
+    if (!expectArgs(vm, argc, 1))
+        return NATIVE_FAIL;
+    if (!IS_NPBYTES(args[0])) {
+        runtimeError(vm, "Expected bytes as argument.");
+        return NATIVE_FAIL;
+    }
+
+    NPBytes* bytes = AS_NPBYTES(args[0]);
+    if (bytes->source != NULL) {
+        runtimeError(vm, "Expected mapped file, not a view of one.");
+        return NATIVE_FAIL;
+    }
+    // Files read in whole, and empty files, are left to the GC.
+    if (bytes->release == NULL)
+        return NATIVE_VAL(BOOL_VAL(false));
+
+    return NATIVE_VAL(BOOL_VAL(releaseNPBytes(bytes)));
+}
+
+static void freeNPReader(VM* vm, ObjPtr* ptr) {
+    NPReader* reader = (NPReader*) ptr->ptr;
+    if (reader->fp != NULL) {
+        fclose(reader->fp);
+        reader->fp = NULL;
+    }
+
+    FREE(vm, NPReader, reader);
+    ptr->ptr = NULL;
+}
+
+static void blackenNPReader(VM* vm, ObjPtr* ptr) {
+    NPReader* reader = (NPReader*) ptr->ptr;
+    markObject(vm, (Obj*) reader->buffer);
+    markObject(vm, (Obj*) reader->line);
+}
+
+static void relocateNPReader(VM* vm, ObjPtr* ptr) {
+    NPReader* reader = (NPReader*) ptr->ptr;
+    reader->buffer = (ObjPtr*) forwardObject(vm, (Obj*) reader->buffer);
+    reader->line = (ObjPtr*) forwardObject(vm, (Obj*) reader->line);
+}
+
+static FILE* openMode(VM* vm, int argc, Value* args, const char** modes, int modeCount) {
+    if (!expectArgs(vm, argc, 2))
+        return NULL;
+    if (!IS_STRING(args[0]) || !IS_STRING(args[1])) {
+        runtimeError(vm, "Expected strings for arguments.");
+        return NULL;
+    }
+
+    char* mode = AS_CSTRING(args[1]);
+    const char* binaryMode = NULL;
+    for (int i = 0; i < modeCount; i += 2) {
+        if (strcmp(mode, modes[i]) == 0)
+            binaryMode = modes[i + 1];
+    }
+    if (binaryMode == NULL) {
+        runtimeError(vm, "Unsupported mode '%s'.", mode);
+        return NULL;
+    }
+
+    FILE* fp = fopen(AS_CSTRING(args[0]), binaryMode);
+    if (fp == NULL)
+        runtimeError(vm, "Failed to open file.");
+    return fp;
+}
+
+static NativeResult openReaderNative(VM* vm, int argc, Value* args) {
+    const char* modes[] = { "r", "rb" };
+    FILE* fp = openMode(vm, argc, args, modes, 2);
+    if (fp == NULL)
+        return NATIVE_FAIL;
+
+    ObjPtr* buffer = newNPBytes(vm, READER_BUFFER_SIZE);
+    push(vm, OBJ_VAL(buffer));
+    ObjPtr* line = newNPBytesView(vm, buffer, 0, 0);
+    push(vm, OBJ_VAL(line));
+
+    NPReader* reader = ALLOCATE(vm, NPReader, 1);
+    reader->fp = fp;
+    reader->buffer = buffer;
+    reader->start = 0;
+    reader->end = 0;
+    reader->eof = false;
+    reader->line = line;
+
+    ObjPtr* ptr = newPtr(vm, npfilePtrOrigin, IOFILE_READER);
+    ptr->ptr = (void*) reader;
+    ptr->freeFn = freeNPReader;
+    ptr->blackenFn = blackenNPReader;
+    ptr->relocateFn = relocateNPReader;
+    popn(vm, 2);
+
+    return NATIVE_VAL(OBJ_VAL(ptr));
+}
+
+static NPReader* expectOpenReader(VM* vm, int argc, Value* args, int expected) {
+    if (!expectArgs(vm, argc, expected))
+        return NULL;
+    if (!IS_NPREADER(args[0])) {
+        runtimeError(vm, "Expected reader.");
+        return NULL;
+    }
+
+    NPReader* reader = AS_NPREADER(args[0]);
+    if (reader->fp == NULL) {
+        runtimeError(vm, "Reader is closed. Expected open reader.");
+        return NULL;
+    }
+    return reader;
+}
+
+// Moves what is left to the front of the buffer, growing it when it is full, and
+// reads after it. Returns false once the file has nothing more.
+static bool fillReader(VM* vm, NPReader* reader) {
+    if (reader->eof)
+        return false;
+
+    NPBytes* buffer = (NPBytes*) reader->buffer->ptr;
+    size_t left = reader->end - reader->start;
+    if (reader->start > 0) {
+        memmove(buffer->bytes, buffer->bytes + reader->start, left);
+    } else if (left == buffer->length) {
+        ObjPtr* grown = newNPBytes(vm, buffer->length * 2);
+        memcpy(((NPBytes*) grown->ptr)->bytes, buffer->bytes, left);
+        reader->buffer = grown;
+        buffer = (NPBytes*) grown->ptr;
+    }
+    reader->start = 0;
+    reader->end = left;
+
+    size_t read = fread(buffer->bytes + left, sizeof(uint8_t), buffer->length - left, reader->fp);
+    reader->end += read;
+    if (read == 0)
+        reader->eof = true;
+    return read > 0;
+}
+
+// Finds the next line, without its newline, as an offset and length in the buffer.
+static bool nextLine(VM* vm, NPReader* reader, size_t* offset, size_t* length) {
+    size_t searched = 0;
+    for (;;) {
+        uint8_t* bytes = ((NPBytes*) reader->buffer->ptr)->bytes;
+        size_t left = reader->end - reader->start;
+        uint8_t* newline = memchr(bytes + reader->start + searched, '\n', left - searched);
+
+        if (newline != NULL || (!fillReader(vm, reader) && left > 0)) {
+            bytes = ((NPBytes*) reader->buffer->ptr)->bytes;
+            *offset = reader->start;
+            *length = newline != NULL ? (size_t) (newline - (bytes + reader->start)) : left;
+            reader->start += newline != NULL ? *length + 1 : *length;
+
+            if (*length > 0 && bytes[*offset + *length - 1] == '\r')
+                (*length)--;
+            return true;
+        }
+        if (reader->eof)
+            return false;
+        searched = left;
+    }
+}
+
+static NativeResult readLineNative(VM* vm, int argc, Value* args) {
+    NPReader* reader = expectOpenReader(vm, argc, args, 1);
+    if (reader == NULL)
+        return NATIVE_FAIL;
+
+    size_t offset, length;
+    if (!nextLine(vm, reader, &offset, &length))
+        return NATIVE_VAL(NULL_VAL);
+
+    char* bytes = (char*) ((NPBytes*) reader->buffer->ptr)->bytes;
+    return NATIVE_VAL(OBJ_VAL(copyString(vm, bytes + offset, length)));
+}
+
+// The line is a view of the reader's buffer, so no string is made for it. It is the
+// same view every time, and only holds the line until the next read.
+static NativeResult nextLineNative(VM* vm, int argc, Value* args) {
+    NPReader* reader = expectOpenReader(vm, argc, args, 1);
+    if (reader == NULL)
+        return NATIVE_FAIL;
+
+    size_t offset, length;
+    if (!nextLine(vm, reader, &offset, &length))
+        return NATIVE_VAL(NULL_VAL);
+
+    NPBytes* line = (NPBytes*) reader->line->ptr;
+    line->source = reader->buffer;
+    line->offset = offset;
+    line->length = length;
+    return NATIVE_VAL(OBJ_VAL(reader->line));
+}
+
+static NativeResult readChunkNative(VM* vm, int argc, Value* args) {
+    NPReader* reader = expectOpenReader(vm, argc, args, 2);
+    if (reader == NULL)
+        return NATIVE_FAIL;
+    if (!IS_NUMBER(args[1]) || AS_NUMBER(args[1]) < 0) {
+        runtimeError(vm, "Expected length as second argument.");
+        return NATIVE_FAIL;
+    }
+
+    size_t length = (size_t) AS_NUMBER(args[1]);
+    while (reader->end - reader->start < length && fillReader(vm, reader));
+
+    size_t left = reader->end - reader->start;
+    if (left == 0 && length > 0)
+        return NATIVE_VAL(NULL_VAL);
+    if (length > left)
+        length = left;
+
+    char* bytes = (char*) ((NPBytes*) reader->buffer->ptr)->bytes;
+    ObjString* str = copyString(vm, bytes + reader->start, length);
+    reader->start += length;
+    return NATIVE_VAL(OBJ_VAL(str));
+}
+
+static NativeResult openWriterNative(VM* vm, int argc, Value* args) {
+    const char* modes[] = { "w", "wb", "a", "ab" };
+    FILE* fp = openMode(vm, argc, args, modes, 4);
+    if (fp == NULL)
+        return NATIVE_FAIL;
+
+    setvbuf(fp, NULL, _IOFBF, WRITER_BUFFER_SIZE);
+
+    return NATIVE_VAL(OBJ_VAL(newNPFile(vm, fp, IOFILE_WRITER)));
+}
+
+static FILE* expectOpenWriter(VM* vm, int argc, Value* args, int expected) {
+    if (!expectArgs(vm, argc, expected))
+        return NULL;
+    if (!IS_NPWRITER(args[0])) {
+        runtimeError(vm, "Expected writer.");
+        return NULL;
+    }
+
+    FILE* fp = AS_NPFILE(args[0])->fp;
+    if (fp == NULL)
+        runtimeError(vm, "Writer is closed. Expected open writer.");
+    return fp;
+}
+
+// Bytes are written as they are, anything else as a string.
+static bool writeValue(VM* vm, FILE* fp, Value val, size_t* written) {
+    if (IS_NPBYTES(val)) {
+        NPBytes* bytes = AS_NPBYTES(val);
+        if (!checkNPBytes(vm, bytes, false))
+            return false;
+        *written += fwrite(npbytesData(bytes), sizeof(uint8_t), bytes->length, fp);
+        return true;
+    }
+
+    ObjString* str = strValue(vm, val);
+    *written += fwrite(str->chars, sizeof(char), str->length, fp);
+    return true;
+}
+
+static NativeResult writeNative(VM* vm, int argc, Value* args) {
+    FILE* fp = expectOpenWriter(vm, argc, args, 2);
+    if (fp == NULL)
+        return NATIVE_FAIL;
+
+    size_t written = 0;
+    if (!writeValue(vm, fp, args[1], &written))
+        return NATIVE_FAIL;
+    return NATIVE_VAL(NUMBER_VAL(written));
+}
+
+static NativeResult writeLineNative(VM* vm, int argc, Value* args) {
+    FILE* fp = expectOpenWriter(vm, argc, args, 2);
+    if (fp == NULL)
+        return NATIVE_FAIL;
+
+    size_t written = 0;
+    if (!writeValue(vm, fp, args[1], &written))
+        return NATIVE_FAIL;
+    written += fwrite("\n", sizeof(char), 1, fp);
+    return NATIVE_VAL(NUMBER_VAL(written));
+}
+
+static NativeResult writeLinesNative(VM* vm, int argc, Value* args) {
+    FILE* fp = expectOpenWriter(vm, argc, args, 2);
+    if (fp == NULL)
+        return NATIVE_FAIL;
+    if (!IS_LIST(args[1])) {
+        runtimeError(vm, "Expected list as second argument.");
+        return NATIVE_FAIL;
+    }
+
+    ValueArray* lines = &AS_LIST(args[1])->list;
+    size_t written = 0;
+    for (int i = 0; i < lines->count; i++) {
+        if (!writeValue(vm, fp, lines->values[i], &written))
+            return NATIVE_FAIL;
+        written += fwrite("\n", sizeof(char), 1, fp);
+    }
+    return NATIVE_VAL(NUMBER_VAL(written));
+}
+
+static NativeResult flushNative(VM* vm, int argc, Value* args) {
+    FILE* fp = expectOpenWriter(vm, argc, args, 1);
+    if (fp == NULL)
+        return NATIVE_FAIL;
+
+    return NATIVE_VAL(BOOL_VAL(fflush(fp) == 0));
+}
+
 static NativeResult getDirectoryNative(VM* vm, int argc, Value* args) {
     if (!expectArgs(vm, argc, 1))
         return NATIVE_FAIL;
@@ -276,6 +748,22 @@ bool importFileLib(VM* vm, ObjString* lib) {
     LIBFUNC("writeFile", writeFileNative);
     LIBFUNC("writeFileAt", writeFileAtNative);
     LIBFUNC("writeFileByte", writeFileByteNative);
+
+    LIBFUNC("readInto", readIntoNative);
+    LIBFUNC("writeFrom", writeFromNative);
+    LIBFUNC("mapFile", mapFileNative);
+    LIBFUNC("unmap", unmapNative);
+
+    LIBFUNC("openReader", openReaderNative);
+    LIBFUNC("readLine", readLineNative);
+    LIBFUNC("nextLine", nextLineNative);
+    LIBFUNC("readChunk", readChunkNative);
+
+    LIBFUNC("openWriter", openWriterNative);
+    LIBFUNC("write", writeNative);
+    LIBFUNC("writeLine", writeLineNative);
+    LIBFUNC("writeLines", writeLinesNative);
+    LIBFUNC("flush", flushNative);
     
     LIBFUNC("getFileDirectory", getDirectoryNative);
     LIBFUNC("setCWD", changeDirectoryNative);
@@ -1,6 +1,8 @@
 
 #include "npmap.hpp"
 
+const char* npmapPtrOrigin = "nupiz.map";
+
 static void freeNPMap(VM* vm, ObjPtr* ptr) {
     NPMap* npmap = (NPMap*) ptr->ptr;
     delete npmap->map;
@@ -17,14 +19,39 @@ static void blackenNPMap(VM* vm, ObjPtr* ptr) {
     }
 }
 
+// Keys are rewritten in place, which is only safe while their hashes hold.
+// Instances may hash by address, so maps keyed by them are rebuilt on next use.
+static void relocateNPMap(VM* vm, ObjPtr* ptr) {
+    NPMap* npmap = (NPMap*) ptr->ptr;
+    for (auto&[key, val] : *npmap->map) {
+        Value moved = forwardValue(vm, key.val);
+        if (IS_INSTANCE(moved) && AS_OBJ(moved) != AS_OBJ(key.val))
+            npmap->stale = true;
+        const_cast<HashValue&>(key).val = moved;
+        val = forwardValue(vm, val);
+    }
+}
+
+NPMap* validNPMap(NPMap* npmap) {
+    if (npmap->stale) {
+        unordered_valmap* map = new unordered_valmap(npmap->map->begin(), npmap->map->end());
+        delete npmap->map;
+        npmap->map = map;
+        npmap->stale = false;
+    }
+    return npmap;
+}
+
 ObjPtr* newNPMap(VM* vm, unordered_valmap* map) {
     NPMap* npmap = ALLOCATE(vm, NPMap, 1);
     npmap->map = map;
+    npmap->stale = false;
 
     ObjPtr* ptr = newPtr(vm, npmapPtrOrigin, 0);
     ptr->ptr = (void*) npmap;
     ptr->freeFn = freeNPMap;
     ptr->blackenFn = blackenNPMap;
+    ptr->relocateFn = relocateNPMap;
 
     return ptr;
 }
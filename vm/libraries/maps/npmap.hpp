@@ -13,15 +13,17 @@ typedef std::unordered_map<HashValue, Value, ValueHash> unordered_valmap;
 
 typedef struct {
     unordered_valmap* map;
+    bool stale;
 } NPMap;
 
-static const char* npmapPtrOrigin = "nupiz.map";
+extern const char* npmapPtrOrigin;
 
 #define IS_NPMAP(val) (IS_PTR(val) && AS_PTR(val)->origin == npmapPtrOrigin && \
     AS_PTR(val)->typeEncoding == 0)
-#define AS_NPMAP(val) ((NPMap*) AS_PTR(val)->ptr)
+#define AS_NPMAP(val) (validNPMap((NPMap*) AS_PTR(val)->ptr))
 
 ObjPtr* newNPMap(VM* vm, unordered_valmap* map);
+NPMap* validNPMap(NPMap* npmap);
 
 }
 
@@ -5,6 +5,28 @@
 #include <time.h>
 
 #include "nplib.h"
+#include "../bytes/npbytes.h"
+
+// Bytes, such as a mapped file, are read in place as text, and only the parts
+// sliced or split out of them are copied into strings.
+static bool expectText(VM* vm, Value val, const char** chars, size_t* length) {
+    if (IS_STRING(val)) {
+        *chars = AS_STRING(val)->chars;
+        *length = AS_STRING(val)->length;
+        return true;
+    }
+    if (IS_NPBYTES(val)) {
+        NPBytes* bytes = AS_NPBYTES(val);
+        if (!checkNPBytes(vm, bytes, false))
+            return false;
+        *chars = (const char*) npbytesData(bytes);
+        *length = bytes->length;
+        return true;
+    }
+
+    runtimeError(vm, "Expected string or bytes as first argument.");
+    return false;
+}
 
 static NativeResult printNative(VM* vm, int argc, Value* args) {
     for (int i = 0; i < argc; i++) {
@@ -38,6 +60,10 @@ static NativeResult lengthNative(VM* vm, int argc, Value* args) {
         return NATIVE_VAL(NUMBER_VAL(AS_STRING(arg)->length));
     } else if (IS_LIST(arg)) {
         return NATIVE_VAL(NUMBER_VAL(AS_LIST(arg)->list.count));
+    } else if (IS_NPBYTES(arg)) {
+        if (!checkNPBytes(vm, AS_NPBYTES(arg), false))
+            return NATIVE_FAIL;
+        return NATIVE_VAL(NUMBER_VAL(AS_NPBYTES(arg)->length));
     }
 
     runtimeError(vm, "Cannot measure length of given type.", argc);
@@ -180,22 +206,25 @@ static NativeResult asByteNative(VM* vm, int argc, Value* args) {
 static NativeResult sliceNative(VM* vm, int argc, Value* args) {
     if (!expectArgs(vm, argc, 3))
         return NATIVE_FAIL;
-    if (!IS_STRING(args[0]) || !IS_NUMBER(args[1]) || !IS_NUMBER(args[2])) {
+    if (!IS_NUMBER(args[1]) || !IS_NUMBER(args[2])) {
         runtimeError(vm, "Expected (string, int, int) as arguments.");
         return NATIVE_FAIL;
     }
-    ObjString* str = AS_STRING(args[0]);
+    const char* chars;
+    size_t length;
+    if (!expectText(vm, args[0], &chars, &length))
+        return NATIVE_FAIL;
 
-    int start = (int) AS_NUMBER(args[1]);
+    int64_t start = (int64_t) AS_NUMBER(args[1]);
     if (start < 0)
-        start += str->length + 1;
+        start += length + 1;
     
-    int end = (int) AS_NUMBER(args[2]);
+    int64_t end = (int64_t) AS_NUMBER(args[2]);
     if (end < 0)
-        end += str->length + 1;
+        end += length + 1;
 
-    if (end > str->length)
-        end = str->length;
+    if (end > (int64_t) length)
+        end = length;
     if (start > end)
         start = end;
     
@@ -204,7 +233,7 @@ static NativeResult sliceNative(VM* vm, int argc, Value* args) {
         return NATIVE_FAIL;
     }
 
-    return NATIVE_VAL(OBJ_VAL(copyString(vm, str->chars + start, end - start)));
+    return NATIVE_VAL(OBJ_VAL(copyString(vm, chars + start, end - start)));
 }
 
 static NativeResult findNative(VM* vm, int argc, Value* args) {
@@ -227,23 +256,22 @@ static NativeResult findNative(VM* vm, int argc, Value* args) {
 static NativeResult splitNative(VM* vm, int argc, Value* args) {
     if (!expectArgs(vm, argc, 2))
         return NATIVE_FAIL;
-    if (!IS_STRING(args[0])) {
-        runtimeError(vm, "Expected string as first argument.");
+    const char* chars;
+    size_t length;
+    if (!expectText(vm, args[0], &chars, &length))
         return NATIVE_FAIL;
-    }
     if (!IS_STRING(args[1])) {
         runtimeError(vm, "Expected string as second argument.");
         return NATIVE_FAIL;
     }
 
-    ObjString* string = AS_STRING(args[0]);
     ObjString* delim = AS_STRING(args[1]);
 
     ObjList* lst = newList(vm);
     push(vm, OBJ_VAL(lst));
 
-    char* idx = string->chars;
-    for (char* i = string->chars; i <= string->chars + string->length - delim->length; i++) {
+    const char* idx = chars;
+    for (const char* i = chars; i + delim->length <= chars + length; i++) {
         if (memcmp(i, delim->chars, delim->length) == 0) {
             Value str = OBJ_VAL(copyString(vm, idx, i - idx));
             push(vm, str);
@@ -254,7 +282,7 @@ static NativeResult splitNative(VM* vm, int argc, Value* args) {
         }
     }
 
-    Value str = OBJ_VAL(copyString(vm, idx, string->chars + string->length - idx));
+    Value str = OBJ_VAL(copyString(vm, idx, chars + length - idx));
     push(vm, str);
     writeValueArray(vm, &lst->list, str);
     pop(vm);
@@ -320,6 +348,88 @@ static NativeResult parseNumberNative(VM* vm, int argc, Value* args) {
     return NATIVE_VAL(NUMBER_VAL(d));
 }
 
+static void writeStat(VM* vm, ObjNamespace* nspace, const char* name, Value val) {
+    ObjString* key = copyString(vm, name, strlen(name));
+    push(vm, OBJ_VAL(key));
+    writeNamespace(vm, nspace, key, val, true);
+    pop(vm);
+}
+
+static ObjNamespace* newStats(VM* vm, const char* name) {
+    push(vm, OBJ_VAL(copyString(vm, name, strlen(name))));
+    ObjNamespace* nspace = newNamespace(vm, AS_STRING(vm->stackTop[-1]));
+    pop(vm);
+    return nspace;
+}
+
+static NativeResult gcStatsNative(VM* vm, int argc, Value* args) {
+    if (!expectArgs(vm, argc, 0))
+        return NATIVE_FAIL;
+
+    GCStats* stats = &vm->gcStats;
+
+    ObjNamespace* nspace = newStats(vm, "gcStats");
+    push(vm, OBJ_VAL(nspace));
+    writeStat(vm, nspace, "collections", NUMBER_VAL(stats->collections));
+    writeStat(vm, nspace, "lastPause", NUMBER_VAL(stats->lastPause));
+    writeStat(vm, nspace, "totalPause", NUMBER_VAL(stats->totalPause));
+    writeStat(vm, nspace, "lastFreed", NUMBER_VAL(stats->lastFreed));
+    writeStat(vm, nspace, "totalFreed", NUMBER_VAL(stats->totalFreed));
+    writeStat(vm, nspace, "heapSize", NUMBER_VAL(vm->bytesAllocated));
+    writeStat(vm, nspace, "nextGC", NUMBER_VAL(vm->nextGC));
+    writeStat(vm, nspace, "compactions", NUMBER_VAL(stats->compactions));
+
+    ObjNamespace* live = newStats(vm, "live");
+    push(vm, OBJ_VAL(live));
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++)
+        writeStat(vm, live, objTypeName(i), NUMBER_VAL(stats->liveBytes[i]));
+    writeStat(vm, nspace, "live", OBJ_VAL(live));
+    pop(vm);
+
+    pop(vm);
+    return NATIVE_VAL(OBJ_VAL(nspace));
+}
+
+static NativeResult collectNative(VM* vm, int argc, Value* args) {
+    if (!expectArgs(vm, argc, 0))
+        return NATIVE_FAIL;
+
+    size_t before = vm->bytesAllocated;
+    collectGarbage(vm);
+    return NATIVE_VAL(NUMBER_VAL(before - vm->bytesAllocated));
+}
+
+static NativeResult compactNative(VM* vm, int argc, Value* args) {
+    if (!expectArgs(vm, argc, 0))
+        return NATIVE_FAIL;
+
+    if (!canCompactHeap(vm)) {
+        vm->compactPending = true;
+        return NATIVE_VAL(BOOL_VAL(false));
+    }
+
+    compactHeap(vm);
+    return NATIVE_VAL(BOOL_VAL(true));
+}
+
+static NativeResult heapSizeNative(VM* vm, int argc, Value* args) {
+    if (!expectArgs(vm, argc, 0))
+        return NATIVE_FAIL;
+
+    return NATIVE_VAL(NUMBER_VAL(vm->bytesAllocated));
+}
+
+static NativeResult heapSnapshotNative(VM* vm, int argc, Value* args) {
+    if (!expectArgs(vm, argc, 1))
+        return NATIVE_FAIL;
+    if (!IS_STRING(args[0])) {
+        runtimeError(vm, "Expected string as first argument.");
+        return NATIVE_FAIL;
+    }
+
+    return NATIVE_VAL(BOOL_VAL(writeHeapSnapshot(vm, AS_CSTRING(args[0]))));
+}
+
 bool importNPLib(VM* vm, ObjString* lib) {
     LIBFUNC("print", printNative);
     LIBFUNC("println", printlnNative);
@@ -337,6 +447,11 @@ bool importNPLib(VM* vm, ObjString* lib) {
     LIBFUNC("split", splitNative);
     LIBFUNC("repeat", repeatNative);
     LIBFUNC("strtod", parseNumberNative);
+    LIBFUNC("gcStats", gcStatsNative);
+    LIBFUNC("collect", collectNative);
+    LIBFUNC("compact", compactNative);
+    LIBFUNC("heapSize", heapSizeNative);
+    LIBFUNC("heapSnapshot", heapSnapshotNative);
 
     return true;
 }
@@ -0,0 +1,311 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tokenlib.h"
+#include "../../compiler/scanner.h"
+
+// Fields scan writes per token.
+#define TOKEN_RECORD_SIZE 6
+
+// Kinds of token scan reports.
+typedef enum {
+    KIND_IDENTIFIER, KIND_KEYWORD, KIND_NUMBER, KIND_STRING,
+    KIND_LEFT_PAREN, KIND_RIGHT_PAREN,
+    KIND_LEFT_BRACE, KIND_RIGHT_BRACE,
+    KIND_LEFT_BRACKET, KIND_RIGHT_BRACKET,
+    KIND_COMMA, KIND_DOT, KIND_MINUS, KIND_PLUS,
+    KIND_SEMICOLON, KIND_SLASH, KIND_STAR,
+    KIND_COLON, KIND_QUESTION,
+    KIND_BANG, KIND_BANG_EQUAL,
+    KIND_EQUAL, KIND_EQUAL_EQUAL, KIND_BIG_ARROW,
+    KIND_GREATER, KIND_GREATER_EQUAL,
+    KIND_LESS, KIND_LESS_EQUAL,
+    KIND_AND, KIND_OR,
+    KIND_BINARY_AND, KIND_BINARY_OR,
+    KIND_LEFT_ARROW, KIND_RIGHT_ARROW,
+    KIND_PLUS_EQUAL, KIND_MINUS_EQUAL,
+    KIND_STAR_EQUAL, KIND_SLASH_EQUAL,
+    KIND_EOF, KIND_ERROR,
+    KIND_COUNT,
+} TokenKind;
+
+static const char* kindNames[KIND_COUNT] = {
+    [KIND_IDENTIFIER]    = "IDENTIFIER",
+    [KIND_KEYWORD]       = "KEYWORD",
+    [KIND_NUMBER]        = "NUMBER",
+    [KIND_STRING]        = "STRING",
+    [KIND_LEFT_PAREN]    = "LEFT_PAREN",
+    [KIND_RIGHT_PAREN]   = "RIGHT_PAREN",
+    [KIND_LEFT_BRACE]    = "LEFT_BRACE",
+    [KIND_RIGHT_BRACE]   = "RIGHT_BRACE",
+    [KIND_LEFT_BRACKET]  = "LEFT_BRACKET",
+    [KIND_RIGHT_BRACKET] = "RIGHT_BRACKET",
+    [KIND_COMMA]         = "COMMA",
+    [KIND_DOT]           = "DOT",
+    [KIND_MINUS]         = "MINUS",
+    [KIND_PLUS]          = "PLUS",
+    [KIND_SEMICOLON]     = "SEMICOLON",
+    [KIND_SLASH]         = "SLASH",
+    [KIND_STAR]          = "STAR",
+    [KIND_COLON]         = "COLON",
+    [KIND_QUESTION]      = "QUESTION",
+    [KIND_BANG]          = "BANG",
+    [KIND_BANG_EQUAL]    = "BANG_EQUAL",
+    [KIND_EQUAL]         = "EQUAL",
+    [KIND_EQUAL_EQUAL]   = "EQUAL_EQUAL",
+    [KIND_BIG_ARROW]     = "BIG_ARROW",
+    [KIND_GREATER]       = "GREATER",
+    [KIND_GREATER_EQUAL] = "GREATER_EQUAL",
+    [KIND_LESS]          = "LESS",
+    [KIND_LESS_EQUAL]    = "LESS_EQUAL",
+    [KIND_AND]           = "AND",
+    [KIND_OR]            = "OR",
+    [KIND_BINARY_AND]    = "BINARY_AND",
+    [KIND_BINARY_OR]     = "BINARY_OR",
+    [KIND_LEFT_ARROW]    = "LEFT_ARROW",
+    [KIND_RIGHT_ARROW]   = "RIGHT_ARROW",
+    [KIND_PLUS_EQUAL]    = "PLUS_EQUAL",
+    [KIND_MINUS_EQUAL]   = "MINUS_EQUAL",
+    [KIND_STAR_EQUAL]    = "STAR_EQUAL",
+    [KIND_SLASH_EQUAL]   = "SLASH_EQUAL",
+    [KIND_EOF]           = "EOF",
+    [KIND_ERROR]         = "ERROR",
+};
+
+static const TokenKind scannedKinds[] = {
+    [TOKEN_LEFT_PAREN]    = KIND_LEFT_PAREN,
+    [TOKEN_RIGHT_PAREN]   = KIND_RIGHT_PAREN,
+    [TOKEN_LEFT_BRACE]    = KIND_LEFT_BRACE,
+    [TOKEN_RIGHT_BRACE]   = KIND_RIGHT_BRACE,
+    [TOKEN_LEFT_BRACKET]  = KIND_LEFT_BRACKET,
+    [TOKEN_RIGHT_BRACKET] = KIND_RIGHT_BRACKET,
+    [TOKEN_COMMA]         = KIND_COMMA,
+    [TOKEN_DOT]           = KIND_DOT,
+    [TOKEN_MINUS]         = KIND_MINUS,
+    [TOKEN_PLUS]          = KIND_PLUS,
+    [TOKEN_SEMICOLON]     = KIND_SEMICOLON,
+    [TOKEN_SLASH]         = KIND_SLASH,
+    [TOKEN_STAR]          = KIND_STAR,
+    [TOKEN_BANG]          = KIND_BANG,
+    [TOKEN_BANG_EQUAL]    = KIND_BANG_EQUAL,
+    [TOKEN_EQUAL]         = KIND_EQUAL,
+    [TOKEN_EQUAL_EQUAL]   = KIND_EQUAL_EQUAL,
+    [TOKEN_GREATER]       = KIND_GREATER,
+    [TOKEN_GREATER_EQUAL] = KIND_GREATER_EQUAL,
+    [TOKEN_LESS]          = KIND_LESS,
+    [TOKEN_LESS_EQUAL]    = KIND_LESS_EQUAL,
+    [TOKEN_AND]           = KIND_AND,
+    [TOKEN_OR]            = KIND_OR,
+    [TOKEN_BINARY_AND]    = KIND_BINARY_AND,
+    [TOKEN_BINARY_OR]     = KIND_BINARY_OR,
+    [TOKEN_LEFT_ARROW]    = KIND_LEFT_ARROW,
+    [TOKEN_RIGHT_ARROW]   = KIND_RIGHT_ARROW,
+    [TOKEN_PLUS_EQUAL]    = KIND_PLUS_EQUAL,
+    [TOKEN_MINUS_EQUAL]   = KIND_MINUS_EQUAL,
+    [TOKEN_STAR_EQUAL]    = KIND_STAR_EQUAL,
+    [TOKEN_SLASH_EQUAL]   = KIND_SLASH_EQUAL,
+    [TOKEN_IDENTIFIER]    = KIND_IDENTIFIER,
+    [TOKEN_STRING]        = KIND_STRING,
+    [TOKEN_NUMBER]        = KIND_NUMBER,
+    [TOKEN_BREAK]         = KIND_KEYWORD,
+    [TOKEN_BUILD]         = KIND_KEYWORD,
+    [TOKEN_CLASS]         = KIND_KEYWORD,
+    [TOKEN_CONST]         = KIND_KEYWORD,
+    [TOKEN_CONTINUE]      = KIND_KEYWORD,
+    [TOKEN_DEF]           = KIND_KEYWORD,
+    [TOKEN_ELSE]          = KIND_KEYWORD,
+    [TOKEN_FALSE]         = KIND_KEYWORD,
+    [TOKEN_FN]            = KIND_KEYWORD,
+    [TOKEN_FOR]           = KIND_KEYWORD,
+    [TOKEN_FROM]          = KIND_KEYWORD,
+    [TOKEN_IF]            = KIND_KEYWORD,
+    [TOKEN_IMPORT]        = KIND_KEYWORD,
+    [TOKEN_LET]           = KIND_KEYWORD,
+    [TOKEN_PRV]           = KIND_KEYWORD,
+    [TOKEN_PUB]           = KIND_KEYWORD,
+    [TOKEN_NEW]           = KIND_KEYWORD,
+    [TOKEN_NULL]          = KIND_KEYWORD,
+    [TOKEN_RETURN]        = KIND_KEYWORD,
+    [TOKEN_SUPER]         = KIND_KEYWORD,
+    [TOKEN_STATIC]        = KIND_KEYWORD,
+    [TOKEN_THIS]          = KIND_KEYWORD,
+    [TOKEN_TRUE]          = KIND_KEYWORD,
+    [TOKEN_UNPACK]        = KIND_KEYWORD,
+    [TOKEN_VAR]           = KIND_KEYWORD,
+    [TOKEN_WHILE]         = KIND_KEYWORD,
+    [TOKEN_ERROR]         = KIND_ERROR,
+    [TOKEN_EOF]           = KIND_EOF,
+};
+
+// Scans the rest of a string opened with a single quote, which the compiler's
+// scanner does not read.
+static TokenKind quotedString(Scanner* scanner) {
+    while (*scanner->current != '\'' && *scanner->current != '\0') {
+        if (*scanner->current == '\n')
+            scanner->line++;
+        if (*scanner->current == '\\' && scanner->current[1] != '\0')
+            scanner->current++;
+        scanner->current++;
+    }
+
+    if (*scanner->current == '\0')
+        return KIND_ERROR;
+    scanner->current++;
+    return KIND_STRING;
+}
+
+// Reads the token the compiler's scanner reported as an error, as the tokens this
+// library adds to it start with characters it does not know.
+static TokenKind extraToken(Scanner* scanner, Token* tok) {
+    TokenKind kind = KIND_ERROR;
+    if (*scanner->start == ':')
+        kind = KIND_COLON;
+    else if (*scanner->start == '?')
+        kind = KIND_QUESTION;
+    else if (*scanner->start == '\'')
+        kind = quotedString(scanner);
+
+    tok->start = scanner->start;
+    tok->length = (int) (scanner->current - scanner->start);
+    tok->line = scanner->line;
+    return kind;
+}
+
+static ObjString* unescapeString(VM* vm, const char* src, int srcLength) {
+    char* chars = malloc(srcLength + 1);
+    int length = 0;
+    for (int i = 0; i < srcLength; i++) {
+        char c = src[i];
+        if (c == '\\' && i + 1 < srcLength) {
+            c = src[++i];
+            switch (c) {
+                case 'n': c = '\n'; break;
+                case 't': c = '\t'; break;
+                case 'b': c = '\b'; break;
+                case 'r': c = '\r'; break;
+                case 'a': c = '\a'; break;
+                case '?': c = '\?'; break;
+                case 'f': c = '\f'; break;
+                case 'v': c = '\v'; break;
+                case '0': c = '\0'; break;
+            }
+        }
+        chars[length++] = c;
+    }
+
+    ObjString* res = copyString(vm, chars, length);
+    free(chars);
+    return res;
+}
+
+// Returns the text of a token, without the quotes and escapes of a string.
+static ObjString* tokenText(VM* vm, TokenKind kind, Token* tok) {
+    if (kind == KIND_STRING)
+        return unescapeString(vm, tok->start + 1, tok->length - 2);
+    return copyString(vm, tok->start, tok->length);
+}
+
+static bool isKeyword(ObjList* keywords, ObjString* text) {
+    // Strings are interned, so the same text is the same string.
+    for (int i = 0; i < keywords->list.count; i++) {
+        Value keyword = keywords->list.values[i];
+        if (IS_OBJ(keyword) && AS_OBJ(keyword) == (Obj*) text)
+            return true;
+    }
+    return false;
+}
+
+static void writeNumber(VM* vm, ObjList* list, double num) {
+    writeValueArray(vm, &list->list, NUMBER_VAL(num));
+}
+
+static NativeResult unescapeNative(VM* vm, int argc, Value* args) {
+    if (!expectArgs(vm, argc, 1))
+        return NATIVE_FAIL;
+    if (!IS_STRING(args[0])) {
+        runtimeError(vm, "Expected string as argument.");
+        return NATIVE_FAIL;
+    }
+    ObjString* str = AS_STRING(args[0]);
+    return NATIVE_VAL(OBJ_VAL(unescapeString(vm, str->chars, str->length)));
+}
+
+static NativeResult scanNative(VM* vm, int argc, Value* args) {
+    if (!expectArgs(vm, argc, 3))
+        return NATIVE_FAIL;
+    if (!IS_STRING(args[0])) {
+        runtimeError(vm, "Expected string as first argument.");
+        return NATIVE_FAIL;
+    }
+    if (!IS_LIST(args[1]) || AS_LIST(args[1])->list.count < KIND_COUNT) {
+        runtimeError(vm, "Expected list of a type for each kind as second argument.");
+        return NATIVE_FAIL;
+    }
+    if (!IS_LIST(args[2])) {
+        runtimeError(vm, "Expected list as third argument.");
+        return NATIVE_FAIL;
+    }
+    ObjString* src = AS_STRING(args[0]);
+    Value* types = AS_LIST(args[1])->list.values;
+    ObjList* keywords = AS_LIST(args[2]);
+
+    ObjList* list = newList(vm);
+    push(vm, OBJ_VAL(list));
+
+    Scanner scanner;
+    initScanner(&scanner, src->chars);
+    // Start of the line holding the last token, and how far newlines were looked for.
+    const char* lineStart = src->chars;
+    const char* searched = src->chars;
+
+    TokenKind kind = KIND_EOF;
+    do {
+        Token tok = scanToken(&scanner);
+        kind = scannedKinds[tok.type];
+        if (kind == KIND_ERROR)
+            kind = extraToken(&scanner, &tok);
+
+        if (kind == KIND_EQUAL && *scanner.current == '>') {
+            scanner.current++;
+            tok.length++;
+            kind = KIND_BIG_ARROW;
+        }
+        // The scanner stops at a null character, which is not a token.
+        if (kind == KIND_EOF && tok.start < src->chars + src->length)
+            kind = KIND_ERROR;
+
+        for (; searched < tok.start; searched++) {
+            if (*searched == '\n')
+                lineStart = searched + 1;
+        }
+
+        ObjString* text = tokenText(vm, kind, &tok);
+        push(vm, OBJ_VAL(text));
+        if (kind == KIND_IDENTIFIER && isKeyword(keywords, text))
+            kind = KIND_KEYWORD;
+
+        writeValueArray(vm, &list->list, types[kind]);
+        writeValueArray(vm, &list->list, OBJ_VAL(text));
+        pop(vm);
+        writeNumber(vm, list, tok.start - src->chars);
+        writeNumber(vm, list, tok.length);
+        writeNumber(vm, list, tok.line);
+        writeNumber(vm, list, tok.start - lineStart + 1);
+    } while (kind != KIND_EOF && kind != KIND_ERROR);
+
+    pop(vm);
+    return NATIVE_VAL(OBJ_VAL(list));
+}
+
+bool importTokenLib(VM* vm, ObjString* lib) {
+    LIBFUNC("scan", scanNative);
+    LIBFUNC("unescape", unescapeNative);
+
+    LIBCONST("RECORD_SIZE", NUMBER_VAL(TOKEN_RECORD_SIZE));
+    for (int i = 0; i < KIND_COUNT; i++)
+        LIBCONST(kindNames[i], NUMBER_VAL(i));
+
+    return true;
+}
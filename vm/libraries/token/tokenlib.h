@@ -0,0 +1,8 @@
+#ifndef jp_tokenlib_h
+#define jp_tokenlib_h
+
+#include "../core/extension.h"
+
+bool importTokenLib(VM* vm, ObjString* lib);
+
+#endif
@@ -1,6 +1,8 @@
 
 #include "npvec.hpp"
 
+const char* npvecPtrOrigin = "nupiz.vec";
+
 static void freeNPVector(VM* vm, ObjPtr* ptr) {
     NPVector* npvec = (NPVector*) ptr->ptr;
     delete npvec->vec;
@@ -15,6 +17,12 @@ static void blackenNPVector(VM* vm, ObjPtr* ptr) {
         markValue(vm, (*npvec->vec)[i]);
 }
 
+static void relocateNPVector(VM* vm, ObjPtr* ptr) {
+    NPVector* npvec = (NPVector*) ptr->ptr;
+    for (size_t i = 0; i < npvec->vec->size(); i++)
+        (*npvec->vec)[i] = forwardValue(vm, (*npvec->vec)[i]);
+}
+
 ObjPtr* newNPVector(VM* vm, std::vector<Value>* vec) {
     NPVector* npvector = ALLOCATE(vm, NPVector, 1);
     npvector->vec = vec;
@@ -23,6 +31,7 @@ ObjPtr* newNPVector(VM* vm, std::vector<Value>* vec) {
     ptr->ptr = (void*) npvector;
     ptr->freeFn = freeNPVector;
     ptr->blackenFn = blackenNPVector;
+    ptr->relocateFn = relocateNPVector;
 
     return ptr;
 }
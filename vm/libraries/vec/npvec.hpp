@@ -8,7 +8,7 @@ extern "C" {
 
 #include "../core/extension.h"
 
-static const char* npvecPtrOrigin = "nupiz.vec";
+extern const char* npvecPtrOrigin;
 
 }
 
@@ -2,22 +2,34 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifndef WIN32
+#include <sys/stat.h>
+#endif
+
 #include "util/common.h"
+#include "compiler/cache.h"
 #include "compiler/chunk.h"
 #include "util/debug.h"
 #include "vm/vm.h"
 #include "libraries/core/extension.h"
 
 #include "compiler/dumper.h"
+#include "compiler/optimizer.h"
+#include "compiler/scheduler.h"
+#include "compiler/server.h"
 #include "vm/loader.h"
 
 #include "util/memory.h"
 
-#define FLAG_COMPILE        0b00001
-#define FLAG_HELP           0b00010
-#define FLAG_VERSION        0b00100
-#define FLAG_OUT            0b01000
-#define FLAG_RUN            0b10000
+#define FLAG_COMPILE        0b000001
+#define FLAG_HELP           0b000010
+#define FLAG_VERSION        0b000100
+#define FLAG_OUT            0b001000
+#define FLAG_RUN            0b010000
+#define FLAG_OPTIMIZE       0b100000
+#define FLAG_BUNDLE         0b1000000
+#define FLAG_IMAGE          0b10000000
+#define FLAG_SERVE          0b100000000
 #define HAS_FLAG(flags, flag) (((flags) & (flag)) != 0)
 
 #define NPZ_VERSION "1.0.0b"
@@ -39,7 +51,7 @@ static void repl(VM* vm) {
 }
 */
 
-static uint8_t* readFileBytes(char* path, size_t* length) {
+static uint8_t* readFileBytes(const char* path, size_t* length) {
     FILE* fp = fopen(path, "rb");
     if (fp == NULL) {
         fprintf(stderr, "Could not open file \"%s\".\n", path);
@@ -67,65 +79,173 @@ static uint8_t* readFileBytes(char* path, size_t* length) {
     return buf;
 }
 
-static void dumpFile(VM* vm, ObjFunction* func, char* path) {
+// An image can hold an object that cannot be written, which exits, so it is laid
+// out in memory before the file is opened. A failed image leaves the file as it was.
+static void dumpFile(VM* vm, ObjFunction* func, const char* path, bool compress, bool image) {
+    BytecodeWriter buffer;
+    if (image) {
+        initMemoryWriter(&buffer);
+        dumpImage(vm, &buffer, func, compress);
+    }
+
     FILE* fp = fopen(path, "wb");
     if (fp == NULL) {
         fprintf(stderr, "Could not open file \"%s\".\n", path);
         exit(74);
     }
 
-    DumpedBytes* bytes = dumpFunction(vm, func);
+    bool written;
+    if (image) {
+        written = fwrite(buffer.bytes, sizeof(uint8_t), buffer.count, fp) == buffer.count;
+        freeWriter(&buffer);
+    } else {
+        BytecodeWriter writer;
+        initFileWriter(&writer, fp);
+        written = dumpProgram(vm, &writer, func, compress);
+        freeWriter(&writer);
+    }
 
-    if (!dumpBytes(fp, bytes)) {
+    if (!written || fclose(fp) != 0) {
         fprintf(stderr, "Failed to write to file \"%s\".\n", path);
         exit(74);
     }
-    freeDumpedBytes(vm, bytes);
-
-    fclose(fp);
     fp = NULL;
 }
 
-static ObjFunction* loadFile(VM* vm, char* path) {
-    size_t length = 0;
-    uint8_t* src = readFileBytes(path, &length);
-
-    vm->pauseGC++;
-    BytecodeLoader* loader = newLoader(vm, src, length);
+// Binaries that are only run are mapped, so their code is not copied, and their
+// functions are read on first call. One that is rewritten is read in full instead,
+// as its mapping would change under the VM. An image that is run has its heap
+// restored, and returns NULL as there is no script left to run.
+static ObjFunction* readLoader(VM* vm, BytecodeLoader* loader, bool run) {
+    loader->lazy = run;
 
     ObjFunction* func = readBytecode(loader);
-    tableSet(vm, &vm->importedFiles, func->name, OBJ_VAL(vm->nspace));
+    if (run && readImage(loader))
+        func = NULL;
+    else
+        tableSet(vm, &vm->importedFiles, func->name, OBJ_VAL(vm->nspace));
+
+    if (loader->lazy)
+        vm->loader = loader;
+    else
+        freeLoader(vm, loader);
+    return func;
+}
+
+static ObjFunction* loadFile(VM* vm, const char* path, bool run) {
+    vm->pauseGC++;
+    BytecodeLoader* loader = run ? mapLoader(vm, path) : NULL;
+    if (loader == NULL) {
+        size_t length = 0;
+        uint8_t* src = readFileBytes(path, &length);
+        loader = newLoader(vm, src, length);
+    }
 
-    freeLoader(vm, loader);
+    ObjFunction* func = readLoader(vm, loader, run);
     vm->pauseGC--;
 
     return func;
 }
 
-static void compileFile(VM* vm, char* srcPath, char* destPath) {
+// Copies the running executable, without any binary already bundled into it, and
+// appends the binary and a trailer pointing at it.
+static void bundleFile(const char* argv0, const char* binPath, const char* destPath) {
+    char* self = getExecutablePath(argv0);
+    if (self == NULL) {
+        fprintf(stderr, "Could not locate the npz executable.\n");
+        exit(74);
+    }
+
+    size_t vmLength = 0;
+    uint8_t* vmBytes = readFileBytes(self, &vmLength);
+    size_t offset = 0, length = 0;
+    if (findBundle(self, &offset, &length))
+        vmLength = offset;
+    free(self);
+
+    size_t binLength = 0;
+    uint8_t* binBytes = readFileBytes(binPath, &binLength);
+    bool sectioned = binLength >= BYTECODE_MAGIC_LENGTH &&
+        memcmp(binBytes, BYTECODE_MAGIC, BYTECODE_MAGIC_LENGTH) == 0;
+    if (!sectioned && (binLength == 0 || binBytes[0] != DUMP_FUNC)) {
+        fprintf(stderr, "\"%s\" is not a compiled binary.\n", binPath);
+        exit(65);
+    }
+
+    uint8_t trailer[BUNDLE_TRAILER_SIZE];
+    for (int i = 0; i < 8; i++)
+        trailer[i] = ((uint64_t) vmLength >> (i * 8)) & 0xFF;
+    memcpy(trailer + 8, BUNDLE_MAGIC, BUNDLE_MAGIC_LENGTH);
+
+    FILE* fp = fopen(destPath, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Could not open file \"%s\".\n", destPath);
+        exit(74);
+    }
+    if (fwrite(vmBytes, 1, vmLength, fp) != vmLength || fwrite(binBytes, 1, binLength, fp) != binLength ||
+            fwrite(trailer, 1, BUNDLE_TRAILER_SIZE, fp) != BUNDLE_TRAILER_SIZE || fclose(fp) != 0) {
+        fprintf(stderr, "Failed to write to file \"%s\".\n", destPath);
+        exit(74);
+    }
+
+#ifndef WIN32
+    chmod(destPath, 0755);
+#endif
+
+    free(vmBytes);
+    free(binBytes);
+}
+
+static void compileFile(VM* vm, char* srcPath, char* destPath, bool compress, int threads) {
     char* src = readFile(srcPath);
     char* path = getFullPath(srcPath);
 
+    vm->scheduler = startImports(vm, path, src, threads);
     ObjFunction* func = compile(vm, path, src);
+    if (vm->scheduler != NULL) {
+        finishImports(vm->scheduler);
+        vm->scheduler = NULL;
+    }
 
     if (func == NULL)
         exit(65);
 
     vm->pauseGC++;
-    dumpFile(vm, func, destPath);
+    dumpFile(vm, func, destPath, compress, false);
     vm->pauseGC--;
     free(src);
 }
 
-static void runFile(VM* vm, char* path) {
-    ObjFunction* func = loadFile(vm, path);
+static void optimizeFile(VM* vm, const char* srcPath, const char* destPath, bool compress) {
+    ObjFunction* func = loadFile(vm, srcPath, false);
+
+    vm->pauseGC++;
+    optimizeFunction(vm, func);
+    dumpFile(vm, func, destPath, compress, false);
+    vm->pauseGC--;
+}
+
+static void snapshotFile(VM* vm, const char* path) {
+    if (!writeHeapSnapshot(vm, path)) {
+        fprintf(stderr, "Could not write heap snapshot \"%s\".\n", path);
+        exit(74);
+    }
+}
 
+static void runScript(VM* vm, ObjFunction* func) {
     vm->keepTop++;
     InterpretResult res = runFunc(vm, func);
     vm->keepTop--;
 
     if (res == INTERPRET_COMPILE_ERR) exit(65);
     if (res == INTERPRET_RUNTIME_ERR) exit(70);
+}
+
+// Runs the script, leaving it on the stack, then the main function given to std.main.
+// A NULL script is a booted image, whose script has already run.
+static void runProgram(VM* vm, ObjFunction* func) {
+    if (func != NULL)
+        runScript(vm, func);
 
     if (vm->mainFunc != NULL) {
         push(vm, OBJ_VAL(vm->mainFunc));
@@ -144,23 +264,91 @@ static void runFile(VM* vm, char* path) {
 
         callFunc(vm, clos, 1, NULL_VAL);
 
-        res = run(vm);
+        InterpretResult res = run(vm);
 
         if (res == INTERPRET_COMPILE_ERR) exit(65);
         if (res == INTERPRET_RUNTIME_ERR) exit(70);
     }
+
+    if (func != NULL)
+        pop(vm);
+}
+
+static void runFile(VM* vm, char* path) {
+    runProgram(vm, loadFile(vm, path, true));
+}
+
+// Runs the script of the binary from its directory, without calling the main function,
+// and writes the heap it leaves. The binary is read in full, as it may be overwritten.
+static void imageFile(VM* vm, const char* srcPath, const char* destPath, bool compress) {
+    char* cwd = getCurrentWorkingDirectory();
+    changeDirectoryToFile(srcPath);
+    runScript(vm, loadFile(vm, srcPath, false));
+    changeDirectory(cwd);
+    free(cwd);
+
+    // A compaction in the script moves the function, so it is read back from the
+    // closure left on the stack.
+    ObjFunction* func = AS_CLOSURE(vm->stackTop[-1])->function;
+    dumpFile(vm, func, destPath, compress, true);
     pop(vm);
 }
 
+// An executable with a bundled binary runs it, passing every argument to the VM.
+// The working directory is left as it is, and no other file is looked up.
+static bool runBundle(VM* vm, int argc, const char* argv[]) {
+    char* self = getExecutablePath(argv[0]);
+    if (self == NULL)
+        return false;
+
+    vm->pauseGC++;
+    BytecodeLoader* loader = bundleLoader(vm, self);
+    free(self);
+    if (loader == NULL) {
+        vm->pauseGC--;
+        return false;
+    }
+    ObjFunction* func = readLoader(vm, loader, true);
+    vm->pauseGC--;
+
+    vm->argv = argv + 1;
+    vm->argc = argc - 1;
+    runProgram(vm, func);
+
+    const char* snapshotTarget = getenv("NPZ_HEAP_SNAPSHOT");
+    if (snapshotTarget != NULL)
+        snapshotFile(vm, snapshotTarget);
+    return true;
+}
+
 int main(int argc, const char* argv[]) {
     VM* vm = malloc(sizeof(VM));
-    initVM(vm, "main");
+    initVM(vm, NULL, "main");
     vm->isMain = true;
 
+    char* gcOptions = getenv("NPZ_GC");
+    if (gcOptions != NULL && !configureGC(vm, gcOptions))
+        exit(2);
+    if (getenv("NPZ_UNTRUSTED") != NULL)
+        vm->trustTyped = false;
+
+    if (runBundle(vm, argc, argv)) {
+        freeVM(vm);
+        return 0;
+    }
+
     int flags = 0;
+    bool compress = false;
+    int threads = 1;
     char* compileTarget = "";
+    const char* optimizeTarget = "";
+    const char* bundleTarget = "";
+    const char* imageTarget = "";
     char* outputTarget = "";
     char* runTarget = "";
+    const char* serveTarget = "";
+    const char* serverTarget = "";
+    const char* snapshotTarget = getenv("NPZ_HEAP_SNAPSHOT");
 
     if (argc == 1) flags |= FLAG_HELP;
 
@@ -178,8 +366,15 @@ int main(int argc, const char* argv[]) {
 
         vm->argv = argv + 3;
         vm->argc = argc - 3;
+        char* cwd = getCurrentWorkingDirectory();
         changeDirectoryToFile(argv[2]);
         runFile(vm, argv[2]);
+
+        if (snapshotTarget != NULL) {
+            changeDirectory(cwd);
+            snapshotFile(vm, snapshotTarget);
+        }
+        free(cwd);
         return 0;
     }
 
@@ -203,6 +398,30 @@ int main(int argc, const char* argv[]) {
                 }
                 compileTarget = argv[++i];
                 break;
+            case 'p':
+                flags |= FLAG_OPTIMIZE;
+                if (i + 1 >= argc) {
+                    fprintf(stderr, "-p does not preceed a path.\n");
+                    exit(2);
+                }
+                optimizeTarget = argv[++i];
+                break;
+            case 'b':
+                flags |= FLAG_BUNDLE;
+                if (i + 1 >= argc) {
+                    fprintf(stderr, "-b does not preceed a path.\n");
+                    exit(2);
+                }
+                bundleTarget = argv[++i];
+                break;
+            case 'I':
+                flags |= FLAG_IMAGE;
+                if (i + 1 >= argc) {
+                    fprintf(stderr, "-I does not preceed a path.\n");
+                    exit(2);
+                }
+                imageTarget = argv[++i];
+                break;
             case 'o':
                 flags |= FLAG_OUT;
                 if (i + 1 >= argc) {
@@ -219,6 +438,82 @@ int main(int argc, const char* argv[]) {
                 }
                 runTarget = argv[++i];
                 break;
+            case 'g':
+                if (i + 1 >= argc) {
+                    fprintf(stderr, "-g does not preceed GC options.\n");
+                    exit(2);
+                }
+                if (!configureGC(vm, argv[++i]))
+                    exit(2);
+                break;
+            case 'O':
+                if (i + 1 >= argc || argv[i + 1][0] < '0' || argv[i + 1][0] > '9') {
+                    fprintf(stderr, "-O does not preceed an optimization level.\n");
+                    exit(2);
+                }
+                vm->optimize = atoi(argv[++i]);
+                break;
+            case 'j':
+                if (i + 1 >= argc || argv[i + 1][0] < '0' || argv[i + 1][0] > '9') {
+                    fprintf(stderr, "-j does not preceed a thread count.\n");
+                    exit(2);
+                }
+                threads = atoi(argv[++i]);
+                break;
+            case 'u':
+                vm->trustTyped = false;
+                break;
+            case 'z':
+                compress = true;
+                break;
+            case 'i':
+                if (i + 1 >= argc) {
+                    fprintf(stderr, "-i does not preceed a path.\n");
+                    exit(2);
+                }
+                if (vm->inlineReport != NULL)
+                    fclose(vm->inlineReport);
+                vm->inlineReport = fopen(argv[++i], "w");
+                if (vm->inlineReport == NULL) {
+                    fprintf(stderr, "Could not open file \"%s\".\n", argv[i]);
+                    exit(74);
+                }
+                break;
+            case 'm':
+                if (i + 1 >= argc) {
+                    fprintf(stderr, "-m does not preceed a path.\n");
+                    exit(2);
+                }
+                if (vm->moduleCache != NULL)
+                    freeModuleCache(vm->moduleCache);
+                vm->moduleCache = newModuleCache(argv[++i]);
+                if (vm->moduleCache == NULL) {
+                    fprintf(stderr, "Could not open module cache \"%s\".\n", argv[i]);
+                    exit(74);
+                }
+                break;
+            case 'S':
+                flags |= FLAG_SERVE;
+                if (i + 1 >= argc) {
+                    fprintf(stderr, "-S does not preceed a path.\n");
+                    exit(2);
+                }
+                serveTarget = argv[++i];
+                break;
+            case 'C':
+                if (i + 1 >= argc) {
+                    fprintf(stderr, "-C does not preceed a path.\n");
+                    exit(2);
+                }
+                serverTarget = argv[++i];
+                break;
+            case 's':
+                if (i + 1 >= argc) {
+                    fprintf(stderr, "-s does not preceed a path.\n");
+                    exit(2);
+                }
+                snapshotTarget = argv[++i];
+                break;
             case 'h':
                 flags |= FLAG_HELP;
                 break;
@@ -236,6 +531,25 @@ int main(int argc, const char* argv[]) {
         printf("  -r [target]\t\tRuns the target compiled file\n");
         printf("  -R [target]\t\tRuns the target compiled file,\n");
         printf("             \t\tpassing all remaining args to the VM\n");
+        printf("  -g [options]\t\tConfigure the garbage collector with comma separated\n");
+        printf("              \t\tgrowth=[factor], init=[size], max=[size] and log=[path]\n");
+        printf("  -O [level]\t\tOptimization level for compiled source, 0 to 2\n");
+        printf("  -i [target]\t\tWrite the inlining decisions made at -O 2 to target\n");
+        printf("  -j [threads]\t\tCompile imported files on up to this many threads\n");
+        printf("  -m [target]\t\tCache compiled imports in the target directory,\n");
+        printf("             \t\tonly recompiling those that changed\n");
+        printf("  -S [target]\t\tServe compile requests on the target Unix socket\n");
+        printf("  -C [target]\t\tSend -c to the compile server on the target socket,\n");
+        printf("             \t\tcompiling here when none is listening\n");
+        printf("  -p [target]\t\tRewrite the target compiled file with peephole\n");
+        printf("             \t\toptimizations, writing it to the output target\n");
+        printf("  -z\t\tCompress the sections of the output binary\n");
+        printf("  -b [target]\t\tBundle the target compiled file with the VM into\n");
+        printf("             \t\tan executable, writing it to the output target\n");
+        printf("  -I [target]\t\tRun the top level of the target compiled file and write\n");
+        printf("             \t\tthe heap it leaves as an image to the output target\n");
+        printf("  -u\t\tCheck the operands of typed opcodes in loaded binaries\n");
+        printf("  -s [target]\t\tWrite a heap snapshot to target when the program exits\n");
         printf("  -v\t\tPrint version\n");
         printf("  -h\t\tPrint this help message\n");
     }
@@ -245,19 +559,58 @@ int main(int argc, const char* argv[]) {
         printf("nupiz version %s\n", NPZ_VERSION);
     }
 
-    if (HAS_FLAG(flags, FLAG_COMPILE)) {
+    if (HAS_FLAG(flags, FLAG_SERVE)) {
+        if (!serveCompiles(vm, serveTarget, threads))
+            exit(74);
+    } else if (HAS_FLAG(flags, FLAG_COMPILE)) {
         if (!HAS_FLAG(flags, FLAG_OUT)) {
             fprintf(stderr, "No output file specified.\n");
             exit(2);
         }
 
+        // Inlining decisions are written here, so those compiles are not sent.
+        int status = -1;
+        if (serverTarget[0] != '\0' && vm->inlineReport == NULL)
+            status = requestCompile(vm, serverTarget, compileTarget, outputTarget, compress);
+        if (status > 0)
+            exit(status);
+
         changeDirectoryToFile(compileTarget);
-        compileFile(vm, compileTarget, outputTarget);
+        if (status < 0)
+            compileFile(vm, compileTarget, outputTarget, compress, threads);
+    } else if (HAS_FLAG(flags, FLAG_OPTIMIZE)) {
+        if (!HAS_FLAG(flags, FLAG_OUT)) {
+            fprintf(stderr, "No output file specified.\n");
+            exit(2);
+        }
+
+        optimizeFile(vm, optimizeTarget, outputTarget, compress);
+    } else if (HAS_FLAG(flags, FLAG_BUNDLE)) {
+        if (!HAS_FLAG(flags, FLAG_OUT)) {
+            fprintf(stderr, "No output file specified.\n");
+            exit(2);
+        }
+
+        bundleFile(argv[0], bundleTarget, outputTarget);
+    } else if (HAS_FLAG(flags, FLAG_IMAGE)) {
+        if (!HAS_FLAG(flags, FLAG_OUT)) {
+            fprintf(stderr, "No output file specified.\n");
+            exit(2);
+        }
+
+        imageFile(vm, imageTarget, outputTarget, compress);
     }
 
     if (HAS_FLAG(flags, FLAG_RUN)) {
+        char* cwd = getCurrentWorkingDirectory();
         changeDirectoryToFile(runTarget);
         runFile(vm, runTarget);
+
+        if (snapshotTarget != NULL) {
+            changeDirectory(cwd);
+            snapshotFile(vm, snapshotTarget);
+        }
+        free(cwd);
     }
     
     freeVM(vm);
@@ -193,6 +193,31 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         CONST_INST(OP_IMPORT);
         SIMPLE_INST(OP_IMPORT_FILE);
         SIMPLE_INST(OP_UNPACK);
+
+        SIMPLE_INST(OP_ADD_NUM);
+        SIMPLE_INST(OP_SUBTRACT_NUM);
+        SIMPLE_INST(OP_MULTIPLY_NUM);
+        SIMPLE_INST(OP_DIVIDE_NUM);
+        SIMPLE_INST(OP_GREATER_NUM);
+        SIMPLE_INST(OP_GREATER_EQUAL_NUM);
+        SIMPLE_INST(OP_LESS_NUM);
+        SIMPLE_INST(OP_LESS_EQUAL_NUM);
+        SIMPLE_INST(OP_ADD_STRING);
+        SIMPLE_INST(OP_ADD_LIST);
+        SIMPLE_INST(OP_GET_INDEX_LIST);
+
+        case OP_INLINE: {
+            uint8_t argc = chunk->code[offset + 1];
+            uint8_t constant = chunk->code[offset + 2];
+            uint16_t jump = (uint16_t) (chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+            printf("%-16s (%d args) %4d -> %d '", "OP_INLINE", argc, offset, offset + 5 + jump);
+            printValue(chunk->constants.values[constant]);
+            printf("'\n");
+            return offset + 5;
+        }
+        BYTE_INST(OP_GET_STACK);
+        BYTE_INST(OP_SET_STACK);
+        BYTE_INST(OP_END_INLINE);
         
         default:
             printf("Unknown opcode %d\n", instruction);
@@ -0,0 +1,157 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 0xFFFF
+#define LZ_HASH_BITS 16
+// Matches are not started in the last bytes, which are always written as literals.
+#define LZ_TAIL 5
+
+static uint32_t read32(const uint8_t* bytes) {
+    uint32_t word;
+    memcpy(&word, bytes, sizeof(uint32_t));
+    return word;
+}
+
+static uint32_t hashSequence(uint32_t seq) {
+    return (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+size_t lzBound(size_t length) {
+    return length + length / 255 + 16;
+}
+
+static bool writeLength(uint8_t* dst, size_t capacity, size_t* out, size_t length) {
+    for (; length >= 255; length -= 255) {
+        if (*out >= capacity)
+            return false;
+        dst[(*out)++] = 255;
+    }
+    if (*out >= capacity)
+        return false;
+    dst[(*out)++] = length;
+    return true;
+}
+
+// A match of 0 ends the block after the literals.
+static bool writeSequence(uint8_t* dst, size_t capacity, size_t* out,
+        const uint8_t* literals, size_t literalLength, size_t offset, size_t match) {
+    size_t matchLength = match == 0 ? 0 : match - LZ_MIN_MATCH;
+
+    if (*out >= capacity)
+        return false;
+    dst[(*out)++] = (literalLength < 15 ? literalLength : 15) << 4 | (matchLength < 15 ? matchLength : 15);
+    if (literalLength >= 15 && !writeLength(dst, capacity, out, literalLength - 15))
+        return false;
+
+    if (literalLength > capacity - *out)
+        return false;
+    memcpy(dst + *out, literals, literalLength);
+    *out += literalLength;
+
+    if (match == 0)
+        return true;
+
+    if (capacity - *out < 2)
+        return false;
+    dst[(*out)++] = offset & 0xFF;
+    dst[(*out)++] = (offset >> 8) & 0xFF;
+    return matchLength < 15 || writeLength(dst, capacity, out, matchLength - 15);
+}
+
+size_t lzCompress(const uint8_t* src, size_t length, uint8_t* dst, size_t capacity) {
+    uint32_t* table = calloc((size_t) 1 << LZ_HASH_BITS, sizeof(uint32_t));
+    if (table == NULL)
+        return 0;
+
+    size_t out = 0;
+    size_t anchor = 0;
+    size_t limit = length > LZ_TAIL + LZ_MIN_MATCH ? length - LZ_TAIL : 0;
+    bool fits = true;
+
+    for (size_t pos = 0; fits && pos < limit;) {
+        uint32_t seq = read32(src + pos);
+        uint32_t hash = hashSequence(seq);
+        size_t ref = table[hash];
+        table[hash] = (uint32_t) pos;
+
+        if (ref >= pos || pos - ref > LZ_MAX_OFFSET || read32(src + ref) != seq) {
+            pos++;
+            continue;
+        }
+
+        size_t match = LZ_MIN_MATCH;
+        while (pos + match < length && src[ref + match] == src[pos + match])
+            match++;
+
+        fits = writeSequence(dst, capacity, &out, src + anchor, pos - anchor, pos - ref, match);
+        pos += match;
+        anchor = pos;
+    }
+
+    if (fits)
+        fits = writeSequence(dst, capacity, &out, src + anchor, length - anchor, 0, 0);
+
+    free(table);
+    return fits ? out : 0;
+}
+
+static bool readLength(const uint8_t* src, size_t length, size_t* in, size_t* value) {
+    uint8_t byte;
+    do {
+        if (*in >= length)
+            return false;
+        byte = src[(*in)++];
+        *value += byte;
+    } while (byte == 255);
+    return true;
+}
+
+bool lzDecompress(const uint8_t* src, size_t length, uint8_t* dst, size_t rawLength) {
+    size_t in = 0;
+    size_t out = 0;
+
+    while (in < length) {
+        uint8_t token = src[in++];
+
+        size_t literalLength = token >> 4;
+        if (literalLength == 15 && !readLength(src, length, &in, &literalLength))
+            return false;
+        if (literalLength > length - in || literalLength > rawLength - out)
+            return false;
+        memcpy(dst + out, src + in, literalLength);
+        in += literalLength;
+        out += literalLength;
+
+        if (in == length)
+            break;
+
+        if (length - in < 2)
+            return false;
+        size_t offset = src[in] | (size_t) src[in + 1] << 8;
+        in += 2;
+
+        size_t match = token & 0x0F;
+        if (match == 15 && !readLength(src, length, &in, &match))
+            return false;
+        match += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > out || match > rawLength - out)
+            return false;
+
+        // Matches can overlap what they write, repeating the last offset bytes. The
+        // repeated run doubles with each copy, so no copy overlaps its source.
+        uint8_t* to = dst + out;
+        for (size_t left = match, span = offset; left > 0; span *= 2) {
+            size_t n = left < span ? left : span;
+            memcpy(to, to - span, n);
+            to += n;
+            left -= n;
+        }
+        out += match;
+    }
+
+    return out == rawLength;
+}
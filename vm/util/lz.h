@@ -0,0 +1,19 @@
+
+#ifndef jp_lz_h
+#define jp_lz_h
+
+#include "common.h"
+
+// A byte oriented LZ77 codec in the style of LZ4. Each sequence is a token holding
+// the literal and match lengths in its high and low nibble, extended by bytes of
+// 255 when the nibble is 15, the literals, then a two byte offset back into the
+// output and the match extension. The last sequence only holds literals.
+
+// Largest output lzCompress can produce for length bytes of input.
+size_t lzBound(size_t length);
+// Compresses src into dst, returning the compressed length, or 0 when it does not fit.
+size_t lzCompress(const uint8_t* src, size_t length, uint8_t* dst, size_t capacity);
+// Decompresses src into exactly rawLength bytes of dst, returning false on malformed input.
+bool lzDecompress(const uint8_t* src, size_t length, uint8_t* dst, size_t rawLength);
+
+#endif
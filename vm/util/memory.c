@@ -3,11 +3,38 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 #include "../vm/object.h"
+#include "../vm/loader.h"
 #include "memory.h"
 
 #define GC_HEAP_GROWTH_FACTOR 2
+#define GC_INITIAL_HEAP (1024 * 1024)
+
+static const char* objTypeNames[OBJ_TYPE_COUNT] = {
+    "string", "function", "native", "closure", "upvalue", "class", "instance",
+    "bound_method", "list", "namespace", "library", "attribute", "ptr",
+};
+
+// Milliseconds of wall time. Pauses are timed with this, as clock() counts the CPU
+// time of every thread in the process.
+static double monotonicMillis() {
+#ifdef WIN32
+    LARGE_INTEGER count, freq;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return (double) count.QuadPart * 1000 / freq.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+#endif
+}
 
 void* reallocate(VM* vm, void* ptr, size_t oldSize, size_t newSize) {
     vm->bytesAllocated += newSize - oldSize;
@@ -17,8 +44,22 @@ void* reallocate(VM* vm, void* ptr, size_t oldSize, size_t newSize) {
             collectGarbage(vm);
         #endif
 
+        bool collected = false;
         if (vm->bytesAllocated > vm->nextGC) {
             collectGarbage(vm);
+            collected = true;
+        }
+
+        // Garbage only counts against the limit while the collector is paused,
+        // so the limit is checked once a collection has had a chance to run.
+        if (vm->gcConfig.maxHeap != 0 && vm->bytesAllocated > vm->gcConfig.maxHeap &&
+                vm->pauseGC == 0) {
+            if (!collected)
+                collectGarbage(vm);
+            if (vm->bytesAllocated > vm->gcConfig.maxHeap) {
+                fprintf(stderr, "Heap limit of %zu bytes exceeded.\n", vm->gcConfig.maxHeap);
+                exit(1);
+            }
         }
     }
 
@@ -34,6 +75,56 @@ void* reallocate(VM* vm, void* ptr, size_t oldSize, size_t newSize) {
 
 
 
+static size_t tableSize(Table* tb) {
+    return tb == NULL ? 0 : TABLE_BYTES(tb->capacity);
+}
+
+size_t objectSize(Obj* obj) {
+    switch (obj->type) {
+        case OBJ_STRING:
+            return sizeof(ObjString) + ((ObjString*) obj)->length + 1;
+        case OBJ_FUNCTION: {
+            Chunk* chunk = &((ObjFunction*) obj)->chunk;
+            return sizeof(ObjFunction) + chunk->capacity + 
+                sizeof(int) * 2 * chunk->lines_capacity + 
+                sizeof(Value) * chunk->constants.capacity;
+        }
+        case OBJ_NATIVE:
+            return sizeof(ObjNative);
+        case OBJ_CLOSURE:
+            return sizeof(ObjClosure) + sizeof(ObjUpvalue*) * ((ObjClosure*) obj)->upvalueCount;
+        case OBJ_UPVALUE:
+            return sizeof(ObjUpvalue);
+        case OBJ_CLASS: {
+            ObjClass* clazz = (ObjClass*) obj;
+            return sizeof(ObjClass) + tableSize(&clazz->methods) + 
+                tableSize(&clazz->fields) + tableSize(&clazz->staticFields);
+        }
+        case OBJ_INSTANCE:
+            return sizeof(ObjInstance) + tableSize(&((ObjInstance*) obj)->fields);
+        case OBJ_BOUND_METHOD:
+            return sizeof(ObjBoundMethod);
+        case OBJ_LIST:
+            return sizeof(ObjList) + sizeof(Value) * ((ObjList*) obj)->list.capacity;
+        case OBJ_NAMESPACE: {
+            ObjNamespace* nspace = (ObjNamespace*) obj;
+            return sizeof(ObjNamespace) + sizeof(Table) * 2 + 
+                tableSize(nspace->values) + tableSize(nspace->publics);
+        }
+        case OBJ_LIBRARY:
+            return sizeof(ObjLibrary);
+        case OBJ_ATTRIBUTE:
+            return sizeof(ObjAttribute);
+        case OBJ_PTR:
+            return sizeof(ObjPtr);
+    }
+    return 0;
+}
+
+const char* objTypeName(ObjType type) {
+    return objTypeNames[type];
+}
+
 void freeObject(VM* vm, Obj* obj) {
     #ifdef DEBUG_LOG_GC
         printObject(OBJ_VAL(obj));
@@ -55,6 +146,8 @@ void freeObject(VM* vm, Obj* obj) {
         case OBJ_CLASS: {
             ObjClass* clazz = (ObjClass*) obj;
             freeTable(vm, &clazz->methods);
+            freeTable(vm, &clazz->fields);
+            freeTable(vm, &clazz->staticFields);
             FREE(vm, ObjClass, obj);
             break;
         }
@@ -99,6 +192,8 @@ void freeObject(VM* vm, Obj* obj) {
             ObjNamespace* nspace = (ObjNamespace*) obj;
             freeTable(vm, nspace->values);
             freeTable(vm, nspace->publics);
+            FREE(vm, Table, nspace->values);
+            FREE(vm, Table, nspace->publics);
             FREE(vm, ObjNamespace, obj);
             break;
         }
@@ -133,9 +228,20 @@ void freeObjects(VM* vm) {
     free(vm->grayStack);
 }
 
+#define SNAPSHOT_ROOT(vm, name) if ((vm)->snapshot != NULL) (vm)->snapshot->root = (name)
+
+static void recordReference(HeapSnapshot* snapshot, Obj* obj) {
+    if (snapshot->parent == NULL)
+        fprintf(snapshot->fp, "r %s %p\n", snapshot->root, (void*) obj);
+    else
+        fprintf(snapshot->fp, "e %p %p\n", (void*) snapshot->parent, (void*) obj);
+}
+
 void markObject(VM* vm, Obj* obj) {
     if (obj == NULL)
         return;
+    if (vm->snapshot != NULL)
+        recordReference(vm->snapshot, obj);
     if (obj->isMarked)
         return;
     
@@ -180,26 +286,37 @@ static void markArray(VM* vm, ValueArray* arr) {
 }
 
 static void markRoots(VM* vm) {
+    SNAPSHOT_ROOT(vm, "stack");
     for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
         markValue(vm, *slot);
     }
 
+    SNAPSHOT_ROOT(vm, "frames");
     for (int i = 0; i < vm->frameCount; i++) {
         markObject(vm, (Obj*) vm->frames[i].closure);
         markValue(vm, vm->frames[i].bound);
     }
 
+    SNAPSHOT_ROOT(vm, "upvalues");
     for (ObjUpvalue* upv = vm->openUpvalues; upv != NULL; upv = upv->next) {
         markObject(vm, (Obj*) upv);
     }
 
+    SNAPSHOT_ROOT(vm, "globals");
     markTable(vm, &vm->globals);
+    SNAPSHOT_ROOT(vm, "libraries");
     markTable(vm, &vm->libraries);
+    SNAPSHOT_ROOT(vm, "main");
     markObject(vm, (Obj*) vm->mainFunc);
+    if (vm->loader != NULL)
+        markLoader(vm, vm->loader);
 
+    SNAPSHOT_ROOT(vm, "imports");
     markTable(vm, &vm->importedFiles);
+    markTable(vm, &vm->fixedNames);
     markObject(vm, (Obj*) vm->nspace);
     
+    SNAPSHOT_ROOT(vm, "compiler");
     markCompilerRoots(vm, vm->compiler);
 }
 
@@ -301,16 +418,24 @@ static void blackenObject(VM* vm, Obj* obj) {
 static void traceReferences(VM* vm) {
     while (vm->grayCount > 0) {
         Obj* obj = vm->grayStack[--vm->grayCount];
+        if (vm->snapshot != NULL)
+            vm->snapshot->parent = obj;
         blackenObject(vm, obj);
     }
 }
 
 static void sweep(VM* vm) {
+    GCStats* stats = &vm->gcStats;
+    memset(stats->liveBytes, 0, sizeof(stats->liveBytes));
+    memset(stats->liveObjects, 0, sizeof(stats->liveObjects));
+
     Obj* prev = NULL;
     Obj* curr = vm->objects;
     while (curr != NULL) {
         if (curr->isMarked) {
             curr->isMarked = false;
+            stats->liveBytes[curr->type] += objectSize(curr);
+            stats->liveObjects[curr->type]++;
             prev = curr;
             curr = curr->next;
         } else {
@@ -322,30 +447,70 @@ static void sweep(VM* vm) {
                 vm->objects = curr;
             }
 
+            // The intern table is weak. Strings leave it as they are freed, since
+            // a shared table also holds strings belonging to other VMs.
+            if (del->type == OBJ_STRING)
+                tableDelete(vm->interned, (ObjString*) del);
             freeObject(vm, del);
         }
     }
 }
 
+static void writeGCLog(VM* vm, size_t before) {
+    FILE* log = vm->gcConfig.log;
+    GCStats* stats = &vm->gcStats;
+
+    fprintf(log, "{\"vm\":\"");
+    const char* name = vm->nspace == NULL ? "" : vm->nspace->name->chars;
+    for (const char* c = name; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\')
+            fputc('\\', log);
+        fputc(*c, log);
+    }
+
+    fprintf(log, "\",\"gc\":%d,\"pause_ms\":%.3f,\"before\":%zu,\"after\":%zu,"
+        "\"freed\":%zu,\"next\":%zu,\"live\":{", stats->collections, stats->lastPause, 
+        before, vm->bytesAllocated, stats->lastFreed, vm->nextGC);
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+        fprintf(log, "%s\"%s\":[%d,%zu]", i == 0 ? "" : ",", objTypeNames[i], 
+            stats->liveObjects[i], stats->liveBytes[i]);
+    }
+    fprintf(log, "}}\n");
+}
+
 void collectGarbage(VM* vm) {
     if (vm->pauseGC > 0)
         return;
     
-    #ifdef DEBUG_LOG_GC
-        //printf("-- gc begin\n");
-
-        size_t before = vm->bytesAllocated;
-    #endif
+    double start = monotonicMillis();
+    size_t before = vm->bytesAllocated;
 
     markRoots(vm);
     traceReferences(vm);
-    tableRemoveWhite(&vm->strings);
     sweep(vm);
 
-    vm->nextGC = vm->bytesAllocated * GC_HEAP_GROWTH_FACTOR;
+    size_t next = (size_t) (vm->bytesAllocated * vm->gcConfig.growthFactor);
+    if (vm->gcConfig.maxHeap != 0 && next > vm->gcConfig.maxHeap)
+        next = vm->gcConfig.maxHeap;
+    vm->nextGC = next;
+
+    GCStats* stats = &vm->gcStats;
+    stats->collections++;
+    stats->lastPause = monotonicMillis() - start;
+    stats->totalPause += stats->lastPause;
+    stats->lastFreed = before - vm->bytesAllocated;
+    stats->totalFreed += stats->lastFreed;
+    stats->freedSinceCompact += stats->lastFreed;
+
+    if (vm->gcConfig.compactThreshold > 0 && stats->freedSinceCompact > 0 && 
+            (double) stats->freedSinceCompact / (stats->freedSinceCompact + vm->bytesAllocated) >= 
+            vm->gcConfig.compactThreshold)
+        vm->compactPending = true;
+
+    if (vm->gcConfig.log != NULL)
+        writeGCLog(vm, before);
 
     #ifdef DEBUG_LOG_GC
-        //printf("-- gc end\n");
         if (before != vm->bytesAllocated)
         printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
             before - vm->bytesAllocated, before, vm->bytesAllocated, vm->nextGC);
@@ -353,6 +518,533 @@ void collectGarbage(VM* vm) {
     
 }
 
+static void writeSnapshotLabel(FILE* fp, Obj* obj) {
+    ObjString* name = NULL;
+    switch (obj->type) {
+        case OBJ_STRING: {
+            ObjString* string = (ObjString*) obj;
+            fputc('"', fp);
+            for (int i = 0; i < string->length && i < 40; i++) {
+                char c = string->chars[i];
+                fputc(c >= ' ' && c <= '~' ? c : '?', fp);
+            }
+            if (string->length > 40)
+                fputs("...", fp);
+            fputc('"', fp);
+            return;
+        }
+        case OBJ_FUNCTION:
+            name = ((ObjFunction*) obj)->name;
+            break;
+        case OBJ_CLOSURE:
+            name = ((ObjClosure*) obj)->function->name;
+            break;
+        case OBJ_BOUND_METHOD:
+            name = ((ObjBoundMethod*) obj)->method->function->name;
+            break;
+        case OBJ_CLASS:
+            name = ((ObjClass*) obj)->name;
+            break;
+        case OBJ_INSTANCE:
+            name = ((ObjInstance*) obj)->clazz->name;
+            break;
+        case OBJ_NAMESPACE:
+            name = ((ObjNamespace*) obj)->name;
+            break;
+        case OBJ_LIBRARY:
+            name = ((ObjLibrary*) obj)->name;
+            break;
+        case OBJ_PTR:
+            fputs(((ObjPtr*) obj)->origin, fp);
+            return;
+        default:
+            break;
+    }
+    fputs(name == NULL ? "-" : name->chars, fp);
+}
+
+bool writeHeapSnapshot(VM* vm, const char* path) {
+    FILE* fp = fopen(path, "w");
+    if (fp == NULL)
+        return false;
+
+    HeapSnapshot snapshot = { fp, NULL, "" };
+    fprintf(fp, "npz-heap 1\n");
+
+    vm->snapshot = &snapshot;
+    markRoots(vm);
+    traceReferences(vm);
+    vm->snapshot = NULL;
+
+    for (Obj* obj = vm->objects; obj != NULL; obj = obj->next) {
+        if (!obj->isMarked)
+            continue;
+        obj->isMarked = false;
+
+        fprintf(fp, "n %p %s %zu ", (void*) obj, objTypeNames[obj->type], objectSize(obj));
+        writeSnapshotLabel(fp, obj);
+        fputc('\n', fp);
+    }
+
+    fclose(fp);
+    return true;
+}
+
+typedef struct {
+    Obj* from;
+    Obj* to;
+} Forward;
+
+typedef struct {
+    Forward* entries;
+    size_t capacity;
+} ForwardTable;
+
+// Only one heap is compacted at a time, so forwarding addresses live here
+// while references are rewritten.
+static ForwardTable* forwarding = NULL;
+
+#define MAX_OBJ_BUFFERS 3
+#define STAGE_ALIGN(size) (((size) + 7) & ~((size_t) 7))
+
+static size_t hashAddress(Obj* obj, size_t capacity) {
+    return (((uintptr_t) obj >> 3) * 11400714819323198485ull) & (capacity - 1);
+}
+
+static void addForward(ForwardTable* tb, Obj* from, Obj* to) {
+    size_t idx = hashAddress(from, tb->capacity);
+    while (tb->entries[idx].from != NULL)
+        idx = (idx + 1) & (tb->capacity - 1);
+    tb->entries[idx].from = from;
+    tb->entries[idx].to = to;
+}
+
+Obj* forwardObject(VM* vm, Obj* obj) {
+    if (obj == NULL || forwarding == NULL)
+        return obj;
+
+    size_t idx = hashAddress(obj, forwarding->capacity);
+    while (forwarding->entries[idx].from != NULL) {
+        if (forwarding->entries[idx].from == obj)
+            return forwarding->entries[idx].to;
+        idx = (idx + 1) & (forwarding->capacity - 1);
+    }
+    return obj;
+}
+
+Value forwardValue(VM* vm, Value val) {
+    if (IS_OBJ(val))
+        return OBJ_VAL(forwardObject(vm, AS_OBJ(val)));
+    return val;
+}
+
+#define FORWARD(vm, type, field) ((field) = (type) forwardObject(vm, (Obj*) (field)))
+#define FORWARD_VALUE(vm, field) ((field) = forwardValue(vm, field))
+
+static void forwardTable(VM* vm, Table* tb) {
+    if (tb == NULL)
+        return;
+    
+    for (int i = 0; i < tb->capacity; i++) {
+        Entry* entry = &tb->entries[i];
+        FORWARD(vm, ObjString*, entry->key);
+        FORWARD_VALUE(vm, entry->value);
+    }
+}
+
+static void forwardArray(VM* vm, ValueArray* arr) {
+    for (int i = 0; i < arr->count; i++)
+        FORWARD_VALUE(vm, arr->values[i]);
+}
+
+static size_t objectStructSize(ObjType type) {
+    switch (type) {
+        case OBJ_STRING: return sizeof(ObjString);
+        case OBJ_FUNCTION: return sizeof(ObjFunction);
+        case OBJ_NATIVE: return sizeof(ObjNative);
+        case OBJ_CLOSURE: return sizeof(ObjClosure);
+        case OBJ_UPVALUE: return sizeof(ObjUpvalue);
+        case OBJ_CLASS: return sizeof(ObjClass);
+        case OBJ_INSTANCE: return sizeof(ObjInstance);
+        case OBJ_BOUND_METHOD: return sizeof(ObjBoundMethod);
+        case OBJ_LIST: return sizeof(ObjList);
+        case OBJ_NAMESPACE: return sizeof(ObjNamespace);
+        case OBJ_LIBRARY: return sizeof(ObjLibrary);
+        case OBJ_ATTRIBUTE: return sizeof(ObjAttribute);
+        case OBJ_PTR: return sizeof(ObjPtr);
+    }
+    return 0;
+}
+
+// Owned buffers that move along with their object. Chunk code stays put,
+// since call frames hold instruction pointers into it.
+static int objectBuffers(Obj* obj, void** slots[], size_t sizes[]) {
+    switch (obj->type) {
+        case OBJ_STRING: {
+            ObjString* string = (ObjString*) obj;
+            slots[0] = (void**) &string->chars;
+            sizes[0] = string->length + 1;
+            return 1;
+        }
+        case OBJ_FUNCTION: {
+            ValueArray* constants = &((ObjFunction*) obj)->chunk.constants;
+            slots[0] = (void**) &constants->values;
+            sizes[0] = sizeof(Value) * constants->capacity;
+            return 1;
+        }
+        case OBJ_CLOSURE: {
+            ObjClosure* clos = (ObjClosure*) obj;
+            slots[0] = (void**) &clos->upvalues;
+            sizes[0] = sizeof(ObjUpvalue*) * clos->upvalueCount;
+            return 1;
+        }
+        case OBJ_CLASS: {
+            ObjClass* clazz = (ObjClass*) obj;
+            slots[0] = (void**) &clazz->methods.entries;
+            sizes[0] = TABLE_BYTES(clazz->methods.capacity);
+            slots[1] = (void**) &clazz->fields.entries;
+            sizes[1] = TABLE_BYTES(clazz->fields.capacity);
+            slots[2] = (void**) &clazz->staticFields.entries;
+            sizes[2] = TABLE_BYTES(clazz->staticFields.capacity);
+            return 3;
+        }
+        case OBJ_INSTANCE: {
+            Table* fields = &((ObjInstance*) obj)->fields;
+            slots[0] = (void**) &fields->entries;
+            sizes[0] = TABLE_BYTES(fields->capacity);
+            return 1;
+        }
+        case OBJ_LIST: {
+            ValueArray* list = &((ObjList*) obj)->list;
+            slots[0] = (void**) &list->values;
+            sizes[0] = sizeof(Value) * list->capacity;
+            return 1;
+        }
+        default:
+            return 0;
+    }
+}
+
+static void forwardObjectFields(VM* vm, Obj* obj) {
+    switch (obj->type) {
+        case OBJ_FUNCTION: {
+            ObjFunction* func = (ObjFunction*) obj;
+            FORWARD(vm, ObjString*, func->name);
+            forwardArray(vm, &func->chunk.constants);
+            break;
+        }
+        case OBJ_CLOSURE: {
+            ObjClosure* clos = (ObjClosure*) obj;
+            FORWARD(vm, ObjFunction*, clos->function);
+            for (int i = 0; i < clos->upvalueCount; i++)
+                FORWARD(vm, ObjUpvalue*, clos->upvalues[i]);
+            break;
+        }
+        case OBJ_UPVALUE: {
+            ObjUpvalue* upv = (ObjUpvalue*) obj;
+            FORWARD_VALUE(vm, upv->closed);
+            FORWARD(vm, ObjUpvalue*, upv->next);
+            break;
+        }
+        case OBJ_CLASS: {
+            ObjClass* clazz = (ObjClass*) obj;
+            FORWARD(vm, ObjString*, clazz->name);
+            FORWARD(vm, ObjClosure*, clazz->constructor);
+            forwardTable(vm, &clazz->methods);
+            forwardTable(vm, &clazz->fields);
+            forwardTable(vm, &clazz->staticFields);
+            for (int i = 0; i < DEFAULT_METHOD_COUNT; i++)
+                FORWARD(vm, ObjClosure*, clazz->defaultMethods[i]);
+            FORWARD_VALUE(vm, clazz->bound);
+            break;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* inst = (ObjInstance*) obj;
+            FORWARD(vm, ObjClass*, inst->clazz);
+            forwardTable(vm, &inst->fields);
+            FORWARD_VALUE(vm, inst->bound);
+            break;
+        }
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* bound = (ObjBoundMethod*) obj;
+            FORWARD_VALUE(vm, bound->reciever);
+            FORWARD(vm, ObjClosure*, bound->method);
+            break;
+        }
+        case OBJ_LIST:
+            forwardArray(vm, &((ObjList*) obj)->list);
+            break;
+        case OBJ_NAMESPACE: {
+            ObjNamespace* nspace = (ObjNamespace*) obj;
+            FORWARD(vm, ObjString*, nspace->name);
+            forwardTable(vm, nspace->values);
+            forwardTable(vm, nspace->publics);
+            break;
+        }
+        case OBJ_LIBRARY: {
+            ObjLibrary* library = (ObjLibrary*) obj;
+            FORWARD(vm, ObjString*, library->name);
+            FORWARD(vm, ObjNamespace*, library->nspace);
+            break;
+        }
+        case OBJ_ATTRIBUTE:
+            FORWARD_VALUE(vm, ((ObjAttribute*) obj)->val);
+            break;
+        case OBJ_PTR: {
+            ObjPtr* ptr = (ObjPtr*) obj;
+            if (ptr->relocateFn != NULL)
+                ptr->relocateFn(vm, ptr);
+            break;
+        }
+        case OBJ_STRING:
+        case OBJ_NATIVE:
+            break;
+    }
+}
+
+static void forwardRoots(VM* vm) {
+    for (Value* slot = vm->stack; slot < vm->stackTop; slot++)
+        FORWARD_VALUE(vm, *slot);
+
+    for (int i = 0; i < vm->frameCount; i++) {
+        FORWARD(vm, ObjClosure*, vm->frames[i].closure);
+        FORWARD_VALUE(vm, vm->frames[i].bound);
+    }
+
+    FORWARD(vm, ObjUpvalue*, vm->openUpvalues);
+
+    forwardTable(vm, &vm->globals);
+    forwardTable(vm, vm->interned);
+    forwardTable(vm, &vm->libraries);
+    forwardTable(vm, &vm->importedFiles);
+    forwardTable(vm, &vm->fixedNames);
+    FORWARD(vm, ObjFunction*, vm->mainFunc);
+    if (vm->loader != NULL)
+        forwardLoader(vm, vm->loader);
+    FORWARD(vm, ObjNamespace*, vm->nspace);
+}
+
+bool canCompactHeap(VM* vm) {
+    return vm->isMain && vm->runDepth <= 1 && vm->compiler == NULL && vm->pauseGC == 0;
+}
+
+// Moves every live object into a staging area, frees the scattered
+// originals, then reallocates them back in list order so the allocator
+// can hand out contiguous memory. References are rewritten through a
+// table of forwarding addresses.
+void compactHeap(VM* vm) {
+    vm->compactPending = false;
+    if (!canCompactHeap(vm))
+        return;
+
+    collectGarbage(vm);
+    double start = monotonicMillis();
+
+    size_t count = 0;
+    size_t stageSize = 0;
+    void** slots[MAX_OBJ_BUFFERS];
+    size_t sizes[MAX_OBJ_BUFFERS];
+    for (Obj* obj = vm->objects; obj != NULL; obj = obj->next) {
+        count++;
+        stageSize += sizeof(Obj*) + STAGE_ALIGN(objectStructSize(obj->type));
+        int buffers = objectBuffers(obj, slots, sizes);
+        for (int i = 0; i < buffers; i++)
+            stageSize += STAGE_ALIGN(sizes[i]);
+    }
+
+    uint8_t* stage = (uint8_t*) malloc(stageSize == 0 ? 1 : stageSize);
+    if (stage == NULL) exit(1);
+
+    uint8_t* cursor = stage;
+    Obj* obj = vm->objects;
+    while (obj != NULL) {
+        Obj* next = obj->next;
+        size_t size = objectStructSize(obj->type);
+
+        memcpy(cursor, &obj, sizeof(Obj*));
+        cursor += sizeof(Obj*);
+        memcpy(cursor, obj, size);
+        cursor += STAGE_ALIGN(size);
+
+        int buffers = objectBuffers(obj, slots, sizes);
+        for (int i = 0; i < buffers; i++) {
+            if (*slots[i] != NULL)
+                memcpy(cursor, *slots[i], sizes[i]);
+            cursor += STAGE_ALIGN(sizes[i]);
+            free(*slots[i]);
+        }
+        free(obj);
+
+        obj = next;
+    }
+
+    #ifdef __GLIBC__
+        malloc_trim(0);
+    #endif
+
+    ForwardTable table;
+    table.capacity = 8;
+    while (table.capacity < count * 2)
+        table.capacity *= 2;
+    table.entries = (Forward*) calloc(table.capacity, sizeof(Forward));
+    if (table.entries == NULL) exit(1);
+
+    Obj* head = NULL;
+    Obj** tail = &head;
+    cursor = stage;
+    for (size_t n = 0; n < count; n++) {
+        Obj* from;
+        memcpy(&from, cursor, sizeof(Obj*));
+        cursor += sizeof(Obj*);
+
+        ObjType type = ((Obj*) cursor)->type;
+        size_t size = objectStructSize(type);
+        Obj* to = (Obj*) malloc(size);
+        if (to == NULL) exit(1);
+        memcpy(to, cursor, size);
+        cursor += STAGE_ALIGN(size);
+
+        int buffers = objectBuffers(to, slots, sizes);
+        for (int i = 0; i < buffers; i++) {
+            if (*slots[i] != NULL) {
+                *slots[i] = malloc(sizes[i]);
+                if (*slots[i] == NULL) exit(1);
+                memcpy(*slots[i], cursor, sizes[i]);
+            }
+            cursor += STAGE_ALIGN(sizes[i]);
+        }
+
+        if (type == OBJ_UPVALUE) {
+            ObjUpvalue* upv = (ObjUpvalue*) to;
+            if (upv->location == &((ObjUpvalue*) from)->closed)
+                upv->location = &upv->closed;
+        }
+
+        addForward(&table, from, to);
+        *tail = to;
+        tail = &to->next;
+    }
+    *tail = NULL;
+    vm->objects = head;
+    free(stage);
+
+    forwarding = &table;
+    for (Obj* obj = vm->objects; obj != NULL; obj = obj->next)
+        forwardObjectFields(vm, obj);
+    forwardRoots(vm);
+    forwarding = NULL;
+    free(table.entries);
+
+    GCStats* stats = &vm->gcStats;
+    stats->compactions++;
+    stats->lastCompactPause = monotonicMillis() - start;
+    stats->totalPause += stats->lastCompactPause;
+    stats->freedSinceCompact = 0;
+
+    if (vm->gcConfig.log != NULL) {
+        fprintf(vm->gcConfig.log, "{\"compact\":%d,\"pause_ms\":%.3f,\"objects\":%zu,\"bytes\":%zu}\n",
+            stats->compactions, stats->lastCompactPause, count, vm->bytesAllocated);
+    }
+}
+
+void initGC(VM* vm) {
+    vm->gcConfig.growthFactor = GC_HEAP_GROWTH_FACTOR;
+    vm->gcConfig.initialHeap = GC_INITIAL_HEAP;
+    vm->gcConfig.maxHeap = 0;
+    vm->gcConfig.compactThreshold = 0;
+    vm->gcConfig.log = NULL;
+
+    memset(&vm->gcStats, 0, sizeof(GCStats));
+
+    vm->bytesAllocated = 0;
+    vm->nextGC = GC_INITIAL_HEAP;
+}
+
+void inheritGC(VM* vm, VM* parent) {
+    vm->gcConfig = parent->gcConfig;
+    if (vm->nextGC < vm->gcConfig.initialHeap)
+        vm->nextGC = vm->gcConfig.initialHeap;
+}
+
+static bool parseSize(const char* str, size_t* size) {
+    char* end;
+    double val = strtod(str, &end);
+    if (end == str || val < 0)
+        return false;
+
+    switch (*end) {
+        case 'k': case 'K': val *= 1024; end++; break;
+        case 'm': case 'M': val *= 1024 * 1024; end++; break;
+        case 'g': case 'G': val *= 1024 * 1024 * 1024; end++; break;
+    }
+    if (*end != '\0')
+        return false;
+
+    *size = (size_t) val;
+    return true;
+}
+
+bool configureGC(VM* vm, const char* options) {
+    char* opts = strdup(options);
+    bool ok = true;
+
+    for (char* opt = strtok(opts, ","); opt != NULL && ok; opt = strtok(NULL, ",")) {
+        char* val = strchr(opt, '=');
+        if (val == NULL) {
+            fprintf(stderr, "Expected key=value in GC option '%s'.\n", opt);
+            ok = false;
+            break;
+        }
+        *val++ = '\0';
+
+        if (strcmp(opt, "growth") == 0) {
+            char* end;
+            double factor = strtod(val, &end);
+            if (end == val || *end != '\0' || factor <= 1) {
+                fprintf(stderr, "GC growth factor must be a number greater than 1.\n");
+                ok = false;
+            } else {
+                vm->gcConfig.growthFactor = factor;
+            }
+        } else if (strcmp(opt, "init") == 0) {
+            if (!parseSize(val, &vm->gcConfig.initialHeap)) {
+                fprintf(stderr, "Invalid initial heap size '%s'.\n", val);
+                ok = false;
+            } else {
+                vm->nextGC = vm->gcConfig.initialHeap;
+            }
+        } else if (strcmp(opt, "max") == 0) {
+            if (!parseSize(val, &vm->gcConfig.maxHeap)) {
+                fprintf(stderr, "Invalid maximum heap size '%s'.\n", val);
+                ok = false;
+            }
+        } else if (strcmp(opt, "compact") == 0) {
+            char* end;
+            double threshold = strtod(val, &end);
+            if (end == val || *end != '\0' || threshold < 0 || threshold >= 1) {
+                fprintf(stderr, "GC compaction threshold must be a fraction in [0, 1).\n");
+                ok = false;
+            } else {
+                vm->gcConfig.compactThreshold = threshold;
+            }
+        } else if (strcmp(opt, "log") == 0) {
+            if (vm->gcConfig.log != NULL)
+                fclose(vm->gcConfig.log);
+            vm->gcConfig.log = fopen(val, "w");
+            if (vm->gcConfig.log == NULL) {
+                fprintf(stderr, "Could not open GC log \"%s\".\n", val);
+                ok = false;
+            }
+        } else {
+            fprintf(stderr, "Unknown GC option '%s'.\n", opt);
+            ok = false;
+        }
+    }
+
+    free(opts);
+    return ok;
+}
+
 char* readFile(char* path) {
     FILE* fp = fopen(path, "rb");
     if (fp == NULL) {
@@ -381,7 +1073,26 @@ char* readFile(char* path) {
     return buf;
 }
 
-char* getDirectory(char* path) {
+char* tryReadFile(char* path) {
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL)
+        return NULL;
+
+    fseek(fp, 0, SEEK_END);
+    long len = ftell(fp);
+    rewind(fp);
+
+    char* buf = len < 0 ? NULL : (char*) malloc(len + 1);
+    if (buf != NULL) {
+        size_t bytesRead = fread(buf, sizeof(char), len, fp);
+        buf[bytesRead] = '\0';
+    }
+
+    fclose(fp);
+    return buf;
+}
+
+char* getDirectory(const char* path) {
     int length = 0;
     for (int i = 0; i < strlen(path); i++)
         if (path[i] == '/' || path[i] == '\\')
@@ -397,10 +1108,10 @@ void changeDirectory(char* path) {
     chdir(path);
 }
 
-void changeDirectoryToFile(char* path) {
-    path = getDirectory(path);
-    changeDirectory(path);
-    free(path);
+void changeDirectoryToFile(const char* path) {
+    char* dir = getDirectory(path);
+    changeDirectory(dir);
+    free(dir);
 }
 
 char* getCurrentWorkingDirectory() {
@@ -426,6 +1137,24 @@ bool fileExists(char* path) {
     return access(path, F_OK) == 0;
 }
 
+char* getExecutablePath(const char* argv0) {
+#ifdef WIN32
+    char* path = malloc(MAX_PATH);
+    DWORD length = GetModuleFileNameA(NULL, path, MAX_PATH);
+    if (length > 0 && length < MAX_PATH)
+        return path;
+    free(path);
+    return NULL;
+#else
+    if (access("/proc/self/exe", F_OK) == 0)
+        return strdup("/proc/self/exe");
+    // Without procfs, only a path the shell did not have to search for can be used.
+    if (argv0 != NULL && strchr(argv0, '/') != NULL)
+        return strdup(argv0);
+    return NULL;
+#endif
+}
+
 bool dirExists(char* path) {
     DIR* dir = opendir(path);
     if (dir) {
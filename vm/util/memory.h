@@ -11,6 +11,12 @@
 #include "debug.h"
 #endif
 
+struct HeapSnapshot {
+    FILE* fp;
+    Obj* parent;
+    const char* root;
+};
+
 #define GROW_CAPACITY(capacity) ((capacity) < 8 ? 8 : (capacity)*  2)
 
 #define ALLOCATE(vm, type, count) (type*) reallocate(vm, NULL, 0, sizeof(type) * (count))
@@ -29,14 +35,30 @@ void markValue(VM* vm, Value val);
 void markTable(VM* vm, Table* tb);
 void markCompilerRoots(VM* vm, Compiler* compiler);
 void collectGarbage(VM* vm);
+size_t objectSize(Obj* obj);
+const char* objTypeName(ObjType type);
+
+void initGC(VM* vm);
+void inheritGC(VM* vm, VM* parent);
+bool configureGC(VM* vm, const char* options);
+bool writeHeapSnapshot(VM* vm, const char* path);
+
+bool canCompactHeap(VM* vm);
+void compactHeap(VM* vm);
+Obj* forwardObject(VM* vm, Obj* obj);
+Value forwardValue(VM* vm, Value val);
 
 char* readFile(char* path);
-char* getDirectory(char* path);
+// Reads the file as readFile does, returning NULL instead of exiting when it cannot.
+char* tryReadFile(char* path);
+char* getDirectory(const char* path);
 void changeDirectory(char* path);
-void changeDirectoryToFile(char* path);
+void changeDirectoryToFile(const char* path);
 char* getCurrentWorkingDirectory();
 char* getFullPath(char* path);
 bool fileExists(char* path);
 bool dirExists(char* path);
+// Path of the running executable, or NULL when it cannot be found. Freed by the caller.
+char* getExecutablePath(const char* argv0);
 
 #endif
@@ -5,87 +5,166 @@
 #include "../vm/object.h"
 #include "table.h"
 
-#define TABLE_MAX_LOAD 0.75
+#ifdef __SSE2__
+#include <emmintrin.h>
+#define TABLE_SSE2
+#endif
+
+// Control bytes. Full slots hold H2 of their key, which never has the top bit set.
+#define CTRL_EMPTY    ((uint8_t) 0x80)
+#define CTRL_DELETED  ((uint8_t) 0xFE)
+#define CTRL_SENTINEL ((uint8_t) 0xFF)
+
+#define H1(hash) ((hash) >> 7)
+#define H2(hash) ((uint8_t) ((hash) & 0x7F))
+
+#define MAX_LOAD(capacity) ((capacity) - (capacity) / 8)
+
+// Each match returns a bitmask with bit i set when control byte i of the group matches.
+#ifdef TABLE_SSE2
+
+static inline uint32_t matchByte(const uint8_t* group, uint8_t byte) {
+    __m128i ctrl = _mm_loadu_si128((const __m128i*) group);
+    return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char) byte)));
+}
+
+// Empty and deleted bytes are the only ones that compare below the sentinel as signed.
+static inline uint32_t matchFree(const uint8_t* group) {
+    __m128i ctrl = _mm_loadu_si128((const __m128i*) group);
+    return (uint32_t) _mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8((char) CTRL_SENTINEL), ctrl));
+}
+
+#else
+
+static inline uint32_t matchByte(const uint8_t* group, uint8_t byte) {
+    uint32_t bits = 0;
+    for (int i = 0; i < TABLE_GROUP; i++)
+        bits |= (uint32_t) (group[i] == byte) << i;
+    return bits;
+}
+
+static inline uint32_t matchFree(const uint8_t* group) {
+    uint32_t bits = 0;
+    for (int i = 0; i < TABLE_GROUP; i++)
+        bits |= (uint32_t) (group[i] == CTRL_EMPTY || group[i] == CTRL_DELETED) << i;
+    return bits;
+}
+
+#endif
+
+#define matchEmpty(group) matchByte(group, CTRL_EMPTY)
+
+// Groups are probed triangularly, which visits every group once the count is a power of two.
+static inline size_t groupMask(Table* tb) {
+    return tb->capacity <= TABLE_GROUP ? 0 : tb->capacity / TABLE_GROUP - 1;
+}
+
+// Keys take their home slot, which lies in the first group probed, whenever it is
+// free. Most lookups then resolve on one compare before any group is matched.
+#define HOME(tb, hash) (H1(hash) & ((tb)->capacity - 1))
+#define FIRST_GROUP(hash, mask) ((H1(hash) / TABLE_GROUP) & (mask))
 
 void initTable(Table* tb) {
     tb->capacity = 0;
     tb->count = 0;
+    tb->tombstones = 0;
     tb->entries = NULL;
 }
 
 void freeTable(VM* vm, Table* tb) {
-    FREE_ARRAY(vm, Entry, tb->entries, tb->capacity);
+    reallocate(vm, tb->entries, TABLE_BYTES(tb->capacity), 0);
     initTable(tb);
 }
 
-// static void printEntries(Entry* entries, int capacity) {
-//     printf("{ ");
-//     for (int i = 0; i < capacity; i++) {
-//         Entry* entry = &entries[i];
-//         if (entry->key == NULL)
-//             continue;
-        
-//         printf("(\"%s\"[%d] -> ", entry->key->chars, i);
-//         printValue(entry->value);
-//         printf(") ");
-//     }
-//     printf("}");
-// }
-
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-    uint32_t idx = key->hash & (capacity - 1);
-    Entry* tombstone = NULL;
-
-    for (;;) {
-        Entry* entry = &entries[idx];
-        if (entry->key == NULL) {
-            if (IS_NULL(entry->value))
-                return tombstone != NULL ? tombstone : entry;
-            if (tombstone == NULL)
-                tombstone = entry;
-        } else if (key->length == entry->key->length && 
-                memcmp(entry->key->chars, key->chars, key->length) == 0) {
-            return entry;
+static Entry* findEntry(Table* tb, ObjString* key) {
+    Entry* home = &tb->entries[HOME(tb, key->hash)];
+    if (home->key == key)
+        return home;
+
+    uint8_t* ctrl = TABLE_CTRL(tb);
+    size_t mask = groupMask(tb);
+    size_t group = FIRST_GROUP(key->hash, mask);
+
+    for (size_t step = 1;; step++) {
+        uint8_t* at = ctrl + group * TABLE_GROUP;
+        for (uint32_t bits = matchByte(at, H2(key->hash)); bits != 0; bits &= bits - 1) {
+            Entry* entry = &tb->entries[group * TABLE_GROUP + __builtin_ctz(bits)];
+            if (entry->key == key)
+                return entry;
+        }
+
+        if (matchEmpty(at) != 0)
+            return NULL;
+        group = (group + step) & mask;
+    }
+}
+
+// Claims the first empty or deleted slot on the key's probe sequence.
+// The key must not already be present.
+static Entry* insertEntry(Table* tb, ObjString* key) {
+    uint8_t* ctrl = TABLE_CTRL(tb);
+    size_t mask = groupMask(tb);
+    size_t group = FIRST_GROUP(key->hash, mask);
+    size_t home = HOME(tb, key->hash);
+
+    for (size_t step = 1;; step++) {
+        uint32_t bits = matchFree(ctrl + group * TABLE_GROUP);
+        if (bits != 0) {
+            size_t idx = group * TABLE_GROUP + __builtin_ctz(bits);
+            if (step == 1 && (ctrl[home] == CTRL_EMPTY || ctrl[home] == CTRL_DELETED))
+                idx = home;
+            if (ctrl[idx] == CTRL_DELETED)
+                tb->tombstones--;
+            ctrl[idx] = H2(key->hash);
+            tb->count++;
+            return &tb->entries[idx];
         }
-        
-        idx = (idx + 1) & (capacity - 1);
+
+        group = (group + step) & mask;
     }
 }
 
 bool tableGet(Table* tb, ObjString* key, Value* ptr) {
     if (tb->count == 0)
         return false;
-    
-    Entry* entry = findEntry(tb->entries, tb->capacity, key);
-    if (entry->key == NULL)
+
+    Entry* entry = findEntry(tb, key);
+    if (entry == NULL)
         return false;
-    
-    *ptr = entry->value;
+
+    if (ptr != NULL)
+        *ptr = entry->value;
     return true;
 }
 
 static void adjustCapacity(VM* vm, Table* tb, int cap) {
-    Entry* entries = ALLOCATE(vm, Entry, cap);
+    Entry* entries = (Entry*) reallocate(vm, NULL, 0, TABLE_BYTES(cap));
     for (int i = 0; i < cap; i++) {
         entries[i].key = NULL;
         entries[i].value = NULL_VAL;
     }
 
+    uint8_t* ctrl = (uint8_t*) (entries + cap);
+    memset(ctrl, CTRL_EMPTY, cap);
+    memset(ctrl + cap, CTRL_SENTINEL, TABLE_BYTES(cap) - sizeof(Entry) * cap - cap);
+
+    Table old = *tb;
+    tb->entries = entries;
+    tb->capacity = cap;
     tb->count = 0;
-    for (int i = 0; i < tb->capacity; i++) {
-        Entry* entry = &tb->entries[i];
+    tb->tombstones = 0;
+
+    for (int i = 0; i < old.capacity; i++) {
+        Entry* entry = &old.entries[i];
         if (entry->key == NULL)
             continue;
-        tb->count++;
-        
-        Entry* dest = findEntry(entries, cap, entry->key);
+
+        Entry* dest = insertEntry(tb, entry->key);
         dest->key = entry->key;
         dest->value = entry->value;
     }
 
-    FREE_ARRAY(vm, Entry, tb->entries, tb->capacity);
-    tb->entries = entries;
-    tb->capacity = cap;
+    reallocate(vm, old.entries, TABLE_BYTES(old.capacity), 0);
 }
 
 void tableAddAll(VM* vm, Table* from, Table* to) {
@@ -93,64 +172,82 @@ void tableAddAll(VM* vm, Table* from, Table* to) {
         Entry* entry = &from->entries[i];
         if (entry->key == NULL)
             continue;
-        
-        tableSet(vm, to, entry->key, entry->value);
-    }
-}
 
-void tableRemoveWhite(Table* tb) {
-    for (int i = 0; i < tb->capacity; i++) {
-        Entry* entry = &tb->entries[i];
-        if (entry->key != NULL && !entry->key->obj.isMarked) {
-            tableDelete(tb, entry->key);
-        }
+        tableSet(vm, to, entry->key, entry->value);
     }
 }
 
 ObjString* tableFindString(Table* tb, const char* src, int len, uint32_t hash) {
     if (tb->count == 0)
         return NULL;
-    
-    uint32_t idx = hash & (tb->capacity - 1);
-    for (;;) {
-        Entry* entry = &tb->entries[idx];
-        if (entry->key == NULL) {
-            if (IS_NULL(entry->value))
-                return NULL;
-        } else if (entry->key->length == len && entry->key->hash == hash &&
-                    memcmp(entry->key->chars, src, len) == 0) {
-            return entry->key;
+
+    ObjString* home = tb->entries[HOME(tb, hash)].key;
+    if (home != NULL && home->hash == hash && home->length == len &&
+            memcmp(home->chars, src, len) == 0)
+        return home;
+
+    uint8_t* ctrl = TABLE_CTRL(tb);
+    size_t mask = groupMask(tb);
+    size_t group = FIRST_GROUP(hash, mask);
+
+    for (size_t step = 1;; step++) {
+        uint8_t* at = ctrl + group * TABLE_GROUP;
+        for (uint32_t bits = matchByte(at, H2(hash)); bits != 0; bits &= bits - 1) {
+            ObjString* key = tb->entries[group * TABLE_GROUP + __builtin_ctz(bits)].key;
+            if (key->hash == hash && key->length == len &&
+                    memcmp(key->chars, src, len) == 0)
+                return key;
         }
 
-        idx = (idx + 1) & (tb->capacity - 1);
+        if (matchEmpty(at) != 0)
+            return NULL;
+        group = (group + step) & mask;
     }
 }
 
 bool tableSet(VM* vm, Table* tb, ObjString* key, Value val) {
-    if (tb->count + 1 > tb->capacity * TABLE_MAX_LOAD) {
-        int capacity = GROW_CAPACITY(tb->capacity);
-        adjustCapacity(vm, tb, capacity);
+    Entry* entry = tb->count == 0 ? NULL : findEntry(tb, key);
+    if (entry != NULL) {
+        entry->value = val;
+        return false;
     }
 
-    Entry* entry = findEntry(tb->entries, tb->capacity, key);
-    bool isNewKey = entry->key == NULL;
-    if (isNewKey && IS_NULL(entry->value))
-        tb->count++;
+    // Tombstones count against the load, but when most of it is tombstones
+    // the table is rebuilt at the same size instead of doubling.
+    if (tb->count + tb->tombstones + 1 > MAX_LOAD(tb->capacity)) {
+        int capacity = tb->capacity;
+        if ((tb->count + 1) * 2 > MAX_LOAD(capacity))
+            capacity = GROW_CAPACITY(capacity);
+        adjustCapacity(vm, tb, capacity);
+    }
 
+    entry = insertEntry(tb, key);
     entry->key = key;
     entry->value = val;
-    return isNewKey;
+    return true;
 }
 
 bool tableDelete(Table* tb, ObjString* key) {
     if (tb->count == 0) return false;
 
-    Entry* entry = findEntry(tb->entries, tb->capacity, key);
-    if (entry->key == NULL)
+    Entry* entry = findEntry(tb, key);
+    if (entry == NULL)
         return false;
 
+    // A probe only moves past a group with no empty slots, so a slot in a group
+    // that still has one can go straight back to empty.
+    size_t idx = entry - tb->entries;
+    uint8_t* ctrl = TABLE_CTRL(tb);
+    if (matchEmpty(ctrl + idx / TABLE_GROUP * TABLE_GROUP) != 0) {
+        ctrl[idx] = CTRL_EMPTY;
+    } else {
+        ctrl[idx] = CTRL_DELETED;
+        tb->tombstones++;
+    }
+
     entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    entry->value = NULL_VAL;
+    tb->count--;
     return true;
 }
 
@@ -160,7 +257,7 @@ void printTable(Table* tb) {
         Entry* entry = &tb->entries[i];
         if (entry->key == NULL)
             continue;
-        
+
         printf("(\"%s\"[%d] -> ", entry->key->chars, i);
         printValue(entry->value);
         printf(") \n");
@@ -10,19 +10,28 @@ typedef struct {
     Value value;
 } Entry;
 
+// Entries are followed in the same allocation by one control byte per slot,
+// holding either the low 7 bits of the key's hash or an empty/deleted marker.
+// Slots without a key always have a NULL key, so entries can be walked directly.
 typedef struct {
     int count;
+    int tombstones;
     int capacity;
     Entry* entries;
 } Table;
 
+#define TABLE_GROUP 16
+
+#define TABLE_CTRL(tb) ((uint8_t*) ((tb)->entries + (tb)->capacity))
+#define TABLE_BYTES(capacity) ((capacity) == 0 ? 0 : \
+    sizeof(Entry) * (capacity) + ((capacity) < TABLE_GROUP ? TABLE_GROUP : (capacity)))
+
 void initTable(Table* tb);
 void freeTable(VM* vm, Table* tb);
 bool tableGet(Table* tb, ObjString* key, Value* ptr);
 bool tableSet(VM* vm, Table* tb, ObjString* key, Value val);
 bool tableDelete(Table* tb, ObjString* key);
 void tableAddAll(VM* vm, Table* from, Table* to);
-void tableRemoveWhite(Table* tb);
 ObjString* tableFindString(Table* tb, const char* src, int len, uint32_t hash);
 void printTable(Table* tb);
 
@@ -4,8 +4,17 @@
 #include <stdbool.h>
 #include <string.h>
 
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 #include "../util/memory.h"
 #include "../compiler/dumper.h"
+#include "../util/lz.h"
+#include "../libraries/core/extension.h"
+#include "vm.h"
 
 BytecodeLoader* newLoader(VM* vm, uint8_t* bytes, int length) {
     BytecodeLoader* loader = ALLOCATE(vm, BytecodeLoader, 1);
@@ -14,12 +23,152 @@ BytecodeLoader* newLoader(VM* vm, uint8_t* bytes, int length) {
     loader->length = length;
     loader->byte = loader->bytes[0];
     loader->idx = 0;
+    loader->mapped = false;
+    loader->lazy = false;
+
+    for (int i = 0; i < SECTION_COUNT; i++) {
+        loader->sections[i].bytes = NULL;
+        loader->sections[i].length = 0;
+        loader->sections[i].owned = false;
+    }
+    loader->strings = NULL;
+    loader->stringCount = 0;
+    loader->functions = NULL;
+    loader->functionCount = 0;
+    loader->objects = NULL;
+    loader->objectCount = 0;
 
     loader->vm = vm;
 
     return loader;
 }
 
+#ifndef WIN32
+// Maps length bytes of the open file as the VM's mapping.
+static uint8_t* mapFile(VM* vm, int fd, size_t length) {
+    if (vm->mapping != NULL || length == 0)
+        return NULL;
+
+    void* bytes = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (bytes == MAP_FAILED)
+        return NULL;
+
+    vm->mapping = bytes;
+    vm->mappingLength = length;
+    return bytes;
+}
+#endif
+
+BytecodeLoader* mapLoader(VM* vm, const char* path) {
+#ifdef WIN32
+    return NULL;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+
+    struct stat st;
+    uint8_t* bytes = NULL;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size <= INT32_MAX)
+        bytes = mapFile(vm, fd, st.st_size);
+    close(fd);
+    if (bytes == NULL)
+        return NULL;
+
+    BytecodeLoader* loader = newLoader(vm, bytes, st.st_size);
+    loader->mapped = true;
+    return loader;
+#endif
+}
+
+// Checks the trailer at the end of a file of fileLength bytes.
+static bool readTrailer(uint8_t* trailer, size_t fileLength, size_t* offset, size_t* length) {
+    if (memcmp(trailer + 8, BUNDLE_MAGIC, BUNDLE_MAGIC_LENGTH) != 0)
+        return false;
+
+    uint64_t start = 0;
+    for (int i = 7; i >= 0; i--)
+        start = start << 8 | trailer[i];
+
+    if (start >= fileLength - BUNDLE_TRAILER_SIZE || fileLength - BUNDLE_TRAILER_SIZE - start > INT32_MAX)
+        return false;
+    *offset = start;
+    *length = fileLength - BUNDLE_TRAILER_SIZE - start;
+    return true;
+}
+
+bool findBundle(const char* path, size_t* offset, size_t* length) {
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL)
+        return false;
+
+    uint8_t trailer[BUNDLE_TRAILER_SIZE];
+    bool found = false;
+    if (fseek(fp, 0, SEEK_END) == 0) {
+        long fileLength = ftell(fp);
+        found = fileLength > BUNDLE_TRAILER_SIZE &&
+            fseek(fp, fileLength - BUNDLE_TRAILER_SIZE, SEEK_SET) == 0 &&
+            fread(trailer, 1, BUNDLE_TRAILER_SIZE, fp) == BUNDLE_TRAILER_SIZE &&
+            readTrailer(trailer, fileLength, offset, length);
+    }
+
+    fclose(fp);
+    return found;
+}
+
+BytecodeLoader* bundleLoader(VM* vm, const char* path) {
+    size_t offset = 0, length = 0;
+
+#ifndef WIN32
+    // One descriptor serves the trailer and the mapping, as this runs on every start.
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+
+    struct stat st;
+    uint8_t trailer[BUNDLE_TRAILER_SIZE];
+    if (fstat(fd, &st) == -1 || st.st_size <= BUNDLE_TRAILER_SIZE ||
+            pread(fd, trailer, BUNDLE_TRAILER_SIZE, st.st_size - BUNDLE_TRAILER_SIZE) != BUNDLE_TRAILER_SIZE ||
+            !readTrailer(trailer, st.st_size, &offset, &length)) {
+        close(fd);
+        return NULL;
+    }
+
+    uint8_t* mapping = mapFile(vm, fd, st.st_size);
+    close(fd);
+    if (mapping != NULL) {
+        BytecodeLoader* loader = newLoader(vm, mapping + offset, length);
+        loader->mapped = true;
+        return loader;
+    }
+#else
+    if (!findBundle(path, &offset, &length))
+        return NULL;
+#endif
+
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL)
+        return NULL;
+
+    uint8_t* bytes = ALLOCATE(vm, uint8_t, length);
+    if (fseek(fp, offset, SEEK_SET) != 0 || fread(bytes, 1, length, fp) != length) {
+        fprintf(stderr, "Could not read the binary bundled in \"%s\".\n", path);
+        exit(74);
+    }
+    fclose(fp);
+
+    return newLoader(vm, bytes, length);
+}
+
+void unmapBytecode(VM* vm) {
+#ifndef WIN32
+    if (vm->mapping != NULL)
+        munmap(vm->mapping, vm->mappingLength);
+#endif
+    vm->mapping = NULL;
+    vm->mappingLength = 0;
+}
+
 static uint8_t advance(BytecodeLoader* loader) {
     #ifdef DEBUG_PRINT_LOADER
         printf("---- reading byte %d/%d (%04u)\n", loader->idx, loader->length, loader->bytes[loader->idx]);
@@ -35,11 +184,28 @@ static uint8_t advance(BytecodeLoader* loader) {
     return byte;
 }
 
+static void expectBytes(BytecodeLoader* loader, int count) {
+    if (count > loader->length - loader->idx) {
+        fprintf(stderr, "Malformed bytecode, ran out of bytes.\n");
+        exit(65);
+    }
+}
+
+// Moves past count bytes that were read directly.
+static void skip(BytecodeLoader* loader, int count) {
+    expectBytes(loader, count);
+    loader->idx += count;
+    if (loader->idx < loader->length)
+        loader->byte = loader->bytes[loader->idx];
+}
+
 static int readInt(BytecodeLoader* loader) {
-    return advance(loader) + 
-        (advance(loader) << 8) +
-        (advance(loader) << 16) +
-        (advance(loader) << 24);
+    expectBytes(loader, 4);
+    uint8_t* bytes = loader->bytes + loader->idx;
+    int i = (int) ((uint32_t) bytes[0] | (uint32_t) bytes[1] << 8 |
+        (uint32_t) bytes[2] << 16 | (uint32_t) bytes[3] << 24);
+    skip(loader, 4);
+    return i;
 }
 
 /*
@@ -61,7 +227,14 @@ static void consume(BytecodeLoader* loader, uint8_t byte) {
 }
 
 void freeLoader(VM* vm, BytecodeLoader* loader) {
-    FREE_ARRAY(vm, uint8_t, loader->bytes, loader->length);
+    if (!loader->mapped)
+        FREE_ARRAY(vm, uint8_t, loader->bytes, loader->length);
+    for (int i = 0; i < SECTION_COUNT; i++) {
+        if (loader->sections[i].owned)
+            FREE_ARRAY(vm, uint8_t, loader->sections[i].bytes, loader->sections[i].length);
+    }
+    FREE_ARRAY(vm, ObjString*, loader->strings, loader->stringCount);
+    FREE_ARRAY(vm, ObjFunction*, loader->functions, loader->functionCount);
     FREE(vm, BytecodeLoader, loader);
 }
 
@@ -82,11 +255,10 @@ static double readNumber(BytecodeLoader* loader) {
         printf("-- reading number\n");
     #endif
     consume(loader, DUMP_NUMBER);
-    uint8_t byte_array[sizeof(double)];
+    expectBytes(loader, sizeof(double));
     double num = 0;
-    for (int i = 0; i < sizeof(double); i++)
-        byte_array[i] = advance(loader);
-    memcpy(&num, byte_array, sizeof(double));
+    memcpy(&num, loader->bytes + loader->idx, sizeof(double));
+    skip(loader, sizeof(double));
     return num;
 }
 
@@ -127,6 +299,21 @@ static ValueArray readValueArray(BytecodeLoader* loader) {
     return array;
 }
 
+// Swaps typed opcodes for the generic ones, which check their operands at run
+// time. Every instruction has to decode for the swap to be sound.
+static void guardTypedOps(Chunk* chunk) {
+    for (int offset = 0; offset < chunk->count;) {
+        int length = instructionLength(chunk, offset);
+        if (length < 0) {
+            fprintf(stderr, "Malformed bytecode, invalid instruction at offset %d.\n", offset);
+            exit(65);
+        }
+
+        chunk->code[offset] = checkedOpcode(chunk->code[offset]);
+        offset += length;
+    }
+}
+
 static Chunk readChunk(BytecodeLoader* loader) {
     #ifdef DEBUG_PRINT_LOADER
         printf("-- reading chunk\n");
@@ -144,23 +331,28 @@ static Chunk readChunk(BytecodeLoader* loader) {
     ValueArray array = readValueArray(loader);
 
     int count = readInt(loader);
-    uint8_t* code = ALLOCATE(loader->vm, uint8_t, count);
-    if (loader->idx + count > loader->length) {
+    if (count < 0 || count > loader->length - loader->idx) {
         fprintf(stderr, "Malformed bytecode, expected %d bytes in chunk, got %d.\n", 
             count, loader->length - loader->idx);
         exit(65);
     }
 
-    memcpy(code, loader->bytes + loader->idx, count);
-    loader->idx += count - 1;
-    advance(loader);
-
     Chunk chunk;
     initChunk(&chunk);
- 
+
+    // Typed opcodes are rewritten in untrusted binaries, so their code is copied.
+    if (loader->mapped && loader->vm->trustTyped) {
+        chunk.code = loader->bytes + loader->idx;
+        chunk.capacity = 0;
+        chunk.mapped = true;
+    } else {
+        chunk.code = ALLOCATE(loader->vm, uint8_t, count);
+        chunk.capacity = count;
+        memcpy(chunk.code, loader->bytes + loader->idx, count);
+    }
+    skip(loader, count);
+
     chunk.count = count;
-    chunk.capacity = count;
-    chunk.code = code;
 
     chunk.constants = array;
 
@@ -169,6 +361,9 @@ static Chunk readChunk(BytecodeLoader* loader) {
     chunk.lines = lines;
     chunk.lines_run = lines_run;
 
+    if (!loader->vm->trustTyped)
+        guardTypedOps(&chunk);
+
     return chunk;
 }
 
@@ -179,29 +374,21 @@ static ObjString* readString(BytecodeLoader* loader) {
     consume(loader, DUMP_STRING);
 
     int length = readInt(loader);
-    char* src = ALLOCATE(loader->vm, char, length + 1);
-    if (loader->idx + length > loader->length) {
+    if (length < 0 || length > loader->length - loader->idx) {
         fprintf(stderr, "Malformed bytecode, expected %d bytes in string, got %d.\n", 
             length, loader->length - loader->idx);
         exit(65);
     }
 
-    // 1 2 3 4 5 6 
-    //       ^
-    // idx : 3
-    // len : 6
-    // 
-
-    memcpy(src, loader->bytes + loader->idx, length);
-    src[length] = '\0';
-    loader->idx += length - 1;
-    advance(loader);
+    // Interned straight from the binary, only copied when no equal string exists yet.
+    ObjString* str = copyString(loader->vm, (const char*) loader->bytes + loader->idx, length);
+    skip(loader, length);
 
     #ifdef DEBUG_PRINT_LOADER
-        printf("-- read string '%s'\n", src);
+        printf("-- read string '%s'\n", str->chars);
     #endif
 
-    return takeString(loader->vm, src, length);
+    return str;
 }
 
 static ObjFunction* readFunction(BytecodeLoader* loader) {
@@ -272,9 +459,552 @@ Table readTable(BytecodeLoader* loader) {
     return tb;
 }
 
+static uint32_t wordAt(uint8_t* bytes) {
+    return (uint32_t) bytes[0] | (uint32_t) bytes[1] << 8 |
+        (uint32_t) bytes[2] << 16 | (uint32_t) bytes[3] << 24;
+}
+
+// The bytes of a range in a section, exiting on one that runs past it.
+static uint8_t* sectionBytes(BytecodeLoader* loader, SectionId id, int64_t offset, int64_t length) {
+    BytecodeSection* section = &loader->sections[id - 1];
+    if (offset < 0 || length < 0 || offset + length > section->length) {
+        fprintf(stderr, "Malformed bytecode, range %lld+%lld outside of section %d.\n",
+            (long long) offset, (long long) length, id);
+        exit(65);
+    }
+    return section->bytes + offset;
+}
+
+static int sectionInt(BytecodeLoader* loader, SectionId id, int offset) {
+    return (int) wordAt(sectionBytes(loader, id, offset, 4));
+}
+
+static uint32_t sectionVarint(BytecodeLoader* loader, SectionId id, int* offset) {
+    uint32_t i = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        uint8_t byte = *sectionBytes(loader, id, (*offset)++, 1);
+        i |= (uint32_t) (byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+            return i;
+    }
+
+    fprintf(stderr, "Malformed bytecode, varint too long in section %d.\n", id);
+    exit(65);
+}
+
+static ObjString* stringAt(BytecodeLoader* loader, uint32_t idx) {
+    if (idx >= (uint32_t) loader->stringCount) {
+        fprintf(stderr, "Malformed bytecode, no string %u.\n", idx);
+        exit(65);
+    }
+    if (loader->strings[idx] != NULL)
+        return loader->strings[idx];
+
+    uint8_t* offsets = sectionBytes(loader, SECTION_STRINGS, 4 + 4 * (int64_t) idx, 8);
+    int64_t start = wordAt(offsets);
+    int64_t end = wordAt(offsets + 4);
+    int64_t blob = 4 + 4 * ((int64_t) loader->stringCount + 1);
+    uint8_t* chars = sectionBytes(loader, SECTION_STRINGS, blob + start, end - start);
+
+    ObjString* str = copyString(loader->vm, (const char*) chars, end - start);
+    loader->strings[idx] = str;
+    return str;
+}
+
+static ObjFunction* functionAt(BytecodeLoader* loader, uint32_t idx);
+
+static Value valueAt(BytecodeLoader* loader, SectionId id, int* offset) {
+    uint8_t tag = *sectionBytes(loader, id, *offset, 1);
+    *offset += 1;
+
+    switch (tag) {
+        case DUMP_NULL:
+            return NULL_VAL;
+
+        case DUMP_BOOL: {
+            uint8_t b = *sectionBytes(loader, id, *offset, 1);
+            *offset += 1;
+            return BOOL_VAL(b == 1);
+        }
+
+        case DUMP_NUMBER: {
+            double num = 0;
+            memcpy(&num, sectionBytes(loader, id, *offset, sizeof(double)), sizeof(double));
+            *offset += sizeof(double);
+            return NUMBER_VAL(num);
+        }
+
+        case DUMP_STRING: {
+            uint32_t idx = sectionInt(loader, id, *offset);
+            *offset += 4;
+            return OBJ_VAL(stringAt(loader, idx));
+        }
+
+        case DUMP_FUNC: {
+            uint32_t idx = sectionInt(loader, id, *offset);
+            *offset += 4;
+            return OBJ_VAL(functionAt(loader, idx));
+        }
+
+        case DUMP_NAMESPACE: {
+            ObjString* name = stringAt(loader, sectionInt(loader, id, *offset));
+            int length = sectionInt(loader, id, *offset + 4);
+            *offset += 8;
+
+            ObjNamespace* nspace = newNamespace(loader->vm, name);
+            for (int i = 0; i < length; i++) {
+                ObjString* key = stringAt(loader, sectionInt(loader, id, *offset));
+                *offset += 4;
+                Value val = valueAt(loader, id, offset);
+                bool public = *sectionBytes(loader, id, *offset, 1) == 1;
+                *offset += 1;
+
+                writeNamespace(loader->vm, nspace, key, val, public);
+            }
+            return OBJ_VAL(nspace);
+        }
+
+        case DUMP_OBJECT: {
+            uint32_t idx = sectionInt(loader, id, *offset);
+            *offset += 4;
+            if (idx >= (uint32_t) loader->objectCount) {
+                fprintf(stderr, "Malformed bytecode, no object %u.\n", idx);
+                exit(65);
+            }
+            return OBJ_VAL(loader->objects[idx]);
+        }
+
+        default:
+            fprintf(stderr, "Malformed bytecode, expected type byte, got '%04u'.\n", tag);
+            exit(65);
+    }
+}
+
+static uint8_t* functionRecord(BytecodeLoader* loader, int idx) {
+    return sectionBytes(loader, SECTION_FUNCTIONS,
+        4 + (int64_t) idx * FUNCTION_RECORD_SIZE, FUNCTION_RECORD_SIZE);
+}
+
+static void readFunctionChunk(BytecodeLoader* loader, ObjFunction* func, int idx) {
+    #ifdef DEBUG_PRINT_LOADER
+        printf("-- reading chunk of function %d\n", idx);
+    #endif
+
+    uint8_t* record = functionRecord(loader, idx);
+    Chunk* chunk = &func->chunk;
+
+    int constants = (int) wordAt(record + 6);
+    int constantCount = (int) wordAt(record + 10);
+    for (int i = 0; i < constantCount; i++)
+        writeValueArray(loader->vm, &chunk->constants, valueAt(loader, SECTION_CONSTANTS, &constants));
+
+    int count = (int) wordAt(record + 18);
+    uint8_t* code = sectionBytes(loader, SECTION_CODE, wordAt(record + 14), count);
+    // Code is used in place when its memory lives as long as the VM, either the mapping
+    // or any section of a loader kept for lazy functions. Typed opcodes are rewritten
+    // in untrusted binaries, so their code is copied.
+    bool inPlace = loader->lazy || (loader->mapped && !loader->sections[SECTION_CODE - 1].owned);
+    if (inPlace && loader->vm->trustTyped) {
+        chunk->code = code;
+        chunk->capacity = 0;
+        chunk->mapped = true;
+    } else {
+        chunk->code = ALLOCATE(loader->vm, uint8_t, count);
+        chunk->capacity = count;
+        memcpy(chunk->code, code, count);
+    }
+    chunk->count = count;
+
+    int lines = (int) wordAt(record + 22);
+    int linesCount = (int) wordAt(record + 26);
+    // Each pair takes at least two bytes.
+    sectionBytes(loader, SECTION_LINES, lines, (int64_t) linesCount * 2);
+    chunk->lines = ALLOCATE(loader->vm, int, linesCount);
+    chunk->lines_run = ALLOCATE(loader->vm, int, linesCount);
+    chunk->lines_count = linesCount;
+    chunk->lines_capacity = linesCount;
+    int line = 0;
+    for (int i = 0; i < linesCount; i++) {
+        uint32_t delta = sectionVarint(loader, SECTION_LINES, &lines);
+        line += (int) (delta >> 1) ^ -(int) (delta & 1);
+        chunk->lines[i] = line;
+        chunk->lines_run[i] = (int) sectionVarint(loader, SECTION_LINES, &lines);
+    }
+
+    if (!loader->vm->trustTyped)
+        guardTypedOps(chunk);
+}
+
+static ObjFunction* functionAt(BytecodeLoader* loader, uint32_t idx) {
+    if (idx >= (uint32_t) loader->functionCount) {
+        fprintf(stderr, "Malformed bytecode, no function %u.\n", idx);
+        exit(65);
+    }
+    if (loader->functions[idx] != NULL)
+        return loader->functions[idx];
+
+    // Cached before its constants are read, so functions held by several chunks are shared.
+    ObjFunction* func = newFunction(loader->vm);
+    loader->functions[idx] = func;
+
+    uint8_t* record = functionRecord(loader, idx);
+    func->arity = record[0];
+    func->upvalueCount = record[1];
+    uint32_t name = wordAt(record + 2);
+    if (name != DUMP_NO_NAME)
+        func->name = stringAt(loader, name);
+
+    if (loader->lazy) {
+        func->loader = loader;
+        func->record = idx;
+    } else {
+        readFunctionChunk(loader, func, idx);
+    }
+
+    return func;
+}
+
+void loadFunction(ObjFunction* func) {
+    BytecodeLoader* loader = func->loader;
+    func->loader = NULL;
+
+    loader->vm->pauseGC++;
+    readFunctionChunk(loader, func, func->record);
+    loader->vm->pauseGC--;
+}
+
+void markLoader(VM* vm, BytecodeLoader* loader) {
+    for (int i = 0; i < loader->stringCount; i++)
+        markObject(vm, (Obj*) loader->strings[i]);
+    for (int i = 0; i < loader->functionCount; i++)
+        markObject(vm, (Obj*) loader->functions[i]);
+}
+
+void forwardLoader(VM* vm, BytecodeLoader* loader) {
+    for (int i = 0; i < loader->stringCount; i++)
+        loader->strings[i] = (ObjString*) forwardObject(vm, (Obj*) loader->strings[i]);
+    for (int i = 0; i < loader->functionCount; i++)
+        loader->functions[i] = (ObjFunction*) forwardObject(vm, (Obj*) loader->functions[i]);
+}
+
+static bool isSectioned(BytecodeLoader* loader) {
+    return loader->length >= BYTECODE_MAGIC_LENGTH &&
+        memcmp(loader->bytes, BYTECODE_MAGIC, BYTECODE_MAGIC_LENGTH) == 0;
+}
+
+// Reads the directory, then the script, which reads the functions and strings it holds.
+static ObjFunction* readProgram(BytecodeLoader* loader) {
+    skip(loader, BYTECODE_MAGIC_LENGTH);
+
+    int version = readInt(loader);
+    if (version < 1 || version > BYTECODE_VERSION) {
+        fprintf(stderr, "Unsupported bytecode version %d, expected %d.\n", version, BYTECODE_VERSION);
+        exit(65);
+    }
+
+    bool found[SECTION_COUNT] = { false };
+    int sections = readInt(loader);
+    for (int i = 0; i < sections; i++) {
+        int id = readInt(loader);
+        int encoding = version == 1 ? SECTION_STORED : readInt(loader);
+        int offset = readInt(loader);
+        int length = readInt(loader);
+        int rawLength = version == 1 ? length : readInt(loader);
+        if (offset < 0 || length < 0 || offset > loader->length - length) {
+            fprintf(stderr, "Malformed bytecode, section %d runs past the end.\n", id);
+            exit(65);
+        }
+
+        if (id < 1 || id > SECTION_COUNT || found[id - 1])
+            continue;
+        found[id - 1] = true;
+
+        BytecodeSection* section = &loader->sections[id - 1];
+        if (encoding == SECTION_STORED) {
+            section->bytes = loader->bytes + offset;
+            section->length = length;
+            continue;
+        }
+
+        // The codec expands a byte to at most 255, which bounds what a corrupt length can allocate.
+        if (encoding != SECTION_LZ || rawLength < 0 || rawLength / 255 > length) {
+            fprintf(stderr, "Malformed bytecode, bad encoding of section %d.\n", id);
+            exit(65);
+        }
+
+        section->bytes = ALLOCATE(loader->vm, uint8_t, rawLength);
+        section->length = rawLength;
+        section->owned = true;
+        if (!lzDecompress(loader->bytes + offset, length, section->bytes, rawLength)) {
+            fprintf(stderr, "Malformed bytecode, could not decompress section %d.\n", id);
+            exit(65);
+        }
+    }
+
+    for (int i = 0; i < PROGRAM_SECTION_COUNT; i++) {
+        if (!found[i]) {
+            fprintf(stderr, "Malformed bytecode, missing section %d.\n", i + 1);
+            exit(65);
+        }
+    }
+
+    int strings = sectionInt(loader, SECTION_STRINGS, 0);
+    int functions = sectionInt(loader, SECTION_FUNCTIONS, 0);
+    if (strings < 0 || strings > loader->sections[SECTION_STRINGS - 1].length / 4 ||
+            functions <= 0 || functions > loader->sections[SECTION_FUNCTIONS - 1].length / FUNCTION_RECORD_SIZE) {
+        fprintf(stderr, "Malformed bytecode, bad string or function count.\n");
+        exit(65);
+    }
+
+    loader->strings = ALLOCATE(loader->vm, ObjString*, strings);
+    loader->stringCount = strings;
+    for (int i = 0; i < strings; i++)
+        loader->strings[i] = NULL;
+
+    // Untrusted binaries are checked in full before anything runs.
+    if (!loader->vm->trustTyped)
+        loader->lazy = false;
+
+    loader->functions = ALLOCATE(loader->vm, ObjFunction*, functions);
+    loader->functionCount = functions;
+    for (int i = 0; i < functions; i++)
+        loader->functions[i] = NULL;
+
+    return functionAt(loader, 0);
+}
+
 ObjFunction* readBytecode(BytecodeLoader* loader) {
     #ifdef DEBUG_PRINT_LOADER
         printf("-- reading bytecode\n");
     #endif
+    if (isSectioned(loader))
+        return readProgram(loader);
+
+    // Legacy binaries have no function table to come back to, so are read in full.
+    loader->lazy = false;
     return readFunction(loader);
 }
+
+static int heapInt(BytecodeLoader* loader, int* offset) {
+    int i = sectionInt(loader, SECTION_HEAP, *offset);
+    *offset += 4;
+    return i;
+}
+
+static Obj* heapObject(BytecodeLoader* loader, uint32_t idx, ObjType type) {
+    if (idx >= (uint32_t) loader->objectCount || loader->objects[idx] == NULL ||
+            loader->objects[idx]->type != type) {
+        fprintf(stderr, "Malformed image, no object %u of type %d.\n", idx, type);
+        exit(65);
+    }
+    return loader->objects[idx];
+}
+
+// An object reference, which can be IMAGE_NO_OBJECT.
+static Obj* heapRef(BytecodeLoader* loader, int* offset, ObjType type) {
+    uint32_t idx = heapInt(loader, offset);
+    return idx == IMAGE_NO_OBJECT ? NULL : heapObject(loader, idx, type);
+}
+
+static void heapTable(BytecodeLoader* loader, int* offset, Table* table) {
+    int count = heapInt(loader, offset);
+    for (int i = 0; i < count; i++) {
+        ObjString* key = stringAt(loader, heapInt(loader, offset));
+        Value val = valueAt(loader, SECTION_HEAP, offset);
+        tableSet(loader->vm, table, key, val);
+    }
+}
+
+// Natives are bound by library and name to the functions of this VM.
+static NativeFn heapNative(VM* vm, NativeName* natives, int count, ObjString* library, ObjString* name) {
+    for (int i = 0; i < count; i++) {
+        if (natives[i].library == library && natives[i].name == name)
+            return natives[i].function;
+    }
+
+    fprintf(stderr, "Image uses native '%s.%s', which is not defined.\n", library->chars, name->chars);
+    exit(65);
+}
+
+// Objects are created first, so the bodies that follow can refer to any of them.
+// Instances are created after the classes they are made from.
+static void createObjects(BytecodeLoader* loader) {
+    VM* vm = loader->vm;
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < loader->objectCount; i++) {
+            uint8_t* header = sectionBytes(loader, SECTION_HEAP, 4 + (int64_t) i * IMAGE_OBJECT_HEADER_SIZE,
+                IMAGE_OBJECT_HEADER_SIZE);
+            uint8_t kind = header[0];
+            uint32_t word = wordAt(header + 1);
+            if ((kind == IMAGE_INSTANCE) != (pass == 1))
+                continue;
+
+            Obj* obj = NULL;
+            switch (kind) {
+                case IMAGE_CLOSURE:
+                    obj = (Obj*) newClosure(vm, functionAt(loader, word));
+                    break;
+                case IMAGE_UPVALUE: {
+                    ObjUpvalue* upvalue = newUpvalue(vm, NULL);
+                    upvalue->location = &upvalue->closed;
+                    obj = (Obj*) upvalue;
+                    break;
+                }
+                case IMAGE_CLASS:
+                    obj = (Obj*) newClass(vm, stringAt(loader, word));
+                    break;
+                case IMAGE_INSTANCE:
+                    obj = (Obj*) newInstance(vm, (ObjClass*) heapObject(loader, word, OBJ_CLASS));
+                    break;
+                case IMAGE_BOUND_METHOD:
+                    obj = (Obj*) newBoundMethod(vm, NULL_VAL, NULL);
+                    break;
+                case IMAGE_LIST:
+                    obj = (Obj*) newList(vm);
+                    break;
+                case IMAGE_NAMESPACE:
+                    obj = (Obj*) newNamespace(vm, stringAt(loader, word));
+                    break;
+                case IMAGE_ATTRIBUTE:
+                    obj = (Obj*) newAttribute(vm, NULL_VAL, false, false, false);
+                    break;
+                case IMAGE_NATIVE:
+                    obj = (Obj*) newNative(vm, NULL);
+                    break;
+                default:
+                    fprintf(stderr, "Malformed image, unknown object kind %d.\n", kind);
+                    exit(65);
+            }
+            loader->objects[i] = obj;
+        }
+    }
+}
+
+static void readObject(BytecodeLoader* loader, int idx, int* offset, NativeName* natives, int nativeCount) {
+    VM* vm = loader->vm;
+    Obj* obj = loader->objects[idx];
+
+    switch (obj->type) {
+        case OBJ_CLOSURE: {
+            ObjClosure* clos = (ObjClosure*) obj;
+            if (heapInt(loader, offset) != clos->upvalueCount) {
+                fprintf(stderr, "Malformed image, closure %d has the wrong upvalue count.\n", idx);
+                exit(65);
+            }
+            for (int i = 0; i < clos->upvalueCount; i++)
+                clos->upvalues[i] = (ObjUpvalue*) heapRef(loader, offset, OBJ_UPVALUE);
+            break;
+        }
+
+        case OBJ_UPVALUE:
+            ((ObjUpvalue*) obj)->closed = valueAt(loader, SECTION_HEAP, offset);
+            break;
+
+        case OBJ_CLASS: {
+            ObjClass* clazz = (ObjClass*) obj;
+            clazz->constructor = (ObjClosure*) heapRef(loader, offset, OBJ_CLOSURE);
+            for (int i = 0; i < DEFAULT_METHOD_COUNT; i++)
+                clazz->defaultMethods[i] = (ObjClosure*) heapRef(loader, offset, OBJ_CLOSURE);
+            clazz->bound = valueAt(loader, SECTION_HEAP, offset);
+            heapTable(loader, offset, &clazz->methods);
+            heapTable(loader, offset, &clazz->fields);
+            heapTable(loader, offset, &clazz->staticFields);
+            break;
+        }
+
+        case OBJ_INSTANCE: {
+            ObjInstance* inst = (ObjInstance*) obj;
+            inst->bound = valueAt(loader, SECTION_HEAP, offset);
+            heapTable(loader, offset, &inst->fields);
+            break;
+        }
+
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* bound = (ObjBoundMethod*) obj;
+            bound->reciever = valueAt(loader, SECTION_HEAP, offset);
+            bound->method = (ObjClosure*) heapObject(loader, heapInt(loader, offset), OBJ_CLOSURE);
+            break;
+        }
+
+        case OBJ_LIST: {
+            ObjList* list = (ObjList*) obj;
+            int count = heapInt(loader, offset);
+            for (int i = 0; i < count; i++)
+                writeValueArray(vm, &list->list, valueAt(loader, SECTION_HEAP, offset));
+            break;
+        }
+
+        case OBJ_NAMESPACE: {
+            ObjNamespace* nspace = (ObjNamespace*) obj;
+            heapTable(loader, offset, nspace->values);
+            heapTable(loader, offset, nspace->publics);
+            break;
+        }
+
+        case OBJ_ATTRIBUTE: {
+            ObjAttribute* attr = (ObjAttribute*) obj;
+            uint8_t flags = *sectionBytes(loader, SECTION_HEAP, (*offset)++, 1);
+            attr->isPublic = (flags & 1) != 0;
+            attr->isStatic = (flags & 2) != 0;
+            attr->isConstant = (flags & 4) != 0;
+            attr->val = valueAt(loader, SECTION_HEAP, offset);
+            break;
+        }
+
+        case OBJ_NATIVE: {
+            uint8_t* header = sectionBytes(loader, SECTION_HEAP, 4 + (int64_t) idx * IMAGE_OBJECT_HEADER_SIZE,
+                IMAGE_OBJECT_HEADER_SIZE);
+            ObjString* library = stringAt(loader, wordAt(header + 1));
+            ObjString* name = stringAt(loader, heapInt(loader, offset));
+            ((ObjNative*) obj)->function = heapNative(vm, natives, nativeCount, library, name);
+            break;
+        }
+
+        default:
+            break;
+    }
+}
+
+bool readImage(BytecodeLoader* loader) {
+    BytecodeSection* heap = &loader->sections[SECTION_HEAP - 1];
+    if (heap->bytes == NULL)
+        return false;
+
+    VM* vm = loader->vm;
+    vm->pauseGC++;
+
+    int offset = 0;
+    int count = heapInt(loader, &offset);
+    if (count < 0 || count > heap->length / IMAGE_OBJECT_HEADER_SIZE) {
+        fprintf(stderr, "Malformed image, bad object count.\n");
+        exit(65);
+    }
+
+    loader->objects = ALLOCATE(vm, Obj*, count);
+    loader->objectCount = count;
+    for (int i = 0; i < count; i++)
+        loader->objects[i] = NULL;
+    createObjects(loader);
+
+    int nativeCount = 0;
+    NativeName* natives = listNatives(vm, &nativeCount);
+    offset += count * IMAGE_OBJECT_HEADER_SIZE;
+    for (int i = 0; i < count; i++)
+        readObject(loader, i, &offset, natives, nativeCount);
+    FREE_ARRAY(vm, NativeName, natives, nativeCount);
+
+    heapTable(loader, &offset, &vm->globals);
+    heapTable(loader, &offset, &vm->importedFiles);
+    vm->nspace = (ObjNamespace*) heapObject(loader, heapInt(loader, &offset), OBJ_NAMESPACE);
+    uint32_t mainFunc = heapInt(loader, &offset);
+    vm->mainFunc = mainFunc == IMAGE_NO_OBJECT ? NULL : functionAt(loader, mainFunc);
+
+    FREE_ARRAY(vm, Obj*, loader->objects, loader->objectCount);
+    loader->objects = NULL;
+    loader->objectCount = 0;
+
+    vm->pauseGC--;
+    return true;
+}
+
@@ -7,20 +7,70 @@
 
 #include "../util/table.h"
 #include "../vm/value.h"
+#include "../compiler/dumper.h"
+
+typedef struct {
+    uint8_t* bytes;
+    int length;
+    // Set when bytes were decompressed into memory owned by the loader.
+    bool owned;
+} BytecodeSection;
 
 struct BytecodeLoader {
     uint8_t* bytes;
     uint8_t byte;
     int idx;
     int length;
+    // Set when bytes is the VM's mapping of the binary, which chunks point their code into.
+    bool mapped;
+    // Set when functions of a sectioned binary are left as stubs until first called.
+    // The loader then has to live as long as the VM.
+    bool lazy;
+
+    // Sections of a sectioned binary, and the strings and functions read from
+    // them so far, by index.
+    BytecodeSection sections[SECTION_COUNT];
+    ObjString** strings;
+    int stringCount;
+    ObjFunction** functions;
+    int functionCount;
+    // Objects of an image's heap by index, only held while it is read.
+    Obj** objects;
+    int objectCount;
     
     VM* vm;
 };
 
+// An executable bundle is the npz executable with a binary appended, followed by a
+// trailer of the binary's offset as a little endian 64 bit word and the magic.
+#define BUNDLE_MAGIC "NPZBUNDL"
+#define BUNDLE_MAGIC_LENGTH 8
+#define BUNDLE_TRAILER_SIZE 16
+
 BytecodeLoader* newLoader(VM* vm, uint8_t* bytes, int length);
+// Maps the binary at path read-only, so that loaded code is shared with other
+// processes running it. Returns NULL when the file cannot be mapped.
+BytecodeLoader* mapLoader(VM* vm, const char* path);
+// Finds the binary embedded in the executable at path, returning false when it has none.
+bool findBundle(const char* path, size_t* offset, size_t* length);
+// Maps the executable at path and loads the binary embedded in it, read into memory
+// when it cannot be mapped. Returns NULL when the executable has no binary.
+BytecodeLoader* bundleLoader(VM* vm, const char* path);
 void freeLoader(VM* vm, BytecodeLoader* loader);
+// Releases the binary mapped by the VM, once no chunk points into it.
+void unmapBytecode(VM* vm);
 
 Table readTable(BytecodeLoader* loader);
+// Reads a sectioned binary, or one in the legacy recursive format.
 ObjFunction* readBytecode(BytecodeLoader* loader);
+// Restores the heap of an image read by readBytecode into the VM: its globals,
+// imported files, namespace and main function. Returns false when the binary is
+// not an image.
+bool readImage(BytecodeLoader* loader);
+// Reads the chunk of a function left as a stub by a lazy loader.
+void loadFunction(ObjFunction* func);
+// Strings and functions cached by a lazy loader are held until the VM is freed.
+void markLoader(VM* vm, BytecodeLoader* loader);
+void forwardLoader(VM* vm, BytecodeLoader* loader);
 
 #endif
@@ -12,12 +12,12 @@
 #define ALLOCATE_OBJ(vm, type, objectType) (type*) allocateObject(vm, sizeof(type), objectType)
 
 void takeOwnership(VM* vm, Obj* objs) {
-    vm->bytesAllocated += sizeof(objs);
+    vm->bytesAllocated += objectSize(objs);
 
     Obj* tail = objs;
     while (tail->next != NULL) {
         tail = tail->next;
-        vm->bytesAllocated += sizeof(tail);
+        vm->bytesAllocated += objectSize(tail);
     }
 
     tail->next = vm->objects;
@@ -46,7 +46,7 @@ static ObjString* allocateString(VM* vm, const char* src, int len, uint32_t hash
     string->hash = hash;
 
     push(vm, OBJ_VAL(string));
-    tableSet(vm, &vm->strings, string, NULL_VAL);
+    tableSet(vm, vm->interned, string, NULL_VAL);
     pop(vm);
 
     return string;
@@ -81,6 +81,8 @@ ObjFunction* newFunction(VM* vm) {
     func->arity = 0;
     func->name = NULL;
     func->upvalueCount = 0;
+    func->loader = NULL;
+    func->record = 0;
     initChunk(&func->chunk);
     return func;
 }
@@ -96,6 +98,10 @@ ObjClass* newClass(VM* vm, ObjString* name) {
     clazz->name = name;
     clazz->constructor = NULL;
     initTable(&clazz->methods);
+    initTable(&clazz->fields);
+    initTable(&clazz->staticFields);
+    for (int i = 0; i < DEFAULT_METHOD_COUNT; i++)
+        clazz->defaultMethods[i] = NULL;
     clazz->bound = NULL_VAL;
     return clazz;
 }
@@ -104,6 +110,8 @@ ObjInstance* newInstance(VM* vm, ObjClass* clazz) {
     ObjInstance* inst = ALLOCATE_OBJ(vm, ObjInstance, OBJ_INSTANCE);
     push(vm, OBJ_VAL(inst));
     inst->clazz = clazz;
+    // Set before the fields are copied, as copying them can collect.
+    inst->bound = clazz->bound;
     initTable(&inst->fields);
     for (int i = 0; i < clazz->fields.capacity; i++) {
         Entry* entry = &clazz->fields.entries[i];
@@ -116,7 +124,6 @@ ObjInstance* newInstance(VM* vm, ObjClass* clazz) {
         pop(vm);
     }
     pop(vm);
-    inst->bound = clazz->bound;
     return inst;
 }
 
@@ -167,7 +174,7 @@ bool getNamespace(VM* vm, ObjNamespace* nspace, ObjString* name, Value* ptr, boo
 
 ObjString* takeString(VM* vm, const char* src, int len) {
     uint32_t hash = hashString(src, len);
-    ObjString* interned = tableFindString(&vm->strings, src, len, hash);
+    ObjString* interned = tableFindString(vm->interned, src, len, hash);
     if (interned != NULL) {
         FREE_ARRAY(vm, char, src, len + 1);
         return interned;
@@ -178,7 +185,7 @@ ObjString* takeString(VM* vm, const char* src, int len) {
 ObjString* copyString(VM* vm, const char* src, int len) {
     uint32_t hash = hashString(src, len);
 
-    ObjString* interned = tableFindString(&vm->strings, src, len, hash);
+    ObjString* interned = tableFindString(vm->interned, src, len, hash);
     if (interned != NULL) 
         return interned;
 
@@ -189,14 +196,16 @@ ObjString* copyString(VM* vm, const char* src, int len) {
 }
 
 ObjString* formatString(VM* vm, const char* format, ...) {
-    va_list args;
+    va_list args, argsCopy;
     va_start(args, format);
+    va_copy(argsCopy, args);
 
     int len = vsnprintf(NULL, 0, format, args);
     char* buf = ALLOCATE(vm, char, len + 1);
     if (buf == NULL) exit(1);
-    vsnprintf(buf, len + 1, format, args);
+    vsnprintf(buf, len + 1, format, argsCopy);
 
+    va_end(argsCopy);
     va_end(args);
 
     return takeString(vm, buf, len);
@@ -231,6 +240,10 @@ ObjPtr* newPtr(VM* vm, const char* origin, int typeEncoding) {
     ptr->freeFn = NULL;
     ptr->printFn = NULL;
     ptr->stringFn = NULL;
+    ptr->hashFn = NULL;
+    ptr->relocateFn = NULL;
+    ptr->getIndexFn = NULL;
+    ptr->setIndexFn = NULL;
 
     return ptr;
 }
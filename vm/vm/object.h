@@ -37,22 +37,6 @@
 #define AS_ATTRIBUTE(val) ((ObjAttribute*) AS_OBJ(val))
 #define AS_PTR(val) ((ObjPtr*) AS_OBJ(val))
 
-typedef enum {
-    OBJ_STRING,
-    OBJ_FUNCTION,
-    OBJ_NATIVE,
-    OBJ_CLOSURE,
-    OBJ_UPVALUE,
-    OBJ_CLASS,
-    OBJ_INSTANCE,
-    OBJ_BOUND_METHOD,
-    OBJ_LIST,
-    OBJ_NAMESPACE,
-    OBJ_LIBRARY,
-    OBJ_ATTRIBUTE,
-    OBJ_PTR,
-} ObjType;
-
 struct Obj {
     ObjType type;
     struct Obj* next;
@@ -72,6 +56,9 @@ struct ObjFunction {
     int upvalueCount;
     Chunk chunk;
     ObjString* name;
+    // Set while the chunk is still in the binary, read from the record on first call.
+    BytecodeLoader* loader;
+    int record;
 };
 
 struct ObjUpvalue {
@@ -99,6 +86,9 @@ struct ObjPtr {
     PtrPrintFunc printFn;
     PtrStringFunc stringFn;
     PtrHashFunc hashFn;
+    PtrRelocateFunc relocateFn;
+    PtrGetIndexFunc getIndexFn;
+    PtrSetIndexFunc setIndexFn;
 };
 
 #define DEFAULT_METHOD_COUNT 3
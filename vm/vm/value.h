@@ -3,6 +3,7 @@
 #define jp_value_h
 
 #include <stdbool.h>
+#include <stddef.h>
 
 typedef int int32_t;
 
@@ -30,11 +31,34 @@ typedef void (*PtrFreeFunc)(VM* vm, ObjPtr* ptr);
 typedef ObjString* (*PtrStringFunc)(VM* vm, ObjPtr* ptr);
 typedef void (*PtrPrintFunc)(ObjPtr* ptr);
 typedef size_t (*PtrHashFunc)(VM* vm, ObjPtr* ptr);
+typedef void (*PtrRelocateFunc)(VM* vm, ObjPtr* ptr);
+
+typedef enum {
+    OBJ_STRING,
+    OBJ_FUNCTION,
+    OBJ_NATIVE,
+    OBJ_CLOSURE,
+    OBJ_UPVALUE,
+    OBJ_CLASS,
+    OBJ_INSTANCE,
+    OBJ_BOUND_METHOD,
+    OBJ_LIST,
+    OBJ_NAMESPACE,
+    OBJ_LIBRARY,
+    OBJ_ATTRIBUTE,
+    OBJ_PTR,
+} ObjType;
+
+#define OBJ_TYPE_COUNT (OBJ_PTR + 1)
 
 typedef struct NativeResult NativeResult;
 
-typedef struct DumpedBytes DumpedBytes;
+typedef struct BytecodeWriter BytecodeWriter;
 typedef struct BytecodeLoader BytecodeLoader;
+typedef struct ModuleCache ModuleCache;
+typedef struct ImportScheduler ImportScheduler;
+typedef struct ImportPlan ImportPlan;
+typedef struct HeapSnapshot HeapSnapshot;
 
 typedef enum {
     VAL_BOOL,
@@ -52,6 +76,11 @@ typedef struct {
     } as;
 } Value;
 
+// Index operations on a pointer, which return false after reporting a runtime error.
+// Getting must not allocate, as the operands are already off the stack.
+typedef bool (*PtrGetIndexFunc)(VM* vm, ObjPtr* ptr, Value idx, Value* res);
+typedef bool (*PtrSetIndexFunc)(VM* vm, ObjPtr* ptr, Value idx, Value val);
+
 #define BOOL_VAL(val) ((Value) { VAL_BOOL, { .boolean = val }})
 #define NULL_VAL ((Value) { VAL_NULL, { .number = 0 }})
 #define NUMBER_VAL(val) ((Value) { VAL_NUMBER, { .number = val }})
@@ -4,10 +4,12 @@
 #include <string.h>
 
 #include "../util/common.h"
+#include "../compiler/cache.h"
 #include "../compiler/compiler.h"
 #include "../util/debug.h"
 #include "../libraries/core/manager.h"
 #include "../util/memory.h"
+#include "loader.h"
 #include "object.h"
 #include "value.h"
 #include "vm.h"
@@ -41,7 +43,7 @@ void runtimeError(VM* vm, const char* format, ...) {
     resetStack(vm);
 }
 
-void initVM(VM* vm, const char* name) {
+void initVM(VM* vm, VM* parent, const char* name) {
     resetStack(vm);
     vm->objects = NULL;
     vm->compiler = NULL;
@@ -50,18 +52,33 @@ void initVM(VM* vm, const char* name) {
     vm->isMain = false;
     vm->mainFunc = NULL;
     vm->nspace = NULL;
+    vm->mapping = NULL;
+    vm->mappingLength = 0;
+    vm->loader = NULL;
 
     initTable(&vm->globals);
     initTable(&vm->strings);
     initTable(&vm->libraries);
     initTable(&vm->importedFiles);
+    initTable(&vm->fixedNames);
+    vm->interned = parent == NULL ? &vm->strings : parent->interned;
+    vm->optimize = parent == NULL ? 0 : parent->optimize;
+    vm->trustTyped = parent == NULL ? true : parent->trustTyped;
+    vm->inlineReport = parent == NULL ? NULL : parent->inlineReport;
+    vm->moduleCache = parent == NULL ? NULL : parent->moduleCache;
+    vm->scheduler = parent == NULL ? NULL : parent->scheduler;
+    vm->importPlan = NULL;
 
     vm->grayStack = NULL;
     vm->grayCount = 0;
     vm->grayCapacity = 0;
+    vm->snapshot = NULL;
+    vm->compactPending = false;
+    vm->runDepth = 0;
 
-    vm->bytesAllocated = 0;
-    vm->nextGC = 1024 * 1024;
+    initGC(vm);
+    if (parent != NULL)
+        inheritGC(vm, parent);
 
     defineAllLibraries(vm);
 
@@ -78,10 +95,21 @@ static void endVM(VM* vm) {
     freeTable(vm, &vm->strings);   
     freeTable(vm, &vm->globals);
     freeTable(vm, &vm->importedFiles);
+    freeTable(vm, &vm->fixedNames);
 }
 
 void freeVM(VM* vm) {
     freeObjects(vm);
+    if (vm->loader != NULL)
+        freeLoader(vm, vm->loader);
+    unmapBytecode(vm);
+
+    if (vm->isMain && vm->gcConfig.log != NULL)
+        fclose(vm->gcConfig.log);
+    if (vm->isMain && vm->inlineReport != NULL)
+        fclose(vm->inlineReport);
+    if (vm->isMain && vm->moduleCache != NULL)
+        freeModuleCache(vm->moduleCache);
 
     endVM(vm);
 }
@@ -209,6 +237,9 @@ static bool call(VM* vm, ObjClosure* clos, int argc, Value binder) {
     if (IS_NULL(binder) && vm->frameCount > 0)
         binder = vm->frames[vm->frameCount - 1].bound;
 
+    if (clos->function->loader != NULL)
+        loadFunction(clos->function);
+
     CallFrame* frame = &vm->frames[vm->frameCount++];
     frame->closure = clos;
     frame->ip = clos->function->chunk.code;
@@ -265,6 +296,57 @@ static bool callValue(VM* vm, Value callee, int argc) {
     return false;
 }
 
+// Functions loaded from a binary are separate objects from the ones their calls
+// were inlined from, so a guard also accepts a function with the same code.
+static bool sameFunction(VM* vm, ObjFunction* a, ObjFunction* b) {
+    if (a->loader != NULL)
+        loadFunction(a);
+    if (b->loader != NULL)
+        loadFunction(b);
+
+    if (a->arity != b->arity || a->upvalueCount != b->upvalueCount ||
+            a->chunk.count != b->chunk.count || a->chunk.constants.count != b->chunk.constants.count)
+        return false;
+    if (memcmp(a->chunk.code, b->chunk.code, a->chunk.count) != 0)
+        return false;
+
+    for (int i = 0; i < a->chunk.constants.count; i++) {
+        Value x = a->chunk.constants.values[i];
+        Value y = b->chunk.constants.values[i];
+        if (x.type != y.type)
+            return false;
+        if (IS_OBJ(x) ? AS_OBJ(x) != AS_OBJ(y) : !valuesEqual(vm, x, y))
+            return false;
+    }
+    return true;
+}
+
+// An inlined body runs in the caller's frame, so it can only stand in for a
+// call that would bind the same receiver. The guard's constant is pointed at
+// the matching function, so later checks compare pointers.
+static bool inlineGuard(VM* vm, CallFrame* frame, int argc, Value* expected) {
+    Value callee = peek(vm, argc);
+    ObjFunction* func;
+    if (IS_CLOSURE(callee)) {
+        func = AS_CLOSURE(callee)->function;
+    } else if (IS_BOUND_METHOD(callee) && IS_OBJ(AS_BOUND_METHOD(callee)->reciever) &&
+            IS_OBJ(frame->bound) && AS_OBJ(AS_BOUND_METHOD(callee)->reciever) == AS_OBJ(frame->bound)) {
+        func = AS_BOUND_METHOD(callee)->method->function;
+    } else {
+        return false;
+    }
+
+    if (func != AS_FUNCTION(*expected)) {
+        if (!sameFunction(vm, func, AS_FUNCTION(*expected)))
+            return false;
+        *expected = OBJ_VAL(func);
+    }
+
+    if (IS_BOUND_METHOD(callee))
+        vm->stackTop[-argc - 1] = AS_BOUND_METHOD(callee)->reciever;
+    return true;
+}
+
 static bool invokeFromClass(VM* vm, ObjClass* clazz, ObjString* name, int argc, Value inst) {
     Value method;
     if (!getInstanceClassMethod(vm, clazz, name, &method, false)) {
@@ -498,13 +580,14 @@ static void defineBuilder(VM* vm) {
     pop(vm);
 }
 
-InterpretResult run(VM* vm) {
+static InterpretResult execute(VM* vm) {
     CallFrame* frame = &vm->frames[vm->frameCount - 1];
     int exitLevel = vm->frameCount - 1;
     #define READ_BYTE() (*(frame->ip++))
     #define READ_SHORT() (frame->ip += 2, (uint16_t) ((frame->ip[-2] << 8) | frame->ip[-1]))
     #define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
-    #define READ_LONG_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE() + (READ_BYTE() << 8) + (READ_BYTE() << 16)])
+    #define READ_LONG_CONSTANT() (frame->ip += 3, \
+        frame->closure->function->chunk.constants.values[frame->ip[-3] | (frame->ip[-2] << 8) | (frame->ip[-1] << 16)])
     #define READ_STRING() AS_STRING(READ_CONSTANT())
     #define BINARY_NUMBER_OP(velcro, op) \
         do { \
@@ -532,6 +615,11 @@ InterpretResult run(VM* vm) {
             } \
             break; \
         } while(false)
+    #define TYPED_NUMBER_OP(velcro, op) \
+        do { \
+            double b = AS_NUMBER(pop(vm)); \
+            vm->stackTop[-1] = velcro(AS_NUMBER(vm->stackTop[-1]) op b); \
+        } while (false)
 
     #ifdef DEBUG_PRINT_CODE
         disassembleChunk(&frame->closure->function->chunk, frame->closure->function->name == NULL ? "<script>" : frame->closure->function->name->chars);
@@ -626,6 +714,61 @@ InterpretResult run(VM* vm) {
             case OP_LESS_EQUAL:
                 BINARY_JOINT_OP(BOOL_VAL(a <= b), BOOL_VAL(strcmp(a, b) <= 0)); 
                 break;
+
+            // Operand types were proven by the compiler, or the loader would
+            // have replaced these with their generic forms.
+            case OP_ADD_NUM: TYPED_NUMBER_OP(NUMBER_VAL, +); break;
+            case OP_SUBTRACT_NUM: TYPED_NUMBER_OP(NUMBER_VAL, -); break;
+            case OP_MULTIPLY_NUM: TYPED_NUMBER_OP(NUMBER_VAL, *); break;
+            case OP_DIVIDE_NUM: TYPED_NUMBER_OP(NUMBER_VAL, /); break;
+            case OP_GREATER_NUM: TYPED_NUMBER_OP(BOOL_VAL, >); break;
+            case OP_GREATER_EQUAL_NUM: TYPED_NUMBER_OP(BOOL_VAL, >=); break;
+            case OP_LESS_NUM: TYPED_NUMBER_OP(BOOL_VAL, <); break;
+            case OP_LESS_EQUAL_NUM: TYPED_NUMBER_OP(BOOL_VAL, <=); break;
+            case OP_ADD_STRING: concatenate(vm); break;
+            case OP_ADD_LIST: addLists(vm); break;
+            case OP_INLINE: {
+                int argc = READ_BYTE();
+                Value* expected = &frame->closure->function->chunk.constants.values[READ_BYTE()];
+                uint16_t offset = READ_SHORT();
+                if (inlineGuard(vm, frame, argc, expected))
+                    break;
+
+                frame->ip += offset;
+                if (!callValue(vm, peek(vm, argc), argc))
+                    return INTERPRET_RUNTIME_ERR;
+                frame = &vm->frames[vm->frameCount - 1];
+                break;
+            }
+            case OP_GET_STACK: {
+                uint8_t distance = READ_BYTE();
+                push(vm, vm->stackTop[-1 - distance]);
+                break;
+            }
+            case OP_SET_STACK: {
+                uint8_t distance = READ_BYTE();
+                vm->stackTop[-1 - distance] = peek(vm, 0);
+                break;
+            }
+            case OP_END_INLINE: {
+                uint8_t count = READ_BYTE();
+                vm->stackTop[-1 - count] = vm->stackTop[-1];
+                vm->stackTop -= count;
+                break;
+            }
+            case OP_GET_INDEX_LIST: {
+                int idx = (int) AS_NUMBER(pop(vm));
+                ObjList* lst = AS_LIST(peek(vm, 0));
+                if (idx < 0)
+                    idx += lst->list.count;
+
+                if (idx >= lst->list.count || idx < 0) {
+                    runtimeError(vm, "Index out of bounds.");
+                    return INTERPRET_RUNTIME_ERR;
+                }
+                vm->stackTop[-1] = lst->list.values[idx];
+                break;
+            }
             case OP_RETURN: {
                 Value res = pop(vm);
                 closeUpvalues(vm, frame->slots);
@@ -718,6 +861,8 @@ InterpretResult run(VM* vm) {
             case OP_LOOP: {
                 uint16_t offs = READ_SHORT();
                 frame->ip -= offs;
+                if (vm->compactPending && canCompactHeap(vm))
+                    compactHeap(vm);
                 break;
             }
 
@@ -755,6 +900,8 @@ InterpretResult run(VM* vm) {
 
             case OP_CALL: {
                 int argc = READ_BYTE();
+                if (vm->compactPending && canCompactHeap(vm))
+                    compactHeap(vm);
                 if (!callValue(vm, peek(vm, argc), argc)) {
                     return INTERPRET_RUNTIME_ERR;
                 }
@@ -906,18 +1053,24 @@ InterpretResult run(VM* vm) {
                 } else if (methodType == 2) {
                     defineDefMethod(vm, READ_BYTE());
                 } else {
-                    if (!defineMethod(vm, READ_STRING(), 
-                            READ_BYTE() == 1, READ_BYTE() == 1))
+                    ObjString* name = READ_STRING();
+                    bool isPublic = READ_BYTE() == 1;
+                    bool isStatic = READ_BYTE() == 1;
+                    if (!defineMethod(vm, name, isPublic, isStatic))
                         return INTERPRET_RUNTIME_ERR;
                 }
                 break;
             }
 
-            case OP_ATTRIBUTE:
-                if (!defineAttribute(vm, READ_STRING(), READ_BYTE() == 1, 
-                        READ_BYTE() == 1, READ_BYTE() == 1))
+            case OP_ATTRIBUTE: {
+                ObjString* name = READ_STRING();
+                bool isConstant = READ_BYTE() == 1;
+                bool isPublic = READ_BYTE() == 1;
+                bool isStatic = READ_BYTE() == 1;
+                if (!defineAttribute(vm, name, isConstant, isPublic, isStatic))
                     return INTERPRET_RUNTIME_ERR;
                 break;
+            }
 
             case OP_INVOKE: {
                 ObjString* method = READ_STRING();
@@ -1009,6 +1162,11 @@ InterpretResult run(VM* vm) {
                         return INTERPRET_RUNTIME_ERR;
                     }
                     push(vm, OBJ_VAL(copyString(vm, str->chars + idx, 1)));
+                } else if (IS_PTR(a) && AS_PTR(a)->getIndexFn != NULL) {
+                    Value res;
+                    if (!AS_PTR(a)->getIndexFn(vm, AS_PTR(a), b, &res))
+                        return INTERPRET_RUNTIME_ERR;
+                    push(vm, res);
                 } else {
                     runtimeError(vm, "Invalid index getting operation recipients.");
                     return INTERPRET_RUNTIME_ERR;
@@ -1033,6 +1191,12 @@ InterpretResult run(VM* vm) {
 
                     lst->list.values[idx] = newVal;
 
+                    popn(vm, 3);
+                    push(vm, newVal);
+                } else if (IS_PTR(a) && AS_PTR(a)->setIndexFn != NULL) {
+                    if (!AS_PTR(a)->setIndexFn(vm, AS_PTR(a), b, newVal))
+                        return INTERPRET_RUNTIME_ERR;
+
                     popn(vm, 3);
                     push(vm, newVal);
                 } else {
@@ -1071,7 +1235,7 @@ InterpretResult run(VM* vm) {
                 ObjFunction* func = AS_FUNCTION(peek(vm, 0));
 
                 VM* temp = malloc(sizeof(VM));
-                initVM(temp, filename->chars);
+                initVM(temp, vm, filename->chars);
 
                 tableSet(vm, &vm->importedFiles, filename, OBJ_VAL(temp->nspace));
                 tableAddAll(temp, &vm->importedFiles, &temp->importedFiles);
@@ -1132,6 +1296,16 @@ InterpretResult run(VM* vm) {
     #undef READ_CONSTANT
     #undef READ_STRING
     #undef BINARY_OP
+    #undef TYPED_NUMBER_OP
+}
+
+// Tracks how many interpreter loops are on the C stack. Only the outermost
+// one is a safe point for moving objects.
+InterpretResult run(VM* vm) {
+    vm->runDepth++;
+    InterpretResult res = execute(vm);
+    vm->runDepth--;
+    return res;
 }
 
 InterpretResult runFuncBound(VM* vm, ObjFunction* func, Value bound) {
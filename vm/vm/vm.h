@@ -2,6 +2,8 @@
 #ifndef jp_vm_h
 #define jp_vm_h
 
+#include <stdio.h>
+
 #include "../compiler/chunk.h"
 #include "../compiler/compiler.h"
 #include "object.h"
@@ -27,6 +29,27 @@ struct NativeResult {
 #define NATIVE_OK (NATIVE_VAL(NULL_VAL))
 #define NATIVE_FAIL ((NativeResult) { false, NULL_VAL })
 
+typedef struct {
+    double growthFactor;
+    size_t initialHeap;
+    size_t maxHeap;
+    double compactThreshold;
+    FILE* log;
+} GCConfig;
+
+typedef struct {
+    int collections;
+    double lastPause;
+    double totalPause;
+    size_t lastFreed;
+    size_t totalFreed;
+    size_t liveBytes[OBJ_TYPE_COUNT];
+    int liveObjects[OBJ_TYPE_COUNT];
+    int compactions;
+    double lastCompactPause;
+    size_t freedSinceCompact;
+} GCStats;
+
 struct VM {
     CallFrame frames[FRAMES_MAX];
     int frameCount;
@@ -35,6 +58,9 @@ struct VM {
     Value* stackTop;
     Table globals;
     Table strings;
+    // Intern table in use, shared with the VM that spawned this one so that
+    // equal strings are the same object across imports.
+    Table* interned;
     Obj* objects;
 
     ObjUpvalue* openUpvalues;
@@ -45,8 +71,27 @@ struct VM {
 
     size_t bytesAllocated;
     size_t nextGC;
+    GCConfig gcConfig;
+    GCStats gcStats;
+    HeapSnapshot* snapshot;
+    bool compactPending;
+    int runDepth;
 
     Compiler* compiler;
+    // Optimization level for source compiled by this VM, 0 emits bytecode as written.
+    int optimize;
+    // Whether typed opcodes in loaded bytecode are run unchecked, otherwise the
+    // loader swaps them for their generic forms.
+    bool trustTyped;
+    // Receives a line for each call the compiler considered inlining, NULL when off.
+    FILE* inlineReport;
+    // Compiled imports kept between runs, shared with the VMs compiling them. NULL when off.
+    ModuleCache* moduleCache;
+    // Files being compiled ahead on threads, shared like the cache. NULL when off.
+    ImportScheduler* scheduler;
+    // Set on a VM compiling a file on one of those threads, whose imports were found
+    // before it started and are not compiled by it.
+    ImportPlan* importPlan;
 
     Table libraries;
 
@@ -61,6 +106,15 @@ struct VM {
 
     ObjNamespace* nspace;
     Table importedFiles;
+    // Binary that loaded chunks point their code into, unmapped when the VM is freed.
+    void* mapping;
+    size_t mappingLength;
+    // Loader of the binary being run, kept for functions that have not been called yet.
+    BytecodeLoader* loader;
+    // Script level names the compiler resolved while compiling, keyed by file path and
+    // name: a class or constant that cannot be reassigned, or for a constant holding an
+    // imported file, its path. Literal const pub static fields are under path and class.field.
+    Table fixedNames;
 };
 
 typedef enum {
@@ -69,7 +123,7 @@ typedef enum {
     INTERPRET_RUNTIME_ERR,
 } InterpretResult;
 
-void initVM(VM* vm, const char* name);
+void initVM(VM* vm, VM* parent, const char* name);
 void freeVM(VM* vm);
 void decoupleVM(VM* vm);
 